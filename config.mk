@@ -24,33 +24,72 @@ vnd_dir := vnd
 srcs :=\
 	main.c\
 	codebook_library.c\
+	discover.c\
 	input.c\
 	lib.c\
+	logger.c\
+	memlimit.c\
+	memstat.c\
 	packer.c\
+	pipeline.c\
+	pool.c\
 	print.c\
 	process.c\
 	process/bnk.c\
 	process/ogg.c\
+	process/probe.c\
 	process/wem.c\
 	process/wsp.c\
 	riff.c\
 	rifflist.c\
+	schedule.c\
+	serve.c\
+	shard.c\
+	timing.c\
+	trace.c\
+	uring.c\
+	watch.c\
 	wwise.c\
 
 hdrs :=\
 	codebook_library.h\
+	discover.h\
 	errors.h\
 	input.h\
 	lib.h\
+	logger.h\
+	memlimit.h\
+	memstat.h\
 	packer.h\
+	pipeline.h\
+	pool.h\
 	print.h\
 	process.h\
 	riff.h\
 	riff_extension.h\
 	rifflist.h\
+	schedule.h\
+	serve.h\
+	shard.h\
+	timing.h\
+	trace.h\
+	uring.h\
+	usdt.h\
+	watch.h\
 	wwise.h\
 
 ## These variables must be set to exclusively 0 to disable them
+# Compile the codebook libraries in codebooks.zip into the executable, selectable with '-cbl @aotuv' and
+# '-cbl @vanilla'; they're written by a generator that's built and run during the build, so this can't be used
+# when cross-compiling
+builtin_codebooks ?= 0
+# Count allocations and peak memory per stage and per input, for the report and '-probe'; every malloc/free is
+# wrapped by the linker, which needs GNU ld (or MinGW's)
+memstats ?= 0
+# Read inputs and write outputs through io_uring, on Linux 5.17 or later; stdio is used wherever it isn't available
+io_uring ?= 0
+# Add USDT probes for perf/bpftrace (see src/usdt.h) when <sys/sdt.h> is found; each is a nop until attached to
+usdt ?= 1
 # Be pedantic about the source files when compiling
 pedantic ?= 1
 # Strip executable(s) when installing
@@ -98,10 +137,31 @@ vnd_cflags :=
 
 ifeq ($(target),unix)
  c_defines := -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L $(c_defines)
+ c_links += -pthread
 else
  c_defines := -DWIN32_LEAN_AND_MEAN $(c_defines)
 endif
 
+ifneq ($(builtin_codebooks),0)
+ ifneq ($(cross_compilation),)
+  $(error builtin_codebooks can't be used when cross-compiling, the codebook generator must run on the host)
+ endif
+ c_defines += -D$(uproject)_builtin_codebooks
+endif
+
+ifneq ($(io_uring),0)
+ c_defines += -D$(uproject)_io_uring
+endif
+
+ifneq ($(usdt),0)
+ c_defines += -D$(uproject)_usdt
+endif
+
+ifneq ($(memstats),0)
+ c_defines += -D$(uproject)_memstats
+ c_links += -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc -Wl,--wrap=free
+endif
+
 ifneq ($(PEDANTIC),0)
  c_warnings := -pedantic -pedantic-errors -Wpedantic $(c_warnings)
  c_defines += -D$(uproject)_pedantic
@@ -77,6 +77,49 @@ help:
 	#       Default: 0
 	#       Changes 'debug' compilation flags to be friendly with valgrind's
 	#       'memcheck' tool; set to anythin other than 0 to enable.
+	#     builtin_codebooks:
+	#       Default: 0
+	#       Compile the codebook libraries in codebooks.zip into the executable,
+	#       so they can be used with '-cbl @aotuv' or '-cbl @vanilla' without
+	#       any files; set to anything other than 0 to enable. Requires 'unzip'
+	#       and can't be used when cross-compiling.
+	#     io_uring:
+	#       Default: 0
+	#       Read inputs and write outputs through io_uring on Linux 5.17 and
+	#       later, so many small outputs are opened, written and closed in
+	#       batches while conversion carries on; set to anything other than 0
+	#       to enable. Falls back to stdio wherever io_uring isn't usable.
+	#     usdt:
+	#       Default: 1
+	#       Build in USDT probes for perf, bpftrace and SystemTap, if
+	#       <sys/sdt.h> is installed (systemtap-sdt-dev or systemtap-sdt-devel);
+	#       they do nothing until attached to. Set to 0 to leave them out.
+	#     memstats:
+	#       Default: 0
+	#       Count allocations, bytes allocated and peak memory per processing
+	#       stage and per input, including those of libogg and libvorbis, and
+	#       print them in the report and '-probe' output; set to anything other
+	#       than 0 to enable. Every malloc/free goes through a counting wrapper,
+	#       so it's a little slower.
+	#   Benchmarking ('make bench', 'make bench-baseline', unix only; 'make microbench'):
+	#     bench_entries:
+	#       Default: 32
+	#       Number of WwRIFFs in each archive of the generated corpus.
+	#     bench_seconds:
+	#       Default: 1
+	#       Scale of the length of the generated audio.
+	#     bench_runs:
+	#       Default: 3
+	#       How many times the corpus is converted; the fastest run is reported.
+	#     bench_baseline:
+	#       Default: $$(output_directory)/bench/baseline
+	#       Where 'make bench-baseline' stores results for 'make bench' to
+	#       compare with.
+	#     microbench_args:
+	#       Default: (empty)
+	#       Arguments for 'make microbench', which times the bit-packing, RIFF
+	#       scanning and header kernels on their own; e.g. '-cpu 2 -reps 31' or
+	#       a kernel name to run only that one.
 	#   Toolchain configuration:
 	#   (note that this is not well-tested, and generally shouldn't be changed from
 	#   the defaults)
@@ -122,3 +122,5 @@ $(eval $(call dUnixWindowsVar,mk_dir_tree,mkdir -pv,helpers/win/mkdir_tree.bat,h
 $(eval $(call dUnixWindowsVar,copy_file,cp -fuv,copy /y,host))
 $(eval $(call dUnixWindowsVar,strip_exe,strip -s -M -v -x,:,host))
 $(eval $(call dUnixWindowsVar,echo,echo,echo,host))
+$(eval $(call dUnixWindowsVar,unzip,unzip -o -q,tar -xf,host))
+$(eval $(call dUnixWindowsVar,unzip_to,-d,-C,host))
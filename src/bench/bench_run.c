@@ -0,0 +1,228 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Benchmark runner (see 'make bench').
+ * Usage: bench_run [-runs N] [-update] BASELINE ARGS PROGRAM
+ * Runs PROGRAM N times with the arguments in ARGS, as written by wwriff_gen, and reports files/s and MB/s of the
+ * fastest run and the largest peak RSS of any, each against the results stored in BASELINE; with '-update', the
+ * results are stored in BASELINE instead.
+ * Each run writes a report next to ARGS with '-report-file', which must show every WwRIFF converted; PROGRAM exits
+ * 0 even when conversions fail, and a run that converts nothing would otherwise look fast.
+ * Exits non-zero if any run of PROGRAM fails. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define RUN_ARGS_MAX 256
+#define RUN_LINE_MAX 4096
+
+typedef struct i_result {
+	double files_per_sec;
+	double mb_per_sec;
+	long peak_rss_kb;
+} i_result_t;
+
+static char s_lines[RUN_ARGS_MAX][RUN_LINE_MAX];
+
+static char s_report[RUN_LINE_MAX];
+
+/* Reads one argument per line into 'argv' after 'program' and a '-report-file' to 's_report'; the first line gives
+ * the totals of the corpus. */
+static int
+i_read_args(const char *const path, char *const program, char **const argv, unsigned long *const entries,
+    unsigned long long *const bytes)
+{
+	int argc = 0;
+	const char *const slash = strrchr(path, '/');
+	snprintf(s_report, sizeof(s_report), "%.*sbench.report", slash ? (int)(slash - path + 1) : 0, path);
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Failed to open '%s' : %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (!fgets(s_lines[0], RUN_LINE_MAX, file) || 2 != sscanf(s_lines[0], "# entries=%lu bytes=%llu", entries, bytes)) {
+		fprintf(stderr, "'%s' wasn't written by wwriff_gen\n", path);
+		fclose(file);
+		return -1;
+	}
+	argv[argc++] = program;
+	argv[argc++] = "-report-file";
+	argv[argc++] = s_report;
+	while (argc < RUN_ARGS_MAX - 1 && fgets(s_lines[argc], RUN_LINE_MAX, file)) {
+		s_lines[argc][strcspn(s_lines[argc], "\r\n")] = 0;
+		if (s_lines[argc][0]) {
+			argv[argc] = s_lines[argc];
+			argc++;
+		}
+	}
+	argv[argc] = NULL;
+	fclose(file);
+	return argc;
+}
+
+/* Returns the wall time of one run in seconds, or a negative value if it failed. */
+static double
+i_run(char **const argv)
+{
+	struct timespec start, end;
+	int status = 0;
+	pid_t child;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (-1 == (child = fork())) {
+		fprintf(stderr, "Failed to start '%s' : %s\n", argv[0], strerror(errno));
+		return -1;
+	}
+	if (!child) {
+		execv(argv[0], argv);
+		fprintf(stderr, "Failed to run '%s' : %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	while (-1 == waitpid(child, &status, 0)) {
+		if (errno != EINTR)
+			return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "'%s' failed with status %d\n", argv[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		return -1;
+	}
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Returns 0 if the report of the last run shows all 'entries' WwRIFFs converted and every output written. */
+static int
+i_check_report(unsigned long entries)
+{
+	char report[RUN_LINE_MAX] = {0};
+	unsigned long long write_failures = 0;
+	unsigned long assigned = 0, succeeded = 0, failed = 0;
+	FILE *file = fopen(s_report, "r");
+	if (!file) {
+		fprintf(stderr, "Failed to open report '%s' : %s\n", s_report, strerror(errno));
+		return -1;
+	}
+	const int read = fgets(report, sizeof(report), file) != NULL;
+	fclose(file);
+	const char *const converts = strstr(report, "\"wem_converts\":");
+	const char *const writes = strstr(report, "\"write_failures\":");
+	if (!read || !converts || !writes
+	    || 3 != sscanf(converts, "\"wem_converts\":[%lu,%lu,%lu]", &assigned, &succeeded, &failed)
+	    || 1 != sscanf(writes, "\"write_failures\":%llu", &write_failures)) {
+		fprintf(stderr, "Malformed report '%s'\n", s_report);
+		return -1;
+	}
+	if (succeeded != entries || failed || write_failures) {
+		fprintf(stderr, "Converted %lu of %lu WwRIFFs (%lu failed, %llu outputs not written); see '%s'\n",
+		    succeeded, entries, failed, write_failures, s_report);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+i_print(const char *const name, double value, double baseline, const char *const unit)
+{
+	printf("    %-10s %12.2f %-4s", name, value, unit);
+	if (baseline > 0)
+		printf("   baseline %12.2f %-4s  %+6.1f%%", baseline, unit, 100 * (value - baseline) / baseline);
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	int runs = 3, update = 0, n_positional = 0;
+	const char *positional[3] = {0};
+	for (int i = 1; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "-runs") && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (0 == strcmp(argv[i], "-update"))
+			update = 1;
+		else if (n_positional < 3)
+			positional[n_positional++] = argv[i];
+	}
+	if (n_positional != 3 || runs < 1) {
+		fprintf(stderr, "Usage: %s [-runs N] [-update] BASELINE ARGS PROGRAM\n", argv[0]);
+		return 2;
+	}
+	const char *const baseline_path = positional[0];
+
+	char *run_argv[RUN_ARGS_MAX];
+	unsigned long entries = 0;
+	unsigned long long bytes = 0;
+	if (-1 == i_read_args(positional[1], (char *)positional[2], run_argv, &entries, &bytes))
+		return 2;
+
+	double best = -1;
+	for (int i = 0; i < runs; ++i) {
+		double seconds = i_run(run_argv);
+		if (seconds < 0 || i_check_report(entries))
+			return 1;
+		if (best < 0 || seconds < best)
+			best = seconds;
+	}
+	if (best <= 0)
+		best = 1e-9;
+
+	/* The largest peak of any child waited for */
+	struct rusage usage = {0};
+	getrusage(RUSAGE_CHILDREN, &usage);
+	const i_result_t result = {
+		.files_per_sec = entries / best,
+		.mb_per_sec = bytes / 1e6 / best,
+		.peak_rss_kb = usage.ru_maxrss,
+	};
+
+	i_result_t baseline = {0};
+	FILE *file = NULL;
+	if (!update && (file = fopen(baseline_path, "r"))) {
+		if (3 != fscanf(file, "files_per_sec=%lf mb_per_sec=%lf peak_rss_kb=%ld",
+		    &baseline.files_per_sec, &baseline.mb_per_sec, &baseline.peak_rss_kb)) {
+			fprintf(stderr, "Ignoring malformed baseline '%s'\n", baseline_path);
+			baseline = (i_result_t){0};
+		}
+		fclose(file);
+	}
+
+	printf("Converted %lu WwRIFFs, %.2f MB, best of %d runs: %.3fs\n", entries, bytes / 1e6, runs, best);
+	i_print("files/s", result.files_per_sec, baseline.files_per_sec, "");
+	i_print("MB/s", result.mb_per_sec, baseline.mb_per_sec, "");
+	i_print("peak RSS", result.peak_rss_kb / 1024.0, baseline.peak_rss_kb / 1024.0, "MiB");
+
+	if (update) {
+		if (!(file = fopen(baseline_path, "w"))) {
+			fprintf(stderr, "Failed to open baseline '%s' : %s\n", baseline_path, strerror(errno));
+			return 2;
+		}
+		fprintf(file, "files_per_sec=%f\nmb_per_sec=%f\npeak_rss_kb=%ld\n",
+		    result.files_per_sec, result.mb_per_sec, result.peak_rss_kb);
+		if (fclose(file)) {
+			fprintf(stderr, "Failed to write baseline '%s' : %s\n", baseline_path, strerror(errno));
+			return 2;
+		}
+		printf("Baseline stored in '%s'\n", baseline_path);
+	} else if (baseline.files_per_sec <= 0) {
+		printf("No baseline yet; store one with 'make bench-baseline'\n");
+	}
+	return 0;
+}
@@ -0,0 +1,677 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Kernel microbenchmarks (see 'make microbench').
+ * Usage: microbench [-cpu N] [-ms MS] [-reps N] [FILTER]
+ * Times the bit-packing, RIFF scanning and vorbis header kernels one at a time, on inputs generated in memory from a
+ * fixed seed, so runs on the same machine are comparable. Each kernel is run in batches of at least MS milliseconds
+ * (default 20), N times (default 15), and the median batch reported as ns and cycles per call and cycles per byte of
+ * input, or of output for the header kernels. Cycles are those of the timestamp counter, so are only reported on x86.
+ * The process is pinned to CPU N (default 0) unless N is -1; only kernels whose names contain FILTER are run. */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE /* sched_setaffinity */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#elif defined(__linux__)
+# include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+# if defined(_MSC_VER)
+#  include <intrin.h>
+# else
+#  include <x86intrin.h>
+# endif
+# define i_cycles() ((brru8)__rdtsc())
+# define HAVE_CYCLES 1
+#else
+# define i_cycles() ((brru8)0)
+# define HAVE_CYCLES 0
+#endif
+
+#include <brrtools/brrtypes.h>
+
+#include "codebook_library.h"
+#include "errors.h"
+#include "lib.h"
+#include "packer.h"
+#include "riff.h"
+#include "rifflist.h"
+#include "timing.h"
+#include "wwise.h"
+
+#define MICRO_RANDOM_SIZE (64 * 1024)
+#define MICRO_CODEBOOKS 64   /* At most 256, the most a setup header can have */
+#define MICRO_WSP_RIFFS 512
+#define MICRO_RIFF_DATA (64 * 1024)
+#define MICRO_CHANNELS 2
+#define MICRO_REPS_MAX 101
+
+/* Fixed inputs, generated once by 'i_generate' */
+static unsigned char *s_random = NULL;  /* MICRO_RANDOM_SIZE random bytes */
+static int s_widths[MICRO_RANDOM_SIZE]; /* Transfer widths that sum to at most the bits of 's_random' */
+static brrsz s_n_widths = 0;
+static unsigned char *s_books = NULL;   /* Stripped codebooks, back to back */
+static brrsz s_books_size = 0;
+static long s_books_bits = 0;
+static unsigned char *s_wsp = NULL;     /* WwRIFFs with junk between them */
+static brrsz s_wsp_size = 0;
+static unsigned char *s_riff = NULL;    /* A single WwRIFF */
+static brrsz s_riff_size = 0;
+static wwriff_t s_stripped = {0};       /* Setup header only, stripped inline codebooks */
+static wwriff_t s_external = {0};       /* Setup header only, codebook indices into 's_library' */
+static wwriff_t s_full = {0};           /* All headers present */
+static codebook_library_t s_library = {0};
+
+static oggpack_buffer s_packer; /* Every kernel packs into this, reset for each call */
+static brru8 s_seed = 0x4e6541655052ull;
+
+static inline brru4
+i_rand(void)
+{
+	/* xorshift64* */
+	s_seed ^= s_seed >> 12;
+	s_seed ^= s_seed << 25;
+	s_seed ^= s_seed >> 27;
+	return (brru4)((s_seed * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static inline void
+i_set_u16(unsigned char *const p, brru2 v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+static inline void
+i_set_u32(unsigned char *const p, brru4 v)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+/* Packs a codebook in the stripped form read by 'packed_codebook_unpack_raw' */
+static void
+i_pack_stripped_codebook(oggpack_buffer *const packer, int dimensions, int entries, int sparse, int lookup)
+{
+	packer_pack(packer, dimensions, 4);
+	packer_pack(packer, entries, 14);
+	packer_pack(packer, 0, 1); /* Ordered */
+	packer_pack(packer, 5, 3); /* Codeword length bits */
+	packer_pack(packer, sparse, 1);
+	for (int i = 0; i < entries; ++i) {
+		if (sparse) {
+			const int used = (i_rand() & 3) != 0;
+			packer_pack(packer, used, 1);
+			if (!used)
+				continue;
+		}
+		packer_pack(packer, i_rand() % 20, 5); /* Codeword length - 1 */
+	}
+	packer_pack(packer, lookup, 1);
+	if (lookup) {
+		const int value_bits = 1 + i_rand() % 8;
+		packer_pack(packer, i_rand(), 32);  /* Minimum value */
+		packer_pack(packer, i_rand(), 32);  /* Delta value */
+		packer_pack(packer, value_bits - 1, 4);
+		packer_pack(packer, 0, 1);          /* Sequence flag */
+		for (long i = 0; i < lib_lookup1_values(entries, dimensions); ++i)
+			packer_pack(packer, i_rand(), value_bits);
+	}
+}
+
+/* Packs the stripped floors, residues, mappings and modes that follow the codebooks */
+static void
+i_pack_stripped_setup_rest(oggpack_buffer *const packer)
+{
+	packer_pack(packer, 2 - 1, 6); /* Floors */
+	for (int i = 0; i < 2; ++i) {
+		const int partitions = 8, classes = 3;
+		packer_pack(packer, partitions, 5);
+		for (int j = 0; j < partitions; ++j)
+			packer_pack(packer, j % classes, 4);
+		for (int j = 0; j < classes; ++j) {
+			packer_pack(packer, 2 - 1, 3); /* Dimensions */
+			packer_pack(packer, 1, 2);     /* Subclasses */
+			packer_pack(packer, j, 8);     /* Master book */
+			for (int k = 0; k < 2; ++k)
+				packer_pack(packer, 1 + (j + k) % MICRO_CODEBOOKS, 8);
+		}
+		packer_pack(packer, 2 - 1, 2); /* Multiplier */
+		packer_pack(packer, 9, 4);     /* Range bits */
+		for (int j = 0; j < 2 * partitions; ++j)
+			packer_pack(packer, i_rand() % 512, 9);
+	}
+
+	packer_pack(packer, 2 - 1, 6); /* Residues */
+	for (int i = 0; i < 2; ++i) {
+		const int classes = 10;
+		packer_pack(packer, 2, 2);        /* Type */
+		packer_pack(packer, 0, 24);       /* Begin */
+		packer_pack(packer, 256 << i, 24); /* End */
+		packer_pack(packer, 32 - 1, 24);  /* Partition size */
+		packer_pack(packer, classes - 1, 6);
+		packer_pack(packer, i, 8);        /* Classbook */
+		for (int j = 0; j < classes; ++j) {
+			packer_pack(packer, 7, 3); /* Cascade low bits */
+			packer_pack(packer, 1, 1);
+			packer_pack(packer, 3, 5); /* Cascade high bits */
+		}
+		for (int j = 0; j < classes * 5; ++j)
+			packer_pack(packer, i_rand() % MICRO_CODEBOOKS, 8);
+	}
+
+	packer_pack(packer, 2 - 1, 6); /* Mappings */
+	for (int i = 0; i < 2; ++i) {
+		packer_pack(packer, 0, 1);     /* Submaps flag */
+		packer_pack(packer, 1, 1);     /* Square mapping */
+		packer_pack(packer, 1 - 1, 8); /* Coupling steps */
+		packer_pack(packer, 0, 1);     /* Magnitude; one bit each for two channels */
+		packer_pack(packer, 1, 1);     /* Angle */
+		packer_pack(packer, 0, 2);     /* Reserved */
+		packer_pack(packer, 0, 8);     /* Submap time */
+		packer_pack(packer, i, 8);     /* Floor */
+		packer_pack(packer, i, 8);     /* Residue */
+	}
+
+	packer_pack(packer, 2 - 1, 6); /* Modes */
+	for (int i = 0; i < 2; ++i) {
+		packer_pack(packer, i, 1); /* Blockflag */
+		packer_pack(packer, i, 8); /* Mapping */
+	}
+}
+
+/* Appends 'payload' to 'out' as a header packet of 'wem' */
+static brrsz
+i_put_packet(unsigned char *const out, const wwriff_t *const wem, const unsigned char *const payload, brrsz size)
+{
+	brrsz header = 2;
+	i_set_u16(out, size);
+	if (wem->flags.granule_present) {
+		i_set_u32(out + header, 0);
+		header += 4;
+		if (wem->flags.all_headers_present) {
+			i_set_u16(out + header, 0);
+			header += 2;
+		}
+	}
+	memcpy(out + header, payload, size);
+	return header + size;
+}
+
+static int
+i_init_wem(wwriff_t *const wem, int all_headers_present)
+{
+	*wem = (wwriff_t){
+		.flags = {.fmt_initialized = 1, .vorb_initialized = 1, .data_initialized = 1, .granule_present = 1,
+		    .all_headers_present = all_headers_present},
+		.fmt = {.format_tag = WWISE_FORMAT_VORBIS, .n_channels = MICRO_CHANNELS, .samples_per_sec = 48000,
+		    .avg_byte_rate = 24000},
+		.vorb = {.sample_count = 48000, .blocksize_0 = 8, .blocksize_1 = 11},
+	};
+	for (int i = 0; i < 4; ++i) {
+		if (wwriff_add_comment(wem, "MICROBENCH_COMMENT_%d=%08x", i, i_rand()))
+			return I_BUFFER_ERROR;
+	}
+	return I_SUCCESS;
+}
+
+/* Stores the header packets in 'payloads' as the data of 'wem' */
+static int
+i_set_wem_packets(wwriff_t *const wem, const unsigned char *const *const payloads, const brrsz *const sizes, int n)
+{
+	brrsz total = 0;
+	for (int i = 0; i < n; ++i) {
+		if (sizes[i] > 0xFFFF)
+			return I_BUFFER_ERROR;
+		total += 8 + sizes[i];
+	}
+	if (!(wem->data = malloc(total)))
+		return I_BUFFER_ERROR;
+	brrsz offset = 0;
+	for (int i = 0; i < n; ++i)
+		offset += i_put_packet(wem->data + offset, wem, payloads[i], sizes[i]);
+	wem->data_size = offset;
+	wem->vorb.header_packets_offset = 0;
+	wem->vorb.audio_start_offset = offset;
+	return I_SUCCESS;
+}
+
+/* Writes a WwRIFF with an explicit 'vorb' and 'data_size' random bytes of data to 'out', and returns its size */
+static brrsz
+i_put_riff(unsigned char *const out, brru4 data_size)
+{
+	unsigned char *p = out;
+	memcpy(p, "RIFF", 4);
+	i_set_u32(p + 4, 4 + 8 + 24 + 8 + 52 + 8 + data_size);
+	memcpy(p + 8, "WAVE", 4);
+	p += 12;
+
+	memcpy(p, "fmt ", 4);
+	i_set_u32(p + 4, 24);
+	memset(p + 8, 0, 24);
+	i_set_u16(p + 8, WWISE_FORMAT_VORBIS);
+	i_set_u16(p + 10, MICRO_CHANNELS);
+	i_set_u32(p + 12, 48000);
+	i_set_u32(p + 16, 24000);
+	p += 8 + 24;
+
+	memcpy(p, "vorb", 4);
+	i_set_u32(p + 4, 52);
+	memset(p + 8, 0, 52);
+	i_set_u32(p + 8 + 28, data_size); /* Audio start */
+	p[8 + 48] = 8;
+	p[8 + 49] = 11;
+	p += 8 + 52;
+
+	memcpy(p, "data", 4);
+	i_set_u32(p + 4, data_size);
+	p += 8;
+	for (brru4 i = 0; i < data_size; ++i)
+		p[i] = i_rand();
+	return p + data_size - out;
+}
+
+static int
+i_generate(void)
+{
+	int err = 0;
+	oggpack_buffer packer;
+
+	if (!(s_random = malloc(MICRO_RANDOM_SIZE)))
+		return I_BUFFER_ERROR;
+	for (brrsz i = 0; i < MICRO_RANDOM_SIZE; ++i)
+		s_random[i] = i_rand();
+	{
+		/* The widths seen most when headers are rebuilt */
+		static const int widths[] = {1, 8, 5, 1, 4, 32, 14, 3, 24, 8, 16, 6, 1, 9, 2};
+		brrsz bits = 0;
+		for (brrsz i = 0; bits + 32 <= 8 * MICRO_RANDOM_SIZE; ++i) {
+			s_widths[s_n_widths++] = widths[i % (sizeof(widths) / sizeof(widths[0]))];
+			bits += s_widths[s_n_widths - 1];
+		}
+	}
+
+	/* Codebooks: each on its own for the library, and back to back without the padding after each */
+	if (!(s_library.codebooks = calloc(1 + MICRO_CODEBOOKS, sizeof(*s_library.codebooks))))
+		return I_BUFFER_ERROR;
+	s_library.codebook_count = 1 + MICRO_CODEBOOKS; /* Slot 0 is never used */
+	oggpack_writeinit(&packer);
+	for (int i = 0; i < MICRO_CODEBOOKS; ++i) {
+		static const int shapes[][2] = {{1, 16}, {2, 81}, {4, 81}, {2, 289}, {1, 256}, {4, 625}, {8, 6561}, {2, 1024}};
+		const int dimensions = shapes[i % 8][0], entries = shapes[i % 8][1];
+		oggpack_buffer book, unpacker;
+		oggpack_writeinit(&book);
+		i_pack_stripped_codebook(&book, dimensions, entries, i % 3 == 0, i % 2);
+		packed_codebook_t *const cb = &s_library.codebooks[1 + i];
+		cb->size = oggpack_bytes(&book);
+		if (!(cb->data = malloc(cb->size))) {
+			oggpack_writeclear(&book);
+			oggpack_writeclear(&packer);
+			return I_BUFFER_ERROR;
+		}
+		memcpy(cb->data, oggpack_get_buffer(&book), cb->size);
+		oggpack_readinit(&unpacker, cb->data, cb->size);
+		packer_transfer_lots(&unpacker, &packer, oggpack_bits(&book));
+		oggpack_writeclear(&book);
+	}
+	s_books_bits = oggpack_bits(&packer);
+	s_books_size = oggpack_bytes(&packer);
+	if (!(s_books = malloc(s_books_size))) {
+		oggpack_writeclear(&packer);
+		return I_BUFFER_ERROR;
+	}
+	memcpy(s_books, oggpack_get_buffer(&packer), s_books_size);
+	oggpack_writeclear(&packer);
+	codebook_library_unpack_all(&s_library);
+
+	/* Setup headers with the same codebooks inline and stripped, and from the library */
+	for (int external = 0; external < 2; ++external) {
+		wwriff_t *const wem = external ? &s_external : &s_stripped;
+		const unsigned char *payload = NULL;
+		brrsz size = 0;
+		oggpack_writeinit(&packer);
+		packer_pack(&packer, MICRO_CODEBOOKS - 1, 8);
+		if (external) {
+			for (int i = 0; i < MICRO_CODEBOOKS; ++i)
+				packer_pack(&packer, i, 10); /* Library slot - 1 */
+		} else {
+			oggpack_buffer unpacker;
+			oggpack_readinit(&unpacker, s_books, s_books_size);
+			packer_transfer_lots(&unpacker, &packer, s_books_bits);
+		}
+		i_pack_stripped_setup_rest(&packer);
+		size = oggpack_bytes(&packer);
+		payload = oggpack_get_buffer(&packer);
+		if (!(err = i_init_wem(wem, 0)))
+			err = i_set_wem_packets(wem, &payload, &size, 1);
+		oggpack_writeclear(&packer);
+		if (err)
+			return err;
+	}
+
+	/* All headers present, as rebuilt from the stripped ones */
+	{
+		oggpack_buffer headers[3];
+		const unsigned char *payloads[3] = {0};
+		brrsz sizes[3] = {0};
+		if ((err = i_init_wem(&s_full, 1)))
+			return err;
+		for (int i = 0; i < 3; ++i) {
+			oggpack_writeinit(&headers[i]);
+			if (!err && !(err = wwise_pack_header(&s_stripped, i, NULL, 1, &headers[i]))) {
+				payloads[i] = oggpack_get_buffer(&headers[i]);
+				sizes[i] = oggpack_bytes(&headers[i]);
+			}
+		}
+		if (!err)
+			err = i_set_wem_packets(&s_full, payloads, sizes, 3);
+		for (int i = 0; i < 3; ++i)
+			oggpack_writeclear(&headers[i]);
+		if (err)
+			return err;
+	}
+
+	/* Archive of WwRIFFs with junk between them, and a lone WwRIFF */
+	{
+		const brrsz most = MICRO_WSP_RIFFS * (12 + 8 + 24 + 8 + 52 + 8 + 16 * 1024 + 8);
+		if (!(s_wsp = malloc(most)))
+			return I_BUFFER_ERROR;
+		for (int i = 0; i < MICRO_WSP_RIFFS; ++i) {
+			const int junk = i_rand() % 8;
+			memset(s_wsp + s_wsp_size, 0, junk);
+			s_wsp_size += junk;
+			s_wsp_size += i_put_riff(s_wsp + s_wsp_size, 1 + i_rand() % (16 * 1024));
+		}
+		if (!(s_riff = malloc(12 + 8 + 24 + 8 + 52 + 8 + MICRO_RIFF_DATA)))
+			return I_BUFFER_ERROR;
+		s_riff_size = i_put_riff(s_riff, MICRO_RIFF_DATA);
+	}
+	return I_SUCCESS;
+}
+
+static void
+i_clear(void)
+{
+	if (s_random)
+		free(s_random);
+	if (s_books)
+		free(s_books);
+	if (s_wsp)
+		free(s_wsp);
+	if (s_riff)
+		free(s_riff);
+	wwriff_clear(&s_stripped);
+	wwriff_clear(&s_external);
+	wwriff_clear(&s_full);
+	codebook_library_clear(&s_library);
+}
+
+/****************************************
+  Kernels; each returns 0 on success.
+****************************************/
+static int
+k_packer_transfer(void)
+{
+	oggpack_buffer unpacker;
+	oggpack_readinit(&unpacker, s_random, MICRO_RANDOM_SIZE);
+	oggpack_reset(&s_packer);
+	for (brrsz i = 0; i < s_n_widths; ++i)
+		packer_transfer(&unpacker, s_widths[i], &s_packer, s_widths[i]);
+	return oggpack_bits(&s_packer) ? I_SUCCESS : I_BUFFER_ERROR;
+}
+static int
+k_packer_transfer_remaining(void)
+{
+	oggpack_buffer unpacker;
+	oggpack_readinit(&unpacker, s_random, MICRO_RANDOM_SIZE);
+	oggpack_reset(&s_packer);
+	return -1 == packer_transfer_remaining(&unpacker, &s_packer) ? I_BUFFER_ERROR : I_SUCCESS;
+}
+static int
+k_packer_transfer_lots(void)
+{
+	oggpack_buffer unpacker;
+	oggpack_readinit(&unpacker, s_random, MICRO_RANDOM_SIZE);
+	oggpack_reset(&s_packer);
+	return -1 == packer_transfer_lots(&unpacker, &s_packer, 8 * MICRO_RANDOM_SIZE) ? I_BUFFER_ERROR : I_SUCCESS;
+}
+/* As codebooks are copied from libraries: neither side byte-aligned */
+static int
+k_packer_transfer_lots_unaligned(void)
+{
+	oggpack_buffer unpacker;
+	oggpack_readinit(&unpacker, s_random, MICRO_RANDOM_SIZE);
+	oggpack_reset(&s_packer);
+	packer_transfer(&unpacker, 3, &s_packer, 5);
+	return -1 == packer_transfer_lots(&unpacker, &s_packer, 8 * MICRO_RANDOM_SIZE - 3) ? I_BUFFER_ERROR : I_SUCCESS;
+}
+static int
+k_codebook_unpack_raw(void)
+{
+	int err = 0;
+	oggpack_buffer unpacker;
+	oggpack_readinit(&unpacker, s_books, s_books_size);
+	oggpack_reset(&s_packer);
+	for (int i = 0; !err && i < MICRO_CODEBOOKS; ++i)
+		err = packed_codebook_unpack_raw(&unpacker, &s_packer);
+	return err;
+}
+static int
+k_rifflist_scan(void)
+{
+	rifflist_t list = {0};
+	int err = rifflist_scan(&list, s_wsp, s_wsp_size);
+	if (!err && list.n_riffs != MICRO_WSP_RIFFS)
+		err = I_CORRUPT;
+	rifflist_clear(&list);
+	return err;
+}
+static int
+k_riff_consume_chunk(void)
+{
+	riff_datasync_t datasync = {0};
+	riff_chunkstate_t chunkstate = {0};
+	riff_t riff = {0};
+	int err = I_SUCCESS;
+	if (riff_datasync_from_buffer(&datasync, s_riff, s_riff_size))
+		return I_INIT_ERROR;
+	/* As 'lib_parse_buffer_as_riff' does */
+	while (!err) {
+		if (!riff_consume_chunk(&riff, &chunkstate, &datasync)) {
+			riff_chunkstate_zero(&chunkstate);
+			continue;
+		}
+		switch (datasync.status) {
+			case riff_status_chunk_unrecognized: riff_datasync_seek(&datasync, 1); break;
+			case riff_status_consume_again: break;
+			case riff_status_chunk_incomplete: err = -1; break; /* Done */
+			default: err = I_CORRUPT; break;
+		}
+	}
+	if (riff.n_basics != 3)
+		err = I_CORRUPT;
+	else if (err == -1)
+		err = I_SUCCESS;
+	riff_clear(&riff);
+	return err;
+}
+
+static inline int
+i_pack(wwriff_t *const wem, vorbis_header_packet_t header, const codebook_library_t *const library)
+{
+	oggpack_reset(&s_packer);
+	return wwise_pack_header(wem, header, library, library == NULL, &s_packer);
+}
+static int k_build_id_header(void) { return i_pack(&s_stripped, vorbis_header_packet_id, NULL); }
+static int k_build_comments_header(void) { return i_pack(&s_stripped, vorbis_header_packet_comment, NULL); }
+static int k_build_setup_stripped(void) { return i_pack(&s_stripped, vorbis_header_packet_setup, NULL); }
+static int k_build_setup_external(void) { return i_pack(&s_external, vorbis_header_packet_setup, &s_library); }
+static int k_copy_id_header(void) { return i_pack(&s_full, vorbis_header_packet_id, NULL); }
+static int k_copy_comment_header(void) { return i_pack(&s_full, vorbis_header_packet_comment, NULL); }
+static int k_copy_setup_header(void) { return i_pack(&s_full, vorbis_header_packet_setup, NULL); }
+
+/****************************************
+  Measurement
+****************************************/
+typedef struct i_sample {
+	double ns;
+	double cycles;
+} i_sample_t;
+
+static int
+i_compare_samples(const void *a, const void *b)
+{
+	const double x = ((const i_sample_t *)a)->ns, y = ((const i_sample_t *)b)->ns;
+	return (x > y) - (x < y);
+}
+
+/* Runs 'kernel' until batches take 'batch_ns', and prints the median of 'reps' batches.
+ * If 'bytes' is 0, it's taken to be what the kernel packed. */
+static int
+i_measure(const char *const name, int (*kernel)(void), brrsz bytes, brru8 batch_ns, int reps)
+{
+	i_sample_t samples[MICRO_REPS_MAX];
+	brru8 n = 1;
+	int err = 0;
+
+	/* Warm up, and find how many calls make a batch */
+	for (;;) {
+		const brru8 start = timing_now();
+		for (brru8 i = 0; i < n; ++i) {
+			if ((err = kernel())) {
+				printf("%-30s failed : %s\n", name, lib_strerr(err));
+				return err;
+			}
+		}
+		if (timing_now() - start >= batch_ns || n >= (1ull << 40))
+			break;
+		n *= 2;
+	}
+	if (!bytes)
+		bytes = oggpack_bytes(&s_packer);
+
+	for (int r = 0; r < reps; ++r) {
+		const brru8 start = timing_now();
+		const brru8 cycles = i_cycles();
+		for (brru8 i = 0; i < n; ++i)
+			kernel();
+		samples[r].cycles = (double)(i_cycles() - cycles) / n;
+		samples[r].ns = (double)(timing_now() - start) / n;
+	}
+	qsort(samples, reps, sizeof(*samples), i_compare_samples);
+	const i_sample_t median = samples[reps / 2];
+
+	printf("%-30s %10zu %12.1f", name, (size_t)bytes, median.ns);
+	if (HAVE_CYCLES)
+		printf(" %12.0f %11.3f", median.cycles, median.cycles / bytes);
+	else
+		printf(" %12s %11s", "-", "-");
+	printf(" %10.1f\n", bytes / median.ns * 1e3);
+	return I_SUCCESS;
+}
+
+static int
+i_pin(int cpu)
+{
+#if defined(_WIN32)
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) ? 0 : -1;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+#else
+	return -1;
+#endif
+}
+
+int
+main(int argc, char **argv)
+{
+	int cpu = 0, reps = 15, err = 0;
+	long batch_ms = 20;
+	const char *filter = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "-cpu") && i + 1 < argc)
+			cpu = atoi(argv[++i]);
+		else if (0 == strcmp(argv[i], "-ms") && i + 1 < argc)
+			batch_ms = atol(argv[++i]);
+		else if (0 == strcmp(argv[i], "-reps") && i + 1 < argc)
+			reps = atoi(argv[++i]);
+		else if (!filter && argv[i][0] != '-')
+			filter = argv[i];
+		else
+			reps = 0;
+	}
+	if (reps < 1 || reps > MICRO_REPS_MAX || batch_ms < 1) {
+		fprintf(stderr, "Usage: %s [-cpu N] [-ms MS] [-reps N (1-%d)] [FILTER]\n", argv[0], MICRO_REPS_MAX);
+		return 2;
+	}
+
+	lib_set_log_silenced(1);
+	if (cpu >= 0) {
+		if (i_pin(cpu))
+			fprintf(stderr, "Could not pin to CPU %d; results will be noisier\n", cpu);
+		else
+			printf("Pinned to CPU %d\n", cpu);
+	}
+	if ((err = i_generate())) {
+		fprintf(stderr, "Failed to generate inputs : %s\n", lib_strerr(err));
+		i_clear();
+		return 1;
+	}
+
+	static const struct i_kernel {
+		const char *name;
+		int (*run)(void);
+		int input; /* Which input 'bytes' is the size of, or -1 for the output */
+	} kernels[] = {
+		{"packer_transfer",                k_packer_transfer,                 0},
+		{"packer_transfer_remaining",      k_packer_transfer_remaining,       0},
+		{"packer_transfer_lots",           k_packer_transfer_lots,            0},
+		{"packer_transfer_lots_unaligned", k_packer_transfer_lots_unaligned,  0},
+		{"packed_codebook_unpack_raw",     k_codebook_unpack_raw,             1},
+		{"rifflist_scan",                  k_rifflist_scan,                   2},
+		{"riff_consume_chunk",             k_riff_consume_chunk,              3},
+		{"build_id_header",                k_build_id_header,                -1},
+		{"build_comments_header",          k_build_comments_header,          - 1},
+		{"build_setup_stripped",           k_build_setup_stripped,           - 1},
+		{"build_setup_external",           k_build_setup_external,           - 1},
+		{"copy_id_header",                 k_copy_id_header,                 -1},
+		{"copy_comment_header",            k_copy_comment_header,            - 1},
+		{"copy_setup_header",              k_copy_setup_header,              - 1},
+	};
+	const brrsz sizes[] = {MICRO_RANDOM_SIZE, s_books_size, s_wsp_size, s_riff_size};
+
+	oggpack_writeinit(&s_packer);
+	printf("%-30s %10s %12s %12s %11s %10s\n", "kernel", "bytes/call", "ns/call", "cycles/call", "cycles/byte", "MB/s");
+	for (brrsz i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+		if (filter && !strstr(kernels[i].name, filter))
+			continue;
+		if (i_measure(kernels[i].name, kernels[i].run, kernels[i].input < 0 ? 0 : sizes[kernels[i].input], batch_ms * 1000000ull, reps))
+			err = 1;
+	}
+	oggpack_writeclear(&s_packer);
+	i_clear();
+	return err;
+}
@@ -0,0 +1,801 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Benchmark corpus generator (see 'make bench').
+ * Usage: wwriff_gen [-n ENTRIES] [-seconds SCALE] OUTDIR
+ * A handful of synthetic signals are encoded with libvorbis, and the packets of those encodes repacked into one
+ * WSP-style archive of ENTRIES WwRIFFs for each header layout the converter distinguishes: explicit 'vorb' chunks
+ * with all headers present ('basic') or only the setup header ('extra'), and 42-byte 'vorb' data implicit in the
+ * 'fmt' chunk, with and without modified audio packets; setup headers are stored with full inline codebooks,
+ * stripped inline codebooks, or codebooks from the external library OUTDIR/bench.cbl.
+ * OUTDIR/bench.args lists the arguments that convert every archive, one per line, after a first line of
+ * '# entries=N bytes=B' giving the number of WwRIFFs and total size of the archives. */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vorbis/vorbisenc.h>
+
+#include <brrtools/brrlib.h>
+
+#include "codebook_library.h"
+#include "errors.h"
+#include "lib.h"
+#include "packer.h"
+#include "wwise.h"
+
+#define GEN_PATH_MAX 4096
+#define GEN_BLOCK 1024
+
+typedef enum i_layout {
+	i_layout_basic = 0, /* Explicit 44-byte 'vorb'; all headers present, packets have granules */
+	i_layout_extra,     /* Explicit 52-byte 'vorb'; setup header only, packets have granules */
+	i_layout_implicit,  /* 'vorb' data at the end of a 66-byte 'fmt'; setup header only, bare packets */
+} i_layout_t;
+
+typedef enum i_codebooks {
+	i_codebooks_full = 0, /* The setup header as encoded, less its time-domain transforms */
+	i_codebooks_stripped, /* Codebooks packed and the rest of the setup header stripped */
+	i_codebooks_external, /* Codebooks replaced by indices into the external library */
+} i_codebooks_t;
+
+/* Ordered so that the options each needs only ever add to those before it */
+static const struct i_flavor {
+	const char *name;
+	i_layout_t layout;
+	i_codebooks_t codebooks;
+	int mod_packets;
+} i_flavors[] = {
+	{"basic",                 i_layout_basic,    i_codebooks_full,     0},
+	{"extra_inline",          i_layout_extra,    i_codebooks_full,     0},
+	{"extra_stripped",        i_layout_extra,    i_codebooks_stripped, 0},
+	{"implicit_stripped",     i_layout_implicit, i_codebooks_stripped, 0},
+	{"implicit_mod_stripped", i_layout_implicit, i_codebooks_stripped, 1},
+	{"extra_external",        i_layout_extra,    i_codebooks_external, 0},
+	{"implicit_external",     i_layout_implicit, i_codebooks_external, 0},
+	{"implicit_mod_external", i_layout_implicit, i_codebooks_external, 1},
+};
+#define N_FLAVORS (sizeof(i_flavors) / sizeof(i_flavors[0]))
+
+/* Different qualities and rates give different codebooks and modes */
+static const struct i_signal {
+	int channels;
+	long rate;
+	float quality;
+	double seconds;
+} i_signals[] = {
+	{1, 22050,  0.0f, 2.0},
+	{2, 44100,  0.3f, 3.0},
+	{2, 48000,  0.6f, 2.5},
+	{1, 48000, -0.1f, 1.5},
+	{2, 32000,  0.9f, 2.0},
+	{1, 44100,  0.5f, 4.0},
+};
+#define N_SIGNALS (sizeof(i_signals) / sizeof(i_signals[0]))
+
+typedef struct i_packet {
+	unsigned char *data;
+	long size;
+	brru8 granule;
+} i_packet_t;
+
+typedef struct i_modes {
+	int count;
+	brru1 blockflags[64];
+} i_modes_t;
+
+typedef struct i_encode {
+	int channels;
+	long rate;
+	brru4 samples;
+	brru4 avg_byte_rate;
+	brru1 blocksize_0;
+	brru1 blocksize_1;
+	i_modes_t modes;
+	i_packet_t headers[3];
+	i_packet_t *packets;
+	brrsz n_packets;
+} i_encode_t;
+
+typedef struct i_buffer {
+	unsigned char *data;
+	brrsz size;
+	brrsz capacity;
+} i_buffer_t;
+
+static int
+i_put(i_buffer_t *const buffer, const void *const data, brrsz size)
+{
+	if (buffer->size + size > buffer->capacity) {
+		brrsz capacity = buffer->capacity ? buffer->capacity : 4096;
+		while (capacity < buffer->size + size)
+			capacity *= 2;
+		if (brrlib_alloc((void **)&buffer->data, capacity, 0))
+			return I_BUFFER_ERROR;
+		buffer->capacity = capacity;
+	}
+	if (size)
+		memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+	return I_SUCCESS;
+}
+static inline int
+i_put_u16(i_buffer_t *const buffer, brru2 value)
+{
+	return i_put(buffer, &value, 2);
+}
+static inline int
+i_put_u32(i_buffer_t *const buffer, brru4 value)
+{
+	return i_put(buffer, &value, 4);
+}
+static inline void
+i_set_u32(unsigned char *const data, brru4 value)
+{
+	memcpy(data, &value, 4);
+}
+static void
+i_buffer_clear(i_buffer_t *const buffer)
+{
+	if (buffer->data)
+		free(buffer->data);
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+static int
+i_copy_packet(i_packet_t *const packet, const ogg_packet *const from)
+{
+	if (!(packet->data = malloc(from->bytes ? from->bytes : 1)))
+		return I_BUFFER_ERROR;
+	memcpy(packet->data, from->packet, from->bytes);
+	packet->size = from->bytes;
+	packet->granule = from->granulepos;
+	return I_SUCCESS;
+}
+
+static void
+i_encode_clear(i_encode_t *const encode)
+{
+	for (int i = 0; i < 3; ++i) {
+		if (encode->headers[i].data)
+			free(encode->headers[i].data);
+	}
+	if (encode->packets) {
+		for (brrsz i = 0; i < encode->n_packets; ++i)
+			free(encode->packets[i].data);
+		free(encode->packets);
+	}
+	memset(encode, 0, sizeof(*encode));
+}
+
+/* Swept tones with a slow tremolo and a little noise, so every block has something to code */
+static void
+i_synthesize(float **const buffer, int channels, long rate, brru8 first, int n, double seconds, brru4 *const noise)
+{
+	for (int c = 0; c < channels; ++c) {
+		for (int i = 0; i < n; ++i) {
+			const double t = (double)(first + i) / rate;
+			const double base = 110.0 * (c + 1) * (1.0 + 3.0 * t / seconds);
+			const double phase = 2 * M_PI * base * t;
+			const double envelope = 0.5 + 0.5 * sin(2 * M_PI * 0.7 * t);
+			*noise ^= *noise << 13;
+			*noise ^= *noise >> 17;
+			*noise ^= *noise << 5;
+			buffer[c][i] = envelope * (0.4 * sin(phase) + 0.2 * sin(2.01 * phase))
+			    + 0.05 * ((double)*noise / 0xFFFFFFFFu - 0.5);
+		}
+	}
+}
+
+/****************************************
+  Repack the setup header; the inverse of what the converter does to rebuild it.
+****************************************/
+static int
+i_repack_codebook(oggpack_buffer *const unpacker, oggpack_buffer *const packer, int strip)
+{
+	for (int i = 0; i < sizeof(CODEBOOK_SYNC) - 1; ++i) {
+		if (CODEBOOK_SYNC[i] != packer_unpack(unpacker, 8))
+			return I_CORRUPT;
+		if (!strip)
+			packer_pack(packer, CODEBOOK_SYNC[i], 8);
+	}
+	long dimensions = packer_unpack(unpacker, 16);
+	long entries = packer_unpack(unpacker, 24);
+	if (strip && (dimensions > 0xF || entries > 0x3FFF))
+		return I_UNRECOGNIZED_DATA;
+	packer_pack(packer, dimensions, strip ? 4 : 16);
+	packer_pack(packer, entries, strip ? 14 : 24);
+
+	int ordered = packer_transfer(unpacker, 1, packer, 1);
+	if (ordered) {
+		packer_transfer(unpacker, 5, packer, 5); /* Start length */
+		for (long current = 0; current < entries;) {
+			int number_bits = lib_count_bits(entries - current);
+			long number = packer_transfer(unpacker, number_bits, packer, number_bits);
+			if (number <= 0)
+				return I_CORRUPT;
+			current += number;
+		}
+	} else {
+		/* Stripped lengths are only as wide as the longest needs, so they're all read first */
+		int sparse = packer_unpack(unpacker, 1);
+		brru1 *lengths = NULL;
+		int max_length = 0;
+		if (!(lengths = malloc(entries ? entries : 1)))
+			return I_BUFFER_ERROR;
+		for (long i = 0; i < entries; ++i) {
+			int used = sparse ? packer_unpack(unpacker, 1) : 1;
+			/* Stored as length - 1, or 0xFF for unused entries */
+			lengths[i] = used ? packer_unpack(unpacker, 5) : 0xFF;
+			if (used && lengths[i] > max_length)
+				max_length = lengths[i];
+		}
+		const int length_bits = strip ? lib_count_bits(max_length) : 5;
+		if (strip)
+			packer_pack(packer, length_bits, 3);
+		packer_pack(packer, sparse, 1);
+		for (long i = 0; i < entries; ++i) {
+			if (sparse)
+				packer_pack(packer, lengths[i] != 0xFF, 1);
+			if (lengths[i] != 0xFF)
+				packer_pack(packer, lengths[i], length_bits);
+		}
+		free(lengths);
+	}
+
+	int lookup = packer_unpack(unpacker, 4);
+	if (lookup > 2)
+		return I_CORRUPT;
+	if (strip && lookup > 1)
+		return I_UNRECOGNIZED_DATA;
+	packer_pack(packer, lookup, strip ? 1 : 4);
+	if (lookup) {
+		packer_transfer(unpacker, 32, packer, 32); /* Minimum value */
+		packer_transfer(unpacker, 32, packer, 32); /* Delta value */
+		int value_bits = 1 + packer_transfer(unpacker, 4, packer, 4);
+		packer_transfer(unpacker, 1, packer, 1);   /* Sequence flag */
+		long lookup_values = lookup == 1 ? lib_lookup1_values(entries, dimensions) : entries * dimensions;
+		for (long i = 0; i < lookup_values; ++i)
+			packer_transfer(unpacker, value_bits, packer, value_bits);
+	}
+	return I_SUCCESS;
+}
+
+/* Adds the stripped codebook in 'book' to 'library', unless it's already there, and returns its index, or 0 on error.
+ * The first codebook of a library is an empty placeholder, like those of real libraries. */
+static brru4
+i_library_add(codebook_library_t *const library, oggpack_buffer *const book)
+{
+	const unsigned char *const data = oggpack_get_buffer(book);
+	const brru4 size = oggpack_bytes(book);
+	for (brru4 i = 1; i < library->codebook_count; ++i) {
+		if (library->codebooks[i].size == size && 0 == memcmp(library->codebooks[i].data, data, size))
+			return i;
+	}
+	/* Indices are stored in 10 bits, one less than the index */
+	if (library->codebook_count >= 1025)
+		return 0;
+	const brru4 count = library->codebook_count ? library->codebook_count + 1 : 2;
+	if (brrlib_alloc((void **)&library->codebooks, count * sizeof(*library->codebooks), 0))
+		return 0;
+	packed_codebook_t codebook = {.size = size};
+	if (!(codebook.data = malloc(size ? size : 1)))
+		return 0;
+	memcpy(codebook.data, data, size);
+	if (!library->codebook_count)
+		library->codebooks[library->codebook_count++] = (packed_codebook_t){0};
+	library->codebooks[library->codebook_count] = codebook;
+	return library->codebook_count++;
+}
+
+static int
+i_strip_floors(oggpack_buffer *const unpacker, oggpack_buffer *const packer)
+{
+	int floor_count = 1 + packer_transfer(unpacker, 6, packer, 6);
+	for (int i = 0; i < floor_count; ++i) {
+		/* Only floor 1 can be stripped, since the type isn't kept */
+		if (1 != packer_unpack(unpacker, 16))
+			return I_UNRECOGNIZED_DATA;
+		int partitions = packer_transfer(unpacker, 5, packer, 5);
+		int partition_classes[31];
+		int max_class = -1;
+		for (int j = 0; j < partitions; ++j) {
+			int class = partition_classes[j] = packer_transfer(unpacker, 4, packer, 4);
+			if (class > max_class)
+				max_class = class;
+		}
+		int class_dims[16];
+		for (int j = 0; j <= max_class; ++j) {
+			class_dims[j] = 1 + packer_transfer(unpacker, 3, packer, 3);
+			int n_subs = packer_transfer(unpacker, 2, packer, 2);
+			if (n_subs)
+				packer_transfer(unpacker, 8, packer, 8); /* Master book */
+			for (int k = 0; k < 1 << n_subs; ++k)
+				packer_transfer(unpacker, 8, packer, 8); /* Subclass books */
+		}
+		packer_transfer(unpacker, 2, packer, 2); /* Multiplier */
+		int rangebits = packer_transfer(unpacker, 4, packer, 4);
+		for (int j = 0; j < partitions; ++j) {
+			for (int k = 0; k < class_dims[partition_classes[j]]; ++k)
+				packer_transfer(unpacker, rangebits, packer, rangebits);
+		}
+	}
+	return I_SUCCESS;
+}
+static int
+i_strip_residues(oggpack_buffer *const unpacker, oggpack_buffer *const packer)
+{
+	int residue_count = 1 + packer_transfer(unpacker, 6, packer, 6);
+	for (int i = 0; i < residue_count; ++i) {
+		long type = packer_unpack(unpacker, 16);
+		if (type > 2)
+			return I_CORRUPT;
+		packer_pack(packer, type, 2);
+		packer_transfer(unpacker, 24, packer, 24); /* Begin */
+		packer_transfer(unpacker, 24, packer, 24); /* End */
+		packer_transfer(unpacker, 24, packer, 24); /* Partition size */
+		int classes = 1 + packer_transfer(unpacker, 6, packer, 6);
+		packer_transfer(unpacker, 8, packer, 8);   /* Classbook */
+		int books = 0;
+		for (int j = 0; j < classes; ++j) {
+			int cascade = packer_transfer(unpacker, 3, packer, 3);
+			if (packer_transfer(unpacker, 1, packer, 1))
+				cascade += 8 * packer_transfer(unpacker, 5, packer, 5);
+			books += lib_count_ones(cascade);
+		}
+		for (int j = 0; j < books; ++j)
+			packer_transfer(unpacker, 8, packer, 8);
+	}
+	return I_SUCCESS;
+}
+static int
+i_strip_mappings(oggpack_buffer *const unpacker, oggpack_buffer *const packer, int n_channels)
+{
+	const int n_channel_bits = lib_count_bits(n_channels - 1);
+	int mapping_count = 1 + packer_transfer(unpacker, 6, packer, 6);
+	for (int i = 0; i < mapping_count; ++i) {
+		if (0 != packer_unpack(unpacker, 16))
+			return I_UNRECOGNIZED_DATA;
+		int submaps = 1;
+		if (packer_transfer(unpacker, 1, packer, 1))
+			submaps = 1 + packer_transfer(unpacker, 4, packer, 4);
+		if (packer_transfer(unpacker, 1, packer, 1)) {
+			int coupling_steps = 1 + packer_transfer(unpacker, 8, packer, 8);
+			for (int j = 0; j < coupling_steps; ++j) {
+				packer_transfer(unpacker, n_channel_bits, packer, n_channel_bits); /* Magnitude */
+				packer_transfer(unpacker, n_channel_bits, packer, n_channel_bits); /* Angle */
+			}
+		}
+		packer_transfer(unpacker, 2, packer, 2); /* Reserved */
+		if (submaps > 1) {
+			for (int j = 0; j < n_channels; ++j)
+				packer_transfer(unpacker, 4, packer, 4);
+		}
+		for (int j = 0; j < submaps; ++j) {
+			packer_transfer(unpacker, 8, packer, 8); /* Unused time config */
+			packer_transfer(unpacker, 8, packer, 8); /* Floor */
+			packer_transfer(unpacker, 8, packer, 8); /* Residue */
+		}
+	}
+	return I_SUCCESS;
+}
+static int
+i_strip_modes(oggpack_buffer *const unpacker, oggpack_buffer *const packer, i_modes_t *const modes)
+{
+	int mode_count = 1 + packer_transfer(unpacker, 6, packer, 6);
+	if (mode_count > sizeof(modes->blockflags))
+		return I_CORRUPT;
+	for (int i = 0; i < mode_count; ++i) {
+		modes->blockflags[i] = packer_transfer(unpacker, 1, packer, 1);
+		packer_unpack(unpacker, 16); /* Window type */
+		packer_unpack(unpacker, 16); /* Transform type */
+		packer_transfer(unpacker, 8, packer, 8); /* Mapping */
+	}
+	modes->count = mode_count;
+	return I_SUCCESS;
+}
+
+/* Writes the setup header of a WwRIFF with the codebooks stored as 'codebooks' from the standard 'setup' header to
+ * 'packer'; external codebooks are added to 'library', and stripping fills in 'modes'. */
+static int
+i_repack_setup(
+    const i_packet_t *const setup,
+    i_codebooks_t codebooks,
+    int n_channels,
+    i_modes_t *const modes,
+    codebook_library_t *const library,
+    oggpack_buffer *const packer
+)
+{
+	int err = 0;
+	oggpack_buffer unpacker;
+	oggpack_readinit(&unpacker, setup->data, setup->size);
+	if (5 != packer_unpack(&unpacker, 8))
+		return I_CORRUPT;
+	for (int i = 0; i < 6; ++i)
+		packer_unpack(&unpacker, 8); /* Vorbis string */
+
+	int codebook_count = 1 + packer_transfer(&unpacker, 8, packer, 8);
+	for (int i = 0; !err && i < codebook_count; ++i) {
+		if (codebooks != i_codebooks_external) {
+			err = i_repack_codebook(&unpacker, packer, codebooks == i_codebooks_stripped);
+		} else {
+			oggpack_buffer book;
+			oggpack_writeinit(&book);
+			if (!(err = i_repack_codebook(&unpacker, &book, 1))) {
+				brru4 index = i_library_add(library, &book);
+				if (!index)
+					err = I_BUFFER_ERROR;
+				else
+					packer_pack(packer, index - 1, 10);
+			}
+			oggpack_writeclear(&book);
+		}
+	}
+	if (err)
+		return err;
+
+	/* Time-domain transforms are always rewritten as a single placeholder */
+	int time_count = 1 + packer_unpack(&unpacker, 6);
+	for (int i = 0; i < time_count; ++i) {
+		if (0 != packer_unpack(&unpacker, 16))
+			return I_UNRECOGNIZED_DATA;
+	}
+
+	if (codebooks == i_codebooks_full) {
+		if (-1 == packer_transfer_remaining(&unpacker, packer))
+			return I_CORRUPT;
+		return I_SUCCESS;
+	}
+	if ((err = i_strip_floors(&unpacker, packer)))
+		return err;
+	if ((err = i_strip_residues(&unpacker, packer)))
+		return err;
+	if ((err = i_strip_mappings(&unpacker, packer, n_channels)))
+		return err;
+	return i_strip_modes(&unpacker, packer, modes);
+}
+
+static int
+i_encode(i_encode_t *const encode, const struct i_signal *const signal, double scale, brru4 seed)
+{
+	int err = 0;
+	vorbis_info vi;
+	vorbis_comment vc;
+	vorbis_dsp_state vd;
+	vorbis_block vb;
+	brrsz capacity = 0;
+	const brru8 total = signal->seconds * scale * signal->rate;
+	brru8 audio_bytes = 0;
+	brru4 noise = seed | 1;
+
+	memset(encode, 0, sizeof(*encode));
+	vorbis_info_init(&vi);
+	if (vorbis_encode_init_vbr(&vi, signal->channels, signal->rate, signal->quality)) {
+		fprintf(stderr, "libvorbis can't encode %d channels at %ld Hz, quality %.1f\n",
+		    signal->channels, signal->rate, signal->quality);
+		vorbis_info_clear(&vi);
+		return I_INIT_ERROR;
+	}
+	vorbis_comment_init(&vc);
+	vorbis_analysis_init(&vd, &vi);
+	vorbis_block_init(&vd, &vb);
+
+	{
+		ogg_packet headers[3];
+		vorbis_analysis_headerout(&vd, &vc, &headers[0], &headers[1], &headers[2]);
+		for (int i = 0; !err && i < 3; ++i)
+			err = i_copy_packet(&encode->headers[i], &headers[i]);
+	}
+
+	for (brru8 written = 0, done = 0; !err && !done;) {
+		if (written < total) {
+			const int n = total - written < GEN_BLOCK ? (int)(total - written) : GEN_BLOCK;
+			i_synthesize(vorbis_analysis_buffer(&vd, n), signal->channels, signal->rate, written, n,
+			    signal->seconds * scale, &noise);
+			vorbis_analysis_wrote(&vd, n);
+			written += n;
+		} else {
+			vorbis_analysis_wrote(&vd, 0);
+			done = 1;
+		}
+		while (!err && vorbis_analysis_blockout(&vd, &vb) == 1) {
+			ogg_packet packet;
+			vorbis_analysis(&vb, NULL);
+			vorbis_bitrate_addblock(&vb);
+			while (!err && vorbis_bitrate_flushpacket(&vd, &packet)) {
+				if (encode->n_packets == capacity) {
+					capacity = capacity ? 2 * capacity : 256;
+					if (brrlib_alloc((void **)&encode->packets, capacity * sizeof(*encode->packets), 0)) {
+						err = I_BUFFER_ERROR;
+						break;
+					}
+				}
+				if (!(err = i_copy_packet(&encode->packets[encode->n_packets], &packet))) {
+					audio_bytes += packet.bytes;
+					encode->n_packets++;
+				}
+			}
+		}
+	}
+
+	vorbis_block_clear(&vb);
+	vorbis_dsp_clear(&vd);
+	vorbis_comment_clear(&vc);
+	vorbis_info_clear(&vi);
+
+	if (!err) {
+		/* Blocksize exponents are the byte after the bitrates of the ID header, smaller first */
+		const unsigned char blocksizes = encode->headers[0].data[28];
+		encode->channels = signal->channels;
+		encode->rate = signal->rate;
+		encode->samples = total;
+		encode->avg_byte_rate = total ? audio_bytes * signal->rate / total : 0;
+		encode->blocksize_0 = blocksizes & 0x0F;
+		encode->blocksize_1 = blocksizes >> 4;
+
+		/* Stripping the setup header once fills in the modes, which modified audio packets need */
+		oggpack_buffer scratch;
+		oggpack_writeinit(&scratch);
+		err = i_repack_setup(&encode->headers[2], i_codebooks_stripped, encode->channels, &encode->modes, NULL, &scratch);
+		oggpack_writeclear(&scratch);
+	}
+	if (err)
+		i_encode_clear(encode);
+	return err;
+}
+
+/****************************************
+  Write WwRIFFs
+****************************************/
+static int
+i_put_packet(i_buffer_t *const data, i_layout_t layout, const void *const payload, long size, brru8 granule)
+{
+	int err = 0;
+	if (size > 0xFFFF) {
+		fprintf(stderr, "Packet of %ld bytes is too large for a WwRIFF\n", size);
+		return I_OUT_OF_RANGE;
+	}
+	if ((err = i_put_u16(data, size)))
+		return err;
+	if (layout != i_layout_implicit) {
+		if ((err = i_put_u32(data, granule)))
+			return err;
+		if (layout == i_layout_basic && (err = i_put_u16(data, 0)))
+			return err;
+	}
+	return i_put(data, payload, size);
+}
+
+/* Drops the packet type and window flags from an audio packet, which the converter puts back from the modes of it
+ * and its neighbours */
+static int
+i_put_mod_packet(i_buffer_t *const data, const i_encode_t *const encode, const i_packet_t *const packet)
+{
+	int err = 0;
+	const int mode_bits = lib_count_bits(encode->modes.count - 1);
+	oggpack_buffer unpacker, packer;
+	oggpack_readinit(&unpacker, packet->data, packet->size);
+	oggpack_writeinit(&packer);
+	if (0 != packer_unpack(&unpacker, 1)) {
+		err = I_CORRUPT;
+	} else {
+		int mode = packer_transfer(&unpacker, mode_bits, &packer, mode_bits);
+		if (mode < 0 || mode >= encode->modes.count) {
+			err = I_CORRUPT;
+		} else {
+			if (encode->modes.blockflags[mode]) {
+				packer_unpack(&unpacker, 1); /* Previous window type */
+				packer_unpack(&unpacker, 1); /* Next window type */
+			}
+			if (-1 == packer_transfer_remaining(&unpacker, &packer))
+				err = I_CORRUPT;
+		}
+	}
+	if (!err)
+		err = i_put_packet(data, i_layout_implicit, oggpack_get_buffer(&packer), oggpack_bytes(&packer), 0);
+	oggpack_writeclear(&packer);
+	return err;
+}
+
+static int
+i_put_wwriff(
+    i_buffer_t *const out,
+    const i_encode_t *const encode,
+    const struct i_flavor *const flavor,
+    codebook_library_t *const library,
+    brru4 uid
+)
+{
+	int err = 0;
+	i_buffer_t data = {0};
+	brru4 audio_start = 0;
+
+	if (flavor->layout == i_layout_basic) {
+		for (int i = 0; !err && i < 3; ++i)
+			err = i_put_packet(&data, flavor->layout, encode->headers[i].data, encode->headers[i].size, 0);
+	} else {
+		oggpack_buffer packer;
+		oggpack_writeinit(&packer);
+		/* The modes were already read by 'i_encode' */
+		i_modes_t modes = {0};
+		if (!(err = i_repack_setup(&encode->headers[2], flavor->codebooks, encode->channels, &modes, library, &packer)))
+			err = i_put_packet(&data, flavor->layout, oggpack_get_buffer(&packer), oggpack_bytes(&packer), 0);
+		oggpack_writeclear(&packer);
+	}
+	audio_start = data.size;
+	for (brrsz i = 0; !err && i < encode->n_packets; ++i) {
+		const i_packet_t *const packet = &encode->packets[i];
+		if (flavor->mod_packets)
+			err = i_put_mod_packet(&data, encode, packet);
+		else
+			err = i_put_packet(&data, flavor->layout, packet->data, packet->size, packet->granule);
+	}
+
+	if (!err) {
+		unsigned char fmt[66] = {0};
+		unsigned char vorb[52] = {0};
+		const brru4 fmt_size = flavor->layout == i_layout_implicit ? 66 : 24;
+		const brru4 vorb_size = flavor->layout == i_layout_basic ? 44 : flavor->layout == i_layout_extra ? 52 : 0;
+		wwise_fmt_t f = {
+			.format_tag = WWISE_FORMAT_VORBIS,
+			.n_channels = encode->channels,
+			.samples_per_sec = encode->rate,
+			.avg_byte_rate = encode->avg_byte_rate,
+			.extra_size = fmt_size - 18,
+			.channel_mask = encode->channels == 1 ? 0x4 : 0x3,
+		};
+		/* Only the first 24 bytes are stored, the same as the converter reads them */
+		memcpy(fmt, &f, 24);
+		if (flavor->layout == i_layout_implicit) {
+			unsigned char *const v = fmt + 24;
+			i_set_u32(v + 0, encode->samples);
+			i_set_u32(v + 4, flavor->mod_packets ? 0 : 0x4A); /* Mod signal */
+			i_set_u32(v + 16, 0);                             /* Header packets offset */
+			i_set_u32(v + 20, audio_start);
+			i_set_u32(v + 36, uid);
+			v[40] = encode->blocksize_0;
+			v[41] = encode->blocksize_1;
+		} else {
+			i_set_u32(vorb + 0, encode->samples);
+			i_set_u32(vorb + 24, 0); /* Header packets offset */
+			i_set_u32(vorb + 28, audio_start);
+			if (flavor->layout == i_layout_extra) {
+				i_set_u32(vorb + 44, uid);
+				vorb[48] = encode->blocksize_0;
+				vorb[49] = encode->blocksize_1;
+			}
+		}
+
+		const brru4 riff_size = 4 + 8 + fmt_size + (vorb_size ? 8 + vorb_size : 0) + 8 + data.size;
+		if (!(err = i_put(out, "RIFF", 4))
+		    && !(err = i_put_u32(out, riff_size))
+		    && !(err = i_put(out, "WAVE", 4))
+		    && !(err = i_put(out, "fmt ", 4))
+		    && !(err = i_put_u32(out, fmt_size))
+		    && !(err = i_put(out, fmt, fmt_size))) {
+			if (vorb_size && !(err = i_put(out, "vorb", 4)) && !(err = i_put_u32(out, vorb_size)))
+				err = i_put(out, vorb, vorb_size);
+			if (!err && !(err = i_put(out, "data", 4)) && !(err = i_put_u32(out, data.size)))
+				err = i_put(out, data.data, data.size);
+		}
+	}
+	i_buffer_clear(&data);
+	return err;
+}
+
+static int
+i_write_file(const char *const path, const void *const data, brrsz size)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Failed to open '%s' : %s\n", path, strerror(errno));
+		return I_IO_ERROR;
+	}
+	brrsz written = fwrite(data, 1, size, file);
+	if (fclose(file) || written != size) {
+		fprintf(stderr, "Failed to write '%s' : %s\n", path, strerror(errno));
+		return I_IO_ERROR;
+	}
+	return I_SUCCESS;
+}
+
+int
+main(int argc, char **argv)
+{
+	long n_entries = 32;
+	double scale = 1;
+	const char *directory = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "-n") && i + 1 < argc)
+			n_entries = strtol(argv[++i], NULL, 10);
+		else if (0 == strcmp(argv[i], "-seconds") && i + 1 < argc)
+			scale = strtod(argv[++i], NULL);
+		else
+			directory = argv[i];
+	}
+	if (!directory || n_entries <= 0 || scale <= 0) {
+		fprintf(stderr, "Usage: %s [-n ENTRIES] [-seconds SCALE] OUTDIR\n", argv[0]);
+		return 1;
+	}
+
+	int err = 0;
+	char path[GEN_PATH_MAX];
+	i_encode_t encodes[N_SIGNALS] = {0};
+	codebook_library_t library = {0};
+	FILE *args = NULL;
+	brru8 total_bytes = 0;
+
+	for (int i = 0; !err && i < N_SIGNALS; ++i)
+		err = i_encode(&encodes[i], &i_signals[i], scale, 0x9E3779B9u * (i + 1));
+
+	snprintf(path, sizeof(path), "%s/bench.args", directory);
+	if (!err && !(args = fopen(path, "w"))) {
+		fprintf(stderr, "Failed to open '%s' : %s\n", path, strerror(errno));
+		err = I_IO_ERROR;
+	}
+	for (int f = 0; !err && f < N_FLAVORS; ++f) {
+		const struct i_flavor *const flavor = &i_flavors[f];
+		i_buffer_t archive = {0};
+		for (long e = 0; !err && e < n_entries; ++e) {
+			if ((err = i_put_wwriff(&archive, &encodes[e % N_SIGNALS], flavor, &library, 0x57000000u + f * 0x10000 + e)))
+				fprintf(stderr, "Failed to build %s WwRIFF %ld : %s\n", flavor->name, e, lib_strerr(err));
+		}
+		snprintf(path, sizeof(path), "%s/%s.wsp", directory, flavor->name);
+		if (!err && !(err = i_write_file(path, archive.data, archive.size)))
+			total_bytes += archive.size;
+		i_buffer_clear(&archive);
+	}
+	if (!err) {
+		void *serialized = NULL;
+		brru8 size = 0;
+		snprintf(path, sizeof(path), "%s/bench.cbl", directory);
+		if (codebook_library_serialize(&library, &serialized, &size)) {
+			err = I_BUFFER_ERROR;
+		} else {
+			err = i_write_file(path, serialized, size);
+			free(serialized);
+		}
+	}
+	if (!err) {
+		fprintf(args, "# entries=%lu bytes=%llu\n", (unsigned long)(n_entries * N_FLAVORS), (unsigned long long)total_bytes);
+		fprintf(args, "-Q\n-W\n-w2o\n-inline\n");
+		for (int f = 0; f < N_FLAVORS; ++f) {
+			const i_codebooks_t previous = f ? i_flavors[f - 1].codebooks : i_codebooks_full;
+			if (i_flavors[f].codebooks != i_codebooks_full && previous == i_codebooks_full)
+				fprintf(args, "-stripped\n");
+			if (i_flavors[f].codebooks == i_codebooks_external && previous != i_codebooks_external)
+				fprintf(args, "-cbl\n%s/bench.cbl\n", directory);
+			fprintf(args, "%s/%s.wsp\n", directory, i_flavors[f].name);
+		}
+	}
+	if (args && fclose(args) && !err)
+		err = I_IO_ERROR;
+
+	codebook_library_clear(&library);
+	for (int i = 0; i < N_SIGNALS; ++i)
+		i_encode_clear(&encodes[i]);
+	if (err) {
+		fprintf(stderr, "Failed to generate benchmark corpus : %s\n", lib_strerr(err));
+		return 1;
+	}
+	printf("Generated %lu WwRIFFs in %d archives, %llu bytes\n",
+	    (unsigned long)(n_entries * N_FLAVORS), (int)N_FLAVORS, (unsigned long long)total_bytes);
+	return 0;
+}
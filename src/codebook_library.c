@@ -159,6 +159,24 @@ codebook_library_clear(codebook_library_t *const library)
 	}
 }
 
+void
+codebook_library_unpack_all(codebook_library_t *const library)
+{
+	if (library) {
+		for (brru4 i = 0; i < library->codebook_count; ++i)
+			packed_codebook_unpack(&library->codebooks[i]);
+	}
+}
+
+#if !defined(Ne_builtin_codebooks)
+/* With 'builtin_codebooks', this is generated from codebooks.zip along with the libraries themselves */
+const codebook_library_t *
+codebook_library_builtin(const char *const name)
+{
+	return NULL;
+}
+#endif
+
 int
 codebook_library_deserialize_alt(codebook_library_t *const library, const void *const input_data, brru8 data_size)
 {
@@ -37,6 +37,14 @@ typedef struct codebook_library {
 } codebook_library_t;
 
 void codebook_library_clear(codebook_library_t *const cb);
+/* Unpacks every codebook of 'library' up front, so it can be shared between threads without any being unpacked
+ * while in use; codebooks that fail to unpack are left as they are, and fail again when used. */
+void codebook_library_unpack_all(codebook_library_t *const library);
+
+/* Returns the library compiled in under 'name' ('aotuv' or 'vanilla'), or NULL if there is none or the program was
+ * built without 'builtin_codebooks'.
+ * Built-in codebooks are already unpacked, and must never be cleared. */
+const codebook_library_t *codebook_library_builtin(const char *const name);
 
 /* Codebooks first, offsets last.
  *  0 : success
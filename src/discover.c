@@ -0,0 +1,315 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "discover.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <dirent.h>
+# include <sys/stat.h>
+#endif
+
+#include <brrtools/brrlib.h>
+
+#include "errors.h"
+#include "lib.h"
+#include "pool.h"
+
+#define DISCOVER_READ_CHUNK 65536
+
+typedef struct i_paths {
+	char **paths;
+	brrsz n_paths;
+	brrsz capacity;
+} i_paths_t;
+
+/* Takes ownership of 'path', freeing it if it can't be added. */
+static int
+i_paths_add(i_paths_t *const paths, char *const path)
+{
+	if (paths->n_paths == paths->capacity) {
+		const brrsz capacity = paths->capacity ? paths->capacity * 2 : 64;
+		if (brrlib_alloc((void **)&paths->paths, capacity * sizeof(*paths->paths), 0)) {
+			free(path);
+			return I_BUFFER_ERROR;
+		}
+		paths->capacity = capacity;
+	}
+	paths->paths[paths->n_paths++] = path;
+	return I_SUCCESS;
+}
+static void
+i_paths_clear(i_paths_t *const paths)
+{
+	for (brrsz i = 0; i < paths->n_paths; ++i)
+		free(paths->paths[i]);
+	if (paths->paths)
+		free(paths->paths);
+	*paths = (i_paths_t){0};
+}
+
+static int
+i_read_stream(FILE *const stream, char **const buffer, brrsz *const size)
+{
+	char *data = NULL;
+	brrsz n = 0, capacity = 0;
+	for (;;) {
+		if (capacity - n < DISCOVER_READ_CHUNK) {
+			capacity = capacity ? capacity * 2 : 4 * DISCOVER_READ_CHUNK;
+			if (brrlib_alloc((void **)&data, capacity, 0)) {
+				if (data)
+					free(data);
+				return I_BUFFER_ERROR;
+			}
+		}
+		const brrsz got = fread(data + n, 1, capacity - n, stream);
+		n += got;
+		if (!got)
+			break;
+	}
+	if (ferror(stream)) {
+		free(data);
+		return I_IO_ERROR;
+	}
+	*buffer = data;
+	*size = n;
+	return I_SUCCESS;
+}
+
+int
+discover_list(const char *const list, discover_add_t add, void *const context)
+{
+	char *buffer = NULL;
+	brrsz size = 0;
+	int err = 0;
+	if (0 == strcmp(list, "-"))
+		err = i_read_stream(stdin, &buffer, &size);
+	else
+		err = lib_read_entire_file(list, (void **)&buffer, &size);
+	if (err)
+		return err;
+
+	const char separator = memchr(buffer, 0, size) ? 0 : '\n';
+	for (brrsz start = 0; !err && start < size;) {
+		const char *const end = memchr(buffer + start, separator, size - start);
+		brrsz length = (end ? (brrsz)(end - buffer) : size) - start;
+		const brrsz next = start + length + 1;
+		/* Lines written on Windows */
+		if (separator && length && buffer[start + length - 1] == '\r')
+			--length;
+		if (length) {
+			char *const path = malloc(length + 1);
+			if (!path) {
+				err = I_BUFFER_ERROR;
+				break;
+			}
+			memcpy(path, buffer + start, length);
+			path[length] = 0;
+			err = add(context, path, length);
+		}
+		start = next;
+	}
+	free(buffer);
+	return err;
+}
+
+static inline char *
+i_join(const char *const dir, const char *const name)
+{
+	brrsz dir_length = strlen(dir), name_length = strlen(name);
+	char *path = malloc(dir_length + name_length + 2);
+	if (path) {
+		memcpy(path, dir, dir_length);
+		path[dir_length] = '/';
+		memcpy(path + dir_length + 1, name, name_length + 1);
+	}
+	return path;
+}
+
+static inline int
+i_is_discovered(const char *const name)
+{
+	return -1 != lib_cmp_ext(name, strlen(name), 0, "wem", "wsp", "bnk", NULL);
+}
+
+/* One directory of a level of the tree, listed by its own task */
+typedef struct i_listing {
+	const char *path;
+	i_paths_t files;
+	i_paths_t dirs;
+	int err;
+} i_listing_t;
+
+static int
+i_list(void *const context, brrsz task)
+{
+	i_listing_t *const listing = &((i_listing_t *)context)[task];
+#if defined(_WIN32)
+	WIN32_FIND_DATAA found;
+	char *const pattern = i_join(listing->path, "*");
+	HANDLE find = pattern ? FindFirstFileA(pattern, &found) : INVALID_HANDLE_VALUE;
+	if (pattern)
+		free(pattern);
+	if (find == INVALID_HANDLE_VALUE) {
+		listing->err = I_IO_ERROR;
+		return 0;
+	}
+	do {
+		const char *const name = found.cFileName;
+		const int dir = found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+		char *child = NULL;
+		if (0 == strcmp(name, ".") || 0 == strcmp(name, "..") || (found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			continue;
+		if (!dir && !i_is_discovered(name))
+			continue;
+		if (!(child = i_join(listing->path, name))
+		    || i_paths_add(dir ? &listing->dirs : &listing->files, child)) {
+			listing->err = I_BUFFER_ERROR;
+			break;
+		}
+	} while (FindNextFileA(find, &found));
+	FindClose(find);
+#else
+	DIR *dir = opendir(listing->path);
+	if (!dir) {
+		listing->err = I_IO_ERROR;
+		return 0;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		const char *const name = entry->d_name;
+		int is_dir = -1; /* Unknown until stat'ed */
+		int is_link = 0;
+		char *child = NULL;
+		if (0 == strcmp(name, ".") || 0 == strcmp(name, ".."))
+			continue;
+# if defined(DT_DIR)
+		/* Most filesystems say what an entry is, sparing a stat of every one */
+		if (entry->d_type == DT_DIR)
+			is_dir = 1;
+		else if (entry->d_type == DT_REG)
+			is_dir = 0;
+		else if (entry->d_type == DT_LNK)
+			is_link = 1;
+		else if (entry->d_type != DT_UNKNOWN)
+			continue;
+# endif
+		/* Links are only followed to files, so they need a discovered name as files do */
+		if ((!is_dir || is_link) && !i_is_discovered(name))
+			continue;
+		if (!(child = i_join(listing->path, name))) {
+			listing->err = I_BUFFER_ERROR;
+			break;
+		}
+		if (is_dir == -1) {
+			struct stat st;
+			int err = is_link ? stat(child, &st) : lstat(child, &st);
+			if (!err && !is_link && S_ISLNK(st.st_mode)) {
+				is_link = 1;
+				err = i_is_discovered(name) ? stat(child, &st) : -1;
+			}
+			/* Links to directories are not followed, which keeps the walk free of cycles */
+			if (err || !((S_ISDIR(st.st_mode) && !is_link) || (S_ISREG(st.st_mode) && i_is_discovered(name)))) {
+				free(child);
+				continue;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+		}
+		if (i_paths_add(is_dir ? &listing->dirs : &listing->files, child)) {
+			listing->err = I_BUFFER_ERROR;
+			break;
+		}
+	}
+	closedir(dir);
+#endif
+	return 0;
+}
+
+static int
+i_compare_paths(const void *const a, const void *const b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int
+discover_tree(const char *const root, int threads, discover_add_t add, void *const context)
+{
+	i_paths_t files = {0}, level = {0};
+	int err = 0;
+	{
+		char *const copy = malloc(strlen(root) + 1);
+		if (!copy)
+			return I_BUFFER_ERROR;
+		strcpy(copy, root);
+		/* Trailing separators would be doubled by every path joined to it */
+		for (brrsz length = strlen(copy); length > 1 && (copy[length - 1] == '/' || copy[length - 1] == '\\'); --length)
+			copy[length - 1] = 0;
+		if ((err = i_paths_add(&level, copy)))
+			return err;
+	}
+
+	for (int depth = 0; !err && level.n_paths; ++depth) {
+		i_paths_t next = {0};
+		i_listing_t *listings = calloc(level.n_paths, sizeof(*listings));
+		if (!listings) {
+			err = I_BUFFER_ERROR;
+			break;
+		}
+		for (brrsz i = 0; i < level.n_paths; ++i)
+			listings[i].path = level.paths[i];
+		pool_run_threads(threads, level.n_paths, i_list, listings);
+		for (brrsz i = 0; i < level.n_paths; ++i) {
+			i_listing_t *const listing = &listings[i];
+			if (listing->err == I_IO_ERROR) {
+				if (!depth)
+					err = I_IO_ERROR;
+				else
+					fprintf(stderr, "Failed to list directory '%s', skipping it\n", listing->path);
+			} else if (listing->err && !err) {
+				err = listing->err;
+			}
+			for (brrsz j = 0; !err && j < listing->files.n_paths; ++j) {
+				err = i_paths_add(&files, listing->files.paths[j]);
+				listing->files.paths[j] = NULL;
+			}
+			for (brrsz j = 0; !err && j < listing->dirs.n_paths; ++j) {
+				err = i_paths_add(&next, listing->dirs.paths[j]);
+				listing->dirs.paths[j] = NULL;
+			}
+			i_paths_clear(&listing->files);
+			i_paths_clear(&listing->dirs);
+		}
+		free(listings);
+		i_paths_clear(&level);
+		level = next;
+	}
+	i_paths_clear(&level);
+
+	if (!err && files.n_paths)
+		qsort(files.paths, files.n_paths, sizeof(*files.paths), i_compare_paths);
+	for (brrsz i = 0; !err && i < files.n_paths; ++i) {
+		char *const path = files.paths[i];
+		files.paths[i] = NULL;
+		err = add(context, path, strlen(path));
+	}
+	i_paths_clear(&files);
+	return err;
+}
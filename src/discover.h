@@ -0,0 +1,41 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DISCOVER_H
+#define DISCOVER_H
+
+#include <brrtools/brrtypes.h>
+
+/* Finding inputs other than on the command line, for batches too large for it: from lists of paths with
+ * '-files-from', and by walking directory trees with '-recursive'. */
+
+/* Takes ownership of the 'length' bytes of 'path', which are NUL-terminated.
+ * Returns 0 to go on, or non-zero to stop, which is then returned. */
+typedef int (*discover_add_t)(void *const context, char *const path, brrsz length);
+
+/* Calls 'add' with every path listed in the file 'list', or on stdin if 'list' is "-". Paths are separated by NULs
+ * if there are any, as written by 'find -print0', and by lines otherwise; empty ones are skipped.
+ * Returns 0 on success, I_IO_ERROR if the list can't be read, I_BUFFER_ERROR, or what 'add' stopped with. */
+int discover_list(const char *const list, discover_add_t add, void *const context);
+
+/* Calls 'add' with the path of every WwRIFF, WSP and BNK file (by extension, as '-watch' does) in the directory tree
+ * under 'root', in order by path. The directories of each level of the tree are listed in parallel on 'threads'
+ * threads, as 'pool_run_threads' takes them; symbolic links are only followed to files, so a link back up the tree
+ * can't loop, and unreadable directories are skipped with a warning on stderr, as this runs before logging is set up.
+ * Returns 0 on success, I_IO_ERROR if 'root' can't be read, I_BUFFER_ERROR, or what 'add' stopped with. */
+int discover_tree(const char *const root, int threads, discover_add_t add, void *const context);
+
+#endif /* DISCOVER_H */
@@ -14,6 +14,7 @@
 #define I_NOT_RIFF -9
 #define I_UNRECOGNIZED_DATA -10
 #define I_INSUFFICIENT_DATA -11
+#define I_OUT_OF_RANGE -12
 #define I_BAD_ERROR -99
 
 /* Ogg/Vorbis function return codes */
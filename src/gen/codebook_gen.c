@@ -0,0 +1,122 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Build-time generator for the built-in codebook libraries (see 'builtin_codebooks' in config.mk).
+ * Usage: codebook_gen OUTPUT.c NAME LIBRARY [NAME LIBRARY ...]
+ * Every library is loaded and all of its codebooks unpacked exactly as they would be at runtime, and the unpacked
+ * codebooks are written to OUTPUT.c as constant arrays, along with 'codebook_library_builtin' to look them up. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "codebook_library.h"
+#include "errors.h"
+#include "input.h"
+#include "lib.h"
+
+/* The generator is linked against the rest of the program, which looks up built-in libraries through this; there
+ * are none yet. */
+const codebook_library_t *
+codebook_library_builtin(const char *const name)
+{
+	return NULL;
+}
+
+static int
+i_write_library(FILE *const out, const char *const name, const char *const path)
+{
+	int err = 0;
+	neinput_library_t library = {.path = path, .path_length = strlen(path)};
+	if ((err = neinput_library_load(&library))) {
+		fprintf(stderr, "Failed to load codebook library '%s' : %s\n", path, lib_strerr(err));
+		return err;
+	}
+
+	const codebook_library_t *const lib = &library.library;
+	for (brru4 i = 0; i < lib->codebook_count; ++i) {
+		packed_codebook_t *const cb = &lib->codebooks[i];
+		const unsigned char *data = cb->data;
+		brru8 size = cb->size;
+		/* Some codebooks, like the first, are just placeholders that don't unpack; those are kept packed, so
+		 * they fail the same way they would loaded from a file */
+		if (CODEBOOK_SUCCESS == packed_codebook_unpack(cb)) {
+			data = cb->unpacked_data;
+			size = (cb->unpacked_bits + 7) / 8;
+		}
+		fprintf(out, "static const unsigned char i_%s_%lu[] = {", name, (unsigned long)i);
+		for (brru8 b = 0; b < size; ++b)
+			fprintf(out, "%s0x%02x,", b % 16 ? "" : "\n\t", data[b]);
+		/* Empty initializers aren't allowed */
+		fprintf(out, "%s\n};\n", size ? "" : "0");
+	}
+
+	/* Unpacked codebooks are marked as such, so 'packed_codebook_unpack' returns before ever touching them */
+	fprintf(out, "static packed_codebook_t i_%s[] = {\n", name);
+	for (brru4 i = 0; i < lib->codebook_count; ++i) {
+		const packed_codebook_t *const cb = &lib->codebooks[i];
+		if (cb->did_unpack) {
+			fprintf(out, "\t{.unpacked_data = (unsigned char *)i_%s_%lu, .unpacked_bits = %llu, .did_unpack = 1},\n",
+			    name, (unsigned long)i, (unsigned long long)cb->unpacked_bits);
+		} else {
+			fprintf(out, "\t{.data = (unsigned char *)i_%s_%lu, .size = %lu},\n",
+			    name, (unsigned long)i, (unsigned long)cb->size);
+		}
+	}
+	fprintf(out, "};\n\n");
+	fprintf(out, "static const codebook_library_t i_%s_library = {i_%s, %lu};\n\n",
+	    name, name, (unsigned long)lib->codebook_count);
+
+	neinput_library_clear(&library);
+	return I_SUCCESS;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 4 || argc % 2) {
+		fprintf(stderr, "Usage: %s OUTPUT.c NAME LIBRARY [NAME LIBRARY ...]\n", argv[0]);
+		return 1;
+	}
+
+	FILE *out = fopen(argv[1], "w");
+	if (!out) {
+		fprintf(stderr, "Failed to open '%s' : %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	fprintf(out,
+	    "/* Generated by codebook_gen from codebooks.zip; do not edit. */\n\n"
+	    "#include \"codebook_library.h\"\n\n"
+	    "#include <string.h>\n\n");
+
+	int err = 0;
+	for (int i = 2; !err && i < argc; i += 2)
+		err = i_write_library(out, argv[i], argv[i + 1]);
+
+	if (!err) {
+		fprintf(out, "const codebook_library_t *\ncodebook_library_builtin(const char *const name)\n{\n");
+		for (int i = 2; i < argc; i += 2) {
+			fprintf(out, "\tif (0 == strcmp(name, \"%s\"))\n\t\treturn &i_%s_library;\n", argv[i], argv[i]);
+		}
+		fprintf(out, "\treturn NULL;\n}\n");
+	}
+
+	if (fclose(out) || err) {
+		remove(argv[1]);
+		return 1;
+	}
+	return 0;
+}
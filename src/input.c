@@ -16,12 +16,15 @@ limitations under the License.
 #include "input.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #if !defined(_WIN32)
 #include <strings.h>
+#include <sys/stat.h>
 #endif
 
 #include <brrtools/brrlib.h>
@@ -29,9 +32,11 @@ limitations under the License.
 #include <brrtools/brrstringr.h>
 #include <brrtools/brrpath.h>
 
+#include "discover.h"
 #include "errors.h"
 #include "lib.h"
 #include "print.h"
+#include "usdt.h"
 
 static inline int
 i_mod_priority(neinput_t *const input, int delta)
@@ -55,6 +60,21 @@ i_parse_argument(const char *const arg, nestate_t *const state, neinput_t *const
 	if (arg[0] == 0) { /* Argument is of 0 length, very bad! */
 		return 1;
 	} else if (state->settings.next_is_filter ||
+	           state->settings.next_is_expression ||
+	           state->settings.next_is_threads ||
+	           state->settings.next_is_range ||
+	           state->settings.next_is_serve ||
+	           state->settings.next_is_watch ||
+	           state->settings.next_is_flush ||
+	           state->settings.next_is_trace ||
+	           state->settings.next_is_queue ||
+	           state->settings.next_is_queue_memory ||
+	           state->settings.next_is_schedule ||
+	           state->settings.next_is_mem_limit ||
+	           state->settings.next_is_shard ||
+	           state->settings.next_is_report_file ||
+	           state->settings.next_is_files_from ||
+	           state->settings.next_is_recursive ||
 	           state->settings.next_is_library ||
 	           state->settings.next_is_file ||
 	           state->settings.always_file) {
@@ -77,8 +97,10 @@ i_parse_argument(const char *const arg, nestate_t *const state, neinput_t *const
 	else CHECK_SET_ARG(1, state->settings.next_is_library, 1, "-cbl", "-codebook-library")
 	else CHECK_SET_ARG(1, current->library_index, -1, "-inline")
 	else CHECK_TOGGLE_ARG(1, current->flag.stripped_headers, "-stripped")
+	else CHECK_TOGGLE_ARG(1, current->flag.auto_codebooks, "-cba", "-codebooks-auto")
 
 	else CHECK_TOGGLE_ARG(1, current->flag.auto_ogg, "-w2o", "-wem2ogg")
+	else CHECK_TOGGLE_ARG(1, current->flag.keep_wem, "-w2ow", "-wem2ogg-keep")
 	else IF_CHECK_ARG(1, "-white", "-weiss") {
 		current->filter.type = neinput_filter_white;
 		state->settings.next_is_filter = 1;
@@ -90,6 +112,11 @@ i_parse_argument(const char *const arg, nestate_t *const state, neinput_t *const
 		return 1;
 	}
 	else CHECK_TOGGLE_ARG(1, current->filter.type, "-rubrum")
+	else CHECK_SET_ARG(1, state->settings.next_is_expression, 1, "-where", "-filter")
+	else CHECK_SET_ARG(1, state->settings.next_is_range, 1, "-range")
+	else CHECK_SET_ARG(1, current->flag.time_range, 0, "-full")
+	else CHECK_TOGGLE_ARG(1, current->flag.wav_out, "-wav")
+	else CHECK_TOGGLE_ARG(1, current->flag.pcm_out, "-pcm")
 
 	else CHECK_TOGGLE_ARG(1, state->settings.next_is_file, "-!")
 	else CHECK_TOGGLE_ARG(1, state->settings.always_file, "--")
@@ -104,14 +131,32 @@ i_parse_argument(const char *const arg, nestate_t *const state, neinput_t *const
 	else CHECK_TOGGLE_ARG(1, current->flag.log_enabled, "-Q", "-qq", "too-quiet")
 	else CHECK_TOGGLE_ARG(1, current->flag.dry_run, "-n", "-dry", "-dry-run")
 	else CHECK_TOGGLE_ARG(1, state->settings.should_reset, "-reset")
+	else CHECK_TOGGLE_ARG(1, state->settings.probe, "-probe")
+	else CHECK_SET_ARG(1, state->settings.next_is_threads, 1, "-j", "-threads")
+	else CHECK_SET_ARG(1, state->settings.next_is_serve, 1, "-serve")
+	else CHECK_SET_ARG(1, state->settings.next_is_watch, 1, "-watch")
+	else CHECK_SET_ARG(1, state->settings.log_mode, nestate_log_lines, "-lines")
+	else CHECK_SET_ARG(1, state->settings.log_mode, nestate_log_summary, "-summary")
+	else CHECK_SET_ARG(1, state->settings.next_is_flush, 1, "-flush")
+	else CHECK_SET_ARG(1, state->settings.next_is_trace, 1, "-trace")
+	else CHECK_SET_ARG(1, state->settings.next_is_queue, 1, "-queue")
+	else CHECK_SET_ARG(1, state->settings.next_is_queue_memory, 1, "-queue-memory")
+	else CHECK_SET_ARG(1, state->settings.next_is_schedule, 1, "-schedule")
+	else CHECK_SET_ARG(1, state->settings.next_is_mem_limit, 1, "-mem-limit")
+	else CHECK_SET_ARG(1, state->settings.next_is_shard, 1, "-shard")
+	else CHECK_SET_ARG(1, state->settings.next_is_report_file, 1, "-report-file")
+	else CHECK_TOGGLE_ARG(1, state->settings.merge_reports, "-merge-reports")
+	else CHECK_SET_ARG(1, state->settings.next_is_files_from, 1, "-files-from")
+	else CHECK_SET_ARG(1, state->settings.next_is_recursive, 1, "-R", "-recursive")
 #undef IF_CHECK_ARG
 #undef CHECK_TOGGLE_ARG
 #undef CHECK_SET_ARG
 #undef CHECK_RUN_ARG
 	else return 0;
 }
+/* Parses one comma-separated element of an index list: either a single index or an inclusive range 'first-last'. */
 static inline int
-i_parse_index(char *const arg, int arglen, neinput_filter_t *const list, int *const offset)
+i_parse_index(const char *const arg, int arglen, neinput_filter_t *const filter, int *const offset)
 {
 	int comma = *offset;
 	for (;comma < arglen && arg[comma] != ','; ++comma);
@@ -119,17 +164,22 @@ i_parse_index(char *const arg, int arglen, neinput_filter_t *const list, int *co
 		int digit = *offset;
 		for (;digit < comma && !isdigit(arg[digit]); ++digit);
 		if (digit < comma) {
-			char *start = arg + digit, *error = NULL;
-			unsigned long long val = 0;
-			arg[comma] = 0;
-			val = strtoull(start, &error, 0);
-			arg[comma] = ',';
-			if (start[0] && error[0] == ',') { /*  Complete success */
-				if (!neinput_filter_contains(list, val)) {
-					if (brrlib_alloc((void **)&list->list, (list->count + 1) * sizeof(*list->list), 0))
-						return -1;
-					list->list[list->count++] = val;
+			char *end = NULL;
+			unsigned long long first = strtoull(arg + digit, &end, 0), last = first;
+			if (end < arg + comma && end[0] == '-' && isdigit(end[1]))
+				last = strtoull(end + 1, &end, 0);
+			if (end == arg + comma) { /*  Complete success */
+				if (first > last) {
+					unsigned long long t = first;
+					first = last;
+					last = t;
 				}
+				if (first > 0xFFFFFFFF)
+					first = 0xFFFFFFFF;
+				if (last > 0xFFFFFFFF)
+					last = 0xFFFFFFFF;
+				if (neinput_filter_add_range(filter, first, last))
+					return -1;
 			}
 		}
 	}
@@ -141,7 +191,7 @@ i_set_filter(const char *const arg, int arglen, neinput_filter_t *const filter)
 {
 	int offset = 0;
 	while (offset < arglen) {
-		if (i_parse_index((char *)arg, arglen, filter, &offset))
+		if (i_parse_index(arg, arglen, filter, &offset))
 			return -1;
 	}
 	return 0;
@@ -151,28 +201,301 @@ void
 neinput_filter_clear(neinput_filter_t *const filter)
 {
 	if (filter) {
-		if (filter->list)
-			free(filter->list);
+		if (filter->ranges)
+			free(filter->ranges);
+		if (filter->terms)
+			free(filter->terms);
 		memset(filter, 0, sizeof(*filter));
 	}
 }
 int
+neinput_filter_copy(neinput_filter_t *const filter, const neinput_filter_t *const source)
+{
+	neinput_filter_t copy = *source;
+	copy.ranges = NULL;
+	copy.terms = NULL;
+	if (source->n_ranges) {
+		if (!(copy.ranges = malloc(source->n_ranges * sizeof(*copy.ranges))))
+			return -1;
+		memcpy(copy.ranges, source->ranges, source->n_ranges * sizeof(*copy.ranges));
+	}
+	if (source->n_terms) {
+		if (!(copy.terms = malloc(source->n_terms * sizeof(*copy.terms)))) {
+			free(copy.ranges);
+			return -1;
+		}
+		memcpy(copy.terms, source->terms, source->n_terms * sizeof(*copy.terms));
+	}
+	*filter = copy;
+	return 0;
+}
+
+/* Returns the first range that ends at or after 'index' (or that 'index' directly follows, if 'adjacent'). */
+static inline brru4
+i_lower_range(const neinput_filter_t *const filter, brru4 index, int adjacent)
+{
+	brru4 lo = 0, hi = filter->n_ranges;
+	while (lo < hi) {
+		brru4 mid = lo + (hi - lo) / 2;
+		if ((brru8)filter->ranges[mid].last + (adjacent ? 1 : 0) < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+int
+neinput_filter_add_range(neinput_filter_t *const filter, brru4 first, brru4 last)
+{
+	brru4 lo = i_lower_range(filter, first, 1), hi = lo;
+	/* Absorb every range that overlaps or touches the new one */
+	for (;hi < filter->n_ranges && filter->ranges[hi].first <= (brru8)last + 1; ++hi) {
+		if (filter->ranges[hi].first < first)
+			first = filter->ranges[hi].first;
+		if (filter->ranges[hi].last > last)
+			last = filter->ranges[hi].last;
+	}
+	if (hi == lo) {
+		if (brrlib_alloc((void **)&filter->ranges, (filter->n_ranges + 1) * sizeof(*filter->ranges), 0))
+			return -1;
+		memmove(filter->ranges + lo + 1, filter->ranges + lo, (filter->n_ranges - lo) * sizeof(*filter->ranges));
+		filter->n_ranges++;
+	} else if (hi > lo + 1) {
+		memmove(filter->ranges + lo + 1, filter->ranges + hi, (filter->n_ranges - hi) * sizeof(*filter->ranges));
+		filter->n_ranges -= hi - lo - 1;
+	}
+	filter->ranges[lo] = (neinput_range_t){.first = first, .last = last};
+	return 0;
+}
+int
 neinput_filter_contains(const neinput_filter_t *const filter, brru4 index)
 {
-	if (!filter || !filter->list)
+	if (!filter || !filter->ranges)
 		return 0;
-	for (brru4 i = 0; i < filter->count; ++i) {
-		if (filter->list[i] == index)
+	brru4 i = i_lower_range(filter, index, 0);
+	return i < filter->n_ranges && filter->ranges[i].first <= index;
+}
+
+int
+neinput_filter_excludes(const neinput_filter_t *const filter, brru4 index)
+{
+	if (!filter || !filter->n_ranges)
+		return 0;
+	int contained = neinput_filter_contains(filter, index);
+	return (contained && filter->type) || (!contained && !filter->type);
+}
+
+#define FORMAT_PCM 0x0001
+#define FORMAT_EXTENSIBLE 0xFFFE
+#define FORMAT_VORBIS 0xFFFF
+
+static const char *const i_field_names[neinput_field_count] = {
+	"index", "format", "channels", "rate", "samples", "duration", "size",
+};
+
+static inline const char *
+i_skip_space(const char *c)
+{
+	while (isspace((unsigned char)*c))
+		++c;
+	return c;
+}
+static inline int
+i_parse_field(neinput_term_t *const term, const char **const cursor)
+{
+	const char *c = *cursor;
+	brrsz length = 0;
+	while (isalpha((unsigned char)c[length]) || c[length] == '_')
+		++length;
+	for (int i = 0; i < neinput_field_count; ++i) {
+		if (length == strlen(i_field_names[i]) && 0 == strncmp(c, i_field_names[i], length)) {
+			term->field = i;
+			*cursor = c + length;
+			return 0;
+		}
+	}
+	return 1;
+}
+static inline int
+i_parse_compare(neinput_term_t *const term, const char **const cursor)
+{
+	static const struct {
+		const char *str;
+		neinput_compare_t compare;
+	} ops[] = {
+		/* Two-character operators first, so '<=' isn't taken as '<' */
+		{"==", neinput_compare_eq}, {"!=", neinput_compare_ne},
+		{"<=", neinput_compare_le}, {">=", neinput_compare_ge},
+		{"=",  neinput_compare_eq}, {"<",  neinput_compare_lt}, {">", neinput_compare_gt},
+	};
+	for (brrsz i = 0; i < sizeof(ops) / sizeof(*ops); ++i) {
+		brrsz length = strlen(ops[i].str);
+		if (0 == strncmp(*cursor, ops[i].str, length)) {
+			term->compare = ops[i].compare;
+			*cursor += length;
+			return 0;
+		}
+	}
+	return 1;
+}
+static inline int
+i_parse_value(neinput_term_t *const term, const char **const cursor, const char **const error)
+{
+	const char *c = *cursor;
+	char *end = NULL;
+	if (term->field == neinput_field_format && isalpha((unsigned char)*c)) {
+		if (0 == strncmp(c, "vorbis", 6) && !isalnum((unsigned char)c[6])) {
+			term->value = FORMAT_VORBIS;
+			*cursor = c + 6;
+		} else if (0 == strncmp(c, "pcm", 3) && !isalnum((unsigned char)c[3])) {
+			term->value = FORMAT_PCM;
+			*cursor = c + 3;
+		} else {
+			*error = "Unknown format, expected 'vorbis' or 'pcm'";
 			return 1;
+		}
+		return 0;
+	}
+	term->value = strtod(c, &end);
+	if (end == c) {
+		*error = "Expected a number";
+		return 1;
+	}
+	c = end;
+	if (term->field == neinput_field_duration) {
+		if (0 == strncmp(c, "ms", 2)) {
+			term->value /= 1000;
+			c += 2;
+		} else if (*c == 's') {
+			c++;
+		} else if (*c == 'm') {
+			term->value *= 60;
+			c++;
+		} else if (*c == 'h') {
+			term->value *= 3600;
+			c++;
+		}
+	} else if (term->field == neinput_field_size) {
+		switch (*c) {
+			case 'k': case 'K': term->value *= 1024; c++; break;
+			case 'M': term->value *= 1024 * 1024; c++; break;
+			case 'G': term->value *= 1024 * 1024 * 1024; c++; break;
+		}
+	}
+	if (isalnum((unsigned char)*c)) {
+		*error = "Unexpected suffix after value";
+		return 1;
 	}
+	*cursor = c;
 	return 0;
 }
+int
+neinput_filter_parse(neinput_filter_t *const filter, const char *const expression, const char **const error)
+{
+	neinput_term_t *terms = NULL;
+	brru4 n_terms = 0;
+	const char *c = expression;
+	int or_next = 0;
+	for (;;) {
+		neinput_term_t term = {.or_before = or_next};
+		c = i_skip_space(c);
+		if (i_parse_field(&term, &c)) {
+			*error = "Expected one of 'index', 'format', 'channels', 'rate', 'samples', 'duration' or 'size'";
+			break;
+		}
+		c = i_skip_space(c);
+		if (i_parse_compare(&term, &c)) {
+			*error = "Expected one of '==', '!=', '<', '<=', '>' or '>='";
+			break;
+		}
+		c = i_skip_space(c);
+		if (i_parse_value(&term, &c, error))
+			break;
+		if (brrlib_alloc((void **)&terms, (n_terms + 1) * sizeof(*terms), 0)) {
+			free(terms);
+			return -1;
+		}
+		terms[n_terms++] = term;
+		c = i_skip_space(c);
+		if (!*c) {
+			/* Complete success */
+			if (filter->terms)
+				free(filter->terms);
+			filter->terms = terms;
+			filter->n_terms = n_terms;
+			return 0;
+		} else if (0 == strncmp(c, "&&", 2)) {
+			or_next = 0;
+			c += 2;
+		} else if (0 == strncmp(c, "||", 2)) {
+			or_next = 1;
+			c += 2;
+		} else if (*c == ',') {
+			or_next = 0;
+			c += 1;
+		} else {
+			*error = "Expected '&&', '||' or the end of the expression";
+			break;
+		}
+	}
+	if (terms)
+		free(terms);
+	return 1;
+}
+
+static inline double
+i_meta_field(const neinput_meta_t *const meta, int field)
+{
+	switch (field) {
+		case neinput_field_index: return meta->index;
+		case neinput_field_format: return meta->format_tag == FORMAT_EXTENSIBLE ? FORMAT_PCM : meta->format_tag;
+		case neinput_field_channels: return meta->channels;
+		case neinput_field_rate: return meta->rate;
+		case neinput_field_samples: return meta->samples;
+		case neinput_field_duration: return meta->rate ? (double)meta->samples / meta->rate : 0;
+		case neinput_field_size: return meta->data_size;
+		default: return 0;
+	}
+}
+static inline int
+i_term_matches(const neinput_term_t *const term, const neinput_meta_t *const meta)
+{
+	double value = i_meta_field(meta, term->field);
+	switch (term->compare) {
+		case neinput_compare_eq: return value == term->value;
+		case neinput_compare_ne: return value != term->value;
+		case neinput_compare_lt: return value <  term->value;
+		case neinput_compare_le: return value <= term->value;
+		case neinput_compare_gt: return value >  term->value;
+		case neinput_compare_ge: return value >= term->value;
+		default: return 0;
+	}
+}
+int
+neinput_filter_rejects(const neinput_filter_t *const filter, const neinput_meta_t *const meta)
+{
+	if (!filter || !filter->n_terms)
+		return 0;
+	int group = 1;
+	for (brru4 i = 0; i < filter->n_terms; ++i) {
+		if (filter->terms[i].or_before) {
+			if (group)
+				return 0;
+			group = 1;
+		}
+		if (group && !i_term_matches(&filter->terms[i], meta))
+			group = 0;
+	}
+	return !group;
+}
 
 void
 neinput_clear(neinput_t *const input)
 {
 	if (input) {
 		neinput_filter_clear(&input->filter);
+		if (input->flag.owns_path && input->path)
+			free((char *)input->path);
 		memset(input, 0, sizeof(*input));
 	}
 }
@@ -223,6 +546,7 @@ neinput_library_load(neinput_library_t *const library)
 		library->status.load_error = i_parse_library_data(library, buffer, bufsize);
 		free(buffer);
 	}
+	USDT_PROBE3(codebook__load, library->path, library->library.codebook_count, library->status.load_error);
 	library->status.loaded = !library->status.load_error;
 	return library->status.load_error;
 }
@@ -230,7 +554,8 @@ void
 neinput_library_clear(neinput_library_t *const library)
 {
 	if (library) {
-		codebook_library_clear(&library->library);
+		if (!library->status.shared)
+			codebook_library_clear(&library->library);
 		memset(library, 0, sizeof(*library));
 	}
 }
@@ -252,6 +577,50 @@ neinput_load_codebooks(neinput_library_t *const libraries, const codebook_librar
 	return I_SUCCESS;
 }
 
+/* Parses a byte count, with an optional 'k', 'M' or 'G' suffix for KiB, MiB or GiB. */
+static inline int
+i_parse_size(const char *const arg, brru8 *const size)
+{
+	char *end = NULL;
+	unsigned long long value;
+	if (arg[0] == '-' || (value = strtoull(arg, &end, 10), end == arg))
+		return -1;
+	switch (*end) {
+		case 'k': case 'K': value <<= 10; end++; break;
+		case 'm': case 'M': value <<= 20; end++; break;
+		case 'g': case 'G': value <<= 30; end++; break;
+	}
+	if (*end)
+		return -1;
+	*size = value;
+	return 0;
+}
+
+/* Parses 'start:end' in seconds, where either may be empty to mean the start/end of the stream. */
+static inline int
+i_set_time_range(const char *const arg, neinput_t *const current)
+{
+	const char *colon = strchr(arg, ':');
+	char *end = NULL;
+	double start = 0, stop = -1;
+	if (!colon)
+		return -1;
+	if (colon != arg) {
+		start = strtod(arg, &end);
+		if (end != colon || start < 0)
+			return -1;
+	}
+	if (colon[1]) {
+		stop = strtod(colon + 1, &end);
+		if (*end || stop <= start)
+			return -1;
+	}
+	current->range_start = start;
+	current->range_end = stop;
+	current->flag.time_range = 1;
+	return 0;
+}
+
 static inline int
 i_add_library(nestate_t *const state, neinput_t *const current, const char *const arg, int arglen)
 {
@@ -260,6 +629,15 @@ i_add_library(nestate_t *const state, neinput_t *const current, const char *cons
 		if (0 == strcmp(state->libraries[current->library_index].path, arg))
 			return 0;
 	}
+	/* Built-in libraries are named with a leading '@', and are ready without loading anything */
+	if (arg[0] == '@') {
+		const codebook_library_t *builtin = codebook_library_builtin(arg + 1);
+		if (!builtin)
+			return 1;
+		next.library = *builtin;
+		next.status.shared = 1;
+		next.status.loaded = 1;
+	}
 	/* Not found, add */
 	if (brrlib_alloc((void **)&state->libraries, (state->n_libraries + 1) * sizeof(next), 0))
 		return -1;
@@ -269,22 +647,102 @@ i_add_library(nestate_t *const state, neinput_t *const current, const char *cons
 	state->libraries[state->n_libraries++] = next;
 	return 0;
 }
+/* Finishes 'slot' with the identity of the file at 'path', for looking it up. */
+static inline void
+i_identify_input(nestate_input_slot_t *const slot, const char *const path)
+{
+	brru8 hash = 0xcbf29ce484222325ULL;
+#if !defined(_WIN32)
+	struct stat st;
+	if (!stat(path, &st)) {
+		slot->device = st.st_dev;
+		slot->inode = st.st_ino;
+		slot->identified = 1;
+		hash = slot->device * 0x9e3779b97f4a7c15ULL ^ slot->inode;
+	} else
+#endif
+	{
+		for (const unsigned char *c = (const unsigned char *)path; *c; ++c)
+			hash = (hash ^ *c) * 0x100000001b3ULL;
+	}
+	/* splitmix64's mixer, so the low bits used as the slot depend on all of them */
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	slot->hash = hash ^ (hash >> 31);
+}
+/* Returns the slot of the input that's the same as 'key', or the free slot it would go in. */
+static inline nestate_input_slot_t *
+i_find_input(const nestate_t *const state, const nestate_input_slot_t *const key, const char *const path)
+{
+	const brrsz mask = state->n_input_slots - 1;
+	for (brrsz i = key->hash & mask;; i = (i + 1) & mask) {
+		nestate_input_slot_t *const slot = &state->input_slots[i];
+		if (!slot->index)
+			return slot;
+		if (slot->hash != key->hash || slot->identified != key->identified)
+			continue;
+		if (key->identified ? slot->device == key->device && slot->inode == key->inode
+		                    : 0 == strcmp(state->inputs[slot->index - 1].path, path))
+			return slot;
+	}
+}
+/* Keeps the table at most half full, so lookups stay short. */
 static inline int
-i_add_input(nestate_t *const state, neinput_t *const current, const char *const arg, int arglen)
+i_grow_input_slots(nestate_t *const state)
+{
+	if (2 * (state->n_inputs + 1) <= state->n_input_slots)
+		return 0;
+	const brrsz n_slots = state->n_input_slots ? 2 * state->n_input_slots : 64;
+	nestate_input_slot_t *const old = state->input_slots;
+	const brrsz n_old = state->n_input_slots;
+	if (!(state->input_slots = calloc(n_slots, sizeof(*state->input_slots)))) {
+		state->input_slots = old;
+		return -1;
+	}
+	state->n_input_slots = n_slots;
+	for (brrsz i = 0; i < n_old; ++i) {
+		if (old[i].index)
+			*i_find_input(state, &old[i], state->inputs[old[i].index - 1].path) = old[i];
+	}
+	if (old)
+		free(old);
+	return 0;
+}
+/* With 'owned', 'arg' becomes the input's, to be freed with it, even if it can't be added. */
+static inline int
+i_add_input(nestate_t *const state, neinput_t *const current, const char *const arg, int arglen, int owned)
 {
 	neinput_t next = *current;
+	nestate_input_slot_t key = {0}, *slot = NULL;
 	next.path = arg;
 	next.path_length = arglen;
-	for (brrsz i = 0; i < state->n_inputs; ++i) {
-		if (0 == strcmp(state->inputs[i].path, arg)) {
-			state->inputs[i] = next;
-			return 0;
-		}
+	next.flag.owns_path = owned != 0;
+	/* Every input owns its filter, since 'current' keeps its own for the inputs that follow */
+	if (neinput_filter_copy(&next.filter, &current->filter) || i_grow_input_slots(state)) {
+		neinput_clear(&next);
+		return -1;
+	}
+	i_identify_input(&key, arg);
+	if ((slot = i_find_input(state, &key, arg))->index) {
+		/* Given again, so the options given with it last are the ones that count */
+		neinput_clear(&state->inputs[slot->index - 1]);
+		state->inputs[slot->index - 1] = next;
+		return 0;
 	}
 	/* Not found, add */
-	if (brrlib_alloc((void **)&state->inputs, (state->n_inputs + 1) * sizeof(next), 0))
-		return -1;
+	if (state->n_inputs == state->inputs_capacity) {
+		const brrsz capacity = state->inputs_capacity ? 2 * state->inputs_capacity : 16;
+		if (brrlib_alloc((void **)&state->inputs, capacity * sizeof(next), 0)) {
+			neinput_clear(&next);
+			return -1;
+		}
+		state->inputs_capacity = capacity;
+	}
 	state->inputs[state->n_inputs++] = next;
+	key.index = state->n_inputs;
+	*slot = key;
 	{
 		int n = strlen(next.path);
 		if (n > state->stats.input_path_max)
@@ -292,41 +750,250 @@ i_add_input(nestate_t *const state, neinput_t *const current, const char *const
 	}
 	return 0;
 }
+
+typedef struct i_discovered {
+	nestate_t *state;
+	neinput_t *current;
+} i_discovered_t;
+static int
+i_add_discovered(void *const context, char *const path, brrsz length)
+{
+	i_discovered_t *const discovered = context;
+	if (length > 0xFFFF) {
+		fprintf(stderr, "Path too long '%.64s...'\n", path);
+		free(path);
+		errno = ENAMETOOLONG;
+		return I_GENERIC_ERROR;
+	}
+	if (i_add_input(discovered->state, discovered->current, path, length, 1))
+		return I_BUFFER_ERROR;
+	return 0;
+}
+
+/* Returns the thread count of the last valid '-j'/'-threads' in 'argv', or 0; directories are discovered while the
+ * arguments are still being parsed, on the threads given anywhere among them. */
+static int
+i_find_threads(int argc, char **argv)
+{
+	int threads = 0;
+	for (int i = 0; i + 1 < argc; ++i) {
+		if (0 == strcmp(argv[i], "--"))
+			break;
+		if (0 == strcmp(argv[i], "-!")) {
+			++i;
+		} else if (0 == strcmp(argv[i], "-j") || 0 == strcmp(argv[i], "-threads")) {
+			char *end = NULL;
+			long count = strtol(argv[++i], &end, 10);
+			if (end != argv[i] && !*end && count >= 0 && count <= INT_MAX)
+				threads = count;
+		}
+	}
+	return threads;
+}
+
 int
 nestate_init(nestate_t *const state, int argc, char **argv)
 {
 	neinput_t current = state->default_input;
-	neinput_filter_t working_filter = {0};
+	int new_list = 1; /* Whether the next index list replaces the current one instead of adding to it */
+	const int discover_threads = i_find_threads(argc, argv);
 	for (int i = 0; i < argc; ++i) {
 		char *arg = argv[i];
 		if (i_parse_argument(arg, state, &current)) {
 			continue;
 		} else if (state->settings.next_is_filter) {
-			working_filter.type = current.filter.type;
-			if (i_set_filter(arg, strlen(arg), &working_filter)) {
+			if (new_list) {
+				if (current.filter.ranges)
+					free(current.filter.ranges);
+				current.filter.ranges = NULL;
+				current.filter.n_ranges = 0;
+				new_list = 0;
+			}
+			if (i_set_filter(arg, strlen(arg), &current.filter)) {
 				/* This probably doesn't need to be a fatal error */
+				neinput_filter_clear(&current.filter);
 				nestate_clear(state);
 				return -1;
 			}
-			current.filter = working_filter;
 			state->settings.next_is_filter = 0;
+		} else if (state->settings.next_is_expression) {
+			const char *error = NULL;
+			int err = neinput_filter_parse(&current.filter, arg, &error);
+			if (err) {
+				if (err > 0) {
+					fprintf(stderr, "Invalid filter expression '%s' : %s\n", arg, error);
+					errno = EINVAL;
+				}
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_expression = 0;
+		} else if (state->settings.next_is_threads) {
+			char *end = NULL;
+			long threads = strtol(arg, &end, 10);
+			if (end == arg || *end || threads < 0) {
+				fprintf(stderr, "Invalid thread count '%s'\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->threads = threads;
+			state->settings.next_is_threads = 0;
+		} else if (state->settings.next_is_range) {
+			if (i_set_time_range(arg, &current)) {
+				fprintf(stderr, "Invalid time range '%s', expected 'start:end' in seconds\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_range = 0;
+		} else if (state->settings.next_is_serve) {
+			state->serve_path = arg;
+			state->settings.next_is_serve = 0;
+		} else if (state->settings.next_is_watch) {
+			/* Files that show up in the directory are processed with the options in effect here */
+			neinput_clear(&state->watch_input);
+			state->watch_input = current;
+			state->watch_input.path = arg;
+			state->watch_input.path_length = strlen(arg);
+			if (neinput_filter_copy(&state->watch_input.filter, &current.filter)) {
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_watch = 0;
+		} else if (state->settings.next_is_flush) {
+			if (brrstringr_cstr_compare(arg, 0, "always", NULL)) {
+				state->settings.flush_mode = nestate_flush_always;
+			} else if (brrstringr_cstr_compare(arg, 0, "line", NULL)) {
+				state->settings.flush_mode = nestate_flush_line;
+			} else if (brrstringr_cstr_compare(arg, 0, "end", NULL)) {
+				state->settings.flush_mode = nestate_flush_end;
+			} else {
+				fprintf(stderr, "Invalid flush mode '%s', expected 'always', 'line' or 'end'\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_flush = 0;
+		} else if (state->settings.next_is_trace) {
+			state->trace_path = arg;
+			state->settings.next_is_trace = 0;
+		} else if (state->settings.next_is_queue) {
+			char *end = NULL;
+			long depth = strtol(arg, &end, 10);
+			if (end == arg || *end || depth < 0) {
+				fprintf(stderr, "Invalid queue depth '%s'\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->queue_depth = depth;
+			state->settings.no_queue = !depth;
+			state->settings.next_is_queue = 0;
+		} else if (state->settings.next_is_queue_memory) {
+			if (i_parse_size(arg, &state->queue_memory)) {
+				fprintf(stderr, "Invalid queue memory '%s', expected bytes with an optional k/M/G suffix\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_queue_memory = 0;
+		} else if (state->settings.next_is_schedule) {
+			if (brrstringr_cstr_compare(arg, 0, "size", NULL)) {
+				state->settings.schedule_mode = nestate_schedule_size;
+			} else if (brrstringr_cstr_compare(arg, 0, "disk", NULL)) {
+				state->settings.schedule_mode = nestate_schedule_disk;
+			} else if (brrstringr_cstr_compare(arg, 0, "order", NULL)) {
+				state->settings.schedule_mode = nestate_schedule_order;
+			} else {
+				fprintf(stderr, "Invalid schedule '%s', expected 'size', 'disk' or 'order'\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_schedule = 0;
+		} else if (state->settings.next_is_mem_limit) {
+			if (i_parse_size(arg, &state->mem_limit)) {
+				fprintf(stderr, "Invalid memory limit '%s', expected bytes with an optional k/M/G suffix\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_mem_limit = 0;
+		} else if (state->settings.next_is_shard) {
+			char *end = NULL;
+			unsigned long index = strtoul(arg, &end, 10), count = 0;
+			if (end != arg && *end == '/') {
+				const char *const from = end + 1;
+				count = strtoul(from, &end, 10);
+				if (end == from || *end)
+					count = 0;
+			}
+			if (!count || !index || index > count || count > 0xFFFFFFFFUL) {
+				fprintf(stderr, "Invalid shard '%s', expected 'i/N' with i from 1 to N\n", arg);
+				errno = EINVAL;
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->shard_index = index - 1;
+			state->n_shards = count;
+			state->settings.next_is_shard = 0;
+		} else if (state->settings.next_is_report_file) {
+			state->report_path = arg;
+			state->settings.next_is_report_file = 0;
+		} else if (state->settings.next_is_files_from || state->settings.next_is_recursive) {
+			i_discovered_t discovered = {state, &current};
+			const int from_list = state->settings.next_is_files_from;
+			int err = from_list ? discover_list(arg, i_add_discovered, &discovered)
+			                    : discover_tree(arg, discover_threads, i_add_discovered, &discovered);
+			if (err) {
+				if (err != I_GENERIC_ERROR) {
+					fprintf(stderr, "Failed to take inputs from %s '%s' : %s\n", from_list ? "list" : "directory",
+					    arg, lib_strerr(err));
+					errno = err == I_BUFFER_ERROR ? ENOMEM : EIO;
+				}
+				neinput_filter_clear(&current.filter);
+				nestate_clear(state);
+				return -1;
+			}
+			state->settings.next_is_files_from = 0;
+			state->settings.next_is_recursive = 0;
+			new_list = 1;
 		} else if (state->settings.next_is_library) {
-			if (i_add_library(state, &current, arg, strlen(arg))) {
+			int err = i_add_library(state, &current, arg, strlen(arg));
+			if (err) {
+				if (err > 0) {
+					fprintf(stderr, "Unknown built-in codebook library '%s'\n", arg);
+					errno = EINVAL;
+				}
+				neinput_filter_clear(&current.filter);
 				nestate_clear(state);
 				return -1;
 			}
 			state->settings.next_is_library = 0;
 		} else {
-			if (i_add_input(state, &current, arg, strlen(arg))) {
+			if (i_add_input(state, &current, arg, strlen(arg), 0)) {
+				neinput_filter_clear(&current.filter);
 				nestate_clear(state);
 				return -1;
 			}
 			state->settings.next_is_file = 0;
-			working_filter = (neinput_filter_t){0};
+			new_list = 1;
 			if (state->settings.should_reset)
 				nestate_clear(state);
 		}
 	}
+	neinput_filter_clear(&current.filter);
 	state->stats.n_input_digits = brrnum_ndigits(state->n_inputs, 10, 0);
 	return 0;
 }
@@ -341,10 +1008,33 @@ nestate_clear(nestate_t *const state)
 			neinput_clear(&(state->inputs)[i]);
 		free(state->inputs);
 	}
+	if (state->input_slots)
+		free(state->input_slots);
 	if (state->libraries) {
 		for (brrsz i = 0; i < state->n_libraries; ++i)
 			neinput_library_clear(&(state->libraries)[i]);
 		free(state->libraries);
 	}
+	neinput_clear(&state->watch_input);
 	memset(state, 0, sizeof(*state) - sizeof(state->stats));
 }
+
+static inline void
+i_stat_add(nestate_stat_t *const stat, const nestate_stat_t *const from)
+{
+	stat->assigned += from->assigned;
+	stat->succeeded += from->succeeded;
+	stat->failed += from->failed;
+}
+void
+nestate_stats_add(nestate_stats_t *const stats, const nestate_stats_t *const from)
+{
+	i_stat_add(&stats->oggs, &from->oggs);
+	i_stat_add(&stats->wems, &from->wems);
+	i_stat_add(&stats->wsps, &from->wsps);
+	i_stat_add(&stats->bnks, &from->bnks);
+	i_stat_add(&stats->wem_extracts, &from->wem_extracts);
+	i_stat_add(&stats->wem_converts, &from->wem_converts);
+	stats->n_reported_inputs += from->n_reported_inputs;
+	stats->write_failures += from->write_failures;
+}
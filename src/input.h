@@ -22,27 +22,80 @@ limitations under the License.
 
 #include "codebook_library.h"
 
-/*
- * TODO
- * Only a naive strcmp is done when checking for duplicate files, so one could
- * pass the same file differently and that one file would be allocated and
- * processed twice; this'll be something for brrpath to help with eventually.
- * */
-
 typedef enum neinput_filter_type {
 	neinput_filter_white = 0,
 	neinput_filter_black,
 } neinput_filter_type_t;
 
-/* TODO Eventually index white/blackisting can be replaced by a more flexible filtering system, similar to in 'countwsp' */
+/* An inclusive range of entry indices */
+typedef struct neinput_range {
+	brru4 first;
+	brru4 last;
+} neinput_range_t;
+
+typedef enum neinput_field {
+	neinput_field_index = 0,
+	neinput_field_format,   /* 'vorbis' or 'pcm', or a raw format tag */
+	neinput_field_channels,
+	neinput_field_rate,
+	neinput_field_samples,
+	neinput_field_duration, /* In seconds; values may be suffixed with 'ms', 's', 'm' or 'h' */
+	neinput_field_size,     /* Size of the 'data' chunk; values may be suffixed with 'k', 'M' or 'G' */
+	neinput_field_count,
+} neinput_field_t;
+
+typedef enum neinput_compare {
+	neinput_compare_eq = 0,
+	neinput_compare_ne,
+	neinput_compare_lt,
+	neinput_compare_le,
+	neinput_compare_gt,
+	neinput_compare_ge,
+} neinput_compare_t;
+
+/* One comparison of a filter expression.
+ * Expressions are stored in disjunctive normal form: terms are and-ed together until a term with 'or_before' set,
+ * which starts a new group; the expression matches if any group does. */
+typedef struct neinput_term {
+	double value;
+	brru1 field;        /* neinput_field_t */
+	brru1 compare;      /* neinput_compare_t */
+	brru1 or_before;
+} neinput_term_t;
+
+/* Header metadata of a single WwRIFF, which filter expressions are evaluated against. */
+typedef struct neinput_meta {
+	brru4 index;
+	brru2 format_tag;
+	brru2 channels;
+	brru4 rate;
+	brru4 data_size;
+	brru8 samples;
+} neinput_meta_t;
+
 typedef struct neinput_filter {
-	brru4 *list;
-	brru4 count;
+	neinput_range_t *ranges; /* Sorted, disjoint and non-adjacent */
+	brru4 n_ranges;
 	neinput_filter_type_t type;
+	neinput_term_t *terms;   /* Filter expression, empty if none was given */
+	brru4 n_terms;
 } neinput_filter_t;
 
 void neinput_filter_clear(neinput_filter_t *const filter);
+/* Deep-copies 'source' into 'filter'; 'filter' is overwritten, not cleared, first. */
+int neinput_filter_copy(neinput_filter_t *const filter, const neinput_filter_t *const source);
+/* Adds the indices 'first' through 'last' to the index set of 'filter'. */
+int neinput_filter_add_range(neinput_filter_t *const filter, brru4 first, brru4 last);
 int neinput_filter_contains(const neinput_filter_t *const filter, brru4 index);
+/* Returns non-zero if the index set of 'filter' means the entry at 'index' is not to be processed. */
+int neinput_filter_excludes(const neinput_filter_t *const filter, brru4 index);
+/* Parses the filter expression 'expression', replacing any expression already in 'filter'.
+ * Returns 0 on success, -1 on allocation failure, or 1 if 'expression' is malformed, in which case 'error' points to
+ * a description of the problem. */
+int neinput_filter_parse(neinput_filter_t *const filter, const char *const expression, const char **const error);
+/* Returns non-zero if the filter expression of 'filter' rejects the entry described by 'meta'. */
+int neinput_filter_rejects(const neinput_filter_t *const filter, const neinput_meta_t *const meta);
+#define neinput_filter_has_expression(_filter_) ((_filter_)->n_terms != 0)
 
 typedef enum neinput_type {
 	neinput_type_auto = 0,
@@ -69,7 +122,15 @@ typedef struct neinput {
 		brru2 auto_ogg:1;             /* Should output weems automatically be converted to ogg? */
 		brru2 inplace_ogg:1;          /* Should weem-to-ogg conversion be done in-place (replace)? */
 		brru2 inplace_regrain:1;      /* Should regranularized oggs replace the original? */
+		brru2 keep_wem:1;             /* When auto-converting, also extract the raw weems in the same pass? */
+		brru2 time_range:1;           /* Convert only the audio between 'range_start' and 'range_end'? */
+		brru2 wav_out:1;              /* Decode converted weems to WAV instead of writing Oggs? */
+		brru2 pcm_out:1;              /* Decode converted weems to raw PCM on stdout instead of writing Oggs? */
+		brru2 auto_codebooks:1;       /* Detect the codebooks of each weem, ignoring 'library_index' and 'stripped_headers'? */
+		brru2 owns_path:1;            /* Was 'path' allocated for this input, to be freed with it? */
 	} flag;
+	double range_start;               /* Seconds */
+	double range_end;                 /* Seconds; negative means the end of the stream */
 	neinput_filter_t filter;
 } neinput_t;
 
@@ -79,7 +140,8 @@ typedef struct neinput_library {
 	struct {
 		brru2 loaded:1;      /* Whether the library is valid and ready for use */
 		brru2 old:1;         /* Whether to use the old form of deserialization */
-		brru2 load_error:14; /* If non-zero, the library failed to be loaded */
+		brru2 shared:1;      /* Whether the library is compiled in or owned elsewhere, and must not be freed */
+		brru2 load_error:13; /* If non-zero, the library failed to be loaded */
 	} status;
 	brru2 path_length;
 	const char *path;
@@ -95,12 +157,67 @@ typedef struct neprocessstat {
 	brrsz succeeded;
 	brrsz failed;
 } nestate_stat_t;
+typedef struct nestate_stats {
+	brrsz input_path_max; /* For log padding */
+	brrsz n_input_digits;
+
+	nestate_stat_t oggs, wems, wsps, bnks;
+	nestate_stat_t wem_extracts;
+	nestate_stat_t wem_converts;
+	brrsz n_reported_inputs; /* Inputs of the reports merged by '-merge-reports' */
+	brru8 write_failures;    /* Outputs that failed to be written, in the reports merged by '-merge-reports' */
+} nestate_stats_t;
+
+/* How per-input progress is logged */
+typedef enum nestate_log_mode {
+	nestate_log_full = 0, /* Everything, as it happens, with inputs processed one at a time */
+	nestate_log_lines,    /* One line per input, with inputs processed in parallel */
+	nestate_log_summary,  /* Nothing but the report, with inputs processed in parallel */
+} nestate_log_mode_t;
+
+/* What order parallel runs process inputs in */
+typedef enum nestate_schedule {
+	nestate_schedule_size = 0, /* Largest first, so no thread is left with a big input at the end */
+	nestate_schedule_disk,     /* By device, then by where on it each is stored, to keep spinning disks seeking less */
+	nestate_schedule_order,    /* As given */
+} nestate_schedule_t;
+
+/* When log output is flushed */
+typedef enum nestate_flush {
+	nestate_flush_always = 0, /* After every message */
+	nestate_flush_line,       /* At the end of every line */
+	nestate_flush_end,        /* Only once everything is done, or when the output buffer is full */
+} nestate_flush_t;
+
+/* A slot of the table inputs are looked up in for duplicates: the same file is only taken once, however its path is
+ * given; paths that can't be stat'ed (or on Windows) are compared as given */
+typedef struct nestate_input_slot {
+	brru8 device;
+	brru8 inode;
+	brru8 hash;
+	brrsz index;     /* Of the input, plus 1; 0 if the slot is free */
+	int identified;  /* Whether 'device' and 'inode' are those of the input's file */
+} nestate_input_slot_t;
+
 typedef struct nestate {
 	neinput_t *inputs;
 	brrsz n_inputs;
+	brrsz inputs_capacity;
+	nestate_input_slot_t *input_slots;
+	brrsz n_input_slots;  /* A power of 2, or 0 */
 	const neinput_t default_input;
 	neinput_library_t *libraries;
 	brrsz n_libraries;
+	int threads; /* How many threads conversion may use; 0 for one per processor */
+	const char *serve_path; /* If set, serve conversion jobs on this Unix socket instead of processing inputs */
+	neinput_t watch_input;  /* If its path is set, watch that directory and process files as they're written to it */
+	const char *trace_path; /* If set, write a trace of everything processed here */
+	brrsz queue_depth;      /* Of the pipeline of parallel runs (see pipeline.h); 0 for the default */
+	brru8 queue_memory;     /* Budget of each of the pipeline's queues, in bytes; 0 for the default */
+	brru8 mem_limit;        /* Most bytes inputs being processed may be expected to hold at once (see memlimit.h) */
+	brru4 shard_index;      /* The shard of the inputs processed here, from 0 (see shard.h) */
+	brru4 n_shards;         /* 0 or 1 when inputs aren't sharded */
+	const char *report_path; /* If set, write the report's counts here as JSON */
 
 	struct {
 		brru8 next_is_file:1;
@@ -112,19 +229,37 @@ typedef struct nestate {
 		brru8 report_card:1;
 		brru8 full_report:1;
 	/* < Byte boundary > */
-	} settings;
+		brru8 probe:1;
+		brru8 next_is_expression:1;
+		brru8 next_is_threads:1;
+		brru8 next_is_range:1;
+		brru8 next_is_serve:1;
+		brru8 next_is_watch:1;
+		brru8 next_is_flush:1;
+		brru8 log_mode:2;   /* nestate_log_mode_t */
+	/* < Byte boundary > */
+		brru8 flush_mode:2; /* nestate_flush_t */
+		brru8 next_is_trace:1;
+		brru8 next_is_queue:1;
+		brru8 next_is_queue_memory:1;
+		brru8 no_queue:1;   /* Parallel runs don't go through the pipeline */
+		brru8 next_is_schedule:1;
+		brru8 schedule_mode:2; /* nestate_schedule_t */
+		brru8 next_is_mem_limit:1;
+		brru8 next_is_shard:1;
+		brru8 next_is_report_file:1;
+		brru8 merge_reports:1; /* Inputs are reports to add up, not files to process */
+		brru8 next_is_files_from:1;
+		brru8 next_is_recursive:1;
 
-	struct {
-		brrsz input_path_max; /* For log padding */
-		brrsz n_input_digits;
+	} settings;
 
-		nestate_stat_t oggs, wems, wsps, bnks;
-		nestate_stat_t wem_extracts;
-		nestate_stat_t wem_converts;
-	} stats;
+	nestate_stats_t stats; /* Must be last; it's kept when the state is cleared */
 } nestate_t;
 
 int nestate_init(nestate_t *const state, int argc, char **argv);
 void nestate_clear(nestate_t *const state);
+/* Adds the counts of 'from' to 'stats'. */
+void nestate_stats_add(nestate_stats_t *const stats, const nestate_stats_t *const from);
 
 #endif /* INPUT_H */
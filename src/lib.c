@@ -14,6 +14,11 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* copy_file_range */
+# define _GNU_SOURCE
+#endif
+
 #include "lib.h"
 
 #include <errno.h>
@@ -21,6 +26,17 @@ limitations under the License.
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#if defined(__linux__)
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/ioctl.h>
+# include <sys/stat.h>
+# include <linux/fs.h>
+#endif
+#if defined(_WIN32)
+# include <fcntl.h>
+# include <io.h>
+#endif
 
 #include <vorbis/vorbisenc.h>
 
@@ -29,7 +45,11 @@ limitations under the License.
 #include <brrtools/brrpath.h>
 
 #include "errors.h"
+#include "pipeline.h"
 #include "print.h"
+#include "timing.h"
+#include "uring.h"
+#include "usdt.h"
 
 const lib_cmp_t lib_cmp = strcmp;
 const lib_ncmp_t lib_ncmp = strncmp;
@@ -41,7 +61,7 @@ const lib_cmp_t  lib_case_cmp = strcasecmp;
 const lib_ncmp_t lib_case_ncmp = strncasecmp;
 #endif
 
-static char s_strerr[256] = "";
+static _Thread_local char s_strerr[256] = "";
 #define s_max_strerr sizeof(s_strerr)
 
 const char *
@@ -59,12 +79,41 @@ lib_strerr(int err)
 		case I_NOT_RIFF          : return "Data is not RIFF";
 		case I_UNRECOGNIZED_DATA : return "Data type is unrecognized";
 		case I_INSUFFICIENT_DATA : return "Insufficient data to decode";
+		case I_OUT_OF_RANGE      : return "Requested range is outside of the stream";
 		case I_BAD_ERROR         : return "I don't know what to do";
 	}
 	snprintf(s_strerr, s_max_strerr, "Unrecognized error code %d", err);
 	return s_strerr;
 }
 
+static int s_log_silenced = 0;
+
+void
+lib_set_log_silenced(int silenced)
+{
+	s_log_silenced = silenced;
+	if (silenced) {
+		gbrrlogctl.debug_enabled = 0;
+		brrlog_set_max_priority(0);
+	}
+}
+void
+lib_set_log_priority(const neinput_t *const input)
+{
+#if defined(Ne_debug)
+	gbrrlogctl.debug_enabled = 1;
+	brrlog_set_max_priority(brrlog_priority_debug);
+#else
+	gbrrlogctl.debug_enabled = input->flag.log_debug;
+	brrlog_set_max_priority(input->log_priority);
+#endif
+	/* Logging would otherwise end up mixed into the audio */
+	if (input->flag.pcm_out || s_log_silenced) {
+		gbrrlogctl.debug_enabled = 0;
+		brrlog_set_max_priority(0);
+	}
+}
+
 int
 lib_count_ones(unsigned long number)
 {
@@ -112,12 +161,9 @@ lib_lookup1_values(long entries, long dimensions)
 	}
 }
 
-int
-lib_read_entire_file(const char *const path, void **const buffer, brrsz *const buffer_size)
+static int
+i_read_entire_file(const char *const path, void **const buffer, brrsz *const buffer_size)
 {
-	if (!path || !buffer || !buffer_size)
-		return I_GENERIC_ERROR;
-
 	int err = 0;
 	void *buff = NULL;
 	brrsz size = 0;
@@ -133,21 +179,86 @@ lib_read_entire_file(const char *const path, void **const buffer, brrsz *const b
 			return I_BUFFER_ERROR;
 	}
 
+#if defined(__linux__)
+	if (uring_available()) {
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			free(buff);
+			return I_IO_ERROR;
+		}
+		err = uring_read(fd, buff, size);
+		close(fd);
+		if (err) {
+			free(buff);
+			return err;
+		}
+		*buffer = buff;
+		*buffer_size = size;
+		return I_SUCCESS;
+	}
+#endif
 	{
 		FILE *file;
-		if (!(file = fopen(path, "rb")))
+		if (!(file = fopen(path, "rb"))) {
+			free(buff);
 			return I_IO_ERROR;
+		}
 		if (size > fread(buff, 1, size, file)) {
 			err = feof(file) ? I_FILE_TRUNCATED : I_IO_ERROR;
 			fclose(file);
+			free(buff);
 			return err;
 		}
+		fclose(file);
 	}
 
 	*buffer = buff;
 	*buffer_size = size;
 	return err;
 }
+int
+lib_read_entire_file(const char *const path, void **const buffer, brrsz *const buffer_size)
+{
+	if (!path || !buffer || !buffer_size)
+		return I_GENERIC_ERROR;
+
+	/* Already read by the pipeline's reader stage, which timed it */
+	if (!pipeline_take_read(path, buffer, buffer_size))
+		return I_SUCCESS;
+	const brru8 start = timing_start(timing_stage_read);
+	int err = i_read_entire_file(path, buffer, buffer_size);
+	if (!err)
+		timing_add(timing_stage_read, start, *buffer_size, 0);
+	return err;
+}
+
+int
+lib_read_file_head(const char *const path, void *const buffer, brrsz buffer_size, brrsz *const read_size, brrsz *const file_size)
+{
+	if (!path || !buffer || !read_size)
+		return I_GENERIC_ERROR;
+
+	FILE *file;
+	brrsz size = 0;
+	if (!(file = fopen(path, "rb")))
+		return I_IO_ERROR;
+	size = fread(buffer, 1, buffer_size, file);
+	if (ferror(file)) {
+		fclose(file);
+		return I_IO_ERROR;
+	}
+	if (file_size) {
+		long end;
+		if (fseek(file, 0, SEEK_END) || -1 == (end = ftell(file))) {
+			fclose(file);
+			return I_IO_ERROR;
+		}
+		*file_size = end;
+	}
+	fclose(file);
+	*read_size = size;
+	return I_SUCCESS;
+}
 
 static inline int
 i_consume_next_buffer_chunk(riff_t *const riff, riff_chunkstate_t *const chunkstate, riff_datasync_t *const datasync)
@@ -173,6 +284,7 @@ i_consume_next_buffer_chunk(riff_t *const riff, riff_chunkstate_t *const chunkst
 int
 lib_parse_buffer_as_riff(riff_t *const riff, const void *const buffer, brrsz buffer_size)
 {
+	const brru8 start = timing_start(timing_stage_parse);
 	riff_datasync_t datasync = {0};
 	if (riff_datasync_from_buffer(&datasync, (void *)buffer, buffer_size))
 		return I_INIT_ERROR;
@@ -189,6 +301,7 @@ lib_parse_buffer_as_riff(riff_t *const riff, const void *const buffer, brrsz buf
 		return err;
 	}
 	*riff = rf;
+	timing_add(timing_stage_parse, start, buffer_size, 0);
 	return 0;
 }
 
@@ -210,11 +323,65 @@ lib_parse_buffer_as_wwriff(wwriff_t *const wwriff_out, const void *const buffer,
 	return 0;
 }
 
+/* Gathers every page of 'streamer' into one buffer, for the write to be handed off while the stream is cleared. */
+static int
+i_gather_pages(ogg_stream_state *const streamer, const char *const destination, unsigned char **const pages,
+    brrsz *const size)
+{
+	unsigned char *data = NULL;
+	brrsz capacity = 0, written = 0;
+	ogg_page pager;
+	while (ogg_stream_pageout(streamer, &pager) || ogg_stream_flush(streamer, &pager)) {
+		const brrsz page_size = pager.header_len + pager.body_len;
+		if (written + page_size > capacity) {
+			capacity = capacity ? capacity * 2 : 65536;
+			while (written + page_size > capacity)
+				capacity *= 2;
+			if (brrlib_alloc((void **)&data, capacity, 0)) {
+				if (data)
+					free(data);
+				BRRLOG_ERR("Failed to allocate %zu bytes for output ogg '%s'", capacity, destination);
+				return I_BUFFER_ERROR;
+			}
+		}
+		memcpy(data + written, pager.header, pager.header_len);
+		memcpy(data + written + pager.header_len, pager.body, pager.body_len);
+		USDT_PROBE3(page__write, destination, written, page_size);
+		written += page_size;
+	}
+	*pages = data;
+	*size = written;
+	return I_SUCCESS;
+}
+
 int
-lib_write_ogg_out(ogg_stream_state *const streamer, const char *const destination)
+lib_write_ogg_out(ogg_stream_state *const streamer, const char *const destination, brrsz *const failures)
 {
+	const brru8 start = timing_start(timing_stage_write);
+	brru8 written = 0;
 	FILE *out = NULL;
 	ogg_page pager;
+	if (pipeline_writing() || uring_available()) {
+		unsigned char *pages = NULL;
+		brrsz size = 0;
+		int err = 0;
+		if ((err = i_gather_pages(streamer, destination, &pages, &size)))
+			return err;
+		/* The writer stage times the write itself */
+		if (!(err = pipeline_write(destination, pages, size)))
+			return I_SUCCESS;
+		if (err == I_GENERIC_ERROR && !(err = uring_write_file(destination, pages, size, 1, failures))) {
+			/* Nothing else waits on it for whatever called without somewhere to count its failure */
+			if (!failures && uring_wait())
+				return I_IO_ERROR;
+			timing_add(timing_stage_write, start, 0, size);
+			return I_SUCCESS;
+		}
+		if (pages)
+			free(pages);
+		BRRLOG_ERR("Failed to queue writing output ogg '%s' : %s", destination, lib_strerr(err));
+		return err;
+	}
 	if (!(out = fopen(destination, "wb"))) {
 		BRRLOG_ERRN("Failed to open output ogg file '%s' : %s", destination, strerror(errno));
 		return I_IO_ERROR;
@@ -229,11 +396,300 @@ lib_write_ogg_out(ogg_stream_state *const streamer, const char *const destinatio
 			BRRLOG_ERRN("Failed to write ogg page body to output '%s' : %s", destination, strerror(errno));
 			return I_IO_ERROR;
 		}
+		USDT_PROBE3(page__write, destination, written, pager.header_len + pager.body_len);
+		written += pager.header_len + pager.body_len;
 	}
 	fclose(out);
+	timing_add(timing_stage_write, start, 0, written);
 	return I_SUCCESS;
 }
 
+int
+lib_write_pcm_out(
+    wwriff_t *const wwriff,
+    const codebook_library_t *const library,
+    const neinput_t *const input,
+    const char *const destination
+)
+{
+	int err = 0;
+	FILE *out = stdout;
+	if (destination) {
+		if (!(out = fopen(destination, "wb"))) {
+			BRRLOG_ERRN("Failed to open output wav file '%s' : %s", destination, strerror(errno));
+			return I_IO_ERROR;
+		}
+	} else {
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+	err = wwise_decode_wwriff(wwriff, out, destination != NULL, library, input);
+	if (destination) {
+		if (fclose(out) && !err) {
+			BRRLOG_ERRN("Failed to write output wav file '%s' : %s", destination, strerror(errno));
+			err = I_IO_ERROR;
+		}
+	} else {
+		fflush(out);
+	}
+	return err;
+}
+
+int
+lib_range_source_open(const char *const path)
+{
+#if defined(__linux__)
+	if (path)
+		return open(path, O_RDONLY);
+#endif
+	return -1;
+}
+void
+lib_range_source_close(int source)
+{
+#if defined(__linux__)
+	if (source != -1)
+		close(source);
+#endif
+}
+
+#if defined(__linux__)
+/* Returns the number of bytes at the start of the range that were shared with 'destination', which may be 0.
+ * Cloning is all-or-nothing per call and requires the source offset, destination offset and length to be
+ * multiples of the filesystem block size, so only the aligned head of the range is attempted here; the caller
+ * copies whatever tail remains. */
+static inline brrsz
+i_clone_range(int source, brrsz offset, brrsz size, int destination, brrsz destination_offset)
+{
+#if defined(FICLONERANGE)
+	struct stat st;
+	if (fstat(destination, &st) || st.st_blksize <= 0)
+		return 0;
+	brrsz block = st.st_blksize;
+	if (offset % block || destination_offset % block || size < block)
+		return 0;
+	struct file_clone_range range = {
+		.src_fd = source,
+		.src_offset = offset,
+		.src_length = size - size % block,
+		.dest_offset = destination_offset,
+	};
+	if (ioctl(destination, FICLONERANGE, &range))
+		return 0; /* EXDEV, EOPNOTSUPP, etc.; not an error, just not possible here */
+	return range.src_length;
+#else
+	return 0;
+#endif
+}
+#endif
+
+int
+lib_copy_range(int source, brrsz offset, brrsz size, FILE *const destination, const void *const fallback)
+{
+	if (!destination || (source == -1 && !fallback))
+		return I_GENERIC_ERROR;
+
+	brrsz done = 0;
+#if defined(__linux__)
+	int out = source != -1 ? fileno(destination) : -1;
+	off_t out_start = -1;
+	if (out != -1 && fflush(destination))
+		return I_IO_ERROR;
+	/* Pipes and terminals can't be written at an offset, so they take the plain copy below */
+	if (out != -1 && -1 != (out_start = lseek(out, 0, SEEK_CUR))) {
+		done = i_clone_range(source, offset, size, out, out_start);
+		while (done < size) {
+			loff_t in_offset = offset + done;
+			loff_t out_offset = out_start + done;
+			ssize_t copied = copy_file_range(source, &in_offset, out, &out_offset, size - done, 0);
+			if (copied <= 0)
+				break; /* ENOSYS/EXDEV/EINVAL on older kernels or odd filesystems; fall back below */
+			done += copied;
+		}
+		/* The offset-taking calls above don't move the file position, so move it past what was written */
+		if (-1 == lseek(out, out_start + done, SEEK_SET) || fseek(destination, out_start + done, SEEK_SET))
+			return I_IO_ERROR;
+	}
+#endif
+	if (done < size && !fallback) {
+#if defined(__linux__)
+		unsigned char chunk[65536];
+		while (done < size) {
+			brrsz want = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+			ssize_t got = pread(source, chunk, want, offset + done);
+			if (got <= 0 || got != fwrite(chunk, 1, got, destination))
+				return I_IO_ERROR;
+			done += got;
+		}
+#else
+		return I_IO_ERROR;
+#endif
+	}
+	if (done < size) {
+		if (size - done != fwrite((const unsigned char *)fallback + done, 1, size - done, destination))
+			return I_IO_ERROR;
+	}
+	return I_SUCCESS;
+}
+
+static inline void
+i_put_le(unsigned char *const data, brru4 value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		data[i] = (value >> (8 * i)) & 0xFF;
+}
+brrsz
+lib_make_wav_header(unsigned char header[LIB_WAV_HEADER_MAX], const wwise_fmt_t *const fmt, brru4 data_size)
+{
+	/* KSDATAFORMAT_SUBTYPE_PCM */
+	static const unsigned char pcm_guid[16] = {
+		0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71,
+	};
+	/* Extensible keeps the channel mask, which matters for anything past stereo */
+	const int extensible = fmt->format_tag == WWISE_FORMAT_EXTENSIBLE || fmt->n_channels > 2;
+	/* Vorbis formats lay out their extra bytes as extensible ones do */
+	const int has_mask = fmt->format_tag == WWISE_FORMAT_EXTENSIBLE || fmt->format_tag == WWISE_FORMAT_VORBIS;
+	const brru4 channel_mask = has_mask && fmt->extra_size >= 6 ? fmt->channel_mask : 0;
+	const brru4 fmt_size = extensible ? 40 : 16;
+	const brrsz header_size = 20 + fmt_size + 8;
+	memcpy(header, "RIFF", 4);
+	i_put_le(header + 4, header_size - 8 + data_size, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	i_put_le(header + 16, fmt_size, 4);
+	i_put_le(header + 20, extensible ? WWISE_FORMAT_EXTENSIBLE : WWISE_FORMAT_PCM, 2);
+	i_put_le(header + 22, fmt->n_channels, 2);
+	i_put_le(header + 24, fmt->samples_per_sec, 4);
+	i_put_le(header + 28, fmt->avg_byte_rate, 4);
+	i_put_le(header + 32, fmt->block_align, 2);
+	i_put_le(header + 34, fmt->bits_per_sample, 2);
+	if (extensible) {
+		i_put_le(header + 36, 22, 2);
+		i_put_le(header + 38, fmt->bits_per_sample, 2);
+		i_put_le(header + 40, channel_mask, 4);
+		memcpy(header + 44, pcm_guid, 16);
+	}
+	memcpy(header + header_size - 8, "data", 4);
+	i_put_le(header + header_size - 4, data_size, 4);
+	return header_size;
+}
+/* Writes 'size' bytes of 'sample_size'-byte samples to 'destination' as 16-bit little-endian ones, keeping the most
+ * significant bytes of wider samples and re-centering 8-bit samples, which are unsigned.
+ * The samples are taken from 'data' if it isn't NULL, otherwise read from 'source' at 'offset'. */
+static inline int
+i_write_pcm16(int source, brrsz offset, const unsigned char *const data, brrsz size, int sample_size, int big_endian,
+    FILE *const destination)
+{
+	unsigned char out[32768], in[sizeof(out) / 2 * 4];
+	const brrsz per_chunk = sizeof(out) / 2 * sample_size;
+	size -= size % sample_size;
+	for (brrsz done = 0; done < size;) {
+		const brrsz want = size - done < per_chunk ? size - done : per_chunk;
+		const unsigned char *samples = data ? data + done : in;
+		if (!data) {
+#if defined(__linux__)
+			if (want != pread(source, in, want, offset + done))
+				return I_IO_ERROR;
+#else
+			return I_IO_ERROR;
+#endif
+		}
+		brrsz n_out = 0;
+		for (brrsz i = 0; i < want; i += sample_size, n_out += 2) {
+			const unsigned char *const sample = samples + i;
+			if (sample_size == 1) {
+				out[n_out] = 0;
+				out[n_out + 1] = sample[0] ^ 0x80;
+			} else if (big_endian) {
+				out[n_out] = sample[1];
+				out[n_out + 1] = sample[0];
+			} else {
+				out[n_out] = sample[sample_size - 2];
+				out[n_out + 1] = sample[sample_size - 1];
+			}
+		}
+		if (n_out != fwrite(out, 1, n_out, destination))
+			return I_IO_ERROR;
+		done += want;
+	}
+	return I_SUCCESS;
+}
+int
+lib_write_pcm_wem_out(
+    const wwise_probe_t *const probe,
+    int source,
+    brrsz riff_offset,
+    const unsigned char *const riff,
+    const char *const destination
+)
+{
+	const wwise_fmt_t *const fmt = &probe->fmt;
+	const int big_endian = probe->byteorder == riff_byteorder_RIFX || probe->byteorder == riff_byteorder_FFIR;
+	const int sample_size = fmt->bits_per_sample / 8;
+	brru4 data_size = probe->data_size;
+	if (!probe->flags.data_initialized || !fmt->n_channels || !sample_size || fmt->bits_per_sample % 8)
+		return I_UNRECOGNIZED_DATA;
+	if (probe->data_offset > probe->riff_size)
+		return I_INSUFFICIENT_DATA;
+	if (data_size > probe->riff_size - probe->data_offset)
+		data_size = probe->riff_size - probe->data_offset; /* Truncated */
+	if ((big_endian && !riff && destination) || (!destination && sample_size > 4))
+		return I_UNRECOGNIZED_DATA;
+
+	int err = I_SUCCESS;
+	FILE *out = stdout;
+	if (destination) {
+		if (!(out = fopen(destination, "wb"))) {
+			BRRLOG_ERRN("Failed to open output wav file '%s' : %s", destination, strerror(errno));
+			return I_IO_ERROR;
+		}
+		unsigned char header[LIB_WAV_HEADER_MAX];
+		brrsz header_size = lib_make_wav_header(header, fmt, data_size);
+		if (header_size != fwrite(header, 1, header_size, out))
+			err = I_IO_ERROR;
+	} else {
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+
+	if (!err) {
+		const unsigned char *const data = riff ? riff + probe->data_offset : NULL;
+		if (!destination && (sample_size != 2 || big_endian)) {
+			/* Raw output is always 16-bit little-endian, as decoded Vorbis is */
+			err = i_write_pcm16(source, riff_offset + probe->data_offset, data, data_size, sample_size, big_endian, out);
+		} else if (big_endian) {
+			/* WAV samples are little-endian, so these can't be copied as they are */
+			unsigned char *swapped = malloc(data_size);
+			if (!swapped) {
+				err = I_BUFFER_ERROR;
+			} else {
+				brrsz whole = data_size - data_size % sample_size;
+				for (brrsz i = 0; i < whole; i += sample_size) {
+					for (int b = 0; b < sample_size; ++b)
+						swapped[i + b] = data[i + sample_size - 1 - b];
+				}
+				memcpy(swapped + whole, data + whole, data_size - whole);
+				if (data_size != fwrite(swapped, 1, data_size, out))
+					err = I_IO_ERROR;
+				free(swapped);
+			}
+		} else {
+			err = lib_copy_range(source, riff_offset + probe->data_offset, data_size, out, data);
+		}
+	}
+
+	if (destination) {
+		if (fclose(out) && !err)
+			err = I_IO_ERROR;
+	} else {
+		fflush(out);
+	}
+	if (err == I_IO_ERROR)
+		BRRLOG_ERRN("Failed to write PCM data to '%s' : %s", destination ? destination : "stdout", strerror(errno));
+	return err;
+}
+
 /* -1 : Not found */
 static inline int
 i_find_ext(const char *const arg, int arglen)
@@ -257,8 +713,11 @@ lib_cmp_ext(const char *const arg, int arglen, int case_sensitive, ...)
 {
 	char ext[BRRPATH_MAX_NAME + 1] = {0};
 	{
-		int idx = 0;
-		if (-1 == (idx = i_find_ext(arg, arglen)))
+		/* Only the last extension is compared, without its dot */
+		int idx = arglen;
+		while (idx > 0 && arg[idx - 1] != '.' && arg[idx - 1] != BRRPATH_SEP_CHR)
+			--idx;
+		if (idx == 0 || arg[idx - 1] != '.')
 			return -1;
 		snprintf(ext, BRRPATH_MAX_NAME + 1, "%s", arg + idx);
 	}
@@ -271,7 +730,7 @@ lib_cmp_ext(const char *const arg, int arglen, int case_sensitive, ...)
 		va_start(lptr, case_sensitive);
 		const char *a;
 		while ((a = va_arg(lptr, const char *))) {
-			if (0 == cmp(arg, a)) {
+			if (0 == cmp(ext, a)) {
 				did_match = 1;
 				break;
 			}
@@ -17,6 +17,8 @@ limitations under the License.
 #ifndef LIB_H
 #define LIB_H
 
+#include <stdio.h>
+
 #include <ogg/ogg.h>
 
 #include <brrtools/brrapi.h>
@@ -56,6 +58,11 @@ typedef union fourcc {
 
 const char *lib_strerr(int err);
 
+/* Sets the log priority and debug logging according to 'input'. */
+void lib_set_log_priority(const neinput_t *const input);
+/* While 'silenced' is non-zero, 'lib_set_log_priority' disables logging no matter the input. */
+void lib_set_log_silenced(int silenced);
+
 /* Counts number of set bits in number */
 int lib_count_ones(unsigned long number);
 /* Counts number of bits needed to store number (log base 2) */
@@ -79,14 +86,71 @@ extern const lib_ncmp_t lib_case_ncmp;
  * */
 int lib_read_entire_file(const char *const path, void **const buffer, brrsz *const buffer_size);
 
+/* Reads at most 'buffer_size' bytes from the start of 'path' into 'buffer', and stores the number of bytes read in
+ * 'read_size' and the total size of the file in 'file_size' (if non-NULL).
+ * Returns 0 on success or I_IO_ERROR on failure.
+ * */
+int lib_read_file_head(const char *const path, void *const buffer, brrsz buffer_size, brrsz *const read_size, brrsz *const file_size);
+
 int lib_parse_buffer_as_riff(riff_t *const rf, const void *const buffer, brrsz buffer_size);
 
 int lib_parse_buffer_as_wwriff(wwriff_t *const rf, const void *const buffer, brrsz buffer_size);
 
 /* Writes the ogg stream 'stream' to the file 'destination'.
+ * A write queued with io_uring is counted in 'failures' if it fails, once it's waited on with 'uring_wait'; if
+ * 'failures' is NULL, it's waited on before returning instead, so the result is final.
+ * Returns 0 on success, or I_IO_ERROR on failure.
+ * */
+int lib_write_ogg_out(ogg_stream_state *const streamer, const char *const destination, brrsz *const failures);
+
+/* Decodes 'wwriff' to a 16-bit PCM WAV file 'destination', or to stdout as raw PCM if 'destination' is NULL.
+ * Returns 0 on success, I_IO_ERROR if the output couldn't be opened/written, or a conversion error.
+ * */
+int lib_write_pcm_out(
+    wwriff_t *const wwriff,
+    const codebook_library_t *const library,
+    const neinput_t *const input,
+    const char *const destination
+);
+
+/* Opens 'path' as a source for 'lib_copy_range'.
+ * Returns -1 if the file can't be opened, or if the platform has no kernel-side copying; 'lib_copy_range' then
+ * always uses its fallback buffer.
+ * */
+int lib_range_source_open(const char *const path);
+void lib_range_source_close(int source);
+
+/* Appends 'size' bytes starting at 'offset' of the file 'source' to 'destination', at its current position.
+ * Where possible the data never enters userspace: block-aligned heads are reflinked (FICLONERANGE) and the rest is
+ * moved with copy_file_range.
+ * 'fallback' holds the same bytes in memory and is written normally for anything the kernel couldn't copy; it may
+ * be NULL only if 'source' is valid, in which case the rest is read from 'source' and written normally.
  * Returns 0 on success, or I_IO_ERROR on failure.
  * */
-int lib_write_ogg_out(ogg_stream_state *const streamer, const char *const destination);
+int lib_copy_range(int source, brrsz offset, brrsz size, FILE *const destination, const void *const fallback);
+
+#define LIB_WAV_HEADER_MAX 68
+/* Builds the RIFF/WAVE header of 'data_size' bytes of samples in the format of 'fmt' into 'header', and returns its
+ * size. WAVE_FORMAT_EXTENSIBLE is used when 'fmt' is, and for anything past stereo, so the channel mask of
+ * extensible and Vorbis formats is kept.
+ * */
+brrsz lib_make_wav_header(unsigned char header[LIB_WAV_HEADER_MAX], const wwise_fmt_t *const fmt, brru4 data_size);
+/* Writes the PCM WwRIFF described by 'probe' to 'destination' as a standard RIFF/WAVE file: a fresh header, then the
+ * 'data' chunk copied with 'lib_copy_range' from 'source', where the WwRIFF starts at 'riff_offset'.
+ * 'riff' is the WwRIFF in memory, used as the fallback for 'lib_copy_range'; it may be NULL if 'source' is valid,
+ * except for big-endian WwRIFFs, whose samples must be swapped in memory.
+ * If 'destination' is NULL, just the samples are written to stdout, converted to 16-bit little-endian if they aren't
+ * already, so raw output is the same format whether the WwRIFF was PCM or Vorbis.
+ * Returns 0 on success, I_IO_ERROR if the output couldn't be opened/written, or I_UNRECOGNIZED_DATA if the data
+ * can't be written as WAV.
+ * */
+int lib_write_pcm_wem_out(
+    const wwise_probe_t *const probe,
+    int source,
+    brrsz riff_offset,
+    const unsigned char *const riff,
+    const char *const destination
+);
 
 /* Returns the index of the first extension that matches the last extension of 'arg' (everything after the dot),
  * or -1 if no extension matches.
@@ -0,0 +1,301 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "logger.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+
+#include <brrtools/brrlib.h>
+
+#include "errors.h"
+
+typedef struct i_line {
+	char text[LOGGER_LINE_MAX + 1]; /* Room for the newline */
+	brrsz length;
+} i_line_t;
+
+/* A line finished before those ordered ahead of it */
+typedef struct i_held {
+	char *text;
+	brrsz length;
+} i_held_t;
+
+/* Lines are queued into 'pending', which the writer swaps with its own buffer whenever it wakes, so a whole batch of
+ * lines is written with one call, and workers only ever wait for a copy. */
+typedef struct i_logger {
+#if defined(_WIN32)
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE wake;
+	HANDLE writer;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t writer;
+#endif
+	FILE *output;
+	int flush;
+	int running;  /* Whether the writer thread is running */
+	int stopping;
+	char *pending;
+	brrsz n_pending;
+	brrsz pending_capacity;
+	i_held_t *held;  /* One per ordered line */
+	brrsz n_held;
+	brrsz next_held; /* Next ordered line to be queued */
+} i_logger_t;
+
+static i_logger_t s_logger = {0};
+static int s_started = 0;
+static _Thread_local i_line_t s_line = {0};
+
+#if defined(_WIN32)
+# define i_lock() EnterCriticalSection(&s_logger.lock)
+# define i_unlock() LeaveCriticalSection(&s_logger.lock)
+# define i_signal() WakeConditionVariable(&s_logger.wake)
+# define i_wait() SleepConditionVariableCS(&s_logger.wake, &s_logger.lock, INFINITE)
+#else
+# define i_lock() pthread_mutex_lock(&s_logger.lock)
+# define i_unlock() pthread_mutex_unlock(&s_logger.lock)
+# define i_signal() pthread_cond_signal(&s_logger.wake)
+# define i_wait() pthread_cond_wait(&s_logger.wake, &s_logger.lock)
+#endif
+
+static void
+i_write(const char *const text, brrsz length)
+{
+	fwrite(text, 1, length, s_logger.output);
+	if (s_logger.flush != nestate_flush_end)
+		fflush(s_logger.output);
+}
+
+/* Queues 'length' bytes of 'text' for the writer, or writes them when there isn't one; called locked. */
+static void
+i_queue(const char *const text, brrsz length)
+{
+	if (!s_logger.running) {
+		/* No writer, so lines are written as they're finished, one at a time */
+		i_write(text, length);
+		return;
+	}
+	if (s_logger.n_pending + length > s_logger.pending_capacity) {
+		brrsz capacity = s_logger.pending_capacity ? s_logger.pending_capacity : 4 * LOGGER_LINE_MAX;
+		while (capacity < s_logger.n_pending + length)
+			capacity *= 2;
+		if (!brrlib_alloc((void **)&s_logger.pending, capacity, 0))
+			s_logger.pending_capacity = capacity;
+	}
+	if (s_logger.n_pending + length <= s_logger.pending_capacity) {
+		memcpy(s_logger.pending + s_logger.n_pending, text, length);
+		s_logger.n_pending += length;
+		i_signal();
+	}
+}
+/* Queues held lines from the next one in order, up to the first not yet finished; called locked. */
+static void
+i_release_held(void)
+{
+	while (s_logger.next_held < s_logger.n_held && s_logger.held[s_logger.next_held].text) {
+		i_held_t *const held = &s_logger.held[s_logger.next_held++];
+		i_queue(held->text, held->length);
+		free(held->text);
+		held->text = NULL;
+	}
+}
+
+static void
+i_write_lines(void)
+{
+	char *batch = NULL;
+	brrsz n_batch = 0, batch_capacity = 0;
+	i_lock();
+	for (;;) {
+		while (!s_logger.n_pending && !s_logger.stopping)
+			i_wait();
+		if (!s_logger.n_pending)
+			break;
+		/* Swap buffers, so workers can keep queueing while this batch is written */
+		char *swap = s_logger.pending;
+		brrsz swap_capacity = s_logger.pending_capacity;
+		n_batch = s_logger.n_pending;
+		s_logger.pending = batch;
+		s_logger.pending_capacity = batch_capacity;
+		s_logger.n_pending = 0;
+		batch = swap;
+		batch_capacity = swap_capacity;
+		i_unlock();
+		i_write(batch, n_batch);
+		i_lock();
+	}
+	i_unlock();
+	if (batch)
+		free(batch);
+}
+#if defined(_WIN32)
+static DWORD WINAPI
+i_writer(LPVOID unused)
+{
+	i_write_lines();
+	return 0;
+}
+#else
+static void *
+i_writer(void *unused)
+{
+	i_write_lines();
+	return NULL;
+}
+#endif
+
+int
+logger_start(FILE *const output, int flush)
+{
+	if (s_started)
+		return I_SUCCESS;
+	s_logger = (i_logger_t){.output = output, .flush = flush};
+#if defined(_WIN32)
+	InitializeCriticalSection(&s_logger.lock);
+	InitializeConditionVariable(&s_logger.wake);
+	s_logger.running = NULL != (s_logger.writer = CreateThread(NULL, 0, i_writer, NULL, 0, NULL));
+#else
+	if (pthread_mutex_init(&s_logger.lock, NULL))
+		return I_INIT_ERROR;
+	if (pthread_cond_init(&s_logger.wake, NULL)) {
+		pthread_mutex_destroy(&s_logger.lock);
+		return I_INIT_ERROR;
+	}
+	s_logger.running = !pthread_create(&s_logger.writer, NULL, i_writer, NULL);
+#endif
+	s_started = 1;
+	return I_SUCCESS;
+}
+
+int
+logger_order(brrsz n_lines)
+{
+	if (!s_started || s_logger.held)
+		return I_GENERIC_ERROR;
+	if (!n_lines)
+		return I_SUCCESS;
+	if (!(s_logger.held = calloc(n_lines, sizeof(*s_logger.held))))
+		return I_BUFFER_ERROR;
+	s_logger.n_held = n_lines;
+	s_logger.next_held = 0;
+	return I_SUCCESS;
+}
+
+void
+logger_stop(void)
+{
+	if (!s_started)
+		return;
+	if (s_logger.held) {
+		/* Lines never finished don't hold back those after them any longer */
+		i_lock();
+		for (; s_logger.next_held < s_logger.n_held; ++s_logger.next_held) {
+			i_held_t *const held = &s_logger.held[s_logger.next_held];
+			if (held->text) {
+				i_queue(held->text, held->length);
+				free(held->text);
+			}
+		}
+		i_unlock();
+		free(s_logger.held);
+	}
+	if (s_logger.running) {
+		i_lock();
+		s_logger.stopping = 1;
+		i_signal();
+		i_unlock();
+#if defined(_WIN32)
+		WaitForSingleObject(s_logger.writer, INFINITE);
+		CloseHandle(s_logger.writer);
+#else
+		pthread_join(s_logger.writer, NULL);
+#endif
+	}
+	fflush(s_logger.output);
+#if defined(_WIN32)
+	DeleteCriticalSection(&s_logger.lock);
+#else
+	pthread_cond_destroy(&s_logger.wake);
+	pthread_mutex_destroy(&s_logger.lock);
+#endif
+	if (s_logger.pending)
+		free(s_logger.pending);
+	s_logger = (i_logger_t){0};
+	s_started = 0;
+}
+
+void
+logger_add(const char *const format, ...)
+{
+	if (s_line.length >= LOGGER_LINE_MAX)
+		return;
+	va_list lptr;
+	va_start(lptr, format);
+	int n = vsnprintf(s_line.text + s_line.length, LOGGER_LINE_MAX - s_line.length, format, lptr);
+	va_end(lptr);
+	if (n > 0)
+		s_line.length += n;
+	if (s_line.length > LOGGER_LINE_MAX - 1)
+		s_line.length = LOGGER_LINE_MAX - 1;
+}
+
+void
+logger_emit(void)
+{
+	s_line.text[s_line.length++] = '\n';
+	if (!s_started) {
+		fwrite(s_line.text, 1, s_line.length, stdout);
+	} else {
+		i_lock();
+		i_queue(s_line.text, s_line.length);
+		i_unlock();
+	}
+	s_line.length = 0;
+}
+
+void
+logger_emit_at(brrsz index)
+{
+	if (!s_started || index >= s_logger.n_held) {
+		logger_emit();
+		return;
+	}
+	s_line.text[s_line.length++] = '\n';
+	char *const text = malloc(s_line.length);
+	i_lock();
+	if (text && index >= s_logger.next_held && !s_logger.held[index].text) {
+		memcpy(text, s_line.text, s_line.length);
+		s_logger.held[index] = (i_held_t){text, s_line.length};
+		i_release_held();
+	} else {
+		/* Out of memory, or the line was already emitted; better out of order than not at all */
+		i_queue(s_line.text, s_line.length);
+		if (text)
+			free(text);
+	}
+	i_unlock();
+	s_line.length = 0;
+}
@@ -0,0 +1,50 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+
+#include <brrtools/brrpath.h>
+
+#include "input.h"
+
+/* Whole-line logging for inputs processed in parallel: every thread assembles its current line in a buffer of its
+ * own, and finished lines are queued for a single writer thread, so workers never wait on the output and their lines
+ * never interleave. */
+
+#define LOGGER_LINE_MAX (BRRPATH_MAX_PATH + 256)
+
+/* Starts the writer thread, writing to 'output' and flushing it according to 'flush' (nestate_flush_t).
+ * If the thread can't be started, lines are written as they're finished instead.
+ * Returns 0 on success, or I_INIT_ERROR if the writer couldn't be set up at all. */
+int logger_start(FILE *const output, int flush);
+/* Has lines emitted with 'logger_emit_at' written in the order of their indices, from 0 to 'n_lines' - 1, whatever
+ * order they're finished in; each is held back until all of those before it are written.
+ * Returns 0 on success, or I_BUFFER_ERROR, in which case lines are written as they're finished. */
+int logger_order(brrsz n_lines);
+/* Writes out every queued line, along with any still held back, and stops the writer thread. */
+void logger_stop(void);
+
+/* Appends to this thread's current line; anything past LOGGER_LINE_MAX is cut off. */
+void logger_add(const char *const format, ...);
+/* Queues this thread's current line, with a newline, and starts a new one. */
+void logger_emit(void);
+/* As 'logger_emit', with the line written as line 'index' of those ordered by 'logger_order'. */
+void logger_emit_at(brrsz index);
+
+#endif /* LOGGER_H */
@@ -22,8 +22,27 @@ limitations under the License.
 #include <brrtools/brrlog.h>
 
 #include "input.h"
+#include "lib.h"
+#include "memlimit.h"
+#include "pool.h"
 #include "print.h"
 #include "process.h"
+#include "serve.h"
+#include "trace.h"
+#include "watch.h"
+
+/* The report is skipped when stdout is reserved for probe results or PCM output */
+static int
+i_should_report(const nestate_t *const state)
+{
+	if (state->settings.probe)
+		return 0;
+	for (brrsz i = 0; i < state->n_inputs; ++i) {
+		if (state->inputs[i].flag.pcm_out)
+			return 0;
+	}
+	return state->settings.report_card || state->settings.full_report || state->settings.log_mode == nestate_log_summary;
+}
 
 int
 main(int argc, char **argv)
@@ -50,6 +69,10 @@ main(int argc, char **argv)
 	};
 	int err = 0;
 
+	/* The client only forwards its arguments, so they're never parsed here */
+	if (argc > 2 && 0 == strcmp(argv[1], "-client"))
+		return neserve_client(argv[2], argc - 3, argv + 3);
+
 	if (argc == 1) {
 		print_usage();
 	} else if (nestate_init(&state, argc - 1, argv + 1)) {
@@ -62,8 +85,8 @@ main(int argc, char **argv)
 			fprintf(stderr, "Failed to initialize logging output : %s", strerror(errno));
 			return errno;
 		}
-		gbrrlogctl.flush_enabled = 1;
-		gbrrlogctl.flush_always = 1;
+		gbrrlogctl.flush_enabled = state.settings.flush_mode != nestate_flush_end;
+		gbrrlogctl.flush_always = state.settings.flush_mode == nestate_flush_always;
 		gbrrlog_level(critical).prefix = "[CRAZY] ";
 		gbrrlog_level(error).prefix    = "[ERROR] ";
 		gbrrlog_level(warning).prefix  = "[CAUTION] ";
@@ -71,16 +94,53 @@ main(int argc, char **argv)
 		gbrrlog_format(debug) = BRRLOG_FORMAT_FORE(brrlog_color_green);
 	}
 
-	if (!state.n_inputs) {
+	/* Both are process-wide, so they're set once here rather than by anything running in a pool */
+	pool_set_threads(state.threads);
+	if (state.mem_limit)
+		memlimit_set(state.mem_limit);
+
+	if (state.serve_path) {
+		err = neserve_run(&state);
+		nestate_clear(&state);
+		brrlog_deinit();
+		return err;
+	}
+	if (!state.n_inputs && !state.watch_input.path) {
 		brrlog_set_max_priority(state.default_input.flag.log_debug?brrlog_priority_debug:state.default_input.log_priority);
 		BRRLOG_ERR("No files passed");
 		return 1;
 	}
+	if (state.settings.merge_reports) {
+		lib_set_log_priority(&state.default_input);
+		if (!(err = print_merge_reports(&state)))
+			print_report(&state);
+		nestate_clear(&state);
+		brrlog_deinit();
+		return err;
+	}
+	if (state.trace_path)
+		trace_start();
 	neprocess_inputs(&state);
-	nestate_clear(&state);
+	/* Inputs given alongside '-watch' are processed first */
+	if (state.watch_input.path)
+		err = newatch_run(&state);
+	if (state.trace_path) {
+		int trace_err = 0;
+		if ((trace_err = trace_write(state.trace_path)))
+			BRRLOG_ERR("Failed to write trace '%s' : %s", state.trace_path, lib_strerr(trace_err));
+	}
 
-	if (state.settings.report_card || state.settings.full_report)
+	/* The report needs the settings and inputs, so it's printed before they're cleared */
+	if (i_should_report(&state)) {
+		lib_set_log_priority(&state.default_input);
 		print_report(&state);
+	}
+	if (state.report_path) {
+		int report_err = 0;
+		if ((report_err = print_report_file(&state, state.report_path)))
+			BRRLOG_ERR("Failed to write report '%s' : %s", state.report_path, lib_strerr(report_err));
+	}
+	nestate_clear(&state);
 	brrlog_deinit();
 	return err;
 }
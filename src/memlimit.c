@@ -0,0 +1,110 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "memlimit.h"
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+
+/* A ticket queue under one lock: each reservation takes a ticket, and only the ticket being served may reserve */
+typedef struct i_memlimit {
+#if defined(_WIN32)
+	SRWLOCK lock;
+	CONDITION_VARIABLE wake;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+#endif
+	brru8 limit;
+	brru8 reserved;
+	brru8 next_ticket;
+	brru8 serving;
+} i_memlimit_t;
+
+#if defined(_WIN32)
+static i_memlimit_t s_memlimit = {.lock = SRWLOCK_INIT, .wake = CONDITION_VARIABLE_INIT};
+# define i_lock() AcquireSRWLockExclusive(&s_memlimit.lock)
+# define i_unlock() ReleaseSRWLockExclusive(&s_memlimit.lock)
+# define i_wake_all() WakeAllConditionVariable(&s_memlimit.wake)
+# define i_wait() SleepConditionVariableSRW(&s_memlimit.wake, &s_memlimit.lock, INFINITE, 0)
+#else
+static i_memlimit_t s_memlimit = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+# define i_lock() pthread_mutex_lock(&s_memlimit.lock)
+# define i_unlock() pthread_mutex_unlock(&s_memlimit.lock)
+# define i_wake_all() pthread_cond_broadcast(&s_memlimit.wake)
+# define i_wait() pthread_cond_wait(&s_memlimit.wake, &s_memlimit.lock)
+#endif
+
+void
+memlimit_set(brru8 limit)
+{
+	i_lock();
+	s_memlimit.limit = limit;
+	i_wake_all();
+	i_unlock();
+}
+
+brru8
+memlimit_get(void)
+{
+	i_lock();
+	const brru8 limit = s_memlimit.limit;
+	i_unlock();
+	return limit;
+}
+
+brru8
+memlimit_reserve(brru8 bytes)
+{
+	i_lock();
+	if (!s_memlimit.limit) {
+		i_unlock();
+		return 0;
+	}
+	const brru8 ticket = s_memlimit.next_ticket++;
+	for (;;) {
+		const brru8 limit = s_memlimit.limit;
+		if (!limit) {
+			bytes = 0;
+			break;
+		}
+		if (bytes > limit)
+			bytes = limit;
+		if (ticket == s_memlimit.serving && s_memlimit.reserved + bytes <= limit)
+			break;
+		i_wait();
+	}
+	s_memlimit.reserved += bytes;
+	s_memlimit.serving++;
+	/* The next ticket may fit too */
+	i_wake_all();
+	i_unlock();
+	return bytes;
+}
+
+void
+memlimit_release(brru8 reserved)
+{
+	if (!reserved)
+		return;
+	i_lock();
+	s_memlimit.reserved -= reserved;
+	i_wake_all();
+	i_unlock();
+}
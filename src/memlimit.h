@@ -0,0 +1,37 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef MEMLIMIT_H
+#define MEMLIMIT_H
+
+#include <brrtools/brrtypes.h>
+
+/* Admission control for '-mem-limit': before an input is processed, what it's expected to hold in memory at its peak
+ * is reserved from one budget shared by every thread, and it waits until that much is free.
+ * Waiters are let in strictly in the order they started waiting, so a big input isn't starved by smaller ones
+ * slipping in ahead of it; one bigger than the whole budget waits until nothing else is reserved, and runs alone. */
+
+/* Sets the budget to 'limit' bytes, or lifts it with 0; what's reserved already stays reserved. */
+void memlimit_set(brru8 limit);
+/* Returns the budget, or 0 if there isn't one. */
+brru8 memlimit_get(void);
+
+/* Waits until 'bytes' fit in the budget, and reserves them.
+ * Returns how many bytes were reserved, to be handed to 'memlimit_release' once done; 0 without a budget. */
+brru8 memlimit_reserve(brru8 bytes);
+void memlimit_release(brru8 reserved);
+
+#endif /* MEMLIMIT_H */
@@ -0,0 +1,261 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "memstat.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(Ne_memstats)
+# include <malloc.h>
+# if defined(_WIN32)
+#  define i_block_size(_p_) _msize(_p_)
+# else
+#  define i_block_size(_p_) malloc_usable_size(_p_)
+# endif
+#endif
+
+typedef struct i_stage {
+	atomic_ullong allocations;
+	atomic_ullong bytes;
+	atomic_llong peak;
+} i_stage_t;
+
+static atomic_ullong s_allocations = 0;
+static atomic_ullong s_bytes = 0;
+static atomic_llong s_live = 0;
+static atomic_llong s_peak = 0;
+static i_stage_t s_stages[timing_stage_count];
+static _Thread_local memstat_thread_t s_thread = {NULL, -1};
+
+/* Only guards the top inputs, which is once per input */
+static atomic_flag s_lock = ATOMIC_FLAG_INIT;
+static memstat_input_t s_top[MEMSTAT_TOP_INPUTS];
+static brrsz s_n_top = 0;
+
+static inline void
+i_raise(atomic_llong *const peak, long long value)
+{
+	long long current = atomic_load_explicit(peak, memory_order_relaxed);
+	while (value > current && !atomic_compare_exchange_weak_explicit(peak, &current, value,
+	    memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+#if defined(Ne_memstats)
+static inline void
+i_added(brrsz size)
+{
+	const long long live = atomic_fetch_add_explicit(&s_live, size, memory_order_relaxed) + size;
+	i_raise(&s_peak, live);
+	atomic_fetch_add_explicit(&s_allocations, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s_bytes, size, memory_order_relaxed);
+	if (s_thread.stage >= 0) {
+		i_stage_t *const stage = &s_stages[s_thread.stage];
+		atomic_fetch_add_explicit(&stage->allocations, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&stage->bytes, size, memory_order_relaxed);
+		i_raise(&stage->peak, live);
+	}
+	if (s_thread.scope) {
+		memstat_scope_t *const scope = s_thread.scope;
+		atomic_fetch_add_explicit(&scope->allocations, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&scope->bytes, size, memory_order_relaxed);
+		i_raise(&scope->peak, atomic_fetch_add_explicit(&scope->live, size, memory_order_relaxed) + size);
+	}
+}
+static inline void
+i_removed(brrsz size)
+{
+	atomic_fetch_sub_explicit(&s_live, size, memory_order_relaxed);
+	if (s_thread.scope)
+		atomic_fetch_sub_explicit(&s_thread.scope->live, size, memory_order_relaxed);
+}
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void __real_free(void *pointer);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *pointer, size_t size);
+void __wrap_free(void *pointer);
+
+void *
+__wrap_malloc(size_t size)
+{
+	void *const block = __real_malloc(size);
+	if (block)
+		i_added(i_block_size(block));
+	return block;
+}
+void *
+__wrap_calloc(size_t count, size_t size)
+{
+	void *const block = __real_calloc(count, size);
+	if (block)
+		i_added(i_block_size(block));
+	return block;
+}
+void *
+__wrap_realloc(void *pointer, size_t size)
+{
+	const brrsz old = pointer ? i_block_size(pointer) : 0;
+	void *const block = __real_realloc(pointer, size);
+	if (block) {
+		i_removed(old);
+		i_added(i_block_size(block));
+	} else if (pointer && !size) {
+		/* Freed */
+		i_removed(old);
+	}
+	return block;
+}
+void
+__wrap_free(void *pointer)
+{
+	if (pointer)
+		i_removed(i_block_size(pointer));
+	__real_free(pointer);
+}
+#endif
+
+int
+memstat_enabled(void)
+{
+#if defined(Ne_memstats)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void
+memstat_enter(int stage)
+{
+	s_thread.stage = stage;
+}
+memstat_thread_t
+memstat_thread_get(void)
+{
+	return s_thread;
+}
+void
+memstat_thread_set(memstat_thread_t thread)
+{
+	s_thread = thread;
+}
+
+void
+memstat_scope_begin(memstat_scope_t *const scope)
+{
+	atomic_init(&scope->allocations, 0);
+	atomic_init(&scope->bytes, 0);
+	atomic_init(&scope->live, 0);
+	atomic_init(&scope->peak, 0);
+	s_thread.scope = scope;
+}
+
+void
+memstat_scope_adopt(const void *const block)
+{
+#if defined(Ne_memstats)
+	memstat_scope_t *const scope = s_thread.scope;
+	if (block && scope) {
+		const brrsz size = i_block_size((void *)block);
+		atomic_fetch_add_explicit(&scope->allocations, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&scope->bytes, size, memory_order_relaxed);
+		i_raise(&scope->peak, atomic_fetch_add_explicit(&scope->live, size, memory_order_relaxed) + size);
+	}
+#endif
+}
+
+static inline void
+i_lock(void)
+{
+	while (atomic_flag_test_and_set_explicit(&s_lock, memory_order_acquire))
+		;
+}
+static inline void
+i_unlock(void)
+{
+	atomic_flag_clear_explicit(&s_lock, memory_order_release);
+}
+
+void
+memstat_scope_usage(const memstat_scope_t *const scope, memstat_usage_t *const usage)
+{
+	usage->allocations = atomic_load(&scope->allocations);
+	usage->bytes = atomic_load(&scope->bytes);
+	usage->peak = atomic_load(&scope->peak);
+	usage->live = atomic_load(&scope->live);
+}
+
+void
+memstat_scope_end(const memstat_scope_t *const scope, const char *const path)
+{
+	memstat_usage_t u;
+	s_thread.scope = NULL;
+	s_thread.stage = -1;
+	if (!memstat_enabled() || !path)
+		return;
+
+	memstat_scope_usage(scope, &u);
+	i_lock();
+	brrsz at = s_n_top;
+	while (at > 0 && s_top[at - 1].usage.peak < u.peak)
+		--at;
+	if (at < MEMSTAT_TOP_INPUTS) {
+		if (s_n_top < MEMSTAT_TOP_INPUTS)
+			++s_n_top;
+		memmove(&s_top[at + 1], &s_top[at], (s_n_top - 1 - at) * sizeof(*s_top));
+		/* The end of a path says more than its start */
+		const brrsz length = strlen(path);
+		const char *const from = length < MEMSTAT_PATH_MAX ? path : path + length - (MEMSTAT_PATH_MAX - 1);
+		memcpy(s_top[at].path, from, strlen(from) + 1);
+		s_top[at].usage = u;
+	}
+	i_unlock();
+}
+
+void
+memstat_total(memstat_usage_t *const usage)
+{
+	usage->allocations = atomic_load(&s_allocations);
+	usage->bytes = atomic_load(&s_bytes);
+	usage->peak = atomic_load(&s_peak);
+	usage->live = atomic_load(&s_live);
+}
+
+void
+memstat_stage(timing_stage_t stage, memstat_usage_t *const usage)
+{
+	const i_stage_t *const s = &s_stages[stage];
+	usage->allocations = atomic_load(&s->allocations);
+	usage->bytes = atomic_load(&s->bytes);
+	usage->peak = atomic_load(&s->peak);
+	usage->live = 0;
+}
+
+brrsz
+memstat_top_inputs(memstat_input_t inputs[MEMSTAT_TOP_INPUTS])
+{
+	i_lock();
+	const brrsz n = s_n_top;
+	memcpy(inputs, s_top, n * sizeof(*s_top));
+	i_unlock();
+	return n;
+}
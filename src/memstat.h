@@ -0,0 +1,89 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include <stdatomic.h>
+
+#include <brrtools/brrtypes.h>
+
+#include "timing.h"
+
+/* Memory accounting, only when built with 'memstats=1': the linker then routes every malloc, calloc, realloc and free
+ * of the program, and of brrtools, libogg and libvorbis linked into it, through counting wrappers (-Wl,--wrap).
+ * Sizes are those the allocator reports for each block, so they include its rounding; blocks allocated by the C
+ * library itself but freed here are subtracted without ever having been added, so live bytes may read slightly low.
+ * Allocations are counted against the stage (see timing.h) the thread is in, and against the input being processed;
+ * pool workers take on both from the thread that ran the pool.
+ * Without 'memstats', nothing is counted and every function here does nothing. */
+
+#define MEMSTAT_TOP_INPUTS 5
+#define MEMSTAT_PATH_MAX 96
+
+typedef struct memstat_usage {
+	brru8 allocations; /* Calls to malloc, calloc and realloc */
+	brru8 bytes;       /* Bytes those calls allocated */
+	brru8 peak;        /* Most bytes live at once */
+	brrs8 live;        /* Bytes still live */
+} memstat_usage_t;
+
+/* What is counted against one input, by every thread working on it */
+typedef struct memstat_scope {
+	atomic_ullong allocations;
+	atomic_ullong bytes;
+	atomic_llong live;
+	atomic_llong peak;
+} memstat_scope_t;
+
+/* What a thread counts its allocations against */
+typedef struct memstat_thread {
+	memstat_scope_t *scope;
+	int stage; /* timing_stage_t, or -1 */
+} memstat_thread_t;
+
+typedef struct memstat_input {
+	char path[MEMSTAT_PATH_MAX];
+	memstat_usage_t usage;
+} memstat_input_t;
+
+/* Returns non-zero if built with 'memstats'. */
+int memstat_enabled(void);
+
+/* Counts this thread's allocations against 'stage' (-1 for none) from now on. */
+void memstat_enter(int stage);
+memstat_thread_t memstat_thread_get(void);
+void memstat_thread_set(memstat_thread_t thread);
+
+/* Counts this thread's allocations against 'scope' until 'memstat_scope_end', which keeps 'path' among the inputs
+ * with the highest peaks if it's one of them. */
+void memstat_scope_begin(memstat_scope_t *const scope);
+void memstat_scope_end(const memstat_scope_t *const scope, const char *const path);
+/* Counts 'block', allocated outside of any scope (as by the pipeline's reader, ahead of its input), against this
+ * thread's scope from now on, as if it were allocated here. */
+void memstat_scope_adopt(const void *const block);
+/* Fills 'usage' with what was counted against 'scope' so far. */
+void memstat_scope_usage(const memstat_scope_t *const scope, memstat_usage_t *const usage);
+
+/* Fills 'usage' with everything counted; its peak is that of the whole process. */
+void memstat_total(memstat_usage_t *const usage);
+/* Fills 'usage' with what was counted against 'stage'; its peak is the most bytes the whole process had live while
+ * any thread was in 'stage', and its live bytes are meaningless. */
+void memstat_stage(timing_stage_t stage, memstat_usage_t *const usage);
+/* Stores the inputs with the highest peaks in 'inputs', highest first, and returns how many there are. */
+brrsz memstat_top_inputs(memstat_input_t inputs[MEMSTAT_TOP_INPUTS]);
+
+#endif /* MEMSTAT_H */
@@ -0,0 +1,359 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "pipeline.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <sched.h>
+#endif
+
+#include <brrtools/brrlog.h>
+
+#include "errors.h"
+#include "lib.h"
+#include "memstat.h"
+#include "timing.h"
+#include "uring.h"
+
+/* A file read ahead for a task, or an Ogg to be written */
+typedef struct i_item {
+	brrsz index;
+	char *path;
+	void *data;
+	brrsz size;
+} i_item_t;
+
+typedef struct i_cell {
+	atomic_size_t sequence;
+	i_item_t item;
+} i_cell_t;
+
+/* Bounded multi-producer multi-consumer queue (after Dmitry Vyukov's): every cell carries a sequence number saying
+ * whether it's free for the producer at that position or filled for the consumer, so producers and consumers only
+ * ever contend on their own end. */
+typedef struct i_queue {
+	i_cell_t *cells;
+	brrsz mask;
+	brrsz depth;
+	brru8 budget;
+	atomic_size_t tail;  /* Next position to fill */
+	atomic_size_t head;  /* Next position to take */
+	atomic_size_t count;
+	atomic_ullong bytes;
+	atomic_int closed;
+} i_queue_t;
+
+typedef struct i_pipeline {
+	pool_task_t task;
+	pipeline_path_t path;
+	void *context;
+	brrsz n_tasks;
+	i_queue_t reads;
+	i_queue_t writes;
+	int writer;          /* Whether the writer is running */
+} i_pipeline_t;
+
+static atomic_ullong s_failures = 0;
+/* The item of the task this thread is running, and the queue its Oggs go to */
+static _Thread_local i_item_t *s_read = NULL;
+static _Thread_local i_queue_t *s_writes = NULL;
+
+/* Waits a little longer each time it's called in a row; spinning first, then yielding, then sleeping. */
+static void
+i_backoff(unsigned *const spins)
+{
+	const unsigned n = (*spins)++;
+	if (n < 64)
+		return;
+#if defined(_WIN32)
+	if (n < 128)
+		SwitchToThread();
+	else
+		Sleep(1);
+#else
+	if (n < 128) {
+		sched_yield();
+	} else {
+		struct timespec nap = {0, n < 256 ? 50000 : 1000000};
+		nanosleep(&nap, NULL);
+	}
+#endif
+}
+
+static int
+i_queue_init(i_queue_t *const queue, brrsz depth, brru8 budget)
+{
+	brrsz capacity = 2;
+	while (capacity < depth)
+		capacity <<= 1;
+	if (!(queue->cells = malloc(capacity * sizeof(*queue->cells))))
+		return I_BUFFER_ERROR;
+	for (brrsz i = 0; i < capacity; ++i)
+		atomic_init(&queue->cells[i].sequence, i);
+	queue->mask = capacity - 1;
+	queue->depth = depth;
+	queue->budget = budget;
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->count, 0);
+	atomic_init(&queue->bytes, 0);
+	atomic_init(&queue->closed, 0);
+	return I_SUCCESS;
+}
+static void
+i_queue_clear(i_queue_t *const queue)
+{
+	if (queue->cells)
+		free(queue->cells);
+	queue->cells = NULL;
+}
+
+static int
+i_try_push(i_queue_t *const queue, const i_item_t *const item)
+{
+	brrsz position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	i_cell_t *cell;
+	for (;;) {
+		cell = &queue->cells[position & queue->mask];
+		const brrsz sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		const long long diff = (long long)sequence - (long long)position;
+		if (!diff) {
+			if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return 0; /* Full */
+		} else {
+			position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		}
+	}
+	cell->item = *item;
+	atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+	return 1;
+}
+static int
+i_try_pop(i_queue_t *const queue, i_item_t *const item)
+{
+	brrsz position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	i_cell_t *cell;
+	for (;;) {
+		cell = &queue->cells[position & queue->mask];
+		const brrsz sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		const long long diff = (long long)sequence - (long long)(position + 1);
+		if (!diff) {
+			if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return 0; /* Empty */
+		} else {
+			position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+		}
+	}
+	*item = cell->item;
+	atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+	return 1;
+}
+
+/* Waits until 'item' fits within the queue's depth and budget, and queues it. */
+static void
+i_push(i_queue_t *const queue, const i_item_t *const item)
+{
+	unsigned spins = 0;
+	for (;;) {
+		const brru8 bytes = atomic_load_explicit(&queue->bytes, memory_order_relaxed);
+		const brrsz count = atomic_load_explicit(&queue->count, memory_order_relaxed);
+		if (!count || (count < queue->depth && bytes + item->size <= queue->budget)) {
+			if (i_try_push(queue, item))
+				break;
+		}
+		i_backoff(&spins);
+	}
+	atomic_fetch_add_explicit(&queue->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&queue->bytes, item->size, memory_order_relaxed);
+}
+/* Waits for an item and takes it; returns 0 once the queue is closed and empty. */
+static int
+i_pop(i_queue_t *const queue, i_item_t *const item)
+{
+	unsigned spins = 0;
+	for (;;) {
+		if (i_try_pop(queue, item))
+			break;
+		if (atomic_load_explicit(&queue->closed, memory_order_acquire)) {
+			/* Whatever was queued before closing is visible now */
+			if (i_try_pop(queue, item))
+				break;
+			return 0;
+		}
+		i_backoff(&spins);
+	}
+	atomic_fetch_sub_explicit(&queue->count, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&queue->bytes, item->size, memory_order_relaxed);
+	return 1;
+}
+static void
+i_close(i_queue_t *const queue)
+{
+	atomic_store_explicit(&queue->closed, 1, memory_order_release);
+}
+
+static void
+i_reader(void *const context)
+{
+	i_pipeline_t *const pipeline = context;
+	for (brrsz i = 0; i < pipeline->n_tasks; ++i) {
+		i_item_t item = {.index = i};
+		const char *const path = pipeline->path(pipeline->context, i);
+		/* Whatever can't be read here is left for the task to fail on */
+		if (path && !lib_read_entire_file(path, &item.data, &item.size))
+			item.path = (char *)path;
+		i_push(&pipeline->reads, &item);
+	}
+	i_close(&pipeline->reads);
+}
+
+static void
+i_write(const i_item_t *const item)
+{
+	const brru8 start = timing_start(timing_stage_write);
+	if (uring_available() && !uring_write_file(item->path, item->data, item->size, 1, NULL)) {
+		timing_add(timing_stage_write, start, 0, item->size);
+		return;
+	}
+	FILE *file = fopen(item->path, "wb");
+	int failed = !file || item->size != fwrite(item->data, 1, item->size, file);
+	if (file && fclose(file))
+		failed = 1;
+	if (failed) {
+		BRRLOG_ERR("Failed to write output '%s' : %s", item->path, strerror(errno));
+		atomic_fetch_add(&s_failures, 1);
+	} else {
+		timing_add(timing_stage_write, start, 0, item->size);
+	}
+	if (item->data)
+		free(item->data);
+}
+static void
+i_writer(void *const context)
+{
+	i_pipeline_t *const pipeline = context;
+	i_item_t item;
+	while (i_pop(&pipeline->writes, &item)) {
+		i_write(&item);
+		free(item.path);
+	}
+}
+
+static int
+i_convert(void *const context, brrsz worker)
+{
+	i_pipeline_t *const pipeline = context;
+	i_item_t item;
+	int err = 0;
+	s_writes = pipeline->writer ? &pipeline->writes : NULL;
+	while (i_pop(&pipeline->reads, &item)) {
+		s_read = &item;
+		const int task_err = pipeline->task(pipeline->context, item.index);
+		s_read = NULL;
+		/* Not taken by the task */
+		if (item.data)
+			free(item.data);
+		if (task_err && !err)
+			err = task_err;
+	}
+	s_writes = NULL;
+	return err;
+}
+
+int
+pipeline_run(brrsz n_tasks, pool_task_t task, pipeline_path_t path, void *const context, brrsz depth, brru8 budget)
+{
+	const brrsz n_converters = pool_get_threads();
+	i_pipeline_t pipeline = {.task = task, .path = path, .context = context, .n_tasks = n_tasks};
+	pool_thread_t *reader = NULL, *writer = NULL;
+	if (!depth)
+		depth = n_converters * PIPELINE_DEPTH_PER_THREAD;
+	if (!budget)
+		budget = PIPELINE_BUDGET;
+
+	if (i_queue_init(&pipeline.reads, depth, budget) || i_queue_init(&pipeline.writes, depth, budget)
+	    || !(reader = pool_thread_start(i_reader, &pipeline))) {
+		i_queue_clear(&pipeline.reads);
+		i_queue_clear(&pipeline.writes);
+		return pool_run(n_tasks, task, context);
+	}
+	pipeline.writer = NULL != (writer = pool_thread_start(i_writer, &pipeline));
+
+	int err = pool_run(n_converters, i_convert, &pipeline);
+	/* The reader is done once every task has been taken, and the writer once everything queued is written */
+	pool_thread_join(reader);
+	i_close(&pipeline.writes);
+	pool_thread_join(writer);
+
+	i_queue_clear(&pipeline.reads);
+	i_queue_clear(&pipeline.writes);
+	return err;
+}
+
+int
+pipeline_take_read(const char *const path, void **const buffer, brrsz *const size)
+{
+	if (!s_read || !s_read->path || strcmp(s_read->path, path))
+		return -1;
+	/* Read outside the scope of the input it's for, which it's freed in */
+	memstat_scope_adopt(s_read->data);
+	*buffer = s_read->data;
+	*size = s_read->size;
+	s_read->data = NULL;
+	s_read->path = NULL;
+	return 0;
+}
+
+int
+pipeline_writing(void)
+{
+	return s_writes != NULL;
+}
+
+int
+pipeline_write(const char *const path, void *const data, brrsz size)
+{
+	if (!s_writes)
+		return I_GENERIC_ERROR;
+	const brrsz length = strlen(path);
+	i_item_t item = {.data = data, .size = size};
+	if (!(item.path = malloc(length + 1)))
+		return I_BUFFER_ERROR;
+	memcpy(item.path, path, length + 1);
+	i_push(s_writes, &item);
+	return I_SUCCESS;
+}
+
+brru8
+pipeline_failures(void)
+{
+	return atomic_load(&s_failures);
+}
@@ -0,0 +1,58 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <brrtools/brrtypes.h>
+
+#include "pool.h"
+
+/* Parallel runs go through three stages, so reading, converting and writing overlap instead of taking turns on each
+ * thread: a reader thread reads inputs whole ahead of the converters, the pool's threads convert them as usual, and a
+ * writer thread writes out the Oggs they produce.
+ * The stages are joined by bounded lock-free queues. A stage waits while the queue after it holds 'depth' items or
+ * more than 'budget' bytes (though one item is always let through, however large), and while the queue before it is
+ * empty.
+ * Converters get the files read ahead for them through 'lib_read_entire_file', and hand Oggs to the writer through
+ * 'lib_write_ogg_out', so nothing else changes for them. */
+
+#define PIPELINE_DEPTH_PER_THREAD 2
+#define PIPELINE_BUDGET (256 << 20)
+
+/* Returns the path of the file 'index' reads whole, for the reader to read ahead, or NULL if there isn't one. */
+typedef const char *(*pipeline_path_t)(void *const context, brrsz index);
+
+/* Runs 'task' for each of 'n_tasks' indices on the pool's threads, in order, with the reader and writer stages
+ * alongside; 'depth' 0 means PIPELINE_DEPTH_PER_THREAD per pool thread, 'budget' 0 means PIPELINE_BUDGET.
+ * Returns what 'pool_run' does; should the stages' threads fail to start, the tasks still run, only without them. */
+int pipeline_run(brrsz n_tasks, pool_task_t task, pipeline_path_t path, void *const context, brrsz depth, brru8 budget);
+
+/* If the reader read 'path' ahead for the running task, hands its contents over to be freed by the caller.
+ * Returns 0 if it did, or -1 if 'path' has to be read as usual. */
+int pipeline_take_read(const char *const path, void **const buffer, brrsz *const size);
+/* Returns non-zero if this thread is a converter of a pipeline with a writer. */
+int pipeline_writing(void);
+/* Queues 'size' bytes of 'data' for the writer to write to a new file at 'path', which is copied; the writer frees
+ * 'data' once it's done with it, and logs and counts a failure to write it.
+ * Returns 0 if it was queued, I_GENERIC_ERROR if this thread isn't a converter of a pipeline with a writer, or
+ * I_BUFFER_ERROR; 'data' is then left to the caller. */
+int pipeline_write(const char *const path, void *const data, brrsz size);
+
+/* Returns how many writes by the writer have failed so far. */
+brru8 pipeline_failures(void);
+
+#endif /* PIPELINE_H */
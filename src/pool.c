@@ -0,0 +1,258 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "pool.h"
+
+#include <stdlib.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+#include "memstat.h"
+#include "trace.h"
+#include "uring.h"
+
+#define POOL_MAX_THREADS 256
+
+static int s_threads = 0;
+/* Whether this thread is running a task of a pool with other threads; any pool it runs then runs inline */
+static _Thread_local int s_in_pool = 0;
+
+typedef struct i_pool {
+#if defined(_WIN32)
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+	pool_task_t task;
+	void *context;
+	memstat_thread_t memstat; /* Of the thread that ran the pool, for workers to count against too */
+	brrsz next;
+	brrsz n_tasks;
+	int err;
+} i_pool_t;
+
+#if defined(_WIN32)
+# define i_lock(_p_) EnterCriticalSection(&(_p_)->lock)
+# define i_unlock(_p_) LeaveCriticalSection(&(_p_)->lock)
+#else
+# define i_lock(_p_) pthread_mutex_lock(&(_p_)->lock)
+# define i_unlock(_p_) pthread_mutex_unlock(&(_p_)->lock)
+#endif
+
+void
+pool_set_threads(int threads)
+{
+	s_threads = threads < 0 ? 0 : threads;
+}
+/* Returns how many threads 'threads' means, 0 being one per online processor */
+static int
+i_threads(long threads)
+{
+	if (s_in_pool)
+		return 1;
+	if (!threads) {
+#if defined(_WIN32)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threads = info.dwNumberOfProcessors;
+#else
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (threads < 1)
+		threads = 1;
+	else if (threads > POOL_MAX_THREADS)
+		threads = POOL_MAX_THREADS;
+	return threads;
+}
+int
+pool_get_threads(void)
+{
+	return i_threads(s_threads);
+}
+
+static void
+i_work(i_pool_t *const pool)
+{
+	memstat_thread_set(pool->memstat);
+	for (;;) {
+		brrsz task;
+		int err;
+		i_lock(pool);
+		if (pool->err || pool->next >= pool->n_tasks) {
+			i_unlock(pool);
+			return;
+		}
+		task = pool->next++;
+		i_unlock(pool);
+
+		s_in_pool = 1;
+		err = pool->task(pool->context, task);
+		s_in_pool = 0;
+		if (err) {
+			i_lock(pool);
+			if (!pool->err)
+				pool->err = err;
+			i_unlock(pool);
+		}
+	}
+}
+#if defined(_WIN32)
+static DWORD WINAPI
+i_worker(LPVOID pool)
+{
+	i_work(pool);
+	trace_release_thread();
+	uring_release_thread();
+	return 0;
+}
+#else
+static void *
+i_worker(void *pool)
+{
+	i_work(pool);
+	trace_release_thread();
+	uring_release_thread();
+	return NULL;
+}
+#endif
+
+int
+pool_run(brrsz n_tasks, pool_task_t task, void *const context)
+{
+	return pool_run_threads(0, n_tasks, task, context);
+}
+int
+pool_run_threads(int threads, brrsz n_tasks, pool_task_t task, void *const context)
+{
+	i_pool_t pool = {.task = task, .context = context, .memstat = memstat_thread_get(), .n_tasks = n_tasks};
+	brrsz n_workers = i_threads(threads > 0 ? threads : s_threads) - 1;
+	if (!n_tasks)
+		return 0;
+	if (n_workers > n_tasks - 1)
+		n_workers = n_tasks - 1;
+
+	if (!n_workers) {
+		for (brrsz i = 0; i < n_tasks; ++i) {
+			int err;
+			if ((err = task(context, i)))
+				return err;
+		}
+		return 0;
+	}
+
+#if defined(_WIN32)
+	HANDLE workers[POOL_MAX_THREADS];
+	InitializeCriticalSection(&pool.lock);
+#else
+	pthread_t workers[POOL_MAX_THREADS];
+	pthread_mutex_init(&pool.lock, NULL);
+#endif
+	brrsz started = 0;
+	/* Failing to start a thread isn't an error; the remaining threads just take on its share */
+	for (; started < n_workers; ++started) {
+#if defined(_WIN32)
+		if (!(workers[started] = CreateThread(NULL, 0, i_worker, &pool, 0, NULL)))
+			break;
+#else
+		if (pthread_create(&workers[started], NULL, i_worker, &pool))
+			break;
+#endif
+	}
+	i_work(&pool);
+	for (brrsz i = 0; i < started; ++i) {
+#if defined(_WIN32)
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+#else
+		pthread_join(workers[i], NULL);
+#endif
+	}
+#if defined(_WIN32)
+	DeleteCriticalSection(&pool.lock);
+#else
+	pthread_mutex_destroy(&pool.lock);
+#endif
+	return pool.err;
+}
+
+struct pool_thread {
+#if defined(_WIN32)
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+	void (*run)(void *const context);
+	void *context;
+	memstat_thread_t memstat;
+};
+
+#if defined(_WIN32)
+static DWORD WINAPI
+i_thread(LPVOID thread)
+#else
+static void *
+i_thread(void *thread)
+#endif
+{
+	pool_thread_t *const t = thread;
+	memstat_thread_set(t->memstat);
+	t->run(t->context);
+	trace_release_thread();
+	uring_release_thread();
+#if defined(_WIN32)
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+pool_thread_t *
+pool_thread_start(void (*run)(void *const context), void *const context)
+{
+	pool_thread_t *thread = malloc(sizeof(*thread));
+	if (!thread)
+		return NULL;
+	*thread = (pool_thread_t){.run = run, .context = context, .memstat = memstat_thread_get()};
+#if defined(_WIN32)
+	if (!(thread->handle = CreateThread(NULL, 0, i_thread, thread, 0, NULL))) {
+#else
+	if (pthread_create(&thread->handle, NULL, i_thread, thread)) {
+#endif
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+void
+pool_thread_join(pool_thread_t *const thread)
+{
+	if (!thread)
+		return;
+#if defined(_WIN32)
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+#else
+	pthread_join(thread->handle, NULL);
+#endif
+	free(thread);
+}
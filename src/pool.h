@@ -0,0 +1,51 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <brrtools/brrtypes.h>
+
+/* A minimal parallel-for: tasks are handed out one at a time to a set of threads, the calling thread included, so
+ * a single task runs inline without any threads being started.
+ * Pools run from within the tasks of a pool with more than one thread run inline too, since every thread is already
+ * busy. */
+
+/* Returns non-zero if task 'task' failed; the first failure is returned by 'pool_run'. */
+typedef int (*pool_task_t)(void *const context, brrsz task);
+
+/* Sets how many threads 'pool_run' may use; 0 (the default) means one per online processor. */
+void pool_set_threads(int threads);
+/* Returns how many threads 'pool_run' would use, at least 1, and exactly 1 within a task of a parallel pool. */
+int pool_get_threads(void);
+
+/* Runs 'task' for each of 'n_tasks' task indices and waits for all of them to finish.
+ * Once a task fails, no new tasks are started.
+ * Returns 0 if all tasks succeeded, or the result of the first one to fail.
+ * */
+int pool_run(brrsz n_tasks, pool_task_t task, void *const context);
+/* As 'pool_run', but on 'threads' threads, for work done before 'pool_set_threads' is; 0 uses as many as 'pool_run'. */
+int pool_run_threads(int threads, brrsz n_tasks, pool_task_t task, void *const context);
+
+/* A thread of its own, for work that has to go on alongside a pool rather than wait its turn as one of its tasks. */
+typedef struct pool_thread pool_thread_t;
+/* Starts 'run' on a new thread, which counts its allocations as the calling thread does (see memstat.h).
+ * Returns NULL if it couldn't be started. */
+pool_thread_t *pool_thread_start(void (*run)(void *const context), void *const context);
+/* Waits for 'thread' to return from its function, and frees it. */
+void pool_thread_join(pool_thread_t *const thread);
+
+#endif /* POOL_H */
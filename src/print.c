@@ -1,10 +1,20 @@
 #include "print.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <brrtools/brrnum.h>
 
+#include "errors.h"
+#include "lib.h"
+#include "memstat.h"
+#include "pipeline.h"
+#include "shard.h"
+#include "timing.h"
+#include "uring.h"
+
 #define USAGE "Usage: NAeP [[OPTION ...] FILE ...] ..." \
 "\nNAeP - NieR:Automated extraction Precept_v"Ne_version"" \
 "\nCompiled on "__DATE__", " __TIME__"\n"
@@ -19,6 +29,10 @@
 "\n        -W, -wsp, -wisp . . . . . . . . . .  File(s) are collections of WwRIFFs to be extracted/converted." \
 "\n        -b, -bnk, -bank . . . . . . . . . .  The same as '-wsp'." \
 "\n        -o, -ogg  . . . . . . . . . . . . .  File(s) are Ogg files to be regranularizeed." \
+"\n    Input Lists:" \
+"\n        -files-from . . . . . . . . . . . .  Take inputs from the following file of paths, one per line or" \
+"\n                                             NUL-separated; '-' reads them from stdin." \
+"\n        -R, -recursive  . . . . . . . . . .  Take every WwRIFF/WSP/BNK in the following directory tree." \
 "\n    OGG Processing Options:" \
 "\n        -ri, -rgrn-inplace, -rvb-inplace. .  Oggs are regranularized in-place." \
 "\n    WEM Processing Options:" \
@@ -27,22 +41,57 @@
 "\n                                             WwRIFFs following." \
 "\n                                             If no coedbooks are specified for a WwRIFF, then it is assumed" \
 "\n                                             the codebooks are inline." \
+"\n                                             '@aotuv' and '@vanilla' name the built-in libraries, if the" \
+"\n                                             program was built with them ('builtin_codebooks=1')." \
 "\n        -inline . . . . . . . . . . . . . .  The following WwRIFFs have inline codebooks." \
 "\n        -stripped . . . . . . . . . . . . .  The following WwRIFFs' are stripped and must be rebuilt from" \
 "\n                                             a codebook library." \
+"\n        -cba, -codebooks-auto . . . . . . .  Toggle detecting the codebooks of each WwRIFF, trying inline," \
+"\n                                             stripped, and every '-cbl' library given." \
 "\n    WSP/BNK Processing Options:" \
 "\n        -w2o, -wem2ogg  . . . . . . . . . .  Convert WwRIFFs from '-wsp' files to Oggs, rather than extracting them." \
+"\n        -w2ow, -wem2ogg-keep  . . . . . . .  When converting with '-w2o', also extract the WwRIFFs in the same pass." \
 "\n        -white, -weiss," \
-"\n        -black, -noir . . . . . . . . . . .  Comma-separated list of indices used to determine" \
-"\n                                             what indices to process from the file(s)." \
+"\n        -black, -noir . . . . . . . . . . .  Comma-separated list of indices or index ranges ('100-5000')" \
+"\n                                             used to determine what indices to process from the file(s)." \
 "\n                                             Blacklists and whitelists are mutually exclusive; each " \
 "\n                                             overrides the others preceding it." \
 "\n                                             E.g. '-black 3,9' would process every index except 3 and 9," \
 "\n                                             but  '-white 3,9' would process only indices 3 and 9." \
 "\n        -rubrum . . . . . . . . . . . . . .  Toggle the list to between being a whitelist/blacklist." \
+"\n        -where, -filter . . . . . . . . . .  Only process WwRIFFs whose headers match the following expression," \
+"\n                                             e.g. 'channels>=2 && duration>30s || rate==48000'." \
+"\n                                             Fields are index, format (vorbis/pcm), channels, rate, samples," \
+"\n                                             duration (ms/s/m/h) and size (k/M/G); '&&' binds tighter than '||'." \
+
+/* Split from HELP to stay under the string length C compilers are required to support */
+#define HELP_MISC \
 "\n    Miscellaneous options:" \
 "\n        -!  . . . . . . . . . . . . . . . .  The following argument is a file path, not an option." \
 "\n        --  . . . . . . . . . . . . . . . .  All following arguments are file paths, not options." \
+"\n        -j, -threads  . . . . . . . . . .  Number of threads used to convert a single large file; 0, the" \
+"\n                                             default, uses one per processor." \
+"\n        -serve (g)  . . . . . . . . . . . .  Serve conversion jobs on the following Unix socket path until" \
+"\n                                             interrupted, keeping codebook libraries loaded between jobs." \
+"\n        -client . . . . . . . . . . . . . .  Must be first; submit the arguments after the following socket" \
+"\n                                             path as one job to a server, and print its status." \
+"\n        -watch  . . . . . . . . . . . . . .  Watch the following directory tree until interrupted, processing" \
+"\n                                             each WwRIFF/WSP/BNK written to it with the current options." \
+"\n        -lines (g)  . . . . . . . . . . . .  Process inputs in parallel, logging one line for each." \
+"\n        -summary (g)  . . . . . . . . . . .  Process inputs in parallel, logging only the final report." \
+"\n        -flush (g)  . . . . . . . . . . . .  When to flush log output: 'always' (default), 'line' or 'end'." \
+"\n        -trace (g)  . . . . . . . . . . . .  Write a Chrome/Perfetto trace of every input, entry and stage to" \
+"\n                                             the following path." \
+"\n        -queue (g)  . . . . . . . . . . . .  With -lines/-summary, how many inputs are read ahead and outputs" \
+"\n                                             wait to be written; 0 reads and writes on the converting threads." \
+"\n        -queue-memory (g) . . . . . . . . .  Most bytes read ahead, and waiting to be written, each (k/M/G)." \
+"\n        -schedule (g) . . . . . . . . . . .  Order -lines/-summary start inputs in: 'size' (largest first," \
+"\n                                             default), 'disk' (as stored on disk) or 'order' (as given)." \
+"\n        -mem-limit (g)  . . . . . . . . . .  Start an input only once what it's expected to hold in memory fits" \
+"\n                                             in the following size (k/M/G), alongside those running already." \
+"\n        -shard (g)  . . . . . . . . . . . .  Process only the inputs and archive entries of shard 'i/N'." \
+"\n        -report-file (g)  . . . . . . . . .  Write the report's counts to the following path as JSON." \
+"\n        -merge-reports (g)  . . . . . . . .  Inputs are report files, added up into one report." \
 "\n        -d, -debug  . . . . . . . . . . . .  Enable debug output, irrespective of quiet settings." \
 "\n        -co, -comments  . . . . . . . . . .  Toggles inserting of additional comments in output Oggs." \
 "\n        -c, -color  . . . . . . . . . . . .  Toggle color logging." \
@@ -54,6 +103,8 @@
 "\n        -Q, -qq, -too-quiet . . . . . . . .  Suppress all output, including anything critical." \
 "\n        -n, -dry, -dry-run  . . . . . . . .  Don't actually do anything, just log what would happen." \
 "\n        -reset (g)  . . . . . . . . . . . .  Argument options reset to default values after each file passed." \
+"\n        -probe (g)  . . . . . . . . . . . .  Don't process anything; print the header metadata of every input" \
+"\n                                             and every archive entry to stdout as one JSON object per line." \
 
 int /* Returns non-void so that 'return print_usage()' is valid */
 print_usage(void)
@@ -65,14 +116,120 @@ print_usage(void)
 int /* Returns non-void so that 'return print_help()' is valid */
 print_help(void)
 {
-	fprintf(stdout, USAGE"\n"HELP"\n");
+	fprintf(stdout, USAGE"\n"HELP);
+	fprintf(stdout, HELP_MISC"\n");
 	exit(0);
 	return 0;
 }
+static void
+i_format_duration(char *const out, brrsz size, brru8 ns)
+{
+	if (ns < 1000)
+		snprintf(out, size, "%lluns", (unsigned long long)ns);
+	else if (ns < 1000000)
+		snprintf(out, size, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(out, size, "%.1fms", ns / 1e6);
+	else
+		snprintf(out, size, "%.2fs", ns / 1e9);
+}
+static void
+i_format_bytes(char *const out, brrsz size, brru8 bytes)
+{
+	if (bytes < 1024)
+		snprintf(out, size, "%lluB", (unsigned long long)bytes);
+	else if (bytes < 1024 * 1024)
+		snprintf(out, size, "%.1fKiB", bytes / 1024.0);
+	else if (bytes < 1024 * 1024 * 1024)
+		snprintf(out, size, "%.1fMiB", bytes / (1024.0 * 1024));
+	else
+		snprintf(out, size, "%.2fGiB", bytes / (1024.0 * 1024 * 1024));
+}
+
+/* Throughput is of whichever of input or output the stage is about, over the time spent in it summed across threads,
+ * so it's per thread, not wall-clock. */
+static void
+i_print_stages(void)
+{
+	int header = 0;
+	for (int i = 0; i < timing_stage_count; ++i) {
+		timing_summary_t summary;
+		char total[16], p50[16], p90[16], p99[16], max[16], in[16], out[16];
+		timing_get(i, &summary);
+		if (!summary.count)
+			continue;
+		if (!header) {
+			BRRLOG_NOR("    %-8s %8s %9s %9s %9s %9s %9s %10s %10s %9s",
+			    "Stage", "Runs", "Total", "p50", "p90", "p99", "Max", "In", "Out", "MB/s");
+			header = 1;
+		}
+		i_format_duration(total, sizeof(total), summary.total);
+		i_format_duration(p50, sizeof(p50), summary.p50);
+		i_format_duration(p90, sizeof(p90), summary.p90);
+		i_format_duration(p99, sizeof(p99), summary.p99);
+		i_format_duration(max, sizeof(max), summary.max);
+		i_format_bytes(in, sizeof(in), summary.bytes_in);
+		i_format_bytes(out, sizeof(out), summary.bytes_out);
+		const brru8 bytes = summary.bytes_in ? summary.bytes_in : summary.bytes_out;
+		const double rate = summary.total ? bytes / 1e6 / (summary.total / 1e9) : 0;
+		BRRLOG_NOR("    %-8s %8llu %9s %9s %9s %9s %9s %10s %10s %9.1f", timing_stage_names[i],
+		    (unsigned long long)summary.count, total, p50, p90, p99, max, in, out, rate);
+	}
+}
+
+/* Only when built with 'memstats' */
+static void
+i_print_memory(int full)
+{
+	memstat_usage_t usage;
+	char peak[16], bytes[16], live[16];
+	memstat_total(&usage);
+	i_format_bytes(peak, sizeof(peak), usage.peak);
+	i_format_bytes(bytes, sizeof(bytes), usage.bytes);
+	i_format_bytes(live, sizeof(live), usage.live > 0 ? usage.live : 0);
+	BRRLOG_NOR("Peak memory %s; %llu allocations of %s in total, %s still allocated",
+	    peak, (unsigned long long)usage.allocations, bytes, live);
+	if (!full)
+		return;
+
+	int header = 0;
+	for (int i = 0; i < timing_stage_count; ++i) {
+		memstat_stage(i, &usage);
+		if (!usage.allocations)
+			continue;
+		if (!header) {
+			BRRLOG_NOR("    %-8s %11s %10s %10s", "Stage", "Allocs", "Allocated", "Peak");
+			header = 1;
+		}
+		i_format_bytes(peak, sizeof(peak), usage.peak);
+		i_format_bytes(bytes, sizeof(bytes), usage.bytes);
+		BRRLOG_NOR("    %-8s %11llu %10s %10s", timing_stage_names[i], (unsigned long long)usage.allocations, bytes, peak);
+	}
+
+	memstat_input_t inputs[MEMSTAT_TOP_INPUTS];
+	const brrsz n_inputs = memstat_top_inputs(inputs);
+	if (n_inputs)
+		BRRLOG_NOR("    %-8s %11s %10s %10s  %s", "Input", "Allocs", "Allocated", "Peak", "Path");
+	for (brrsz i = 0; i < n_inputs; ++i) {
+		i_format_bytes(peak, sizeof(peak), inputs[i].usage.peak);
+		i_format_bytes(bytes, sizeof(bytes), inputs[i].usage.bytes);
+		BRRLOG_NOR("    %-8zu %11llu %10s %10s  %s", i + 1, (unsigned long long)inputs[i].usage.allocations,
+		    bytes, peak, inputs[i].path);
+	}
+}
+
+/* Merged reports count the inputs they were written for, and sharded runs only those of their shard */
+static inline brrsz
+i_report_n_inputs(const nestate_t *const state)
+{
+	return state->settings.merge_reports ? state->stats.n_reported_inputs : shard_n_inputs(state);
+}
+
 int
 print_report(const nestate_t *const state)
 {
-	brrsz input_count_digits = 1 + brrnum_ndigits(state->n_inputs, 10, 0);
+	const brrsz n_inputs = i_report_n_inputs(state);
+	brrsz input_count_digits = 1 + brrnum_ndigits(n_inputs, 10, 0);
 	brrsz total_success =
 	      state->stats.oggs.succeeded
 	    + state->stats.wems.succeeded
@@ -85,8 +242,12 @@ print_report(const nestate_t *const state)
 	    + state->stats.bnks.failed;
 	BRRLOG_NORN("Successfully processed a total of ");
 	BRRLOG_FORENP(LOG_COLOR_INFO, "%*i / %*i",
-	    input_count_digits, total_success, input_count_digits, state->n_inputs);
+	    input_count_digits, total_success, input_count_digits, n_inputs);
 	BRRLOG_NORP(" inputs");
+	/* Outputs written by the pipeline's writer or through io_uring fail after what queued them has counted them */
+	const brru8 write_failures = state->stats.write_failures + pipeline_failures() + uring_failures();
+	if (write_failures)
+		BRRLOG_ERR("%llu outputs failed to be written", (unsigned long long)write_failures);
 	if (state->settings.full_report) {
 		if (state->stats.oggs.assigned) {
 			BRRLOG_NORN("    ");
@@ -124,6 +285,152 @@ print_report(const nestate_t *const state)
 				input_count_digits, state->stats.wem_converts.succeeded, input_count_digits, state->stats.wem_converts.assigned);
 			BRRLOG_MESSAGETP(gbrrlog_level(last), LOG_FORMAT_OGG, " Auto-converted WEMs");
 		}
+		i_print_stages();
+	}
+	if (memstat_enabled())
+		i_print_memory(state->settings.full_report);
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	brrsz offset;
+} i_report_counts[] = {
+	{"oggs",         offsetof(nestate_stats_t, oggs)},
+	{"wems",         offsetof(nestate_stats_t, wems)},
+	{"wsps",         offsetof(nestate_stats_t, wsps)},
+	{"bnks",         offsetof(nestate_stats_t, bnks)},
+	{"wem_extracts", offsetof(nestate_stats_t, wem_extracts)},
+	{"wem_converts", offsetof(nestate_stats_t, wem_converts)},
+};
+#define I_N_REPORT_COUNTS (sizeof(i_report_counts) / sizeof(*i_report_counts))
+#define I_REPORT_VERSION 1
+/* Shards past this are merged all the same, only not checked for */
+#define I_MAX_CHECKED_SHARDS 0x10000
+
+int
+print_report_file(const nestate_t *const state, const char *const path)
+{
+	int err = I_SUCCESS;
+	FILE *out = NULL;
+	if (!(out = fopen(path, "w")))
+		return I_IO_ERROR;
+	fprintf(out, "{\"report\":%d,\"shard\":%lu,\"shards\":%lu,\"inputs\":%zu,\"write_failures\":%llu",
+	    I_REPORT_VERSION, (unsigned long)state->shard_index + 1, (unsigned long)(state->n_shards ? state->n_shards : 1),
+	    i_report_n_inputs(state),
+	    (unsigned long long)(state->stats.write_failures + pipeline_failures() + uring_failures()));
+	for (brrsz i = 0; i < I_N_REPORT_COUNTS; ++i) {
+		const nestate_stat_t *const stat = (const nestate_stat_t *)((const char *)&state->stats + i_report_counts[i].offset);
+		fprintf(out, ",\"%s\":[%zu,%zu,%zu]", i_report_counts[i].name, stat->assigned, stat->succeeded, stat->failed);
 	}
+	fputs("}\n", out);
+	if (ferror(out))
+		err = I_IO_ERROR;
+	if (fclose(out))
+		err = I_IO_ERROR;
+	return err;
+}
+
+/* Reads 'n' numbers following '"key":' in 'report', as a single number if 'n' is 1 and as an array otherwise.
+ * Returns 0 on success, or -1 if the key is missing or malformed. */
+static int
+i_read_report_numbers(const char *const report, const char *const key, brru8 *const numbers, brrsz n)
+{
+	char quoted[32];
+	snprintf(quoted, sizeof(quoted), "\"%s\":", key);
+	const char *at = strstr(report, quoted);
+	if (!at)
+		return -1;
+	at += strlen(quoted);
+	if (n > 1 && *at++ != '[')
+		return -1;
+	for (brrsz i = 0; i < n; ++i) {
+		char *end = NULL;
+		if (i && *at++ != ',')
+			return -1;
+		if (*at < '0' || *at > '9')
+			return -1;
+		numbers[i] = strtoull(at, &end, 10);
+		at = end;
+	}
+	if (n > 1 && *at != ']')
+		return -1;
 	return 0;
 }
+
+static int
+i_merge_report(nestate_t *const state, const char *const path, unsigned char *const seen, brru8 *const n_shards)
+{
+	char *report = NULL;
+	brrsz size = 0;
+	brru8 version = 0, shard = 0, shards = 0, inputs = 0, write_failures = 0;
+	nestate_stats_t stats = {0};
+	int err = 0;
+	if ((err = lib_read_entire_file(path, (void **)&report, &size)))
+		return err;
+	/* Made a string, replacing whatever came last; a report always ends in a newline */
+	if (size)
+		report[size - 1] = 0;
+	if (!size || i_read_report_numbers(report, "report", &version, 1) || version != I_REPORT_VERSION
+	    || i_read_report_numbers(report, "shard", &shard, 1) || i_read_report_numbers(report, "shards", &shards, 1)
+	    || i_read_report_numbers(report, "inputs", &inputs, 1)
+	    || i_read_report_numbers(report, "write_failures", &write_failures, 1)
+	    || !shards || !shard || shard > shards) {
+		free(report);
+		return I_UNRECOGNIZED_DATA;
+	}
+	for (brrsz i = 0; i < I_N_REPORT_COUNTS; ++i) {
+		brru8 counts[3];
+		if (i_read_report_numbers(report, i_report_counts[i].name, counts, 3)) {
+			free(report);
+			return I_UNRECOGNIZED_DATA;
+		}
+		nestate_stat_t *const stat = (nestate_stat_t *)((char *)&stats + i_report_counts[i].offset);
+		*stat = (nestate_stat_t){counts[0], counts[1], counts[2]};
+	}
+	free(report);
+
+	/* Counts of a run split another way would overlap the others, so they're refused before any are merged */
+	if (!*n_shards) {
+		*n_shards = shards;
+	} else if (*n_shards != shards) {
+		BRRLOG_ERR("Report '%s' is of shard %llu of %llu, not of %llu shards", path,
+		    (unsigned long long)shard, (unsigned long long)shards, (unsigned long long)*n_shards);
+		return I_GENERIC_ERROR;
+	}
+	stats.n_reported_inputs = inputs;
+	stats.write_failures = write_failures;
+	nestate_stats_add(&state->stats, &stats);
+	if (shard <= I_MAX_CHECKED_SHARDS) {
+		if (seen[shard - 1])
+			BRRLOG_WARN("Shard %llu of %llu is reported more than once", (unsigned long long)shard,
+			    (unsigned long long)shards);
+		seen[shard - 1] = 1;
+	}
+	return I_SUCCESS;
+}
+
+int
+print_merge_reports(nestate_t *const state)
+{
+	unsigned char *seen = NULL;
+	brru8 n_shards = 0;
+	int err = 0;
+	if (!(seen = calloc(I_MAX_CHECKED_SHARDS, 1)))
+		return I_BUFFER_ERROR;
+	for (brrsz i = 0; i < state->n_inputs; ++i) {
+		const char *const path = state->inputs[i].path;
+		if ((err = i_merge_report(state, path, seen, &n_shards))) {
+			/* Generic errors are reported where they happen */
+			if (err != I_GENERIC_ERROR)
+				BRRLOG_ERR("Failed to merge report '%s' : %s", path, lib_strerr(err));
+			break;
+		}
+	}
+	for (brru8 i = 0; !err && i < n_shards && i < I_MAX_CHECKED_SHARDS; ++i) {
+		if (!seen[i])
+			BRRLOG_WARN("Shard %llu of %llu has no report", (unsigned long long)i + 1, (unsigned long long)n_shards);
+	}
+	free(seen);
+	return err;
+}
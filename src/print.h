@@ -121,6 +121,13 @@
 int print_usage(void);
 int print_help(void);
 int print_report(const nestate_t *const state);
+/* Writes the counts of the report of 'state' to 'path' as one JSON object, for '-merge-reports'.
+ * Returns 0 on success, or I_IO_ERROR. */
+int print_report_file(const nestate_t *const state, const char *const path);
+/* Adds the counts of every report file given as an input of 'state' to its stats, warning of any shard missing or
+ * reported more than once.
+ * Returns 0 on success, or the error of the first report that couldn't be read, which is logged. */
+int print_merge_reports(nestate_t *const state);
 
 #if defined(Ne_extra_debug)
 # define NeExtraPrint(_type_, ...) BRRLOG_##_type_(__VA_ARGS__)
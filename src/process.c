@@ -18,48 +18,67 @@ limitations under the License.
 
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <brrtools/brrlog.h>
 #include <brrtools/brrpath.h>
 
+#include "codebook_library.h"
 #include "lib.h"
 #include "errors.h"
+#include "logger.h"
+#include "memlimit.h"
+#include "memstat.h"
+#include "pipeline.h"
+#include "pool.h"
 #include "print.h"
+#include "schedule.h"
+#include "shard.h"
+#include "timing.h"
+#include "trace.h"
+#include "uring.h"
+#include "usdt.h"
 
 static inline void
 i_set_log_state(const nestate_t *const state, const neinput_t *const input)
 {
 	if (state->settings.log_style_enabled)
 		gbrrlogctl.style_disabled = !input->flag.log_color_enabled;
-#if defined(Ne_debug)
-	gbrrlogctl.debug_enabled = 1;
-	brrlog_set_max_priority(brrlog_priority_debug);
-#else
-	gbrrlogctl.debug_enabled = input->flag.log_debug;
-	brrlog_set_max_priority(input->log_priority);
-#endif
+	lib_set_log_priority(input);
 }
-static inline int
-i_check_input(const neinput_t *const input)
+/* Returns why 'input' can't be processed, or NULL if it can; 'unstatable' is set if it couldn't even be stat'ed */
+static inline const char *
+i_input_problem(const neinput_t *const input, int *const unstatable)
 {
 	brrpath_stat_result_t stat;
 	brrstringr_t path_str = brrstringr_cast(input->path);
+	*unstatable = 0;
 	if (brrpath_stat(&stat, &path_str)) {
-		BRRLOG_ERR("Failed to stat input path '%s' : %s", input->path, strerror(errno));
-		return 1;
+		*unstatable = 1;
+		return strerror(errno);
 	} else if (!stat.exists) {
-		BRRLOG_WARN("Cannot parse input '");
-		LOG_FORMAT(LOG_PARAMS_PATH, "%s", input->path);
-		BRRLOG_WAR("' : Path does not exist");
-		return 1;
+		return "Path does not exist";
 	} else if (stat.type != brrpath_type_file) {
+		return "Path is not a regular file";
+	}
+	return NULL;
+}
+static inline int
+i_check_input(const neinput_t *const input)
+{
+	int unstatable = 0;
+	const char *const problem = i_input_problem(input, &unstatable);
+	if (!problem)
+		return 0;
+	if (unstatable) {
+		BRRLOG_ERR("Failed to stat input path '%s' : %s", input->path, problem);
+	} else {
 		BRRLOG_WARN("Cannot parse input '");
 		LOG_FORMAT(LOG_PARAMS_PATH, "%s", input->path);
-		BRRLOG_WAR("' : Path is not a regular file");
-		return 1;
+		BRRLOG_WAR("' : %s", problem);
 	}
-	return 0;
+	return 1;
 }
 static inline int
 i_determine_input_type(neinput_t *const input)
@@ -97,6 +116,41 @@ i_determine_input_type(neinput_t *const input)
 	return 0;
 }
 
+static const char *const i_type_names[] = {"auto", "ogg", "wem", "wsp", "bnk"};
+
+static inline int
+i_dispatch(nestate_t *const state, const neinput_t *const input)
+{
+	const brru8 start = timing_now();
+	memstat_scope_t memory;
+	int err = 0;
+	/* Every shard goes through an archive for its share of the entries, but only the one it falls to counts it */
+	const int archive = input->type == neinput_type_wsp || input->type == neinput_type_bnk;
+	const int owned = shard_owns(state, input->path, SHARD_WHOLE);
+	const nestate_stat_t wsps = state->stats.wsps, bnks = state->stats.bnks;
+	if (!owned && !archive) {
+		LOG_FORMAT(LOG_PARAMS_INFO, "In another shard\n");
+		return I_SUCCESS;
+	}
+	memstat_scope_begin(&memory);
+	USDT_PROBE2(input__start, input->path, (int)input->type);
+	switch (input->type) {
+		case neinput_type_ogg: err = neregrain_ogg(state, input); break;
+		case neinput_type_wem: err = neconvert_wem(state, input); break;
+		case neinput_type_wsp: err = neextract_wsp(state, input); break;
+		case neinput_type_bnk: err = neextract_bnk(state, input); break;
+		default: err = I_UNRECOGNIZED_DATA; break;
+	}
+	if (!owned) {
+		state->stats.wsps = wsps;
+		state->stats.bnks = bnks;
+	}
+	memstat_scope_end(&memory, input->path);
+	USDT_PROBE3(input__end, input->path, (int)input->type, err);
+	trace_add(i_type_names[input->type], "input", input->path, start, -1, 0, 0, err);
+	return err;
+}
+
 static inline int
 i_process_input(nestate_t *const state, neinput_t *const input, brrsz idx)
 {
@@ -117,17 +171,236 @@ i_process_input(nestate_t *const state, neinput_t *const input, brrsz idx)
 		BRRLOG_ERR("Failed to determine data type : %s", lib_strerr(err));
 		return err;
 	}
-	switch (input->type) {
-		case neinput_type_ogg: return neregrain_ogg(state, input);
-		case neinput_type_wem: return neconvert_wem(state, input);
-		case neinput_type_wsp: return neextract_wsp(state, input);
-		case neinput_type_bnk: return neextract_bnk(state, input);
-		default: return I_UNRECOGNIZED_DATA;
+	return i_dispatch(state, input);
+}
+
+/* Streamed inputs hold no more than about this much at a time */
+#define I_STREAMED_FOOTPRINT (1 << 20)
+
+/* Estimates the most memory processing 'input' holds at once, setting 'streamed' if it isn't read whole: an input read
+ * whole to be converted is held along with a copy of its data and the output built from it, each taken to be about
+ * its size, while an archive that's only extracted is held alone, since its entries are copied straight to their
+ * files. */
+static brru8
+i_footprint(const nestate_t *const state, const neinput_t *const input, int *const streamed)
+{
+	/* Typed on a copy, since the input's own task may be typing it at the same time */
+	neinput_t typed = *input;
+	brrpath_stat_result_t stat;
+	brrstringr_t path_str = brrstringr_cast(input->path);
+	*streamed = 0;
+	if (input->flag.dry_run || brrpath_stat(&stat, &path_str) || !stat.exists || stat.type != brrpath_type_file)
+		return 0;
+	if (typed.type == neinput_type_auto && i_determine_input_type(&typed))
+		return 0; /* Fails before reading it */
+	if (typed.type != neinput_type_wsp && typed.type != neinput_type_bnk
+	    && !shard_owns(state, input->path, SHARD_WHOLE))
+		return 0; /* Skipped by this shard */
+	if (typed.type == neinput_type_ogg || (typed.type == neinput_type_wem && neconvert_wem_streams(&typed))) {
+		*streamed = 1;
+		return I_STREAMED_FOOTPRINT;
 	}
+	if ((typed.type == neinput_type_wsp || typed.type == neinput_type_bnk) && !typed.flag.auto_ogg)
+		return stat.size;
+	return 3 * (brru8)stat.size;
 }
 
-int
-neprocess_inputs(nestate_t *const state)
+/* Inputs processed in parallel each get a state of their own, so nothing is shared between them but the libraries */
+typedef struct i_parallel {
+	nestate_t *state;
+	nestate_stats_t *stats; /* One per input, added up once all of them are done */
+	brrsz *order;           /* The input each task processes */
+	struct i_admission {
+		brru8 reserved;
+		int admitted;
+		int streamed;
+	} *admissions;          /* Of each task under '-mem-limit'; NULL without one */
+} i_parallel_t;
+
+/* Reserves the footprint of the input of 'task', waiting for it to fit under the memory limit. */
+static void
+i_admit(i_parallel_t *const parallel, brrsz task)
+{
+	struct i_admission *const admission = &parallel->admissions[task];
+	const neinput_t *const input = &parallel->state->inputs[parallel->order[task]];
+	admission->reserved = memlimit_reserve(i_footprint(parallel->state, input, &admission->streamed));
+	admission->admitted = 1;
+}
+
+/* Processes 'input', input 'idx' of 'state', with its stats going to 'stats'; logging is silenced by the caller, so
+ * all that's logged is a line about it, added to this thread's in the logger, when logging by lines. */
+static void
+i_process_quietly_one(const nestate_t *const state, neinput_t *const input, brrsz idx, nestate_stats_t *const stats)
+{
+	const int lines = state->settings.log_mode == nestate_log_lines;
+	nestate_t job = {
+		.inputs = input,
+		.n_inputs = 1,
+		.libraries = state->libraries,
+		.n_libraries = state->n_libraries,
+		.threads = 1,
+		.shard_index = state->shard_index,
+		.n_shards = state->n_shards,
+	};
+	int err = 0;
+
+	if (lines)
+		logger_add("%*zu / %zu  %s : ", (int)state->stats.n_input_digits, idx + 1, state->n_inputs, input->path);
+	if (i_check_input(input)) {
+		if (lines)
+			logger_add("skipped, not a file");
+	} else if (input->type == neinput_type_auto && (err = i_determine_input_type(input))) {
+		if (lines)
+			logger_add("failed, %s", lib_strerr(err));
+	} else {
+		err = i_dispatch(&job, input);
+		*stats = job.stats;
+		if (lines) {
+			logger_add("%s ", i_type_names[input->type]);
+			if (err)
+				logger_add("failed, %s", lib_strerr(err));
+			else if (!stats->oggs.assigned && !stats->wems.assigned && !stats->wsps.assigned && !stats->bnks.assigned)
+				logger_add(shard_owns(state, input->path, SHARD_WHOLE) ? "filtered" : "in another shard");
+			else
+				logger_add(input->flag.dry_run ? "ok (dry)" : "ok");
+			if (stats->wem_extracts.assigned)
+				logger_add(", %zu / %zu extracted", stats->wem_extracts.succeeded, stats->wem_extracts.assigned);
+			if (stats->wem_converts.assigned)
+				logger_add(", %zu / %zu converted", stats->wem_converts.succeeded, stats->wem_converts.assigned);
+		}
+	}
+}
+
+static int
+i_process_quietly(void *const context, brrsz task)
+{
+	i_parallel_t *const parallel = context;
+	const brrsz idx = parallel->order[task];
+	const nestate_t *const state = parallel->state;
+
+	/* Admitted by the pipeline's reader, unless there isn't one */
+	if (parallel->admissions && !parallel->admissions[task].admitted)
+		i_admit(parallel, task);
+	i_process_quietly_one(state, &state->inputs[idx], idx, &parallel->stats[idx]);
+	if (state->settings.log_mode == nestate_log_lines)
+		logger_emit_at(idx);
+	if (parallel->admissions)
+		memlimit_release(parallel->admissions[task].reserved);
+	return 0;
+}
+
+/* Only inputs read whole are worth the reader stage reading ahead; under '-mem-limit', it's the reader that admits each
+ * task, in order, before reading it, so converters never wait on the limit while holding what's been read for them */
+static const char *
+i_read_ahead_path(void *const context, brrsz task)
+{
+	i_parallel_t *const parallel = context;
+	const neinput_t *const input = &parallel->state->inputs[parallel->order[task]];
+	if (parallel->admissions) {
+		i_admit(parallel, task);
+		if (parallel->admissions[task].streamed)
+			return NULL;
+	}
+	/* Still untyped only if typing failed, which the task reports without reading it */
+	if (input->type == neinput_type_ogg || input->type == neinput_type_auto || input->flag.dry_run)
+		return NULL;
+	/* Other shards' archives are still read, for this shard's share of their entries */
+	if (input->type != neinput_type_wsp && input->type != neinput_type_bnk
+	    && !shard_owns(parallel->state, input->path, SHARD_WHOLE))
+		return NULL;
+	return input->path;
+}
+
+/* Inputs are all typed before the pipeline starts, so the reader knows what to read ahead without racing the tasks
+ * that would otherwise type them; any that fail are left for their task to try again and report. */
+static int
+i_type_input(void *const context, brrsz idx)
+{
+	neinput_t *const input = &((nestate_t *)context)->inputs[idx];
+	if (input->type == neinput_type_auto)
+		i_determine_input_type(input);
+	return 0;
+}
+
+/* Processes every input in parallel, each single-threaded, with logging silenced in favour of one line per input from
+ * the logger, or nothing at all. */
+static int
+i_process_parallel(nestate_t *const state)
+{
+	i_parallel_t parallel = {.state = state};
+	if (!(parallel.stats = calloc(state->n_inputs, sizeof(*parallel.stats)))
+	    || !(parallel.order = malloc(state->n_inputs * sizeof(*parallel.order)))
+	    || (memlimit_get() && !(parallel.admissions = calloc(state->n_inputs, sizeof(*parallel.admissions))))) {
+		BRRLOG_ERR("Failed to process inputs : %s", strerror(errno));
+		if (parallel.stats)
+			free(parallel.stats);
+		if (parallel.order)
+			free(parallel.order);
+		return I_BUFFER_ERROR;
+	}
+	if (schedule_order(state->inputs, state->n_inputs, state->settings.schedule_mode, parallel.order))
+		BRRLOG_WARN("Failed to schedule inputs, processing them in the order given");
+	/* Before silencing, so failures to load are still seen */
+	neprocess_load_libraries(state);
+	lib_set_log_silenced(1);
+	if (state->settings.log_mode == nestate_log_lines) {
+		logger_start(stdout, state->settings.flush_mode);
+		/* Lines come out in the order inputs were given, whatever order they finish in */
+		logger_order(state->n_inputs);
+	}
+
+	if (state->settings.no_queue)
+		pool_run(state->n_inputs, i_process_quietly, &parallel);
+	else if (!pool_run(state->n_inputs, i_type_input, state))
+		pipeline_run(state->n_inputs, i_process_quietly, i_read_ahead_path, &parallel,
+		    state->queue_depth, state->queue_memory);
+
+	logger_stop();
+	lib_set_log_silenced(0);
+	for (brrsz i = 0; i < state->n_inputs; ++i)
+		nestate_stats_add(&state->stats, &parallel.stats[i]);
+	free(parallel.stats);
+	free(parallel.order);
+	if (parallel.admissions)
+		free(parallel.admissions);
+	return 0;
+}
+
+void
+neprocess_load_libraries(nestate_t *const state)
+{
+	for (brrsz i = 0; i < state->n_libraries; ++i) {
+		neinput_library_t *const library = &state->libraries[i];
+		int err = 0;
+		if ((err = neinput_library_load(library)))
+			BRRLOG_WARN("Failed to load codebook library '%s' : %s", library->path, lib_strerr(err));
+		else
+			codebook_library_unpack_all(&library->library);
+	}
+}
+
+/* stdout holds nothing but NDJSON, so logging is silenced and inputs that can't be probed get a record saying why */
+static int
+i_process_probes(nestate_t *const state)
+{
+	lib_set_log_silenced(1);
+	for (brrsz i = 0; i < state->n_inputs; ++i) {
+		neinput_t *const input = &state->inputs[i];
+		int unstatable = 0, err = 0;
+		const char *const problem = i_input_problem(input, &unstatable);
+		if (problem)
+			neprobe_error(input, problem);
+		else if (input->type == neinput_type_auto && (err = i_determine_input_type(input)))
+			neprobe_error(input, lib_strerr(err));
+		else
+			neprobe_input(state, input);
+	}
+	lib_set_log_silenced(0);
+	return 0;
+}
+
+static int
+i_process_serial(nestate_t *const state)
 {
 	for (brrsz i = 0; i < state->n_inputs; ++i) {
 		neinput_t *const input = &state->inputs[i];
@@ -135,11 +408,61 @@ neprocess_inputs(nestate_t *const state)
 		if (i_check_input(input))
 			continue;
 		BRRLOG_DEBUGN("%sLIST : ", input->filter.type?"BLACK":"WHITE");
-		for (brru4 i = 0; i < input->filter.count; ++i) {
-			BRRLOG_DEBUGNP("%zu ", input->filter.list[i]);
+		for (brru4 i = 0; i < input->filter.n_ranges; ++i) {
+			const neinput_range_t range = input->filter.ranges[i];
+			if (range.first == range.last)
+				BRRLOG_DEBUGNP("%lu ", (unsigned long)range.first);
+			else
+				BRRLOG_DEBUGNP("%lu-%lu ", (unsigned long)range.first, (unsigned long)range.last);
 		}
 		BRRLOG_DEBUGP("");
 		i_process_input(state, input, i);
 	}
 	return 0;
 }
+
+/* Raw PCM goes to stdout, so only one input may write at a time, and nothing else may be logged there */
+static inline int
+i_writes_stdout(const nestate_t *const state)
+{
+	for (brrsz i = 0; i < state->n_inputs; ++i) {
+		if (state->inputs[i].flag.pcm_out)
+			return 1;
+	}
+	return 0;
+}
+
+int
+neprocess_inputs(nestate_t *const state)
+{
+	int err = 0;
+	if (state->settings.probe)
+		err = i_process_probes(state);
+	else if (state->settings.log_mode != nestate_log_full && !i_writes_stdout(state))
+		err = i_process_parallel(state);
+	else
+		err = i_process_serial(state);
+	/* Every output is written by the time this returns */
+	uring_release_thread();
+	return err;
+}
+
+int
+neprocess_job(nestate_t *const state)
+{
+	for (brrsz i = 0; i < state->n_inputs; ++i) {
+		neinput_t *const input = &state->inputs[i];
+		nestate_stats_t stats = {0};
+		/* Only ever waits on other jobs */
+		int streamed = 0;
+		const brru8 reserved = memlimit_get() ? memlimit_reserve(i_footprint(state, input, &streamed)) : 0;
+		i_process_quietly_one(state, input, i, &stats);
+		nestate_stats_add(&state->stats, &stats);
+		if (state->settings.log_mode == nestate_log_lines)
+			logger_emit();
+		memlimit_release(reserved);
+	}
+	/* Every output is written by the time this returns */
+	uring_release_thread();
+	return 0;
+}
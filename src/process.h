@@ -20,10 +20,26 @@ limitations under the License.
 #include "input.h"
 
 int neprocess_inputs(nestate_t *const state);
+/* Processes the inputs of a job run alongside others, by a server or watcher, one after another.
+ * Nothing process-wide is touched: the thread count and memory limit are set by the caller, which also keeps logging
+ * silenced while jobs run, so each input is at most logged as one line to the caller's logger, under
+ * 'nestate_log_lines'. */
+int neprocess_job(nestate_t *const state);
+/* Loads every codebook library of 'state' and unpacks all of their codebooks, so they can be shared by conversions
+ * running in parallel; libraries that fail to load are logged, and keep their error for any input that uses them. */
+void neprocess_load_libraries(nestate_t *const state);
 
 int neregrain_ogg(nestate_t *const state, const neinput_t *const input);
 int neconvert_wem(nestate_t *const state, const neinput_t *const input);
+/* Returns non-zero if the WwRIFF 'input' is converted without being read into memory: PCM data is copied straight
+ * from the input by the kernel, where the platform can. */
+int neconvert_wem_streams(const neinput_t *const input);
 int neextract_wsp(nestate_t *const state, const neinput_t *const input);
 int neextract_bnk(nestate_t *const state, const neinput_t *const input);
 
+/* Prints the header metadata of 'input' (and each of its entries, if it's an archive) as NDJSON to stdout. */
+int neprobe_input(nestate_t *const state, const neinput_t *const input);
+/* Prints the NDJSON record of an input that couldn't be probed at all, with 'error' saying why. */
+void neprobe_error(const neinput_t *const input, const char *const error);
+
 #endif /* PROCESS_H */
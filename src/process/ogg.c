@@ -29,8 +29,8 @@ limitations under the License.
 #include "print.h"
 
 /* TODO remove ginput_name and all references to it */
-static const char *s_input_name = NULL;
-static char s_output_name[BRRPATH_MAX_PATH + 1] = {0};
+static _Thread_local const char *s_input_name = NULL;
+static _Thread_local char s_output_name[BRRPATH_MAX_PATH + 1] = {0};
 
 // There should be extended error logging that I think should be optional
 // I'm thinking a tiered error system, with '+E, +error' and '-E, -error' like with the quiet options
@@ -241,7 +241,7 @@ i_regrain(void)
 	i_state_t state = {0};
 	if (!(err = i_state_init(&state, s_input_name))) {
 		if (!(err = i_state_process(&state))) {
-			err = lib_write_ogg_out(&state.output_stream, s_output_name);
+			err = lib_write_ogg_out(&state.output_stream, s_output_name, NULL);
 		}
 	}
 	i_state_clear(&state);
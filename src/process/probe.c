@@ -0,0 +1,340 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "process.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <brrtools/brrlog.h>
+#include <brrtools/brrpath.h>
+
+#include "errors.h"
+#include "lib.h"
+#include "memstat.h"
+#include "print.h"
+#include "rifflist.h"
+#include "wwise.h"
+
+/* Probing prints one JSON object per line (NDJSON) to stdout for every input, and for every entry of every
+ * archive, using only the 'fmt'/'vorb' headers; no audio data is read or converted. */
+
+/* The 'fmt'/'vorb' chunks of a weem are at the very start, so this much is plenty. */
+#define PROBE_HEAD_SIZE 4096
+/* How far back from the end of an Ogg to look for its last page */
+#define PROBE_OGG_TAIL 65536
+#define PROBE_LINE_MAX (2 * BRRPATH_MAX_PATH + 512)
+
+typedef struct i_line {
+	char text[PROBE_LINE_MAX];
+	brrsz length;
+} i_line_t;
+
+static inline void
+i_line_add(i_line_t *const line, const char *const format, ...)
+{
+	if (line->length >= sizeof(line->text))
+		return;
+	va_list lptr;
+	va_start(lptr, format);
+	int n = vsnprintf(line->text + line->length, sizeof(line->text) - line->length, format, lptr);
+	va_end(lptr);
+	if (n > 0)
+		line->length += n;
+}
+
+/* Adds '"key":"value"' with 'value' escaped for JSON */
+static inline void
+i_line_str(i_line_t *const line, const char *const key, const char *const value)
+{
+	i_line_add(line, "%s\"%s\":\"", line->length > 1 ? "," : "", key);
+	for (const char *c = value; *c && line->length < sizeof(line->text) - 8; ++c) {
+		switch (*c) {
+			case '"':  i_line_add(line, "\\\""); break;
+			case '\\': i_line_add(line, "\\\\"); break;
+			case '\n': i_line_add(line, "\\n"); break;
+			case '\r': i_line_add(line, "\\r"); break;
+			case '\t': i_line_add(line, "\\t"); break;
+			default:
+				if ((unsigned char)*c < 0x20)
+					i_line_add(line, "\\u%04x", (unsigned char)*c);
+				else
+					line->text[line->length++] = *c;
+		}
+	}
+	i_line_add(line, "\"");
+}
+#define i_line_num(_line_, _key_, _format_, _value_) \
+	i_line_add((_line_), "%s\"" _key_ "\":" _format_, (_line_)->length > 1 ? "," : "", (_value_))
+
+static inline void
+i_line_emit(i_line_t *const line)
+{
+	if (line->length > sizeof(line->text) - 3)
+		line->length = sizeof(line->text) - 3;
+	line->text[line->length++] = '}';
+	line->text[line->length++] = '\n';
+	fwrite(line->text, 1, line->length, stdout);
+}
+
+static inline void
+i_line_start(i_line_t *const line, const neinput_t *const input, const char *const type)
+{
+	line->length = 0;
+	i_line_add(line, "{");
+	i_line_str(line, "path", input->path);
+	i_line_str(line, "type", type);
+}
+
+/* Adds what probing the input has allocated so far, if built with 'memstats' */
+static inline void
+i_line_memory(i_line_t *const line, const memstat_scope_t *const memory)
+{
+	memstat_usage_t usage;
+	if (!memstat_enabled())
+		return;
+	memstat_scope_usage(memory, &usage);
+	i_line_num(line, "alloc_count", "%llu", (unsigned long long)usage.allocations);
+	i_line_num(line, "alloc_bytes", "%llu", (unsigned long long)usage.bytes);
+	i_line_num(line, "peak_bytes", "%llu", (unsigned long long)usage.peak);
+}
+
+static void
+i_emit_error(const neinput_t *const input, const char *const type, const char *const error)
+{
+	i_line_t line;
+	i_line_start(&line, input, type);
+	i_line_str(&line, "error", error);
+	i_line_emit(&line);
+}
+
+static void
+i_add_wwriff(i_line_t *const line, const nestate_t *const state, const neinput_t *const input, const wwise_probe_t *const probe)
+{
+	static const char *const vorb_types[] = {"none", "implicit", "basic", "extra"};
+	const wwise_fmt_t *const fmt = &probe->fmt;
+	neinput_meta_t meta;
+	wwise_probe_meta(probe, 0, &meta);
+
+	if (wwise_probe_is_pcm(probe))
+		i_line_str(line, "format", "pcm");
+	else if (fmt->format_tag == WWISE_FORMAT_VORBIS)
+		i_line_str(line, "format", "vorbis");
+	else
+		i_line_str(line, "format", "unknown");
+	i_line_num(line, "format_tag", "%u", (unsigned)fmt->format_tag);
+	i_line_num(line, "channels", "%u", (unsigned)fmt->n_channels);
+	i_line_num(line, "rate", "%lu", (unsigned long)fmt->samples_per_sec);
+	i_line_num(line, "byte_rate", "%lu", (unsigned long)fmt->avg_byte_rate);
+	i_line_num(line, "data_size", "%lu", (unsigned long)probe->data_size);
+
+	if (probe->flags.vorb_initialized) {
+		i_line_str(line, "header", vorb_types[probe->vorb_type]);
+		i_line_num(line, "uid", "%lu", (unsigned long)probe->vorb.uid);
+		i_line_num(line, "mod_packets", "%s", probe->flags.mod_packets ? "true" : "false");
+		if (probe->flags.all_headers_present) {
+			/* Full vorbis headers are stored, codebooks are copied verbatim */
+			i_line_str(line, "setup", "full");
+		} else {
+			/* The setup header is rebuilt, according to how this input is configured */
+			i_line_str(line, "setup", "rebuilt");
+			if (input->flag.auto_codebooks)
+				i_line_str(line, "codebooks", "auto");
+			else if (input->library_index != -1)
+				i_line_str(line, "codebooks", state->libraries[input->library_index].path);
+			else
+				i_line_str(line, "codebooks", input->flag.stripped_headers ? "stripped" : "inline");
+		}
+	}
+	i_line_num(line, "sample_count", "%llu", (unsigned long long)meta.samples);
+	if (meta.rate)
+		i_line_num(line, "duration", "%.3f", (double)meta.samples / meta.rate);
+}
+
+static inline int
+i_probe_rejected(const neinput_t *const input, const wwise_probe_t *const probe, brru4 index)
+{
+	neinput_meta_t meta;
+	if (!neinput_filter_has_expression(&input->filter))
+		return 0;
+	wwise_probe_meta(probe, index, &meta);
+	return neinput_filter_rejects(&input->filter, &meta);
+}
+
+static int
+i_probe_wem(const nestate_t *const state, const neinput_t *const input, const memstat_scope_t *const memory)
+{
+	unsigned char head[PROBE_HEAD_SIZE];
+	brrsz read = 0, size = 0;
+	wwise_probe_t probe;
+	int err = 0;
+	if (!(err = lib_read_file_head(input->path, head, sizeof(head), &read, &size)))
+		err = wwise_probe(&probe, head, read);
+	if (err) {
+		i_emit_error(input, "wem", lib_strerr(err));
+		return err;
+	}
+	if (i_probe_rejected(input, &probe, 0))
+		return I_SUCCESS;
+
+	i_line_t line;
+	i_line_start(&line, input, "wem");
+	i_line_num(&line, "size", "%zu", size);
+	i_add_wwriff(&line, state, input, &probe);
+	i_line_memory(&line, memory);
+	i_line_emit(&line);
+	return I_SUCCESS;
+}
+
+static int
+i_probe_archive(const nestate_t *const state, const neinput_t *const input, const char *const type,
+    const memstat_scope_t *const memory)
+{
+	int err = 0;
+	unsigned char *buffer = NULL;
+	brrsz bufsize = 0;
+	rifflist_t list = {0};
+	if (!(err = lib_read_entire_file(input->path, (void **)&buffer, &bufsize))) {
+		if ((err = rifflist_scan(&list, buffer, bufsize)))
+			free(buffer);
+	}
+	if (err) {
+		i_emit_error(input, type, lib_strerr(err));
+		return err;
+	}
+
+	i_line_t line;
+	i_line_start(&line, input, type);
+	i_line_num(&line, "size", "%zu", bufsize);
+	i_line_num(&line, "entries", "%zu", list.n_riffs);
+	i_line_memory(&line, memory);
+	i_line_emit(&line);
+
+	for (brrsz i = 0; i < list.n_riffs; ++i) {
+		const riffgeometry_t *const geom = &list.riffs[i];
+		wwise_probe_t probe;
+		if (neinput_filter_excludes(&input->filter, i))
+			continue;
+		err = wwise_probe(&probe, buffer + geom->buffer_offset, geom->riff_size);
+		if (!err && i_probe_rejected(input, &probe, i))
+			continue;
+		i_line_start(&line, input, "wem");
+		i_line_num(&line, "index", "%zu", i);
+		i_line_num(&line, "offset", "%zu", geom->buffer_offset);
+		i_line_num(&line, "size", "%lu", (unsigned long)geom->riff_size);
+		if (err)
+			i_line_str(&line, "error", lib_strerr(err));
+		else
+			i_add_wwriff(&line, state, input, &probe);
+		i_line_emit(&line);
+	}
+	rifflist_clear(&list);
+	free(buffer);
+	return I_SUCCESS;
+}
+
+static inline brru4
+i_get_u32(const unsigned char *const data)
+{
+	return (brru4)data[0] | (brru4)data[1] << 8 | (brru4)data[2] << 16 | (brru4)data[3] << 24;
+}
+
+/* Reads channels/rate from the ID header in the first page, and the stream length from the granulepos of the last
+ * page, found by searching backwards through the end of the file. */
+static int
+i_probe_ogg(const neinput_t *const input, const memstat_scope_t *const memory)
+{
+	unsigned char head[PROBE_HEAD_SIZE];
+	brrsz read = 0, size = 0;
+	int err = 0;
+	if ((err = lib_read_file_head(input->path, head, sizeof(head), &read, &size))) {
+		i_emit_error(input, "ogg", lib_strerr(err));
+		return err;
+	}
+
+	unsigned channels = 0;
+	unsigned long rate = 0;
+	for (brrsz i = 0; i + 16 <= read; ++i) {
+		if (head[i] == 1 && 0 == memcmp(head + i + 1, VORBIS_STR, 6)) {
+			channels = head[i + 11];
+			rate = i_get_u32(head + i + 12);
+			break;
+		}
+	}
+
+	brru8 granule = 0;
+	{
+		brrsz tail_size = size < PROBE_OGG_TAIL ? size : PROBE_OGG_TAIL;
+		unsigned char *tail = NULL;
+		FILE *file = NULL;
+		if (tail_size >= 27 && (tail = malloc(tail_size)) && (file = fopen(input->path, "rb"))) {
+			if (!fseek(file, (long)(size - tail_size), SEEK_SET) && tail_size == fread(tail, 1, tail_size, file)) {
+				/* 27 is the size of a page header without its segment table */
+				for (brrsz i = tail_size - 27 + 1; i > 0; --i) {
+					const unsigned char *page = tail + i - 1;
+					if (0 == memcmp(page, "OggS", 4) && page[4] == 0) {
+						granule = (brru8)i_get_u32(page + 6) | (brru8)i_get_u32(page + 10) << 32;
+						break;
+					}
+				}
+			}
+		}
+		if (file)
+			fclose(file);
+		free(tail);
+	}
+
+	i_line_t line;
+	i_line_start(&line, input, "ogg");
+	i_line_num(&line, "size", "%zu", size);
+	i_line_str(&line, "format", "vorbis");
+	i_line_num(&line, "channels", "%u", channels);
+	i_line_num(&line, "rate", "%lu", rate);
+	i_line_num(&line, "sample_count", "%llu", (unsigned long long)granule);
+	if (rate)
+		i_line_num(&line, "duration", "%.3f", (double)granule / rate);
+	i_line_memory(&line, memory);
+	i_line_emit(&line);
+	return I_SUCCESS;
+}
+
+void
+neprobe_error(const neinput_t *const input, const char *const error)
+{
+	i_emit_error(input, "unknown", error);
+}
+
+int
+neprobe_input(nestate_t *const state, const neinput_t *const input)
+{
+	memstat_scope_t memory;
+	int err = 0;
+	memstat_scope_begin(&memory);
+	switch (input->type) {
+		case neinput_type_ogg: err = i_probe_ogg(input, &memory); break;
+		case neinput_type_wem: err = i_probe_wem(state, input, &memory); break;
+		case neinput_type_wsp: err = i_probe_archive(state, input, "wsp", &memory); break;
+		case neinput_type_bnk: err = i_probe_archive(state, input, "bnk", &memory); break;
+		default:
+			i_emit_error(input, "unknown", lib_strerr(I_UNRECOGNIZED_DATA));
+			err = I_UNRECOGNIZED_DATA;
+			break;
+	}
+	memstat_scope_end(&memory, input->path);
+	return err;
+}
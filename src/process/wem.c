@@ -29,10 +29,10 @@ limitations under the License.
 #include "wwise.h"
 #include "print.h"
 
-static char s_output_name[BRRPATH_MAX_PATH + 1] = {0};
+static _Thread_local char s_output_name[BRRPATH_MAX_PATH + 1] = {0};
 
 static int
-i_convert_wem(neinput_library_t *const libraries, const neinput_t *const input)
+i_convert_wem(nestate_t *const state, const neinput_t *const input)
 {
 	int err = 0;
 	wwriff_t wwriff = {0};
@@ -55,11 +55,30 @@ i_convert_wem(neinput_library_t *const libraries, const neinput_t *const input)
 	}
 	if (!err) {
 		const codebook_library_t *library = NULL; /* NULL library means inline library */
-		if (!(err = neinput_load_codebooks(libraries, &library, input->library_index))) {
-			ogg_stream_state streamer;
-			if (!(err = wwise_convert_wwriff(&wwriff, &streamer, library, input)))
-				err = lib_write_ogg_out(&streamer, s_output_name);
-			ogg_stream_clear(&streamer);
+		neinput_t detected = *input;
+		if (input->flag.auto_codebooks) {
+			wwise_detector_t detector;
+			const wwise_codebooks_t *codebooks = NULL;
+			if (!(err = wwise_detector_init(&detector, state->libraries, state->n_libraries))) {
+				if (!(err = wwise_detect_codebooks(&detector, &wwriff, &codebooks))) {
+					library = codebooks->library;
+					detected.library_index = codebooks->library_index;
+					detected.flag.stripped_headers = codebooks->stripped;
+				}
+				wwise_detector_clear(&detector);
+			}
+		} else {
+			err = neinput_load_codebooks(state->libraries, &library, input->library_index);
+		}
+		if (!err) {
+			if (input->flag.pcm_out || input->flag.wav_out) {
+				err = lib_write_pcm_out(&wwriff, library, &detected, input->flag.pcm_out ? NULL : s_output_name);
+			} else {
+				ogg_stream_state streamer;
+				if (!(err = wwise_convert_wwriff(&wwriff, &streamer, library, &detected)))
+					err = lib_write_ogg_out(&streamer, s_output_name, NULL);
+				ogg_stream_clear(&streamer);
+			}
 		}
 	}
 	wwriff_clear(&wwriff);
@@ -67,20 +86,87 @@ i_convert_wem(neinput_library_t *const libraries, const neinput_t *const input)
 	return err;
 }
 
+/* Big-endian samples are swapped in memory, and without a kernel-side copy the data is needed in memory anyway */
+static inline int
+i_pcm_streams(const wwise_probe_t *const probe, int source)
+{
+	return source != -1 && probe->byteorder != riff_byteorder_RIFX && probe->byteorder != riff_byteorder_FFIR;
+}
+
+/* PCM weems are already WAV data, so they're rewritten with a fresh header instead of being parsed as Vorbis. */
+static int
+i_convert_pcm_wem(const neinput_t *const input, const wwise_probe_t *const probe)
+{
+	int err = 0;
+	unsigned char *buffer = NULL;
+	int source = lib_range_source_open(input->path);
+	if (!i_pcm_streams(probe, source)) {
+		brrsz bufsize = 0;
+		if ((err = lib_read_entire_file(input->path, (void **)&buffer, &bufsize))) {
+			lib_range_source_close(source);
+			return err;
+		}
+	}
+	err = lib_write_pcm_wem_out(probe, source, 0, buffer, input->flag.pcm_out ? NULL : s_output_name);
+	if (buffer)
+		free(buffer);
+	lib_range_source_close(source);
+	return err;
+}
+
+int
+neconvert_wem_streams(const neinput_t *const input)
+{
+	unsigned char head[4096];
+	brrsz read = 0;
+	wwise_probe_t probe;
+	if (lib_read_file_head(input->path, head, sizeof(head), &read, NULL) || wwise_probe(&probe, head, read)
+	    || !wwise_probe_is_pcm(&probe))
+		return 0;
+	const int source = lib_range_source_open(input->path);
+	const int streams = i_pcm_streams(&probe, source);
+	lib_range_source_close(source);
+	return streams;
+}
+
 int
 neconvert_wem(nestate_t *const state, const neinput_t *const input)
 {
 	int err = 0;
+	int pcm = 0;
+	wwise_probe_t probe;
+	/* Just the first few KiB are needed to check the format and the filter expression, before anything is parsed */
+	{
+		unsigned char head[4096];
+		brrsz read = 0, size = 0;
+		if (!lib_read_file_head(input->path, head, sizeof(head), &read, &size) && !wwise_probe(&probe, head, read)) {
+			neinput_meta_t meta;
+			wwise_probe_meta(&probe, 0, &meta);
+			if (neinput_filter_rejects(&input->filter, &meta)) {
+				LOG_FORMAT(LOG_PARAMS_INFO, "Filtered\n");
+				return I_SUCCESS;
+			}
+			pcm = wwise_probe_is_pcm(&probe);
+		}
+		/* Otherwise, let conversion report the error */
+	}
 	state->stats.wems.assigned++;
 	if (input->flag.dry_run) {
 		LOG_FORMAT(LOG_PARAMS_DRY, "Convert WEM (dry) ");
+	} else if (pcm) {
+		LOG_FORMAT(LOG_PARAMS_WET, "Converting PCM WEM... ");
+		/* Always to [file_path/base_name].wav; never in-place, since the input is copied from as it's written */
+		lib_replace_ext(input->path, input->path_length, s_output_name, NULL, ".wav");
+		err = i_convert_pcm_wem(input, &probe);
 	} else {
 		LOG_FORMAT(LOG_PARAMS_WET, "Converting WEM... ");
 		if (input->flag.inplace_ogg) /* Overwrite input file */
 			snprintf(s_output_name, sizeof(s_output_name), "%s", input->path);
+		else if (input->flag.wav_out) /* Output to [file_path/base_name].wav */
+			lib_replace_ext(input->path, input->path_length, s_output_name, NULL, ".wav");
 		else /* Output to [file_path/base_name].ogg */
 			lib_replace_ext(input->path, input->path_length, s_output_name, NULL, ".ogg");
-		err = i_convert_wem(state->libraries, input);
+		err = i_convert_wem(state, input);
 	}
 	if (!err) {
 		state->stats.wems.succeeded++;
@@ -28,7 +28,7 @@ limitations under the License.
 #include "rifflist.h"
 #include "wwise.h"
 
-static char goutput_root[BRRPATH_MAX_PATH + 1] = {0};
+static _Thread_local char goutput_root[BRRPATH_MAX_PATH + 1] = {0};
 
 static int
 i_extract_wsp(nestate_t *const state, const neinput_t *const input)
@@ -16,6 +16,7 @@ limitations under the License.
 
 #include "rifflist.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,11 @@ limitations under the License.
 #include "errors.h"
 #include "lib.h"
 #include "print.h"
+#include "shard.h"
+#include "timing.h"
+#include "trace.h"
+#include "uring.h"
+#include "usdt.h"
 #include "wwise.h"
 
 int
@@ -40,6 +46,7 @@ rifflist_scan(rifflist_t *const out_list, const unsigned char *const buffer, brr
 		return I_INSUFFICIENT_DATA;
 
 
+	const brru8 start = timing_start(timing_stage_scan);
 	rifflist_t l = {0};
 	brrsz offset = 0;
 	while (offset < buffer_size - 8) {
@@ -74,6 +81,7 @@ rifflist_scan(rifflist_t *const out_list, const unsigned char *const buffer, brr
 		offset += current.riff_size;
 	}
 	NeExtraPrint(DEB, "Scanned list of %zu WwRIFFs...", l.n_riffs);
+	timing_add(timing_stage_scan, start, buffer_size, 0);
 
 	*out_list = l;
 	return I_SUCCESS;
@@ -91,8 +99,230 @@ rifflist_clear(rifflist_t *const list)
  *   Processing file.wsp... . . . X X . . . . X . . . X . . X X . ... etc.
  * */
 
-static char s_output_file[BRRPATH_MAX_PATH + 1] = {0};
+static _Thread_local char s_output_file[BRRPATH_MAX_PATH + 1] = {0};
 #define OUTPUT_FORMAT "_%0*zu"
+
+int
+rifflist_is_extracted(const char *const output_root, const char *const path)
+{
+	const brrsz length = strlen(output_root);
+	const char *p = path + length;
+	if (strncmp(path, output_root, length) || *p++ != '_' || !isdigit((unsigned char)*p))
+		return 0;
+	while (isdigit((unsigned char)*p))
+		++p;
+	return 0 == strcmp(p, ".wem");
+}
+
+static inline int
+i_entry_filtered(const nestate_t *const state, const neinput_t *const input, const riffgeometry_t *const wem,
+    const unsigned char *const buffer, brrsz index)
+{
+	if (!shard_owns(state, input->path, index)) {
+		BRRLOG_DEBUG("WWRIFF %zu is in another shard", index);
+		return 1;
+	}
+	if (neinput_filter_excludes(&input->filter, index)) {
+		BRRLOG_DEBUG("WWRIFF %zu was filtered due to %slist", index, input->filter.type?"black":"white");
+		return 1;
+	}
+	if (neinput_filter_has_expression(&input->filter)) {
+		/* Only the headers are looked at, so a rejected entry is never parsed, converted, or copied */
+		wwise_probe_t probe;
+		neinput_meta_t meta;
+		if (wwise_probe(&probe, buffer + wem->buffer_offset, wem->riff_size)) {
+			BRRLOG_DEBUG("WWRIFF %zu headers could not be read, not filtering", index);
+			return 0;
+		}
+		wwise_probe_meta(&probe, index, &meta);
+		if (neinput_filter_rejects(&input->filter, &meta)) {
+			BRRLOG_DEBUG("WWRIFF %zu was filtered by expression", index);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Moves the outputs of 'stat' counted as succeeded when they were queued, but that failed to be written, to its
+ * failures; 'failures' is only final once 'uring_wait' has returned. */
+static inline void
+i_count_write_failures(nestate_stat_t *const stat, brrsz failures)
+{
+	stat->succeeded -= failures;
+	stat->failed += failures;
+}
+
+static int
+i_extract_entry(
+    const riffgeometry_t *const wem,
+    const unsigned char *const buffer,
+    int source,
+    nestate_t *const state,
+    const char *const output_root,
+    int digits,
+    brrsz index,
+    brrsz *const failures
+)
+{
+	FILE *output = NULL;
+	snprintf(s_output_file, sizeof(s_output_file), "%s"OUTPUT_FORMAT".wem", output_root, digits, index);
+	state->stats.wem_extracts.assigned++;
+
+	/* The kernel copies straight from the archive file when it can, which beats writing it from memory */
+	if (source == -1 && uring_available()) {
+		/* Written from the archive in memory, which the extraction waits on before it's freed */
+		int err = uring_write_file(s_output_file, (void *)(buffer + wem->buffer_offset), wem->riff_size, 0, failures);
+		if (err) {
+			BRRLOG_ERRN("Failed to queue output WEM ");
+			LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+			BRRLOG_ERRP(" (%s), skipping : %s", s_output_file, lib_strerr(err));
+			state->stats.wem_extracts.failed++;
+			return err;
+		}
+		state->stats.wem_extracts.succeeded++;
+		return I_SUCCESS;
+	}
+	if (!(output = fopen(s_output_file, "wb"))) {
+		BRRLOG_ERRN("Failed to open output WEM ");
+		LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+		BRRLOG_ERRP(" (%s), skipping", s_output_file);
+		state->stats.wem_extracts.failed++;
+		return I_IO_ERROR;
+	}
+	if (lib_copy_range(source, wem->buffer_offset, wem->riff_size, output, buffer + wem->buffer_offset)) {
+		BRRLOG_ERRN("Failed to write to output WEM ");
+		LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+		BRRLOG_ERRP(" (%s), skipping", s_output_file);
+		NeExtraPrint(DEB, "Failed to extract WwRIFF to '%s'", s_output_file);
+		state->stats.wem_extracts.failed++;
+		fclose(output);
+		return I_IO_ERROR;
+	}
+	NeExtraPrint(DEB, "Successfuly extracted WwRIFF to '%s'", s_output_file);
+	state->stats.wem_extracts.succeeded++;
+	fclose(output);
+	return I_SUCCESS;
+}
+
+/* PCM entries are already WAV data; they get a fresh header and their 'data' chunk copied straight from the archive,
+ * with no attempt at parsing them as Vorbis. */
+static int
+i_convert_pcm_entry(
+    const riffgeometry_t *const geom,
+    const unsigned char *const buffer,
+    int source,
+    const wwise_probe_t *const probe,
+    nestate_t *const state,
+    const neinput_t *const input,
+    const char *const output_root,
+    int digits,
+    brrsz index
+)
+{
+	int err = 0;
+	snprintf(s_output_file, sizeof(s_output_file), "%s"OUTPUT_FORMAT".wav", output_root, digits, index);
+	state->stats.wem_converts.assigned++;
+	if ((err = lib_write_pcm_wem_out(probe, source, geom->buffer_offset, buffer + geom->buffer_offset,
+	    input->flag.pcm_out ? NULL : s_output_file))) {
+		BRRLOG_ERRN("Failed to write PCM WWRIFF ");
+		LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+		BRRLOG_ERRP(" skipping : %s", lib_strerr(err));
+		state->stats.wem_converts.failed++;
+		return err;
+	}
+	NeExtraPrint(DEB, "Successfuly rewrote PCM WwRIFF to '%s'", s_output_file);
+	state->stats.wem_converts.succeeded++;
+	return I_SUCCESS;
+}
+
+static int
+i_convert_entry(
+    const riffgeometry_t *const geom,
+    const unsigned char *const buffer,
+    int source,
+    nestate_t *const state,
+    const neinput_t *const input,
+    const codebook_library_t *const library,
+    wwise_detector_t *const detector,
+    const char *const output_root,
+    int digits,
+    brrsz index,
+    brrsz *const failures
+)
+{
+	{
+		/* The format is checked up front so PCM entries don't fail as Vorbis first */
+		wwise_probe_t probe;
+		if (!wwise_probe(&probe, buffer + geom->buffer_offset, geom->riff_size) && wwise_probe_is_pcm(&probe))
+			return i_convert_pcm_entry(geom, buffer, source, &probe, state, input, output_root, digits, index);
+	}
+	snprintf(s_output_file, sizeof(s_output_file), "%s"OUTPUT_FORMAT"%s",
+	    output_root, digits, index, input->flag.wav_out ? ".wav" : ".ogg");
+	state->stats.wem_converts.assigned++;
+
+	int err = 0;
+	wwriff_t wwriff = {0};
+	if ((err = lib_parse_buffer_as_wwriff(&wwriff, buffer + geom->buffer_offset, geom->riff_size))) {
+		BRRLOG_ERRN("Failed to parse WWRIFF ");
+		LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+		BRRLOG_ERRP(" skipping : %s", lib_strerr(err));
+	} else {
+		if (input->flag.add_comments) {
+			if ((err = wwriff_add_comment(&wwriff, "SourceFile=%s", input->path))) {
+				BRRLOG_ERR("Failed to add comment to WWRIFF : %s (%d)", strerror(errno), errno);
+			} else if ((err = wwriff_add_comment(&wwriff, "OutputFile=%s", s_output_file))) {
+				BRRLOG_ERR("Failed to add comment to WWRIFF : %s (%d)", strerror(errno), errno);
+			}
+		}
+		/* With detection, the entry is converted as though its input were set up with the codebooks found */
+		neinput_t detected = *input;
+		const codebook_library_t *used = library;
+		if (!err && detector) {
+			const wwise_codebooks_t *codebooks = NULL;
+			if (!(err = wwise_detect_codebooks(detector, &wwriff, &codebooks))) {
+				used = codebooks->library;
+				detected.library_index = codebooks->library_index;
+				detected.flag.stripped_headers = codebooks->stripped;
+			} else {
+				BRRLOG_ERRN("Failed to detect codebooks of WWRIFF ");
+				LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+				BRRLOG_ERRP(", skipping.");
+			}
+		}
+		if (!err && (input->flag.pcm_out || input->flag.wav_out)) {
+			if ((err = lib_write_pcm_out(&wwriff, used, &detected, input->flag.pcm_out ? NULL : s_output_file))) {
+				BRRLOG_ERRN("Failed to decode WWRIFF ");
+				LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+				BRRLOG_ERRP(", skipping.");
+			}
+		} else if (!err) {
+			ogg_stream_state streamer;
+			if (!(err = wwise_convert_wwriff(&wwriff, &streamer, used, &detected))) {
+				if ((err = lib_write_ogg_out(&streamer, s_output_file, failures))) {
+					BRRLOG_ERRN("Failed to write converted WWRIFF ");
+					LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+					BRRLOG_ERRP(", skipping.");
+				}
+				ogg_stream_clear(&streamer);
+			} else {
+				BRRLOG_ERRN("Failed to convert WWRIFF ");
+				LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, index);
+				BRRLOG_ERRP(", skipping.");
+			}
+		}
+		wwriff_clear(&wwriff);
+	}
+
+	if (!err) {
+		NeExtraPrint(DEB, "Successfuly converted WwRIFF to '%s'", s_output_file);
+		state->stats.wem_converts.succeeded++;
+	} else {
+		NeExtraPrint(DEB, "Failed to convert WwRIFF to '%s'", s_output_file);
+		state->stats.wem_converts.failed++;
+	}
+	return err;
+}
+
 int
 rifflist_convert(
     const rifflist_t *const list,
@@ -109,60 +339,47 @@ rifflist_convert(
 		return I_GENERIC_ERROR;
 
 	int digits = brrnum_ndigits(list->n_riffs, 10, 1);
+	/* Kept WwRIFFs are named as 'rifflist_extract' names them */
+	int extract_digits = brrnum_ndigits(list->n_riffs, 10, 0);
+	/* Used for both extracting and copying PCM entries */
+	int source = lib_range_source_open(input->path);
+	/* Detection is remembered for the whole archive, since its entries nearly always share codebooks */
+	wwise_detector_t detector = {0};
+	if (input->flag.auto_codebooks && wwise_detector_init(&detector, state->libraries, state->n_libraries)) {
+		lib_range_source_close(source);
+		return I_BUFFER_ERROR;
+	}
+	/* Of queued writes, only known once they've all been waited on */
+	brrsz extract_failures = 0, convert_failures = 0;
 	NeExtraPrint(DEB, "Converting WwRIFF list...");
 	for (brrsz i = 0; i < list->n_riffs; ++i) {
-		if (input->filter.count) {
-			int contained = neinput_filter_contains(&input->filter, i);
-			if ((contained && input->filter.type) || (!contained && !input->filter.type)) {
-				BRRLOG_DEBUG("WWRIFF %zu was filtered due to %slist", i, input->filter.type?"black":"white");
-				continue;
-			}
-		}
-
-		snprintf(s_output_file, sizeof(s_output_file), "%s"OUTPUT_FORMAT".ogg", output_root, digits, i);
-		state->stats.wem_converts.assigned++;
-
-		int err = 0;
-		wwriff_t wwriff = {0};
-		const riffgeometry_t *const geom = &list->riffs[i];
-		if ((err = lib_parse_buffer_as_wwriff(&wwriff, buffer + geom->buffer_offset, geom->riff_size))) {
-			BRRLOG_ERRN("Failed to parse WWRIFF ");
-			LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, i);
-			BRRLOG_ERRP(" skipping : %s", lib_strerr(err));
-		} else {
-			if (input->flag.add_comments) {
-				if ((err = wwriff_add_comment(&wwriff, "SourceFile=%s", input->path))) {
-					BRRLOG_ERR("Failed to add comment to WWRIFF : %s (%d)", strerror(errno), errno);
-				} else if ((err = wwriff_add_comment(&wwriff, "OutputFile=%s", s_output_file))) {
-					BRRLOG_ERR("Failed to add comment to WWRIFF : %s (%d)", strerror(errno), errno);
-				}
-			}
-			if (!err) {
-				ogg_stream_state streamer;
-				if (!(err = wwise_convert_wwriff(&wwriff, &streamer, library, input))) {
-					if ((err = lib_write_ogg_out(&streamer, s_output_file))) {
-						BRRLOG_ERRN("Failed to write converted WWRIFF ");
-						LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, i);
-						BRRLOG_ERRP(", skipping.");
-					}
-					ogg_stream_clear(&streamer);
-				} else {
-					BRRLOG_ERRN("Failed to convert WWRIFF ");
-					LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, i);
-					BRRLOG_ERRP(", skipping.");
-				}
-			}
-			wwriff_clear(&wwriff);
-		}
-
-		if (!err) {
-			NeExtraPrint(DEB, "Successfuly converted WwRIFF to '%s'", s_output_file);
-			state->stats.wem_converts.succeeded++;
-		} else {
-			NeExtraPrint(DEB, "Failed to convert WwRIFF to '%s'", s_output_file);
-			state->stats.wem_converts.failed++;
+		if (i_entry_filtered(state, input, &list->riffs[i], buffer, i))
+			continue;
+		/* Both outputs are produced from the same scan of the buffer, so keeping the raw WwRIFF costs only
+		 * the extra write. */
+		brru8 start = timing_now();
+		int err = 0, convert_err = 0;
+		USDT_PROBE3(entry__start, input->path, i, list->riffs[i].riff_size);
+		if (input->flag.keep_wem) {
+			err = i_extract_entry(&list->riffs[i], buffer, source, state, output_root, extract_digits, i,
+			    &extract_failures);
+			trace_add("extract", "entry", input->path, start, i, list->riffs[i].riff_size, 0, err);
+			start = timing_now();
 		}
+		convert_err = i_convert_entry(&list->riffs[i], buffer, source, state, input, library,
+		    input->flag.auto_codebooks ? &detector : NULL, output_root, digits, i, &convert_failures);
+		trace_add("convert", "entry", input->path, start, i, list->riffs[i].riff_size, 0, convert_err);
+		/* The entry fails with whichever of its outputs failed first */
+		if (!err)
+			err = convert_err;
+		USDT_PROBE4(entry__end, input->path, i, list->riffs[i].riff_size, err);
 	}
+	wwise_detector_clear(&detector);
+	lib_range_source_close(source);
+	/* Extracted entries are written from 'buffer' */
+	uring_wait();
+	i_count_write_failures(&state->stats.wem_extracts, extract_failures);
+	i_count_write_failures(&state->stats.wem_converts, convert_failures);
 	return I_SUCCESS;
 }
 int
@@ -180,40 +397,22 @@ rifflist_extract(
 		return I_GENERIC_ERROR;
 
 	int digits = brrnum_ndigits(list->n_riffs, 10, 0);
+	/* Entries are copied straight from the archive file by the kernel when possible; 'buffer' is only written
+	 * from when that fails. */
+	int source = lib_range_source_open(input->path);
+	brrsz failures = 0; /* Of queued writes */
 	NeExtraPrint(DEB, "Extracting WwRIFF list...");
 	for (brrsz i = 0; i < list->n_riffs; ++i) {
-		const riffgeometry_t *const wem = &list->riffs[i];
-		brrsz wrote = 0;
-		FILE *output = NULL;
-		if (input->filter.count) {
-			int contained = neinput_filter_contains(&input->filter, i);
-			if ((contained && input->filter.type) || (!contained && !input->filter.type)) {
-				BRRLOG_DEBUG("WWRIFF %zu was filtered due to %slist", i, input->filter.type?"black":"white");
-				continue;
-			}
-		}
-
-		snprintf(s_output_file, sizeof(s_output_file), "%s"OUTPUT_FORMAT".wem", output_root, digits, i);
-		state->stats.wem_extracts.assigned++;
-
-		if (!(output = fopen(s_output_file, "wb"))) {
-			BRRLOG_ERRN("Failed to open output WEM ");
-			LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, i);
-			BRRLOG_ERRP(" (%s), skipping", s_output_file);
-			state->stats.wem_extracts.failed++;
-		} else {
-			if (wem->riff_size != (wrote = fwrite(buffer + wem->buffer_offset, 1, wem->riff_size, output))) {
-				BRRLOG_ERRN("Failed to write to output WEM ");
-				LOG_FORMAT(LOG_PARAMS_INFO, "#%*zu", digits, i);
-				BRRLOG_ERRP(" (%s), skipping", s_output_file);
-				NeExtraPrint(DEB, "Failed to extract WwRIFF to '%s'", s_output_file);
-				state->stats.wem_extracts.failed++;
-			} else {
-				NeExtraPrint(DEB, "Successfuly extracted WwRIFF to '%s'", s_output_file);
-				state->stats.wem_extracts.succeeded++;
-			}
-			fclose(output);
-		}
+		if (i_entry_filtered(state, input, &list->riffs[i], buffer, i))
+			continue;
+		const brru8 start = timing_now();
+		USDT_PROBE3(entry__start, input->path, i, list->riffs[i].riff_size);
+		int err = i_extract_entry(&list->riffs[i], buffer, source, state, output_root, digits, i, &failures);
+		trace_add("extract", "entry", input->path, start, i, list->riffs[i].riff_size, 0, err);
+		USDT_PROBE4(entry__end, input->path, i, list->riffs[i].riff_size, err);
 	}
+	lib_range_source_close(source);
+	uring_wait();
+	i_count_write_failures(&state->stats.wem_extracts, failures);
 	return I_SUCCESS;
 }
@@ -39,6 +39,9 @@ typedef struct rifflist {
 int rifflist_scan(rifflist_t *const out_list, const unsigned char *const buffer, brrsz buffer_size);
 void rifflist_clear(rifflist_t *const list);
 
+/* Converts every unfiltered RIFF in 'list' to an Ogg named from 'output_root'.
+ * If 'input' has 'keep_wem' set, the raw RIFF is extracted alongside each Ogg in the same pass.
+ * */
 int rifflist_convert(
     const rifflist_t *const list,
     const unsigned char *const buffer,
@@ -54,5 +57,8 @@ int rifflist_extract(
     const neinput_t *const input,
     const char *const output_root
 );
+/* Returns non-zero if 'path' is named as an entry extracted to 'output_root' is: the root, '_', the entry's index,
+ * '.wem'. */
+int rifflist_is_extracted(const char *const output_root, const char *const path);
 
 #endif /* WSP_META_H */
@@ -0,0 +1,143 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "schedule.h"
+
+#include <stdlib.h>
+
+#if defined(__linux__)
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/ioctl.h>
+# include <linux/fiemap.h>
+# include <linux/fs.h>
+#endif
+#if !defined(_WIN32)
+# include <sys/stat.h>
+#endif
+
+#include <brrtools/brrpath.h>
+
+#include "errors.h"
+
+typedef struct i_job {
+	brrsz index;
+	brru8 size;
+	brru8 device;
+	brru8 location; /* Physical offset of the first extent, or failing that the inode */
+	int missing;
+} i_job_t;
+
+#if defined(__linux__)
+/* Returns the physical offset of the first byte of 'path' on its device, or 0 if the filesystem won't say. */
+static brru8
+i_physical_offset(const char *const path)
+{
+	union {
+		struct fiemap map;
+		unsigned char bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} request = {0};
+	brru8 offset = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	request.map.fm_length = 1;
+	request.map.fm_extent_count = 1;
+	if (!ioctl(fd, FS_IOC_FIEMAP, &request.map) && request.map.fm_mapped_extents)
+		offset = request.map.fm_extents[0].fe_physical;
+	close(fd);
+	return offset;
+}
+#endif
+
+static void
+i_stat(i_job_t *const job, const char *const path, int locate)
+{
+#if defined(_WIN32)
+	const brrstringr_t path_str = brrstringr_cast(path);
+	brrpath_stat_result_t st;
+	if (brrpath_stat(&st, &path_str) || !st.exists || st.type != brrpath_type_file) {
+		job->missing = 1;
+		return;
+	}
+	job->size = st.size;
+	(void)locate;
+#else
+	struct stat st;
+	if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+		job->missing = 1;
+		return;
+	}
+	job->size = st.st_size;
+	if (!locate)
+		return;
+	job->device = st.st_dev;
+	job->location = st.st_ino;
+# if defined(__linux__)
+	{
+		const brru8 offset = i_physical_offset(path);
+		if (offset)
+			job->location = offset;
+	}
+# endif
+#endif
+}
+
+/* Ties, and everything in 'order' mode, keep the order given */
+static int
+i_by_size(const void *const a, const void *const b)
+{
+	const i_job_t *const x = a, *const y = b;
+	if (x->missing != y->missing)
+		return x->missing - y->missing;
+	if (x->size != y->size)
+		return x->size > y->size ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+static int
+i_by_disk(const void *const a, const void *const b)
+{
+	const i_job_t *const x = a, *const y = b;
+	if (x->missing != y->missing)
+		return x->missing - y->missing;
+	if (x->device != y->device)
+		return x->device < y->device ? -1 : 1;
+	if (x->location != y->location)
+		return x->location < y->location ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+int
+schedule_order(const neinput_t *const inputs, brrsz n_inputs, int mode, brrsz *const order)
+{
+	i_job_t *jobs = NULL;
+	for (brrsz i = 0; i < n_inputs; ++i)
+		order[i] = i;
+	if (mode == nestate_schedule_order || n_inputs < 2)
+		return I_SUCCESS;
+	if (!(jobs = calloc(n_inputs, sizeof(*jobs))))
+		return I_BUFFER_ERROR;
+
+	for (brrsz i = 0; i < n_inputs; ++i) {
+		jobs[i].index = i;
+		i_stat(&jobs[i], inputs[i].path, mode == nestate_schedule_disk);
+	}
+	qsort(jobs, n_inputs, sizeof(*jobs), mode == nestate_schedule_disk ? i_by_disk : i_by_size);
+	for (brrsz i = 0; i < n_inputs; ++i)
+		order[i] = jobs[i].index;
+	free(jobs);
+	return I_SUCCESS;
+}
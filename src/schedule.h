@@ -0,0 +1,34 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <brrtools/brrtypes.h>
+
+#include "input.h"
+
+/* Ordering of the inputs of parallel runs: every input is stat'ed up front, and handed out either largest first, so
+ * the biggest don't end up started last with every other thread idle waiting on them, or in the order they're laid
+ * out on disk, so a spinning disk read from by the reader stage sweeps across rather than seeking back and forth.
+ * Only the order they're started in changes; they're still numbered, logged and reported in the order given. */
+
+/* Fills 'order' with the indices of the 'n_inputs' 'inputs', in the order 'mode' (nestate_schedule_t) has them
+ * processed in; inputs that can't be stat'ed go last, and are left to fail when processed.
+ * Returns 0 on success, or I_BUFFER_ERROR, in which case 'order' is left in the order given. */
+int schedule_order(const neinput_t *const inputs, brrsz n_inputs, int mode, brrsz *const order);
+
+#endif /* SCHEDULE_H */
@@ -0,0 +1,662 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "serve.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+# include <fcntl.h>
+# include <poll.h>
+# include <pthread.h>
+# include <signal.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif
+
+#include <brrtools/brrlib.h>
+#include <brrtools/brrlog.h>
+#include <brrtools/brrpath.h>
+
+#include "codebook_library.h"
+#include "lib.h"
+#include "logger.h"
+#include "pool.h"
+#include "process.h"
+
+#if defined(_WIN32)
+int
+neserve_run(nestate_t *const state)
+{
+	BRRLOG_ERR("Serving jobs is only supported on Unix-like systems");
+	return 1;
+}
+int
+neserve_client(const char *const path, int argc, char **argv)
+{
+	fprintf(stderr, "Submitting jobs is only supported on Unix-like systems\n");
+	return 2;
+}
+#else
+
+/* How often the reader checks whether the server is shutting down, in milliseconds */
+#define SERVE_POLL_INTERVAL 500
+#define SERVE_REPLY_MAX 512
+
+static volatile sig_atomic_t s_stop = 0;
+
+/* A client's connection, which has at most one job in at a time: its next frame isn't read until the last has been
+ * answered, so replies go out in the order jobs were sent, and a client can't take more than one worker */
+typedef struct i_connection {
+	int fd;
+	int busy;                  /* Its job is queued or running; only then do workers touch it, never the reader */
+	int broken;                /* Its reply couldn't be sent, so the reader closes it */
+	brru4 got;                 /* How much of the current frame has been read, header included */
+	brru4 size;                /* Of the current frame's payload, once its header has been read */
+	unsigned char header[4];
+	char *payload;
+	struct i_connection *next; /* In the job queue */
+} i_connection_t;
+
+typedef struct i_server {
+	const nestate_t *state;       /* Every job starts with the defaults of this */
+	int listener;
+	int wake[2];                  /* A pipe workers write to when they're done with a connection */
+	pthread_mutex_t lock;         /* Guards 'libraries' */
+	neinput_library_t *libraries; /* Every library any job has used, loaded and unpacked */
+	brrsz n_libraries;
+	pthread_mutex_t queue_lock;   /* Guards the queue, 'stopping', and the 'busy' and 'broken' of connections */
+	pthread_cond_t queued;
+	i_connection_t *first, *last; /* Connections with a job, in the order their jobs came in */
+	int stopping;
+	i_connection_t **connections; /* Every open connection; only the reader touches this */
+	brrsz n_connections;
+} i_server_t;
+
+static void
+i_on_signal(int signal)
+{
+	s_stop = 1;
+}
+
+static int
+i_send_all(int fd, const void *const data, brrsz size)
+{
+	const char *d = data;
+	while (size) {
+		ssize_t sent = send(fd, d, size, MSG_NOSIGNAL);
+		if (sent < 0) {
+			struct pollfd poller = {.fd = fd, .events = POLLOUT};
+			if (errno == EINTR)
+				continue;
+			/* Connections of the server don't block, in case the reader gets to them first */
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && !s_stop && poll(&poller, 1, SERVE_POLL_INTERVAL) >= 0)
+				continue;
+			return -1;
+		}
+		d += sent;
+		size -= sent;
+	}
+	return 0;
+}
+static int
+i_recv_all(int fd, void *const data, brrsz size)
+{
+	char *d = data;
+	while (size) {
+		ssize_t got = recv(fd, d, size, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+		d += got;
+		size -= got;
+	}
+	return 0;
+}
+
+static int
+i_send_frame(int fd, const void *const payload, brru4 size)
+{
+	const unsigned char header[4] = {size & 0xFF, (size >> 8) & 0xFF, (size >> 16) & 0xFF, (size >> 24) & 0xFF};
+	if (i_send_all(fd, header, sizeof(header)))
+		return -1;
+	return i_send_all(fd, payload, size);
+}
+/* The payload is allocated with a NUL after it, for convenience. */
+static int
+i_recv_frame(int fd, char **const payload, brru4 *const size)
+{
+	unsigned char header[4];
+	if (i_recv_all(fd, header, sizeof(header)))
+		return -1;
+	brru4 s = (brru4)header[0] | (brru4)header[1] << 8 | (brru4)header[2] << 16 | (brru4)header[3] << 24;
+	if (s > SERVE_FRAME_MAX || !(*payload = malloc(s + 1)))
+		return -1;
+	if (i_recv_all(fd, *payload, s)) {
+		free(*payload);
+		return -1;
+	}
+	(*payload)[s] = 0;
+	*size = s;
+	return 0;
+}
+/* Reads whatever's arrived of the current frame of 'connection', without blocking; the payload is allocated with a NUL
+ * after it, as with 'i_recv_frame'.
+ * Returns 1 once the frame is complete, 0 if there's more to come, or -1 if the connection is closed or broken. */
+static int
+i_recv_frame_part(i_connection_t *const connection)
+{
+	const brru4 header = sizeof(connection->header);
+	while (1) {
+		ssize_t got;
+		if (connection->got < header) {
+			got = recv(connection->fd, connection->header + connection->got, header - connection->got, 0);
+		} else if (connection->got - header < connection->size) {
+			got = recv(connection->fd, connection->payload + (connection->got - header),
+			    connection->size - (connection->got - header), 0);
+		} else {
+			connection->payload[connection->size] = 0;
+			connection->got = 0;
+			return 1;
+		}
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (got <= 0)
+			return -1;
+		connection->got += got;
+		if (connection->got == header) {
+			const unsigned char *const h = connection->header;
+			connection->size = (brru4)h[0] | (brru4)h[1] << 8 | (brru4)h[2] << 16 | (brru4)h[3] << 24;
+			if (connection->size > SERVE_FRAME_MAX || !(connection->payload = malloc(connection->size + 1)))
+				return -1;
+		}
+	}
+}
+
+/* Sets '*resolved' to 'path' relative to 'cwd', or NULL if 'path' is already absolute or names a built-in. */
+static int
+i_resolve_path(char **const resolved, const char *const cwd, const char *const path)
+{
+	*resolved = NULL;
+	if (path[0] == '/' || path[0] == '@')
+		return 0;
+	brrsz cwd_length = strlen(cwd), path_length = strlen(path);
+	if (!(*resolved = malloc(cwd_length + path_length + 2)))
+		return -1;
+	memcpy(*resolved, cwd, cwd_length);
+	(*resolved)[cwd_length] = '/';
+	memcpy(*resolved + cwd_length + 1, path, path_length + 1);
+	return 0;
+}
+
+/* Points 'library' at the server's copy of it, loading that first if no job has used it yet.
+ * If the server can't keep a copy, 'library' is left to be loaded by the job as usual. */
+static void
+i_share_library(i_server_t *const server, neinput_library_t *const library)
+{
+	pthread_mutex_lock(&server->lock);
+	brrsz i = 0;
+	for (; i < server->n_libraries; ++i) {
+		if (0 == strcmp(server->libraries[i].path, library->path))
+			break;
+	}
+	if (i == server->n_libraries) {
+		neinput_library_t loaded = {.path_length = library->path_length, .status = {.old = library->status.old}};
+		char *path = malloc(library->path_length + 1);
+		if (!path || brrlib_alloc((void **)&server->libraries, (server->n_libraries + 1) * sizeof(loaded), 0)) {
+			if (path)
+				free(path);
+			pthread_mutex_unlock(&server->lock);
+			return;
+		}
+		memcpy(path, library->path, library->path_length + 1);
+		loaded.path = path;
+		/* Load errors are kept too, so a broken library isn't retried by every job */
+		if (!neinput_library_load(&loaded))
+			codebook_library_unpack_all(&loaded.library);
+		server->libraries[server->n_libraries++] = loaded;
+	}
+	library->library = server->libraries[i].library;
+	library->status = server->libraries[i].status;
+	library->status.shared = 1;
+	pthread_mutex_unlock(&server->lock);
+}
+
+/* Returns the first option of 'job' that would change the whole server rather than just the job, or NULL if there's
+ * none; those are only taken by the server itself. */
+static const char *
+i_server_option(const nestate_t *const job)
+{
+	if (job->threads != 1)
+		return "-j";
+	if (job->mem_limit)
+		return "-mem-limit";
+	if (job->serve_path)
+		return "-serve";
+	if (job->watch_input.path)
+		return "-watch";
+	if (job->trace_path)
+		return "-trace";
+	if (job->report_path)
+		return "-report-file";
+	if (job->settings.merge_reports)
+		return "-merge-reports";
+	/* Both write to the server's stdout */
+	if (job->settings.probe)
+		return "-probe";
+	for (brrsz i = 0; i < job->n_inputs; ++i) {
+		if (job->inputs[i].flag.pcm_out)
+			return "-pcm";
+	}
+	return NULL;
+}
+
+static void
+i_run_job(i_server_t *const server, char *const payload, brru4 size, char *const reply)
+{
+	/* The payload is NUL-separated, so it's split in place */
+	int argc = 0;
+	char **argv = NULL;
+	for (brru4 i = 0; i < size; ++i)
+		argc += payload[i] == 0;
+	if (!argc || payload[size - 1] != 0 || !(argv = malloc(argc * sizeof(*argv)))) {
+		snprintf(reply, SERVE_REPLY_MAX, "status=2 error=Malformed job");
+		return;
+	}
+	argv[0] = payload;
+	for (brru4 i = 0, a = 1; i < size - 1; ++i) {
+		if (payload[i] == 0)
+			argv[a++] = payload + i + 1;
+	}
+	const char *const cwd = argv[0];
+
+	nestate_t job = {
+		.default_input = server->state->default_input,
+		.threads = 1,
+		.settings = {.log_style_enabled = server->state->settings.log_style_enabled},
+	};
+	const char *option = NULL;
+	if (nestate_init(&job, argc - 1, argv + 1)) {
+		snprintf(reply, SERVE_REPLY_MAX, "status=2 error=%s", strerror(errno));
+		free(argv);
+		return;
+	}
+	if ((option = i_server_option(&job))) {
+		snprintf(reply, SERVE_REPLY_MAX, "status=2 error=%s is only taken by the server", option);
+		nestate_clear(&job);
+		free(argv);
+		return;
+	}
+	/* Each input gets a line of the server's log */
+	job.settings.log_mode = nestate_log_lines;
+
+	char **resolved = calloc(job.n_inputs + job.n_libraries + 1, sizeof(*resolved));
+	if (!resolved) {
+		snprintf(reply, SERVE_REPLY_MAX, "status=2 error=%s", strerror(errno));
+		nestate_clear(&job);
+		free(argv);
+		return;
+	}
+	brrsz n_resolved = 0;
+	for (brrsz i = 0; i < job.n_inputs; ++i) {
+		neinput_t *const input = &job.inputs[i];
+		if (!i_resolve_path(&resolved[n_resolved], cwd, input->path) && resolved[n_resolved]) {
+			input->path = resolved[n_resolved++];
+			input->path_length = strlen(input->path);
+		}
+	}
+	for (brrsz i = 0; i < job.n_libraries; ++i) {
+		neinput_library_t *const library = &job.libraries[i];
+		if (library->status.shared)
+			continue;
+		if (!i_resolve_path(&resolved[n_resolved], cwd, library->path) && resolved[n_resolved]) {
+			library->path = resolved[n_resolved++];
+			library->path_length = strlen(library->path);
+		}
+		i_share_library(server, library);
+	}
+
+	neprocess_job(&job);
+
+	const nestate_stat_t *const stats[] = {&job.stats.oggs, &job.stats.wems, &job.stats.wsps, &job.stats.bnks,
+	    &job.stats.wem_extracts, &job.stats.wem_converts};
+	brrsz failed = 0;
+	for (brrsz i = 0; i < sizeof(stats) / sizeof(*stats); ++i)
+		failed += stats[i]->failed;
+	snprintf(reply, SERVE_REPLY_MAX, "status=%d inputs=%zu converted=%zu failed=%zu",
+	    failed ? 1 : 0, job.n_inputs, job.stats.wems.succeeded + job.stats.wem_converts.succeeded, failed);
+
+	nestate_clear(&job);
+	for (brrsz i = 0; i < n_resolved; ++i)
+		free(resolved[i]);
+	free(resolved);
+	free(argv);
+}
+
+/* Every worker takes jobs off the queue, in the order they came in, and answers each on its own connection */
+static int
+i_work(void *const context, brrsz worker)
+{
+	i_server_t *const server = context;
+	while (1) {
+		i_connection_t *connection = NULL;
+		char reply[SERVE_REPLY_MAX];
+		int broken = 0;
+		pthread_mutex_lock(&server->queue_lock);
+		while (!server->first && !server->stopping)
+			pthread_cond_wait(&server->queued, &server->queue_lock);
+		if (server->stopping) {
+			pthread_mutex_unlock(&server->queue_lock);
+			return 0;
+		}
+		connection = server->first;
+		if (!(server->first = connection->next))
+			server->last = NULL;
+		pthread_mutex_unlock(&server->queue_lock);
+
+		i_run_job(server, connection->payload, connection->size, reply);
+		free(connection->payload);
+		connection->payload = NULL;
+		broken = i_send_frame(connection->fd, reply, strlen(reply));
+
+		pthread_mutex_lock(&server->queue_lock);
+		connection->busy = 0;
+		connection->broken = broken;
+		pthread_mutex_unlock(&server->queue_lock);
+		/* If the pipe's full, the reader's already due to wake up */
+		(void)!write(server->wake[1], "", 1);
+	}
+}
+
+static void
+i_close_connection(i_connection_t *const connection)
+{
+	close(connection->fd);
+	if (connection->payload)
+		free(connection->payload);
+	free(connection);
+}
+
+/* Takes every connection waiting on the listener. */
+static void
+i_accept(i_server_t *const server)
+{
+	int fd;
+	while (-1 != (fd = accept(server->listener, NULL, NULL))) {
+		i_connection_t *connection = NULL;
+		/* Some systems don't have accepted sockets inherit the listener's O_NONBLOCK */
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) || !(connection = calloc(1, sizeof(*connection)))
+		    || brrlib_alloc((void **)&server->connections, (server->n_connections + 1) * sizeof(connection), 0)) {
+			if (connection)
+				free(connection);
+			close(fd);
+			continue;
+		}
+		connection->fd = fd;
+		server->connections[server->n_connections++] = connection;
+	}
+}
+
+/* The one thread reading from clients: it takes new connections, reads jobs from every connection that doesn't
+ * already have one in, and queues them for the workers, until the server is interrupted. */
+static void
+i_read_jobs(void *const context)
+{
+	i_server_t *const server = context;
+	struct pollfd *pollers = NULL;
+	i_connection_t **polled = NULL;
+	brrsz capacity = 0;
+	while (!s_stop) {
+		brrsz n_polled = 0;
+		if (capacity < server->n_connections + 2) {
+			const brrsz grown = (server->n_connections + 2) * 2;
+			if (brrlib_alloc((void **)&pollers, grown * sizeof(*pollers), 0)
+			    || brrlib_alloc((void **)&polled, grown * sizeof(*polled), 0))
+				break;
+			capacity = grown;
+		}
+		pollers[0] = (struct pollfd){.fd = server->listener, .events = POLLIN};
+		pollers[1] = (struct pollfd){.fd = server->wake[0], .events = POLLIN};
+		pthread_mutex_lock(&server->queue_lock);
+		for (brrsz i = 0; i < server->n_connections;) {
+			i_connection_t *const connection = server->connections[i];
+			if (connection->busy) {
+				++i;
+			} else if (connection->broken) {
+				i_close_connection(connection);
+				server->connections[i] = server->connections[--server->n_connections];
+			} else {
+				polled[n_polled] = connection;
+				pollers[2 + n_polled++] = (struct pollfd){.fd = connection->fd, .events = POLLIN};
+				++i;
+			}
+		}
+		pthread_mutex_unlock(&server->queue_lock);
+
+		if (poll(pollers, 2 + n_polled, SERVE_POLL_INTERVAL) <= 0)
+			continue;
+		if (pollers[1].revents) {
+			char drain[64];
+			while (read(server->wake[0], drain, sizeof(drain)) > 0) {}
+		}
+		for (brrsz i = 0; i < n_polled; ++i) {
+			i_connection_t *const connection = polled[i];
+			int done = 0;
+			if (!pollers[2 + i].revents)
+				continue;
+			if (-1 == (done = i_recv_frame_part(connection))) {
+				/* Closed once it's next polled, so it's only ever taken out of the list in one place */
+				connection->broken = 1;
+			} else if (done) {
+				pthread_mutex_lock(&server->queue_lock);
+				connection->busy = 1;
+				connection->next = NULL;
+				if (server->last)
+					server->last->next = connection;
+				else
+					server->first = connection;
+				server->last = connection;
+				pthread_cond_signal(&server->queued);
+				pthread_mutex_unlock(&server->queue_lock);
+			}
+		}
+		if (pollers[0].revents)
+			i_accept(server);
+	}
+	/* Queued jobs are dropped, and running ones finish */
+	pthread_mutex_lock(&server->queue_lock);
+	server->stopping = 1;
+	pthread_cond_broadcast(&server->queued);
+	pthread_mutex_unlock(&server->queue_lock);
+	if (pollers)
+		free(pollers);
+	if (polled)
+		free(polled);
+}
+
+/* Returns non-zero if a server is answering on 'address' */
+static int
+i_is_served(const struct sockaddr_un *const address)
+{
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0), served = 1;
+	if (probe == -1)
+		return 1;
+	if (connect(probe, (const struct sockaddr *)address, sizeof(*address)))
+		served = errno != ECONNREFUSED;
+	close(probe);
+	return served;
+}
+
+int
+neserve_run(nestate_t *const state)
+{
+	const char *const path = state->serve_path;
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		BRRLOG_ERR("Socket path '%s' is too long", path);
+		return 1;
+	}
+	strcpy(address.sun_path, path);
+
+	i_server_t server = {.state = state};
+	{
+		/* A socket left behind by a server that didn't shut down cleanly is replaced, but not one that's still
+		 * being served, and anything else is left alone */
+		struct stat st;
+		if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+			if (i_is_served(&address)) {
+				BRRLOG_ERR("'%s' is already being served", path);
+				return 1;
+			}
+			unlink(path);
+		}
+	}
+	if (-1 == (server.listener = socket(AF_UNIX, SOCK_STREAM, 0))) {
+		BRRLOG_ERR("Failed to create socket : %s", strerror(errno));
+		return 1;
+	}
+	if (bind(server.listener, (struct sockaddr *)&address, sizeof(address)) ||
+	    listen(server.listener, SOMAXCONN) ||
+	    fcntl(server.listener, F_SETFL, fcntl(server.listener, F_GETFL) | O_NONBLOCK)) {
+		BRRLOG_ERR("Failed to listen on '%s' : %s", path, strerror(errno));
+		close(server.listener);
+		return 1;
+	}
+	if (pipe(server.wake) ||
+	    fcntl(server.wake[0], F_SETFL, fcntl(server.wake[0], F_GETFL) | O_NONBLOCK) ||
+	    fcntl(server.wake[1], F_SETFL, fcntl(server.wake[1], F_GETFL) | O_NONBLOCK)) {
+		BRRLOG_ERR("Failed to serve on '%s' : %s", path, strerror(errno));
+		close(server.listener);
+		unlink(path);
+		return 1;
+	}
+
+	{
+		struct sigaction action = {.sa_handler = i_on_signal};
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGTERM, &action, NULL);
+	}
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_mutex_init(&server.queue_lock, NULL);
+	pthread_cond_init(&server.queued, NULL);
+
+	int workers = pool_get_threads();
+	pool_thread_t *reader = NULL;
+	BRRLOG_NOR("Serving jobs on '%s' with %d workers", path, workers);
+	/* Jobs run alongside each other, so nothing is logged while they do but a line for each input */
+	lib_set_log_silenced(1);
+	logger_start(stdout, state->settings.flush_mode);
+	if ((reader = pool_thread_start(i_read_jobs, &server))) {
+		pool_run(workers, i_work, &server);
+		pool_thread_join(reader);
+	}
+	logger_stop();
+	lib_set_log_silenced(0);
+	lib_set_log_priority(&state->default_input);
+	if (!reader)
+		BRRLOG_ERR("Failed to start reading jobs : %s", strerror(errno));
+	BRRLOG_NOR("Shutting down");
+
+	close(server.listener);
+	unlink(path);
+	close(server.wake[0]);
+	close(server.wake[1]);
+	for (brrsz i = 0; i < server.n_connections; ++i)
+		i_close_connection(server.connections[i]);
+	if (server.connections)
+		free(server.connections);
+	for (brrsz i = 0; i < server.n_libraries; ++i) {
+		free((char *)server.libraries[i].path);
+		neinput_library_clear(&server.libraries[i]);
+	}
+	if (server.libraries)
+		free(server.libraries);
+	pthread_cond_destroy(&server.queued);
+	pthread_mutex_destroy(&server.queue_lock);
+	pthread_mutex_destroy(&server.lock);
+	return !reader;
+}
+
+int
+neserve_client(const char *const path, int argc, char **argv)
+{
+	char cwd[BRRPATH_MAX_PATH + 1];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		fprintf(stderr, "Failed to get working directory : %s\n", strerror(errno));
+		return 2;
+	}
+
+	brrsz size = strlen(cwd) + 1;
+	for (int i = 0; i < argc; ++i)
+		size += strlen(argv[i]) + 1;
+	if (size > SERVE_FRAME_MAX) {
+		fprintf(stderr, "Job is too large\n");
+		return 2;
+	}
+	char *payload = malloc(size);
+	if (!payload) {
+		fprintf(stderr, "Failed to allocate job : %s\n", strerror(errno));
+		return 2;
+	}
+	{
+		brrsz offset = 0;
+		brrsz length = strlen(cwd) + 1;
+		memcpy(payload, cwd, length);
+		offset += length;
+		for (int i = 0; i < argc; ++i) {
+			length = strlen(argv[i]) + 1;
+			memcpy(payload + offset, argv[i], length);
+			offset += length;
+		}
+	}
+
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	char *reply = NULL;
+	brru4 reply_size = 0;
+	int status = 2;
+	int connection = -1;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		free(payload);
+		return 2;
+	}
+	strcpy(address.sun_path, path);
+	if (-1 == (connection = socket(AF_UNIX, SOCK_STREAM, 0)) ||
+	    connect(connection, (struct sockaddr *)&address, sizeof(address))) {
+		fprintf(stderr, "Failed to connect to '%s' : %s\n", path, strerror(errno));
+	} else if (i_send_frame(connection, payload, size) || i_recv_frame(connection, &reply, &reply_size)) {
+		fprintf(stderr, "Lost connection to '%s'\n", path);
+	} else {
+		printf("%s\n", reply);
+		if (1 != sscanf(reply, "status=%d", &status))
+			status = 2;
+		free(reply);
+	}
+	if (connection != -1)
+		close(connection);
+	free(payload);
+	return status;
+}
+#endif
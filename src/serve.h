@@ -0,0 +1,48 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "input.h"
+
+/* Daemon mode: conversion jobs are taken over a Unix domain socket by a single reader thread, which queues them for a
+ * fixed set of worker threads, while codebook libraries stay loaded (and fully unpacked) between jobs.
+ *
+ * Every message, both ways, is a frame: a 4-byte little-endian payload length followed by the payload.
+ * A job's payload is a series of NUL-terminated strings: the working directory of the client, then the arguments
+ * of the job exactly as they'd be given on the command line; relative input and library paths are resolved against
+ * that directory.
+ * Each job is answered with one frame of text, 'status=S inputs=N converted=C failed=F', where S is 0 if nothing
+ * failed, 1 if anything did, or 2 if the arguments were rejected (then followed by ' error=...' instead of the
+ * counts).
+ * A connection may send any number of jobs, one after another; its next job isn't read until the last is answered.
+ * Options that would change the whole server ('-j', '-mem-limit', '-trace', ...) or write to its stdout are rejected.
+ * */
+
+#define SERVE_FRAME_MAX (1 << 20)
+
+/* Serves jobs on 'state->serve_path' until interrupted (SIGINT/SIGTERM), using as many workers as the pool has threads
+ * and 'state->default_input' as the defaults of every job; each input of a job is logged as one line.
+ * A stale socket at the path is replaced, but not one another server is still answering on.
+ * Returns 0 on a clean shutdown, or non-zero if the socket couldn't be set up. */
+int neserve_run(nestate_t *const state);
+
+/* Sends the job 'argv' to the server at 'path', and prints its reply to stdout.
+ * Returns the job's status, or 2 if the server couldn't be reached. */
+int neserve_client(const char *const path, int argc, char **argv);
+
+#endif /* SERVE_H */
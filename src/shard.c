@@ -0,0 +1,58 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "shard.h"
+
+/* 64-bit FNV-1a over the path then the index's bytes, least significant first, finished with splitmix64's mixer so
+ * the low bits taken by the modulo depend on all of them */
+brru8
+shard_hash(const char *const path, brru8 index)
+{
+	brru8 hash = 0xcbf29ce484222325ULL;
+	for (const unsigned char *c = (const unsigned char *)path; *c; ++c) {
+		hash ^= *c;
+		hash *= 0x100000001b3ULL;
+	}
+	for (int i = 0; i < 8; ++i) {
+		hash ^= (index >> (8 * i)) & 0xff;
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+int
+shard_owns(const nestate_t *const state, const char *const path, brru8 index)
+{
+	if (state->n_shards < 2)
+		return 1;
+	return shard_hash(path, index) % state->n_shards == state->shard_index;
+}
+
+brrsz
+shard_n_inputs(const nestate_t *const state)
+{
+	brrsz n = 0;
+	if (state->n_shards < 2)
+		return state->n_inputs;
+	for (brrsz i = 0; i < state->n_inputs; ++i)
+		n += shard_owns(state, state->inputs[i].path, SHARD_WHOLE);
+	return n;
+}
@@ -0,0 +1,40 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <brrtools/brrtypes.h>
+
+#include "input.h"
+
+/* Deterministic sharding for '-shard i/N', so a batch can be split across processes or machines sharing storage,
+ * each given the same arguments: every input, and every entry of an archive, falls to the shard its path (and entry
+ * index) hashes to. Every shard reads an archive for its share of the entries, but only the archive's own shard
+ * counts it. The hash is the same on every platform, and paths are hashed as given, so shards must be given the
+ * same paths, not just the same files. */
+
+/* The index an input as a whole is hashed with */
+#define SHARD_WHOLE ((brru8)-1)
+
+/* Returns the stable 64-bit hash of 'path' with 'index'. */
+brru8 shard_hash(const char *const path, brru8 index);
+/* Returns non-zero if 'index' of 'path' falls to the shard of 'state', or if it isn't sharded. */
+int shard_owns(const nestate_t *const state, const char *const path, brru8 index);
+/* Returns how many of the inputs of 'state' fall to its shard. */
+brrsz shard_n_inputs(const nestate_t *const state);
+
+#endif /* SHARD_H */
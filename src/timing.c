@@ -0,0 +1,151 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "timing.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "memstat.h"
+#include "trace.h"
+
+/* Durations are bucketed by their highest set bit and the TIMING_SUB_BITS bits below it, so every power of two is
+ * split into 1 << TIMING_SUB_BITS buckets; durations below that are exact. */
+#define TIMING_SUB_BITS 3
+#define TIMING_BUCKETS (64 << TIMING_SUB_BITS)
+
+typedef struct i_stage {
+	atomic_ullong count;
+	atomic_ullong total;
+	atomic_ullong max;
+	atomic_ullong bytes_in;
+	atomic_ullong bytes_out;
+	atomic_ullong buckets[TIMING_BUCKETS];
+} i_stage_t;
+
+const char *const timing_stage_names[timing_stage_count] = {
+	"read",
+	"scan",
+	"parse",
+	"headers",
+	"audio",
+	"write",
+};
+
+static i_stage_t s_stages[timing_stage_count];
+
+brru8
+timing_now(void)
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER frequency = {0};
+	LARGE_INTEGER now;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	return (brru8)(now.QuadPart / frequency.QuadPart) * 1000000000
+	    + (brru8)(now.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (brru8)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+brru8
+timing_start(timing_stage_t stage)
+{
+	memstat_enter(stage);
+	return timing_now();
+}
+
+static inline unsigned
+i_bucket(brru8 duration)
+{
+	if (duration < (1 << TIMING_SUB_BITS))
+		return duration;
+	int high = 0;
+	while (duration >> (high + 1))
+		++high;
+	const unsigned sub = (duration >> (high - TIMING_SUB_BITS)) & ((1 << TIMING_SUB_BITS) - 1);
+	return ((high - TIMING_SUB_BITS + 1) << TIMING_SUB_BITS) | sub;
+}
+/* Middle of the range of durations that land in 'bucket' */
+static inline brru8
+i_bucket_value(unsigned bucket)
+{
+	if (bucket < (1 << TIMING_SUB_BITS))
+		return bucket;
+	const unsigned shift = (bucket >> TIMING_SUB_BITS) - 1;
+	const brru8 low = (brru8)((1 << TIMING_SUB_BITS) + (bucket & ((1 << TIMING_SUB_BITS) - 1))) << shift;
+	return low + ((brru8)1 << shift) / 2;
+}
+
+void
+timing_add(timing_stage_t stage, brru8 start, brru8 bytes_in, brru8 bytes_out)
+{
+	const brru8 end = timing_now();
+	const brru8 duration = end > start ? end - start : 0;
+	i_stage_t *const s = &s_stages[stage];
+	memstat_enter(-1);
+	atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->total, duration, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->bytes_in, bytes_in, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->bytes_out, bytes_out, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->buckets[i_bucket(duration)], 1, memory_order_relaxed);
+	unsigned long long max = atomic_load_explicit(&s->max, memory_order_relaxed);
+	while (duration > max && !atomic_compare_exchange_weak_explicit(&s->max, &max, duration,
+	    memory_order_relaxed, memory_order_relaxed))
+		;
+	trace_add(timing_stage_names[stage], "stage", NULL, start, -1, bytes_in, bytes_out, 0);
+}
+
+void
+timing_get(timing_stage_t stage, timing_summary_t *const summary)
+{
+	i_stage_t *const s = &s_stages[stage];
+	memset(summary, 0, sizeof(*summary));
+	summary->count = atomic_load(&s->count);
+	summary->total = atomic_load(&s->total);
+	summary->max = atomic_load(&s->max);
+	summary->bytes_in = atomic_load(&s->bytes_in);
+	summary->bytes_out = atomic_load(&s->bytes_out);
+	if (!summary->count)
+		return;
+
+	brru8 *const percentiles[] = {&summary->p50, &summary->p90, &summary->p99};
+	const brru8 ranks[] = {
+		(summary->count * 50 + 99) / 100,
+		(summary->count * 90 + 99) / 100,
+		(summary->count * 99 + 99) / 100,
+	};
+	brru8 seen = 0;
+	brrsz next = 0;
+	for (unsigned b = 0; b < TIMING_BUCKETS && next < 3; ++b) {
+		seen += atomic_load(&s->buckets[b]);
+		while (next < 3 && seen >= ranks[next]) {
+			/* The estimate can't be more than the slowest run actually recorded */
+			brru8 value = i_bucket_value(b);
+			*percentiles[next++] = value < summary->max ? value : summary->max;
+		}
+	}
+}
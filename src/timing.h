@@ -0,0 +1,54 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <brrtools/brrtypes.h>
+
+/* Per-stage timing: every run of a stage adds its duration and the bytes it took in and put out to totals shared by
+ * all threads, along with a histogram of durations that percentiles are estimated from (within about 6%). */
+
+typedef enum timing_stage {
+	timing_stage_read = 0, /* Reading whole input files */
+	timing_stage_scan,     /* Finding the RIFFs in archives */
+	timing_stage_parse,    /* Parsing RIFF chunks */
+	timing_stage_headers,  /* Copying or rebuilding vorbis headers */
+	timing_stage_audio,    /* Rewriting or decoding audio packets */
+	timing_stage_write,    /* Writing Oggs */
+	timing_stage_count,
+} timing_stage_t;
+
+extern const char *const timing_stage_names[timing_stage_count];
+
+typedef struct timing_summary {
+	brru8 count;
+	brru8 total;     /* Nanoseconds, summed over every thread */
+	brru8 p50, p90, p99, max;
+	brru8 bytes_in;
+	brru8 bytes_out;
+} timing_summary_t;
+
+/* Returns a monotonic timestamp in nanoseconds. */
+brru8 timing_now(void);
+/* Returns 'timing_now', and counts this thread's allocations against 'stage' until its 'timing_add' (see memstat.h). */
+brru8 timing_start(timing_stage_t stage);
+/* Records one run of 'stage' that started at 'start' (from 'timing_now' or 'timing_start') and ends now. */
+void timing_add(timing_stage_t stage, brru8 start, brru8 bytes_in, brru8 bytes_out);
+/* Fills 'summary' with everything recorded for 'stage' so far. */
+void timing_get(timing_stage_t stage, timing_summary_t *const summary);
+
+#endif /* TIMING_H */
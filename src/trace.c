@@ -0,0 +1,227 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "timing.h"
+
+typedef struct i_event {
+	const char *name;
+	const char *category;
+	brru8 start;
+	brru8 end;
+	long long index;
+	brru8 bytes_in;
+	brru8 bytes_out;
+	int err;
+	char detail[TRACE_DETAIL_MAX];
+} i_event_t;
+
+typedef struct i_ring {
+	struct i_ring *next;      /* Every ring, for writing them out */
+	struct i_ring *next_free; /* Rings no thread is using */
+	int tid;
+	brru8 n_events;           /* Including overwritten ones */
+	i_event_t events[TRACE_RING_EVENTS];
+} i_ring_t;
+
+static int s_enabled = 0;
+static brru8 s_origin = 0;
+/* Only guards handing rings out and taking them back, which is once per thread */
+static atomic_flag s_lock = ATOMIC_FLAG_INIT;
+static i_ring_t *s_rings = NULL;
+static i_ring_t *s_free = NULL;
+static int s_n_rings = 0;
+static _Thread_local i_ring_t *s_ring = NULL;
+
+static inline void
+i_lock(void)
+{
+	while (atomic_flag_test_and_set_explicit(&s_lock, memory_order_acquire))
+		;
+}
+static inline void
+i_unlock(void)
+{
+	atomic_flag_clear_explicit(&s_lock, memory_order_release);
+}
+
+static i_ring_t *
+i_get_ring(void)
+{
+	if (s_ring)
+		return s_ring;
+	i_lock();
+	if (s_free) {
+		s_ring = s_free;
+		s_free = s_free->next_free;
+	} else if ((s_ring = malloc(sizeof(*s_ring)))) {
+		s_ring->tid = s_n_rings++;
+		s_ring->n_events = 0;
+		s_ring->next = s_rings;
+		s_rings = s_ring;
+	}
+	i_unlock();
+	return s_ring;
+}
+
+void
+trace_start(void)
+{
+	s_origin = timing_now();
+	s_enabled = 1;
+}
+
+int
+trace_enabled(void)
+{
+	return s_enabled;
+}
+
+void
+trace_add(
+    const char *const name,
+    const char *const category,
+    const char *const detail,
+    brru8 start,
+    long long index,
+    brru8 bytes_in,
+    brru8 bytes_out,
+    int err
+)
+{
+	if (!s_enabled)
+		return;
+	const brru8 end = timing_now();
+	i_ring_t *const ring = i_get_ring();
+	if (!ring)
+		return;
+	i_event_t *const event = &ring->events[ring->n_events++ % TRACE_RING_EVENTS];
+	event->name = name;
+	event->category = category;
+	event->start = start;
+	event->end = end;
+	event->index = index;
+	event->bytes_in = bytes_in;
+	event->bytes_out = bytes_out;
+	event->err = err;
+	event->detail[0] = 0;
+	if (detail) {
+		/* The end of a path says more than its start */
+		brrsz length = strlen(detail);
+		const char *from = length < TRACE_DETAIL_MAX ? detail : detail + length - (TRACE_DETAIL_MAX - 1);
+		memcpy(event->detail, from, strlen(from) + 1);
+	}
+}
+
+void
+trace_release_thread(void)
+{
+	if (!s_ring)
+		return;
+	i_lock();
+	s_ring->next_free = s_free;
+	s_free = s_ring;
+	i_unlock();
+	s_ring = NULL;
+}
+
+static void
+i_write_string(FILE *const out, const char *const string)
+{
+	fputc('"', out);
+	for (const char *c = string; *c; ++c) {
+		switch (*c) {
+			case '"':  fputs("\\\"", out); break;
+			case '\\': fputs("\\\\", out); break;
+			default:
+				if ((unsigned char)*c < 0x20)
+					fprintf(out, "\\u%04x", (unsigned char)*c);
+				else
+					fputc(*c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void
+i_write_event(FILE *const out, const i_event_t *const event, int tid, int *const first)
+{
+	const brru8 start = event->start > s_origin ? event->start - s_origin : 0;
+	const brru8 duration = event->end > event->start ? event->end - event->start : 0;
+	fprintf(out, "%s\n{\"name\":", *first ? "" : ",");
+	*first = 0;
+	i_write_string(out, event->name);
+	fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+	    event->category, tid, start / 1e3, duration / 1e3);
+	fprintf(out, "\"err\":%d", event->err);
+	if (event->index != -1)
+		fprintf(out, ",\"index\":%lld", event->index);
+	if (event->bytes_in)
+		fprintf(out, ",\"bytes_in\":%llu", (unsigned long long)event->bytes_in);
+	if (event->bytes_out)
+		fprintf(out, ",\"bytes_out\":%llu", (unsigned long long)event->bytes_out);
+	if (event->detail[0]) {
+		fputs(",\"path\":", out);
+		i_write_string(out, event->detail);
+	}
+	fputs("}}", out);
+}
+
+int
+trace_write(const char *const path)
+{
+	int err = I_SUCCESS;
+	FILE *out = NULL;
+	s_enabled = 0;
+	if (!(out = fopen(path, "w"))) {
+		err = I_IO_ERROR;
+	} else {
+		int first = 1;
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+		for (const i_ring_t *ring = s_rings; ring; ring = ring->next) {
+			fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+			    first ? "" : ",", ring->tid, ring->tid);
+			first = 0;
+			/* Oldest first; if the ring wrapped, that's where the next event would have gone */
+			const brru8 n = ring->n_events < TRACE_RING_EVENTS ? ring->n_events : TRACE_RING_EVENTS;
+			const brru8 oldest = ring->n_events - n;
+			for (brru8 i = 0; i < n; ++i)
+				i_write_event(out, &ring->events[(oldest + i) % TRACE_RING_EVENTS], ring->tid, &first);
+		}
+		fputs("\n]}\n", out);
+		if (ferror(out))
+			err = I_IO_ERROR;
+		if (fclose(out))
+			err = I_IO_ERROR;
+	}
+
+	while (s_rings) {
+		i_ring_t *next = s_rings->next;
+		free(s_rings);
+		s_rings = next;
+	}
+	s_free = NULL;
+	s_ring = NULL;
+	s_n_rings = 0;
+	return err;
+}
@@ -0,0 +1,56 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <brrtools/brrtypes.h>
+
+/* Tracing records every input, archive entry and stage (see timing.h) as a span, and writes them out as Chrome
+ * trace-event JSON, which chrome://tracing and Perfetto both load.
+ * Every thread records into a ring buffer of its own without any locking; a ring is only locked to be handed to a
+ * thread, and when the thread is done with it (pool workers give theirs back as they finish, for the next ones to
+ * reuse), so each ring becomes one row of the trace.
+ * Once a ring is full, its oldest spans are overwritten. */
+
+#define TRACE_RING_EVENTS (1 << 14)
+#define TRACE_DETAIL_MAX 96
+
+/* Starts recording; timestamps are relative to now. */
+void trace_start(void);
+/* Stops recording, and writes everything recorded to 'path'.
+ * Returns 0 on success or I_IO_ERROR. */
+int trace_write(const char *const path);
+/* Returns non-zero while recording. */
+int trace_enabled(void);
+
+/* Records a span that started at 'start' (from 'timing_now') and ends now.
+ * 'name' and 'category' must be static strings; 'detail' (usually a path) is copied, or may be NULL.
+ * 'index' is an archive entry's index, or -1. */
+void trace_add(
+    const char *const name,
+    const char *const category,
+    const char *const detail,
+    brru8 start,
+    long long index,
+    brru8 bytes_in,
+    brru8 bytes_out,
+    int err
+);
+/* Gives this thread's ring back for other threads to use; called as pool workers finish. */
+void trace_release_thread(void);
+
+#endif /* TRACE_H */
@@ -0,0 +1,428 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* syscall */
+# define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <brrtools/brrlog.h>
+
+#include "errors.h"
+
+#if defined(Ne_io_uring) && defined(__linux__)
+# include <errno.h>
+# include <fcntl.h>
+# include <stdint.h>
+# include <unistd.h>
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <time.h>
+# define I_URING 1
+#endif
+
+static atomic_ullong s_failures = 0;
+
+brru8
+uring_failures(void)
+{
+	return atomic_load(&s_failures);
+}
+
+#if defined(I_URING)
+#define URING_ENTRIES 256
+#define URING_FILES 64             /* Outputs in flight at once, per thread */
+#define URING_BATCH 32             /* Queued entries that get submitted without anything waiting on them */
+#define URING_READ_CHUNK (1 << 20)
+#define URING_WRITE_CHUNK (1 << 30)
+
+/* One read or one output file, completed once all of its entries are */
+typedef struct i_job {
+	int pending;  /* Completions yet to come */
+	int err;      /* First errno of any of them */
+	brrsz size;
+	brrsz done;   /* Bytes read or written */
+	int slot;     /* Fixed file of a write, or -1 */
+	void *data;   /* Freed once done, for writes that own it */
+	brrsz *failures; /* Incremented if a write fails, for whatever queued it */
+	char path[];
+} i_job_t;
+
+typedef struct i_ring {
+	int fd;
+	int state;                 /* 0 not set up yet, 1 set up, -1 unavailable */
+	void *map;
+	brrsz map_size;
+	struct io_uring_sqe *sqes;
+	brrsz sqes_size;
+	_Atomic unsigned *sq_head;
+	_Atomic unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	_Atomic unsigned *cq_head;
+	_Atomic unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+	unsigned cq_entries;
+	unsigned tail;             /* Ahead of '*sq_tail' by the entries queued but not submitted */
+	unsigned in_flight;        /* Completions expected, submitted or not */
+	brrsz failed;              /* Writes failed since the last wait */
+	int free_slots[URING_FILES];
+	int n_free;
+} i_ring_t;
+
+static _Thread_local i_ring_t s_ring = {.fd = -1};
+
+static int
+i_setup(i_ring_t *const ring)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd < 0)
+		return -1;
+	/* Each write is linked to the open that fills its fixed file, which only works if the file is looked up when
+	 * the write runs rather than when it's submitted; that came with 5.17, along with its feature flag. */
+	if (!(params.features & IORING_FEAT_LINKED_FILE) || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(fd);
+		return -1;
+	}
+
+	const brrsz sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	const brrsz cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->map_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+	if (ring->map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->map, ring->map_size);
+		close(fd);
+		return -1;
+	}
+	/* An empty table; opens fill in free slots */
+	int files[URING_FILES];
+	for (int i = 0; i < URING_FILES; ++i)
+		files[i] = -1;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, files, URING_FILES)) {
+		munmap(ring->sqes, ring->sqes_size);
+		munmap(ring->map, ring->map_size);
+		close(fd);
+		return -1;
+	}
+
+	char *const map = ring->map;
+	ring->sq_head = (_Atomic unsigned *)(map + params.sq_off.head);
+	ring->sq_tail = (_Atomic unsigned *)(map + params.sq_off.tail);
+	ring->sq_array = (unsigned *)(map + params.sq_off.array);
+	ring->sq_mask = *(unsigned *)(map + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = (_Atomic unsigned *)(map + params.cq_off.head);
+	ring->cq_tail = (_Atomic unsigned *)(map + params.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+	ring->cq_mask = *(unsigned *)(map + params.cq_off.ring_mask);
+	ring->cq_entries = params.cq_entries;
+	ring->tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+	ring->in_flight = 0;
+	ring->failed = 0;
+	for (int i = 0; i < URING_FILES; ++i)
+		ring->free_slots[i] = URING_FILES - 1 - i;
+	ring->n_free = URING_FILES;
+	ring->fd = fd;
+	return 0;
+}
+
+static void
+i_complete(i_ring_t *const ring, i_job_t *const job)
+{
+	if (job->slot == -1)
+		return; /* Reads belong to whoever waits on them */
+
+	if (!job->err && job->done != job->size)
+		job->err = EIO;
+	if (job->err) {
+		BRRLOG_ERR("Failed to write output '%s' : %s", job->path, strerror(job->err));
+		ring->failed++;
+		atomic_fetch_add(&s_failures, 1);
+		if (job->failures)
+			(*job->failures)++;
+	}
+	ring->free_slots[ring->n_free++] = job->slot;
+	if (job->data)
+		free(job->data);
+	free(job);
+}
+
+/* Handles every completion there is. */
+static void
+i_reap(i_ring_t *const ring)
+{
+	unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+	const unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *const cqe = &ring->cqes[head & ring->cq_mask];
+		i_job_t *const job = (i_job_t *)(uintptr_t)cqe->user_data;
+		if (cqe->res < 0) {
+			/* The rest of a chain after a failure is canceled, which says nothing new */
+			if (!job->err || job->err == ECANCELED)
+				job->err = -cqe->res;
+		} else {
+			job->done += cqe->res;
+		}
+		ring->in_flight--;
+		if (!--job->pending)
+			i_complete(ring, job);
+	}
+	atomic_store_explicit(ring->cq_head, head, memory_order_release);
+}
+
+/* Submits whatever is queued and handles every completion there is, after waiting for at least 'wait_for'. */
+static int
+i_enter(i_ring_t *const ring, unsigned wait_for)
+{
+	/* Anything the kernel didn't take last time is still there to submit */
+	const unsigned to_submit = ring->tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+	atomic_store_explicit(ring->sq_tail, ring->tail, memory_order_release);
+	if (to_submit || wait_for) {
+		while (-1 == syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_for,
+		    wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) {
+			if (errno != EINTR)
+				return -1;
+		}
+	}
+	i_reap(ring);
+	return 0;
+}
+
+/* Gives up on a ring that can't be entered any more. What the kernel has already taken may still be reading from or
+ * writing to memory its callers are about to free, so it's waited out by watching for completions, which need no
+ * syscall; whatever it hasn't taken never will be, so that's failed here. */
+static void
+i_abandon(i_ring_t *const ring)
+{
+	const struct timespec interval = {.tv_nsec = 1000000};
+	unsigned head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+	ring->state = -1;
+	for (; head != ring->tail; ++head) {
+		i_job_t *const job = (i_job_t *)(uintptr_t)ring->sqes[head & ring->sq_mask].user_data;
+		if (!job->err)
+			job->err = ECANCELED;
+		ring->in_flight--;
+		if (!--job->pending)
+			i_complete(ring, job);
+	}
+	ring->tail = head;
+	atomic_store_explicit(ring->sq_tail, head, memory_order_release);
+	while (ring->in_flight) {
+		i_reap(ring);
+		if (ring->in_flight)
+			nanosleep(&interval, NULL);
+	}
+}
+
+/* Makes room to queue 'count' entries as one batch, so links between them aren't split across submissions. */
+static int
+i_reserve(i_ring_t *const ring, unsigned count)
+{
+	if (ring->tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) + count > ring->sq_entries) {
+		if (i_enter(ring, 0))
+			return -1;
+	}
+	/* Completions must never outnumber the completion ring */
+	while (ring->in_flight + count > ring->cq_entries) {
+		if (i_enter(ring, 1))
+			return -1;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *
+i_queue(i_ring_t *const ring, i_job_t *const job, unsigned char opcode, unsigned char flags)
+{
+	const unsigned index = ring->tail & ring->sq_mask;
+	struct io_uring_sqe *const sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->user_data = (uintptr_t)job;
+	ring->sq_array[index] = index;
+	ring->tail++;
+	ring->in_flight++;
+	job->pending++;
+	return sqe;
+}
+
+int
+uring_available(void)
+{
+	if (!s_ring.state)
+		s_ring.state = i_setup(&s_ring) ? -1 : 1;
+	return s_ring.state == 1;
+}
+
+int
+uring_read(int fd, void *const buffer, brrsz size)
+{
+	i_ring_t *const ring = &s_ring;
+	i_job_t job = {.size = size, .slot = -1};
+	if (!uring_available())
+		return I_GENERIC_ERROR;
+
+	for (brrsz offset = 0; offset < size; offset += URING_READ_CHUNK) {
+		const brrsz chunk = size - offset < URING_READ_CHUNK ? size - offset : URING_READ_CHUNK;
+		if (i_reserve(ring, 1)) {
+			job.err = EIO;
+			break;
+		}
+		struct io_uring_sqe *const sqe = i_queue(ring, &job, IORING_OP_READ, 0);
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)((unsigned char *)buffer + offset);
+		sqe->len = chunk;
+		sqe->off = offset;
+	}
+	while (job.pending) {
+		if (i_enter(ring, 1)) {
+			/* Nothing to do but give up on the ring, once it's done with 'buffer' */
+			i_abandon(ring);
+			return I_IO_ERROR;
+		}
+	}
+	if (job.err)
+		return I_IO_ERROR;
+	return job.done < size ? I_FILE_TRUNCATED : I_SUCCESS;
+}
+
+int
+uring_write_file(const char *const path, void *const data, brrsz size, int owned, brrsz *const failures)
+{
+	i_ring_t *const ring = &s_ring;
+	if (!uring_available())
+		return I_GENERIC_ERROR;
+
+	const brrsz path_length = strlen(path);
+	const unsigned n_writes = size ? (size + URING_WRITE_CHUNK - 1) / URING_WRITE_CHUNK : 0;
+	i_job_t *job = NULL;
+	if (n_writes + 2 > ring->sq_entries || !(job = malloc(sizeof(*job) + path_length + 1)))
+		return I_BUFFER_ERROR;
+	*job = (i_job_t){.size = size, .data = owned ? data : NULL, .failures = failures};
+	memcpy(job->path, path, path_length + 1);
+
+	while (!ring->n_free) {
+		if (i_enter(ring, 1)) {
+			free(job);
+			return I_IO_ERROR;
+		}
+	}
+	if (i_reserve(ring, n_writes + 2)) {
+		free(job);
+		return I_IO_ERROR;
+	}
+	job->slot = ring->free_slots[--ring->n_free];
+
+	struct io_uring_sqe *sqe = i_queue(ring, job, IORING_OP_OPENAT, IOSQE_IO_LINK);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)job->path;
+	sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC; /* Fixed files can't take O_CLOEXEC */
+	sqe->len = 0666;
+	sqe->file_index = job->slot + 1;
+	for (unsigned i = 0; i < n_writes; ++i) {
+		const brrsz offset = (brrsz)i * URING_WRITE_CHUNK;
+		sqe = i_queue(ring, job, IORING_OP_WRITE, IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+		sqe->fd = job->slot;
+		sqe->addr = (uintptr_t)((unsigned char *)data + offset);
+		sqe->len = size - offset < URING_WRITE_CHUNK ? size - offset : URING_WRITE_CHUNK;
+		sqe->off = offset;
+	}
+	/* Last in the chain, so it waits on the writes; if anything before it fails it's canceled, leaving the file in
+	 * its slot to be replaced by the next open there. */
+	sqe = i_queue(ring, job, IORING_OP_CLOSE, 0);
+	sqe->file_index = job->slot + 1;
+
+	if (ring->tail - atomic_load_explicit(ring->sq_tail, memory_order_relaxed) >= URING_BATCH)
+		i_enter(ring, 0);
+	return I_SUCCESS;
+}
+
+brrsz
+uring_wait(void)
+{
+	i_ring_t *const ring = &s_ring;
+	if (ring->state != 1)
+		return 0;
+	while (ring->in_flight) {
+		if (i_enter(ring, 1)) {
+			BRRLOG_ERR("Failed to wait on outputs being written : %s", strerror(errno));
+			/* Writes that don't own their data may still be reading it, so they're waited out all the same */
+			i_abandon(ring);
+			break;
+		}
+	}
+	const brrsz failed = ring->failed;
+	ring->failed = 0;
+	return failed;
+}
+
+void
+uring_release_thread(void)
+{
+	i_ring_t *const ring = &s_ring;
+	/* Abandoned rings are still torn down */
+	if (ring->fd == -1)
+		return;
+	uring_wait();
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->map, ring->map_size);
+	close(ring->fd);
+	*ring = (i_ring_t){.fd = -1};
+}
+
+#else
+int
+uring_available(void)
+{
+	return 0;
+}
+int
+uring_read(int fd, void *const buffer, brrsz size)
+{
+	return I_GENERIC_ERROR;
+}
+int
+uring_write_file(const char *const path, void *const data, brrsz size, int owned, brrsz *const failures)
+{
+	return I_GENERIC_ERROR;
+}
+brrsz
+uring_wait(void)
+{
+	return 0;
+}
+void
+uring_release_thread(void)
+{
+}
+#endif
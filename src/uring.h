@@ -0,0 +1,53 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <brrtools/brrtypes.h>
+
+/* Asynchronous I/O through io_uring, only when built with 'io_uring=1' on Linux 5.17 or later.
+ * Every thread gets a ring of its own the first time it asks for one, so nothing here is locked.
+ * Output files are written without waiting on them: the open, write and close of each are queued as one linked
+ * chain, and queued chains are submitted together in batches, so conversion goes on while they complete. A write
+ * that then fails is logged with its path, counted for 'uring_failures', and counted for whatever queued it once it's
+ * waited on.
+ * When io_uring isn't there, or the kernel refuses it, 'uring_available' returns 0 and callers keep to stdio. */
+
+/* Returns non-zero if this thread can use io_uring, setting up its ring if need be. */
+int uring_available(void);
+
+/* Reads 'size' bytes from the start of 'fd' into 'buffer', in chunks read in parallel, and waits for them.
+ * Returns 0 on success, I_FILE_TRUNCATED if the file ends early or I_IO_ERROR. */
+int uring_read(int fd, void *const buffer, brrsz size);
+
+/* Queues writing 'size' bytes of 'data' to a new file at 'path', replacing any there. 'path' is copied.
+ * With 'owned' non-zero, 'data' is freed once written; otherwise it must stay valid until 'uring_wait'.
+ * If the write fails, 'failures' is incremented when it completes, if it isn't NULL; it too must stay valid until
+ * 'uring_wait'.
+ * Returns 0 if it was queued, or I_BUFFER_ERROR. */
+int uring_write_file(const char *const path, void *const data, brrsz size, int owned, brrsz *const failures);
+
+/* Submits everything queued by this thread and waits for all of it to complete.
+ * Returns the number of writes that failed while waiting. */
+brrsz uring_wait(void);
+/* Waits as 'uring_wait' does, then tears down this thread's ring; pool workers call this before they exit. */
+void uring_release_thread(void);
+
+/* Returns how many writes have failed so far, on any thread. */
+brru8 uring_failures(void);
+
+#endif /* URING_H */
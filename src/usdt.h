@@ -0,0 +1,51 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef USDT_H
+#define USDT_H
+
+/* USDT (SystemTap-style) static probes for perf, bpftrace and the like, under the provider 'naep':
+ *   input__start(path, type)                  input__end(path, type, err)
+ *   entry__start(path, index, size)           entry__end(path, index, size, err)
+ *   headers__start(data_size)                 headers__end(size, err)
+ *   batch__start(range, first, count)         batch__end(range, count, size, err)
+ *   page__write(path, offset, size)           codebook__load(path, count, err)
+ * Types are those of 'neinput_type_t', sizes are in bytes and errors are 'I_*' codes (see errors.h); a batch is a
+ * range of audio packets rewritten by one task, with 'first' being its first packet.
+ * A probe is a single nop until something attaches to it, though its arguments are still evaluated, so they should
+ * be no more than values already at hand.
+ * The probes are only there with 'usdt' set and <sys/sdt.h> available; otherwise they're nothing at all. */
+
+#if defined(Ne_usdt) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define USDT_ENABLED 1
+# endif
+#endif
+
+#if defined(USDT_ENABLED)
+# define USDT_PROBE1(_name_, _a_) STAP_PROBE1(naep, _name_, _a_)
+# define USDT_PROBE2(_name_, _a_, _b_) STAP_PROBE2(naep, _name_, _a_, _b_)
+# define USDT_PROBE3(_name_, _a_, _b_, _c_) STAP_PROBE3(naep, _name_, _a_, _b_, _c_)
+# define USDT_PROBE4(_name_, _a_, _b_, _c_, _d_) STAP_PROBE4(naep, _name_, _a_, _b_, _c_, _d_)
+#else
+# define USDT_PROBE1(_name_, _a_) do {} while (0)
+# define USDT_PROBE2(_name_, _a_, _b_) do {} while (0)
+# define USDT_PROBE3(_name_, _a_, _b_, _c_) do {} while (0)
+# define USDT_PROBE4(_name_, _a_, _b_, _c_, _d_) do {} while (0)
+#endif
+
+#endif /* USDT_H */
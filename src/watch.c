@@ -0,0 +1,410 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "watch.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+# include <dirent.h>
+# include <poll.h>
+# include <signal.h>
+# include <time.h>
+# include <unistd.h>
+# include <sys/inotify.h>
+# include <sys/stat.h>
+#endif
+
+#include <brrtools/brrlib.h>
+#include <brrtools/brrlog.h>
+#include <brrtools/brrpath.h>
+
+#include "lib.h"
+#include "logger.h"
+#include "pool.h"
+#include "process.h"
+#include "rifflist.h"
+
+#if !defined(__linux__)
+int
+newatch_run(nestate_t *const state)
+{
+	BRRLOG_ERR("Watching directories is only supported on Linux");
+	return 1;
+}
+#else
+
+/* How often the watcher checks whether it's been interrupted while nothing is pending, in milliseconds */
+#define WATCH_POLL_INTERVAL 500
+#define WATCH_EVENT_BUFFER 16384
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+static volatile sig_atomic_t s_stop = 0;
+
+typedef struct i_dir {
+	int wd;
+	char *path;
+} i_dir_t;
+
+/* A file that's been written to, and the time it's processed unless it's written to again first */
+typedef struct i_pending {
+	char *path;
+	brru8 due;
+} i_pending_t;
+
+typedef struct i_watcher {
+	nestate_t *state;
+	int fd;
+	i_dir_t *dirs;
+	brrsz n_dirs;
+	i_pending_t *pending;
+	brrsz n_pending;
+} i_watcher_t;
+
+static void
+i_on_signal(int signal)
+{
+	s_stop = 1;
+}
+
+static brru8
+i_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (brru8)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static char *
+i_join(const char *const dir, const char *const name)
+{
+	brrsz dir_length = strlen(dir), name_length = strlen(name);
+	char *path = malloc(dir_length + name_length + 2);
+	if (path) {
+		memcpy(path, dir, dir_length);
+		path[dir_length] = '/';
+		memcpy(path + dir_length + 1, name, name_length + 1);
+	}
+	return path;
+}
+
+static inline int
+i_is_watched(const char *const name)
+{
+	return -1 != lib_cmp_ext(name, strlen(name), 0, "wem", "wsp", "bnk", NULL);
+}
+
+/* Takes ownership of 'path'; if it's already pending, it's only pushed back. */
+static void
+i_touch(i_watcher_t *const watcher, char *const path)
+{
+	const brru8 due = i_now() + WATCH_DEBOUNCE_MS;
+	for (brrsz i = 0; i < watcher->n_pending; ++i) {
+		if (0 == strcmp(watcher->pending[i].path, path)) {
+			watcher->pending[i].due = due;
+			free(path);
+			return;
+		}
+	}
+	if (brrlib_alloc((void **)&watcher->pending, (watcher->n_pending + 1) * sizeof(*watcher->pending), 0)) {
+		BRRLOG_ERR("Failed to queue '%s' : %s", path, strerror(errno));
+		free(path);
+		return;
+	}
+	watcher->pending[watcher->n_pending++] = (i_pending_t){.path = path, .due = due};
+}
+
+/* Watches 'path' and every directory under it, which takes ownership of 'path'.
+ * Files already in directories are queued only if 'queue_files' is set, as they are for directories created or moved
+ * in while watching, which may have been filled before their watch was added. */
+static int
+i_add_dir(i_watcher_t *const watcher, char *const path, int queue_files)
+{
+	int wd = inotify_add_watch(watcher->fd, path, WATCH_EVENTS);
+	if (wd == -1) {
+		BRRLOG_WARN("Failed to watch '%s' : %s", path, strerror(errno));
+		free(path);
+		return 1;
+	}
+	/* Watching a directory twice gives the same descriptor */
+	int known = 0;
+	for (brrsz i = 0; i < watcher->n_dirs; ++i) {
+		if (watcher->dirs[i].wd == wd) {
+			free(watcher->dirs[i].path);
+			watcher->dirs[i].path = path;
+			known = 1;
+			break;
+		}
+	}
+	if (!known) {
+		if (brrlib_alloc((void **)&watcher->dirs, (watcher->n_dirs + 1) * sizeof(*watcher->dirs), 0)) {
+			BRRLOG_ERR("Failed to watch '%s' : %s", path, strerror(errno));
+			inotify_rm_watch(watcher->fd, wd);
+			free(path);
+			return 1;
+		}
+		watcher->dirs[watcher->n_dirs++] = (i_dir_t){.wd = wd, .path = path};
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		return 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		struct stat st;
+		char *child;
+		if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+			continue;
+		if (!(child = i_join(path, entry->d_name)))
+			continue;
+		/* Symbolic links aren't followed, so links back up the tree can't recurse forever */
+		if (lstat(child, &st)) {
+			free(child);
+		} else if (S_ISDIR(st.st_mode)) {
+			i_add_dir(watcher, child, queue_files);
+		} else if (queue_files && S_ISREG(st.st_mode) && i_is_watched(entry->d_name)) {
+			i_touch(watcher, child);
+		} else {
+			free(child);
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+static const char *
+i_dir_path(const i_watcher_t *const watcher, int wd)
+{
+	for (brrsz i = 0; i < watcher->n_dirs; ++i) {
+		if (watcher->dirs[i].wd == wd)
+			return watcher->dirs[i].path;
+	}
+	return NULL;
+}
+static void
+i_remove_dir(i_watcher_t *const watcher, int wd)
+{
+	for (brrsz i = 0; i < watcher->n_dirs; ++i) {
+		if (watcher->dirs[i].wd == wd) {
+			free(watcher->dirs[i].path);
+			watcher->dirs[i] = watcher->dirs[--watcher->n_dirs];
+			return;
+		}
+	}
+}
+
+/* Returns non-zero if 'path' was written by one of the 'n_jobs' in 'jobs' rather than by anyone else: an input
+ * converted in place, or an entry extracted from an archive input. */
+static int
+i_is_output(const nestate_t *const jobs, brrsz n_jobs, const char *const path)
+{
+	for (brrsz i = 0; i < n_jobs; ++i) {
+		const neinput_t *const input = jobs[i].inputs;
+		char root[BRRPATH_MAX_PATH + 1];
+		if (input->flag.inplace_ogg && 0 == strcmp(input->path, path))
+			return 1;
+		if (input->type != neinput_type_wsp && input->type != neinput_type_bnk)
+			continue;
+		/* The same root 'neextract_wsp' and 'neextract_bnk' name entries with */
+		lib_replace_ext(input->path, input->path_length - 1, root, NULL, "");
+		if (rifflist_is_extracted(root, path))
+			return 1;
+	}
+	return 0;
+}
+
+/* Queues the files that have changed, except for those written by the 'n_jobs' in 'jobs'. */
+static void
+i_read_events(i_watcher_t *const watcher, const nestate_t *const jobs, brrsz n_jobs)
+{
+	_Alignas(struct inotify_event) char buffer[WATCH_EVENT_BUFFER];
+	ssize_t length;
+	while ((length = read(watcher->fd, buffer, sizeof(buffer))) > 0) {
+		for (char *e = buffer; e < buffer + length; e += sizeof(struct inotify_event) + ((struct inotify_event *)e)->len) {
+			const struct inotify_event *const event = (struct inotify_event *)e;
+			const char *dir = NULL;
+			char *path = NULL;
+			if (event->mask & IN_Q_OVERFLOW) {
+				BRRLOG_WARN("Too many changes at once, some files were missed");
+				continue;
+			} else if (event->mask & IN_IGNORED) {
+				/* The directory was removed, or unmounted */
+				i_remove_dir(watcher, event->wd);
+				continue;
+			} else if (!event->len || !(dir = i_dir_path(watcher, event->wd))) {
+				continue;
+			}
+			if (event->mask & IN_ISDIR) {
+				if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (path = i_join(dir, event->name)))
+					i_add_dir(watcher, path, 1);
+			} else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && i_is_watched(event->name)) {
+				if (!(path = i_join(dir, event->name)))
+					continue;
+				if (i_is_output(jobs, n_jobs, path))
+					free(path);
+				else
+					i_touch(watcher, path);
+			}
+		}
+	}
+}
+
+/* Every settled file is processed as its own state, since they're processed at once */
+static int
+i_process(void *const context, brrsz task)
+{
+	nestate_t *const jobs = context;
+	neprocess_job(&jobs[task]);
+	return 0;
+}
+
+/* Processes every pending file that's settled, all at once. */
+static void
+i_process_settled(i_watcher_t *const watcher)
+{
+	nestate_t *const state = watcher->state;
+	const brru8 now = i_now();
+	brrsz n_settled = 0;
+	for (brrsz i = 0; i < watcher->n_pending; ++i)
+		n_settled += watcher->pending[i].due <= now;
+	if (!n_settled)
+		return;
+
+	neinput_t *inputs = calloc(n_settled, sizeof(*inputs));
+	nestate_t *jobs = calloc(n_settled, sizeof(*jobs));
+	char **paths = calloc(n_settled, sizeof(*paths));
+	if (!inputs || !jobs || !paths) {
+		BRRLOG_ERR("Failed to process changed files : %s", strerror(errno));
+		free(inputs);
+		free(jobs);
+		free(paths);
+		return;
+	}
+	/* Settled files are taken out of the pending list, keeping the order they were written in */
+	for (brrsz i = 0, n = 0, kept = 0; i < watcher->n_pending; ++i) {
+		if (watcher->pending[i].due > now) {
+			watcher->pending[kept++] = watcher->pending[i];
+			continue;
+		}
+		neinput_t *const input = &inputs[n];
+		*input = state->watch_input;
+		input->path = paths[n] = watcher->pending[i].path;
+		input->path_length = strlen(input->path);
+		jobs[n].inputs = input;
+		jobs[n].n_inputs = 1;
+		jobs[n].libraries = state->libraries;
+		jobs[n].n_libraries = state->n_libraries;
+		jobs[n].settings.log_mode = nestate_log_lines;
+		jobs[n].stats.input_path_max = input->path_length;
+		jobs[n].stats.n_input_digits = 1;
+		++n;
+	}
+	watcher->n_pending -= n_settled;
+
+	/* Files are processed alongside each other, so nothing is logged while they are but a line for each */
+	lib_set_log_silenced(1);
+	logger_start(stdout, state->settings.flush_mode);
+	pool_run(n_settled, i_process, jobs);
+	logger_stop();
+	lib_set_log_silenced(0);
+	lib_set_log_priority(&state->default_input);
+	/* Changes made by the files' own processing are only read now, so they can be told apart */
+	i_read_events(watcher, jobs, n_settled);
+
+	brrsz failed = 0;
+	for (brrsz i = 0; i < n_settled; ++i) {
+		nestate_stats_add(&state->stats, &jobs[i].stats);
+		failed += jobs[i].stats.oggs.failed + jobs[i].stats.wems.failed + jobs[i].stats.wsps.failed
+		    + jobs[i].stats.bnks.failed + jobs[i].stats.wem_extracts.failed + jobs[i].stats.wem_converts.failed;
+		free(paths[i]);
+	}
+	if (failed)
+		BRRLOG_WARN("Processed %zu changed file%s, %zu failure%s", n_settled, n_settled == 1 ? "" : "s",
+		    failed, failed == 1 ? "" : "s");
+	else
+		BRRLOG_NOR("Processed %zu changed file%s", n_settled, n_settled == 1 ? "" : "s");
+	free(inputs);
+	free(jobs);
+	free(paths);
+}
+
+int
+newatch_run(nestate_t *const state)
+{
+	i_watcher_t watcher = {.state = state};
+	const char *const root = state->watch_input.path;
+	char *path = NULL;
+	if (-1 == (watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC))) {
+		BRRLOG_ERR("Failed to start watching : %s", strerror(errno));
+		return 1;
+	}
+	if (!(path = malloc(state->watch_input.path_length + 1))) {
+		BRRLOG_ERR("Failed to start watching : %s", strerror(errno));
+		close(watcher.fd);
+		return 1;
+	}
+	memcpy(path, root, state->watch_input.path_length + 1);
+	if (i_add_dir(&watcher, path, 0)) {
+		close(watcher.fd);
+		return 1;
+	}
+
+	/* Files are converted in parallel, and nothing would guard loading libraries lazily */
+	neprocess_load_libraries(state);
+
+	{
+		struct sigaction action = {.sa_handler = i_on_signal};
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGTERM, &action, NULL);
+	}
+
+	BRRLOG_NOR("Watching '%s' (%zu director%s)", root, watcher.n_dirs, watcher.n_dirs == 1 ? "y" : "ies");
+	while (!s_stop && watcher.n_dirs) {
+		int timeout = WATCH_POLL_INTERVAL;
+		if (watcher.n_pending) {
+			const brru8 now = i_now();
+			brru8 due = watcher.pending[0].due;
+			for (brrsz i = 1; i < watcher.n_pending; ++i) {
+				if (watcher.pending[i].due < due)
+					due = watcher.pending[i].due;
+			}
+			timeout = due <= now ? 0 : (int)(due - now);
+		}
+		struct pollfd poller = {.fd = watcher.fd, .events = POLLIN};
+		if (poll(&poller, 1, timeout) > 0)
+			i_read_events(&watcher, NULL, 0);
+		i_process_settled(&watcher);
+	}
+	if (!watcher.n_dirs)
+		BRRLOG_WARN("'%s' is gone, stopping", root);
+	BRRLOG_NOR("Stopped watching");
+
+	close(watcher.fd);
+	for (brrsz i = 0; i < watcher.n_dirs; ++i)
+		free(watcher.dirs[i].path);
+	for (brrsz i = 0; i < watcher.n_pending; ++i)
+		free(watcher.pending[i].path);
+	if (watcher.dirs)
+		free(watcher.dirs);
+	if (watcher.pending)
+		free(watcher.pending);
+	return 0;
+}
+#endif
@@ -0,0 +1,37 @@
+/*
+Copyright 2021-2022 BowToes (bow.toes@mailfence.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "input.h"
+
+/* Watch mode: the directory of 'state->watch_input' and every directory under it are watched with inotify, and each
+ * '.wem', '.wsp' or '.bnk' file that's written to or moved into them is processed like an input given with the same
+ * options, once nothing has been written to it for WATCH_DEBOUNCE_MS.
+ * Files that settle at around the same time are processed together by 'state->threads' workers; nothing is ever
+ * rescanned, apart from the contents of directories created while watching.
+ * Each file is logged as one line while they're processed.
+ * Oggs and WAVs aren't watched, since they're what conversion writes, and neither are the entries extracted from
+ * archives or inputs converted in place by the watcher itself. */
+
+#define WATCH_DEBOUNCE_MS 200
+
+/* Watches until interrupted (SIGINT/SIGTERM).
+ * Returns 0 on a clean shutdown, or non-zero if the directory couldn't be watched. */
+int newatch_run(nestate_t *const state);
+
+#endif /* WATCH_H */
@@ -30,12 +30,16 @@ limitations under the License.
 #include "errors.h"
 #include "lib.h"
 #include "packer.h"
+#include "pool.h"
 #include "print.h"
+#include "timing.h"
+#include "usdt.h"
 
 #define COMMENT_MAX 1024
 
-static const codebook_library_t *s_used_library = NULL;
-static const neinput_t *s_current_input = NULL;
+/* Per-thread, so separate conversions can run at once */
+static _Thread_local const codebook_library_t *s_used_library = NULL;
+static _Thread_local const neinput_t *s_current_input = NULL;
 
 const char *const vorbis_header_packet_names[3] = {
 	"ID",
@@ -202,6 +206,106 @@ i_init_fmt(wwise_fmt_t *const fmt, const unsigned char *const data, brru4 data_s
 	memcpy(fmt, data, brrnum_umin(data_size, sizeof(*fmt)));
 }
 
+/* Chunks bigger than this can't be 'fmt'/'vorb' headers of any known layout. */
+#define PROBE_HEADER_MAX 128
+int
+wwise_probe(wwise_probe_t *const probe, const unsigned char *const buffer, brrsz buffer_size)
+{
+	if (!probe || !buffer)
+		return I_GENERIC_ERROR;
+	if (buffer_size < 12)
+		return I_INSUFFICIENT_DATA;
+
+	wwise_probe_t p = {0};
+	brru4 cc;
+	memcpy(&cc, buffer, 4);
+	if (!(p.byteorder = riff_cc_byteorder(cc)))
+		return I_NOT_RIFF;
+	riff_copier_t cpy_cc = riff_copier_cc(p.byteorder);
+	riff_copier_t cpy_data = riff_copier_data(p.byteorder);
+	cpy_data(&p.riff_size, buffer + 4, 4);
+	p.riff_size += 8;
+
+	wwriff_t w = {0};
+	brrsz offset = 12;
+	brrsz end = brrnum_umin(buffer_size, p.riff_size);
+	while (offset + 8 <= end) {
+		brru4 chunkcc, chunksize;
+		cpy_cc(&chunkcc, buffer + offset, 4);
+		cpy_data(&chunksize, buffer + offset + 4, 4);
+		offset += 8;
+		if (riff_cc_list_type(chunkcc)) {
+			/* Step into the list; its children are ordinary chunks */
+			offset += 4;
+			continue;
+		}
+		riff_basic_type_t type = riff_cc_basic_type(chunkcc);
+		switch (type) {
+			case riff_basic_fmt:
+			case riff_basic_vorb: {
+				unsigned char header[PROBE_HEADER_MAX];
+				if (chunksize > PROBE_HEADER_MAX || offset + chunksize > end)
+					break;
+				/* Same byte handling as full parsing does through riff_consume_chunk */
+				cpy_data(header, buffer + offset, chunksize);
+				if (type == riff_basic_fmt) {
+					i_init_fmt(&w.fmt, header, chunksize);
+					w.flags.fmt_initialized = 1;
+					if (chunksize == 66) {
+						i_init_vorb(&w, header + 24, chunksize - 24);
+						w.flags.vorb_initialized = 1;
+						p.vorb_type = wwise_vorb_type_implicit;
+					}
+				} else {
+					i_init_vorb(&w, header, chunksize);
+					w.flags.vorb_initialized = 1;
+					p.vorb_type = w.flags.all_headers_present ? wwise_vorb_type_basic : wwise_vorb_type_extra;
+				}
+			} break;
+			case riff_basic_data:
+				p.data_size = chunksize;
+				p.data_offset = offset;
+				w.flags.data_initialized = 1;
+				break;
+			default: break;
+		}
+		offset += chunksize;
+	}
+	if (!w.flags.fmt_initialized)
+		return I_INSUFFICIENT_DATA;
+
+	p.flags = w.flags;
+	p.fmt = w.fmt;
+	p.vorb = w.vorb;
+	*probe = p;
+	return I_SUCCESS;
+}
+int
+wwise_probe_is_pcm(const wwise_probe_t *const probe)
+{
+	switch (probe->fmt.format_tag) {
+		case WWISE_FORMAT_PCM: return 1;
+		case WWISE_FORMAT_EXTENSIBLE: return !probe->flags.vorb_initialized;
+		default: return 0;
+	}
+}
+void
+wwise_probe_meta(const wwise_probe_t *const probe, brru4 index, neinput_meta_t *const meta)
+{
+	neinput_meta_t m = {
+		.index = index,
+		.format_tag = probe->fmt.format_tag,
+		.channels = probe->fmt.n_channels,
+		.rate = probe->fmt.samples_per_sec,
+		.data_size = probe->data_size,
+	};
+	if (probe->flags.vorb_initialized)
+		m.samples = probe->vorb.sample_count;
+	else if (probe->fmt.block_align)
+		m.samples = probe->data_size / probe->fmt.block_align;
+	*meta = m;
+}
+
 int
 wwriff_init(wwriff_t *const wwriff, const riff_t *const rf)
 {
@@ -215,6 +319,7 @@ wwriff_init(wwriff_t *const wwriff, const riff_t *const rf)
 		if (basic.type == riff_basic_fmt) {
 			if (w.flags.fmt_initialized) {
 				BRRLOG_ERR("WWRIFF has multiple 'fmt' chunks");
+				wwriff_clear(&w);
 				return I_INIT_ERROR;
 			}
 
@@ -225,6 +330,7 @@ wwriff_init(wwriff_t *const wwriff, const riff_t *const rf)
 			if (basic.size == 66) {
 				if (w.flags.vorb_initialized) {
 					BRRLOG_ERR("WWRIFF has both explicit and implicit 'vorb' chunks.");
+					wwriff_clear(&w);
 					return I_INIT_ERROR;
 				}
 				i_init_vorb(&w, basic.data + 24, basic.size - 24);
@@ -235,6 +341,7 @@ wwriff_init(wwriff_t *const wwriff, const riff_t *const rf)
 			/* Vorb init header data is explicit */
 			if (w.flags.vorb_initialized) {
 				BRRLOG_ERR("WWRIFF has multiple 'vorb' chunks.");
+				wwriff_clear(&w);
 				return I_INIT_ERROR;
 			}
 			i_init_vorb(&w, basic.data, basic.size);
@@ -243,10 +350,12 @@ wwriff_init(wwriff_t *const wwriff, const riff_t *const rf)
 		} else if (basic.type == riff_basic_data) {
 			if (w.flags.data_initialized) {
 				BRRLOG_ERR("WWRIFF has multiple 'data' chunks.");
+				wwriff_clear(&w);
 				return I_INIT_ERROR;
 			}
 			if (brrlib_alloc((void**)&w.data, basic.size, 0)) {
 				BRRLOG_ERR("Failed to allocated %zu bytes for WWRIFF data : %s (%d)", basic.size, strerror(errno), errno);
+				wwriff_clear(&w);
 				return I_BUFFER_ERROR;
 			}
 			memcpy(w.data, basic.data, basic.size);
@@ -277,6 +386,7 @@ wwriff_init(wwriff_t *const wwriff, const riff_t *const rf)
 			++count;
 		}
 		BRRLOG_ERRP(count==1?" chunk":" chunks.");
+		wwriff_clear(&w);
 		return I_INSUFFICIENT_DATA;
 	}
 	if (w.vorb.header_packets_offset > w.data_size || w.vorb.audio_start_offset > w.data_size) {
@@ -286,6 +396,7 @@ wwriff_init(wwriff_t *const wwriff, const riff_t *const rf)
 		} else {
 			BRRLOG_ERRP("'audio_start_offset' is past end of data.");
 		}
+		wwriff_clear(&w);
 		return I_CORRUPT;
 	}
 
@@ -297,6 +408,8 @@ void
 wwriff_clear(wwriff_t *const wem)
 {
 	if (wem) {
+		if (wem->data)
+			free(wem->data);
 		if (wem->comments) {
 			for (brru4 i = 0; i < wem->n_comments; ++i)
 				brrstringr_clear(&wem->comments[i]);
@@ -464,8 +577,11 @@ i_copy_comment_header(oggpack_buffer *const unpacker, oggpack_buffer *const pack
 	packer_pack(packer, 1, 1); /* W Frame flag */
 	return I_SUCCESS;
 }
+/* Setup headers are also built just to try codebooks out, where errors are expected and not worth logging */
+#define I_SETUP_ERR(_quiet_, ...) do { if (!(_quiet_)) BRRLOG_ERR(__VA_ARGS__); } while (0)
+
 static int
-i_copy_next_codebook(oggpack_buffer *const unpacker, oggpack_buffer *const packer)
+i_copy_next_codebook(oggpack_buffer *const unpacker, oggpack_buffer *const packer, int quiet)
 {
 	/* See:
 	 *   https://xiph.org/vorbis/doc/Vorbis_I_spec.html#x1-510003.2.1
@@ -474,7 +590,7 @@ i_copy_next_codebook(oggpack_buffer *const unpacker, oggpack_buffer *const packe
 	for (int i = 0; i < sizeof(CODEBOOK_SYNC) - 1; ++i) {
 		/* R/W Codebook sync */
 		if (CODEBOOK_SYNC[i] != packer_transfer(unpacker, 8, packer, 8)) {
-			BRRLOG_ERR("Bad codebook sync.");
+			I_SETUP_ERR(quiet, "Bad codebook sync.");
 			return I_CORRUPT;
 		}
 	}
@@ -491,7 +607,7 @@ i_copy_next_codebook(oggpack_buffer *const unpacker, oggpack_buffer *const packe
 			current_length++;
 		}
 		if (current_entry > entries) {
-			BRRLOG_ERR("Corrupt ordered entries when copying codebook.");
+			I_SETUP_ERR(quiet, "Corrupt ordered entries when copying codebook.");
 			return I_CORRUPT;
 		}
 	} else {
@@ -511,7 +627,7 @@ i_copy_next_codebook(oggpack_buffer *const unpacker, oggpack_buffer *const packe
 	int lookup = packer_transfer(unpacker, 4, packer, 4); /* R/W Lookup type */
 	if (lookup) {
 		if (lookup > 2) {
-			BRRLOG_ERR("Bad lookup value %i", lookup);
+			I_SETUP_ERR(quiet, "Bad lookup value %i", lookup);
 			return I_CORRUPT;
 		}
 		long minval_packed = packer_transfer(unpacker, 32, packer, 32); /* R/W Minimum value as uint; for real decoding, would be unpacked as a float. */
@@ -555,7 +671,7 @@ i_copy_setup_header(oggpack_buffer *const unpacker, oggpack_buffer *const packer
 		/* Inline codebooks, copy verbatim */
 		/* For now, always copy verbatim */
 		for (int i = 0; i < codebook_count; ++i) {
-			if ((err = i_copy_next_codebook(unpacker, packer))) {
+			if ((err = i_copy_next_codebook(unpacker, packer, 0))) {
 				BRRLOG_ERR("Could not copy codebook %lld.", i);
 				return err;
 			}
@@ -781,14 +897,14 @@ i_build_floors(oggpack_buffer *const unpacker, oggpack_buffer *const packer)
 	return I_SUCCESS;
 }
 static int
-i_build_residues(oggpack_buffer *const unpacker, oggpack_buffer *const packer)
+i_build_residues(oggpack_buffer *const unpacker, oggpack_buffer *const packer, int quiet)
 {
 	/* As far as I can tell, residue decode is identical to spec */
 	int residue_count = 1 + packer_transfer(unpacker, 6, packer, 6); /* R/W Residue count */
 	for (int i = 0; i < residue_count; ++i) {
 		int type = packer_transfer(unpacker, 2, packer, 16);  /* R/W Residue type */
 		if (type > 2) {
-			BRRLOG_ERR("Bad residue type %i", type);
+			I_SETUP_ERR(quiet, "Bad residue type %i", type);
 			return I_CORRUPT;
 		}
 
@@ -873,35 +989,34 @@ i_build_modes(oggpack_buffer *const unpacker, oggpack_buffer *const packer, brru
 /* This is easily the most complicated function in this entire project; it's even split up
  * amongst 4 other functions! */
 static int
-i_build_setup_header(oggpack_buffer *const packer, wwriff_t *const wem)
+i_build_setup_header(oggpack_buffer *const packer, wwriff_t *const wem, const codebook_library_t *const library, int stripped,
+    int quiet)
 {
 	unsigned char *packets_start = wem->data + wem->vorb.header_packets_offset;
 	brru4 packets_size = wem->vorb.audio_start_offset - wem->vorb.header_packets_offset;
 	i_packeteer_t packeteer = {0};
 	int err = 0;
 	if ((err = i_packeteer_init(&packeteer, packets_start, packets_size, wem->flags, (brrsz)(packets_start - wem->data)))) {
-		BRRLOG_ERR("Failed to initialize vorbis setup header packet.");
+		I_SETUP_ERR(quiet, "Failed to initialize vorbis setup header packet.");
 		return err;
 	}
 
 	oggpack_buffer unpacker;
 	oggpack_readinit(&unpacker, packeteer.payload, packeteer.payload_size);
 
-	int stripped = s_current_input->flag.stripped_headers;
-
 	packer_pack(packer, 5, 8); /* W Packet type (setup header = 5) */
 	for (int i = 0; i < 6; ++i) /* W Vorbis string */
 		packer_pack(packer, VORBIS_STR[i], 8);
 
 	int codebook_count = 1 + packer_transfer(&unpacker, 8, packer, 8); /* R/W Codebook count */
-	if (!s_used_library) {
+	if (!library) {
 		/* Internal codebooks */
 		if (!stripped) {
 			/* Full codebooks, can be copied from header directly */
 			for (int i = 0; i < codebook_count; ++i) {
 				//NeExtraPrint(DEBUG, "Copying internal codebook %d", i);
-				if ((err = i_copy_next_codebook(&unpacker, packer))) {
-					BRRLOG_ERR("Failed to copy codebook %d", i);
+				if ((err = i_copy_next_codebook(&unpacker, packer, quiet))) {
+					I_SETUP_ERR(quiet, "Failed to copy codebook %d", i);
 					return err;
 				}
 			}
@@ -910,7 +1025,7 @@ i_build_setup_header(oggpack_buffer *const packer, wwriff_t *const wem)
 			/* Stripped codebooks, need to be unpacked/rebuilt to spec */
 			for (int i = 0; i < codebook_count; ++i) {
 				if ((err = packed_codebook_unpack_raw(&unpacker, packer))) {
-					BRRLOG_ERR("Failed to build codebook %d", i);
+					I_SETUP_ERR(quiet, "Failed to build codebook %d", i);
 					return err;
 				}
 			}
@@ -925,7 +1040,7 @@ i_build_setup_header(oggpack_buffer *const packer, wwriff_t *const wem)
 			/* I don't know why it's off by 1; ww2ogg just sorta rolls with it
 			 * without too much checking (specifically in get_codebook_size) and
 			 * I can't figure out why it works there */
-			if (cbidx > s_used_library->codebook_count) {
+			if (cbidx > library->codebook_count) {
 				/* This bit ripped from ww2ogg, no idea what it means */
 				if (cbidx == 0x342) {
 					cbidx = packer_unpack(&unpacker, 14);      /* R Codebook id */
@@ -933,17 +1048,17 @@ i_build_setup_header(oggpack_buffer *const packer, wwriff_t *const wem)
 						/* ??? */
 					}
 				}
-				BRRLOG_ERR("Codebook index too large %d", cbidx);
+				I_SETUP_ERR(quiet, "Codebook index too large %d", cbidx);
 				return I_CORRUPT;
 			}
 
-			cb = &s_used_library->codebooks[cbidx];
+			cb = &library->codebooks[cbidx];
 			if (CODEBOOK_SUCCESS != (err = packed_codebook_unpack(cb))) { /* Copy from external */
 				if (err == CODEBOOK_ERROR)
 					err = I_BUFFER_ERROR;
 				else if (err == CODEBOOK_CORRUPT)
 					err = I_CORRUPT;
-				BRRLOG_ERR("Failed to copy external codebook %d : %s", cbidx, lib_strerr(err));
+				I_SETUP_ERR(quiet, "Failed to copy external codebook %d : %s", cbidx, lib_strerr(err));
 				return err;
 			} else {
 				oggpack_buffer cb_unpacker;
@@ -960,26 +1075,26 @@ i_build_setup_header(oggpack_buffer *const packer, wwriff_t *const wem)
 	if (!stripped) {
 		/* Rest of the header in-spec, copy verbatim */
 		if (-1 == (err = packer_transfer_remaining(&unpacker, packer))) {
-			BRRLOG_ERR("Failed to copy the rest of vorbis setup packet");
+			I_SETUP_ERR(quiet, "Failed to copy the rest of vorbis setup packet");
 			return I_CORRUPT;
 		}
 
 	} else {
 		/* Need to rebuild the setup header */
 		if ((err = i_build_floors(&unpacker, packer))) {
-			BRRLOG_ERR("Failed to rebuild floors");
+			I_SETUP_ERR(quiet, "Failed to rebuild floors");
 			return err;
 		}
-		if ((err = i_build_residues(&unpacker, packer))) {
-			BRRLOG_ERR("Failed to rebuild residues");
+		if ((err = i_build_residues(&unpacker, packer, quiet))) {
+			I_SETUP_ERR(quiet, "Failed to rebuild residues");
 			return err;
 		}
 		if ((err = i_build_mappings(&unpacker, packer, wem->fmt.n_channels))) {
-			BRRLOG_ERR("Failed to rebuild mappings");
+			I_SETUP_ERR(quiet, "Failed to rebuild mappings");
 			return err;
 		}
 		if ((err = i_build_modes(&unpacker, packer, wem->mode_blockflags, &wem->mode_count))) {
-			BRRLOG_ERR("Failed to rebuild modes");
+			I_SETUP_ERR(quiet, "Failed to rebuild modes");
 			return err;
 		}
 	}
@@ -997,7 +1112,7 @@ i_build_headers(ogg_stream_state *const streamer, wwriff_t *const wem, vorbis_in
 		switch (current_header) {
 			case 0: err = i_build_id_header(&packer, wem); break;
 			case 1: err = i_build_comments_header(&packer, wem); break;
-			case 2: err = i_build_setup_header(&packer, wem); break;
+			case 2: err = i_build_setup_header(&packer, wem, s_used_library, s_current_input->flag.stripped_headers, 0); break;
 		}
 		if (err) {
 			BRRLOG_ERRN("Failed to build vorbis %s header", vorbis_header(current_header));
@@ -1029,95 +1144,581 @@ i_process_headers(ogg_stream_state *const streamer, wwriff_t *const wem, vorbis_
 	}
 }
 
-static int
-i_process_audio(ogg_stream_state *const streamer, wwriff_t *const wem, vorbis_info *const vi, vorbis_comment *const vc)
+int
+wwise_pack_header(
+    wwriff_t *const wwriff,
+    vorbis_header_packet_t header,
+    const codebook_library_t *const library,
+    int stripped,
+    oggpack_buffer *const packer
+)
 {
-	const int mode_count_bits = lib_count_bits(wem->mode_count - 1);
-	brru4 packets_start = wem->vorb.audio_start_offset;
-	brru4 packets_size = wem->data_size - wem->vorb.audio_start_offset;
+	if (!wwriff->flags.all_headers_present) {
+		switch (header) {
+			case vorbis_header_packet_id: return i_build_id_header(packer, wwriff);
+			case vorbis_header_packet_comment: return i_build_comments_header(packer, wwriff);
+			default: return i_build_setup_header(packer, wwriff, library, stripped, 0);
+		}
+	}
+
+	const unsigned char *packets = wwriff->data + wwriff->vorb.header_packets_offset;
+	brru4 packets_length = wwriff->vorb.audio_start_offset - wwriff->vorb.header_packets_offset;
 	i_packeteer_t packeteer = {0};
+	int err = 0;
+	for (int current_header = vorbis_header_packet_id; ; ++current_header) {
+		if ((err = i_packeteer_init(&packeteer, packets, packets_length, wwriff->flags, (brrsz)(packets - wwriff->data))))
+			return err;
+		if (current_header >= header)
+			break;
+		packets += packeteer.total_size;
+		packets_length -= packeteer.total_size;
+	}
+
+	oggpack_buffer unpacker;
+	oggpack_readinit(&unpacker, packeteer.payload, packeteer.payload_size);
+	switch (header) {
+		case vorbis_header_packet_id: return i_copy_id_header(&unpacker, packer);
+		case vorbis_header_packet_comment: return i_copy_comment_header(&unpacker, packer);
+		default: return i_copy_setup_header(&unpacker, packer);
+	}
+}
+
+/****************************************
+  Detect codebooks; only the setup header is rebuilt, once per candidate, until one is accepted.
+****************************************/
+int
+wwise_detector_init(wwise_detector_t *const detector, neinput_library_t *const libraries, brrsz n_libraries)
+{
+	memset(detector, 0, sizeof(*detector));
+	if (!(detector->candidates = malloc(2 * (1 + n_libraries) * sizeof(*detector->candidates))))
+		return I_BUFFER_ERROR;
+	detector->candidates[detector->n_candidates++] = (wwise_codebooks_t){.library_index = -1, .stripped = 0};
+	detector->candidates[detector->n_candidates++] = (wwise_codebooks_t){.library_index = -1, .stripped = 1};
+	for (brrsz i = 0; i < n_libraries; ++i) {
+		const codebook_library_t *library = NULL;
+		int err = 0;
+		if ((err = neinput_load_codebooks(libraries, &library, i))) {
+			BRRLOG_WARN("Not detecting codebook library '%s' : %s", libraries[i].path, lib_strerr(err));
+			continue;
+		}
+		/* External codebooks nearly always come with the rest of the setup header stripped */
+		detector->candidates[detector->n_candidates++] = (wwise_codebooks_t){
+			.library = library, .library_index = i, .stripped = 1
+		};
+		detector->candidates[detector->n_candidates++] = (wwise_codebooks_t){
+			.library = library, .library_index = i, .stripped = 0
+		};
+	}
+	return I_SUCCESS;
+}
+void
+wwise_detector_clear(wwise_detector_t *const detector)
+{
+	if (detector) {
+		if (detector->candidates)
+			free(detector->candidates);
+		if (detector->matches)
+			free(detector->matches);
+		memset(detector, 0, sizeof(*detector));
+	}
+}
 
-	int prev_blockflag = 0;
+/* FNV-1a */
+static inline brru8
+i_hash_setup(const wwriff_t *const wem)
+{
+	brru8 hash = 0xcbf29ce484222325ULL;
+	for (brru4 i = wem->vorb.header_packets_offset; i < wem->vorb.audio_start_offset && i < wem->data_size; ++i) {
+		hash ^= wem->data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* The ID and comment headers don't depend on the codebooks, but vorbis_synthesis_headerin needs them first. */
+static int
+i_try_codebooks(wwriff_t *const wem, const wwise_codebooks_t *const candidate)
+{
+	int err = 0;
+	vorbis_info vi;
+	vorbis_comment vc;
+	vorbis_info_init(&vi);
+	vorbis_comment_init(&vc);
+	for (int current_header = 0; !err && current_header < 3; ++current_header) {
+		oggpack_buffer packer;
+		oggpack_writeinit(&packer);
+		switch (current_header) {
+			case 0: err = i_build_id_header(&packer, wem); break;
+			case 1: err = i_build_comments_header(&packer, wem); break;
+			case 2: err = i_build_setup_header(&packer, wem, candidate->library, candidate->stripped, 1); break;
+		}
+		if (!err) {
+			ogg_packet packet;
+			i_init_ogg_packet(&packet, &packer, current_header, 0, 0);
+			if (vorbis_synthesis_headerin(&vi, &vc, &packet))
+				err = I_CORRUPT;
+		}
+		oggpack_writeclear(&packer);
+	}
+	vorbis_info_clear(&vi);
+	vorbis_comment_clear(&vc);
+	return err;
+}
+
+int
+wwise_detect_codebooks(
+    wwise_detector_t *const detector,
+    wwriff_t *const wwriff,
+    const wwise_codebooks_t **const detected
+)
+{
+	/* Complete headers are copied as they are, whatever the codebooks */
+	if (wwriff->flags.all_headers_present) {
+		*detected = &detector->candidates[0];
+		return I_SUCCESS;
+	}
+
+	brru8 hash = i_hash_setup(wwriff);
+	for (brrsz i = 0; i < detector->n_matches; ++i) {
+		if (detector->matches[i].hash == hash) {
+			*detected = &detector->candidates[detector->matches[i].candidate];
+			return I_SUCCESS;
+		}
+	}
+
+	/* Wrong candidates are expected to fail, so they're tried without logging why */
+	brrsz found = detector->n_candidates;
+	if (!i_try_codebooks(wwriff, &detector->candidates[detector->last])) {
+		found = detector->last;
+	} else {
+		for (brrsz i = 0; i < detector->n_candidates; ++i) {
+			if (i != detector->last && !i_try_codebooks(wwriff, &detector->candidates[i])) {
+				found = i;
+				break;
+			}
+		}
+	}
+
+	if (found == detector->n_candidates) {
+		BRRLOG_ERR("No codebooks match the setup header");
+		return I_UNRECOGNIZED_DATA;
+	}
+	detector->last = found;
+	if (!brrlib_alloc((void **)&detector->matches, (detector->n_matches + 1) * sizeof(*detector->matches), 0))
+		detector->matches[detector->n_matches++] = (wwise_setup_match_t){.hash = hash, .candidate = found};
+	*detected = &detector->candidates[found];
+	NeExtraPrint(DEB, "Detected %s codebooks, %s setup header", detector->candidates[found].library ? "external" : "inline",
+	    detector->candidates[found].stripped ? "stripped" : "full");
+	return I_SUCCESS;
+}
+
+/* Audio is converted in two passes. The first walks just the packet headers, recording where each packet is, which
+ * mode it uses, and its granule position; since a packet's rewrite depends only on its own mode and the window
+ * types of its neighbours, ranges of packets are then rewritten in parallel into their own buffers, which are
+ * spliced into the stream in order. */
+
+/* Ranges are at least this many packets, so short streams don't pay for threads they don't need */
+#define AUDIO_RANGE_MIN_PACKETS 512
+/* Ranges per thread, so threads that finish early can take on more */
+#define AUDIO_RANGES_PER_THREAD 4
+
+typedef struct i_audio_packet {
+	brru8 granule;
+	brru4 offset;   /* Offset of the wwise packet in the 'data' chunk */
+	brru4 out_size; /* Size of the rewritten packet */
+	int mode;       /* Mode number of mod packets, or -1 if there wasn't one */
+} i_audio_packet_t;
+
+typedef struct i_audio_range {
+	brrsz first;
+	brrsz count;
+	unsigned char *data;
+	brrsz size;
+} i_audio_range_t;
+
+typedef struct i_audio {
+	const wwriff_t *wem;
+	int mode_count_bits;
+	i_audio_packet_t *packets;
+	brrsz n_packets;
+	brru8 total_granule;  /* Granule position after the last packet */
+	brru8 index_until;    /* If non-zero, indexing stops after the first packet starting at or past this granule */
+	brrsz first;          /* Only packets 'first' up to 'end' are rewritten and output */
+	brrsz end;
+	brru8 end_granule;    /* If non-zero, the granule position of the last packet output, in place of its own */
+	brru8 granule_offset; /* Subtracted from the granule positions of output packets */
+	i_audio_range_t *ranges;
+	brrsz n_ranges;
+} i_audio_t;
+
+static inline int
+i_mode_blockflag(const wwriff_t *const wem, int mode)
+{
+	if (mode < 0 || mode >= sizeof(wem->mode_blockflags))
+		return 0;
+	return wem->mode_blockflags[mode];
+}
+
+static int
+i_index_audio(i_audio_t *const audio, vorbis_info *const vi)
+{
+	const wwriff_t *const wem = audio->wem;
+	brru4 packets_start = wem->vorb.audio_start_offset;
+	brrsz capacity = 0;
 	brru8 last_block = 0;
 	brru8 total_block = 0;
-	brru8 packetno = 0;
 
-	int err = 0;
-	NeExtraPrint(DEB, "Stream mod packets");
 	while (packets_start < wem->data_size) {
-		int eos = 0;
-		if ((err = i_packeteer_init(&packeteer, wem->data + packets_start, packets_size, wem->flags, packets_start))) {
-			BRRLOG_ERR("Insufficient data to build next audio packet %lld", packetno);
+		int err = 0;
+		i_packeteer_t packeteer;
+		i_audio_packet_t entry = {.offset = packets_start, .mode = -1};
+		if ((err = i_packeteer_init(&packeteer, wem->data + packets_start, wem->data_size - packets_start, wem->flags, packets_start))) {
+			BRRLOG_ERR("Insufficient data to build next audio packet %zu", audio->n_packets);
 			return err;
 		}
+		if (audio->n_packets == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			if (brrlib_alloc((void **)&audio->packets, capacity * sizeof(*audio->packets), 0)) {
+				BRRLOG_ERR("Failed to allocate audio packet index : %s", strerror(errno));
+				return I_BUFFER_ERROR;
+			}
+		}
 
-		brru4 next_start = packets_start + packeteer.total_size;
-
-		oggpack_buffer unpacker, packer;
-		oggpack_readinit(&unpacker, packeteer.payload, packeteer.payload_size);
-		oggpack_writeinit(&packer);
-
-		if (wem->flags.mod_packets) {
-			int packet_type = packer_pack(&packer, 0, 1); /* W Packet type */
-			int mode_number = packer_transfer(&unpacker, mode_count_bits, &packer, mode_count_bits); /* R/W Mode number */
-			int remainder = packer_unpack(&unpacker, 8 - mode_count_bits); /* R Remainder bits */
-			if (wem->mode_blockflags[mode_number]) {
-				/* Long window */
-				int next_blockflag = 0;
-				brru4 next_size  = packets_size  + packeteer.total_size;
-				i_packeteer_t next_packeteer;
-				if ((err = i_packeteer_init(&next_packeteer, wem->data + next_start, next_size, wem->flags, next_start))) {
-					eos = 1;
-				} else if (next_packeteer.payload_size) {
-					oggpack_buffer next_unpacker;
-					oggpack_readinit(&next_unpacker, next_packeteer.payload, next_packeteer.payload_size);
-					int next_number = packer_unpack(&next_unpacker, mode_count_bits); /* R Next number */
-					next_blockflag = wem->mode_blockflags[next_number];
+		{
+			/* Only the packet type and mode number are needed for the block size, so mod packets get by with a
+			 * single byte holding what their rewrite would start with */
+			unsigned char first = 0;
+			ogg_packet packet = {.packet = packeteer.payload, .bytes = packeteer.payload_size};
+			if (wem->flags.mod_packets) {
+				if (packeteer.payload_size) {
+					oggpack_buffer unpacker;
+					oggpack_readinit(&unpacker, packeteer.payload, packeteer.payload_size);
+					entry.mode = packer_unpack(&unpacker, audio->mode_count_bits);
+					first = (unsigned char)(entry.mode << 1); /* Packet type 0, then the mode number */
 				}
-				packer_pack(&packer, prev_blockflag, 1); /* W Previous window type */
-				packer_pack(&packer, next_blockflag, 1); /* W Next window type */
+				packet.packet = &first;
+				packet.bytes = entry.mode < 0 ? 0 : 1;
 			}
-			packer_pack(&packer, remainder, 8 - mode_count_bits); /* W Remainder of read-in first byte */
-			prev_blockflag = wem->mode_blockflags[mode_number];
+			/* This granule calculation is from revorb, not sure its source though; probably somewhere in vorbis docs, haven't found it */
+			long current_block = vorbis_packet_blocksize(vi, &packet);
+			/* This goes after the 'if' in original revorb, however putting it before incrementing total_block
+			 * gets rid of one error from ogginfo, the ".. headers incorrectly framed, terminal header page has non-zero granpos."
+			 * Honestly, it's probably just a fluke with this whole algorithm and that one test I did it on; */
+			entry.granule = total_block;
+			if (last_block)
+				total_block += (last_block + current_block) / 4;
+			last_block = current_block;
 		}
 
-		packer_transfer_remaining(&unpacker, &packer);
+		audio->packets[audio->n_packets++] = entry;
+		packets_start += packeteer.total_size;
+		/* Nothing past a time range is output, but the packet after it is still needed for where it ends */
+		if (audio->index_until && entry.granule >= audio->index_until)
+			break;
+	}
+	audio->total_granule = total_block;
+	return I_SUCCESS;
+}
 
-		/* This granule calculation is from revorb, not sure its source though; probably somewhere in vorbis docs, haven't found it */
-		/* I'll be honest; I really don't understand this at all. */
-		ogg_packet packet;
-		i_init_ogg_packet(&packet, &packer, packetno + 3, 0, eos || next_start >= wem->data_size);
+/* Returns the granule position at which decoding packet 'index' has finished. */
+static inline brru8
+i_granule_after(const i_audio_t *const audio, brrsz index)
+{
+	return index + 1 < audio->n_packets ? audio->packets[index + 1].granule : audio->total_granule;
+}
+/* Narrows the output to the packets needed for the samples from 'start' to 'end' seconds, plus the packet before
+ * them, which a decoder needs to overlap with the first but whose own samples are discarded.
+ * Output granule positions are shifted to start at 0 from that pre-roll packet, and the last is cut back to the end
+ * sample, so the result is a valid stream on its own that decodes to no more than the range. */
+static int
+i_select_time_range(i_audio_t *const audio, double start, double end)
+{
+	const wwriff_t *const wem = audio->wem;
+	brru8 total = audio->total_granule;
+	brru8 first_sample, end_sample;
+	if (wem->vorb.sample_count && wem->vorb.sample_count < total)
+		total = wem->vorb.sample_count;
+	if (!wem->fmt.samples_per_sec || start < 0 || (end >= 0 && end <= start))
+		return I_OUT_OF_RANGE;
+	first_sample = start * wem->fmt.samples_per_sec;
+	end_sample = end < 0 ? total : end * wem->fmt.samples_per_sec;
+	if (end_sample > total)
+		end_sample = total;
+	if (first_sample >= end_sample)
+		return I_OUT_OF_RANGE;
+
+	brrsz first = 0, last = 0;
+	/* Decoding packet 'i' produces the samples between where the previous packet's finished and its own */
+	while (first < audio->n_packets && i_granule_after(audio, first) <= first_sample)
+		++first;
+	for (last = first; last + 1 < audio->n_packets && i_granule_after(audio, last) < end_sample; ++last);
+	if (first >= audio->n_packets)
+		return I_OUT_OF_RANGE;
+
+	audio->first = first ? first - 1 : 0;
+	audio->end = last + 1;
+	audio->end_granule = i_granule_after(audio, last) < end_sample ? i_granule_after(audio, last) : end_sample;
+	audio->granule_offset = audio->first + 1 < audio->n_packets ? audio->packets[audio->first + 1].granule : 0;
+	return I_SUCCESS;
+}
 
-		long current_block = vorbis_packet_blocksize(vi, &packet);
+/* Returns the output granule position of packet 'index'. */
+static inline brru8
+i_output_granule(const i_audio_t *const audio, brrsz index)
+{
+	const brru8 granule = audio->end_granule && index + 1 == audio->end ? audio->end_granule : audio->packets[index].granule;
+	return granule > audio->granule_offset ? granule - audio->granule_offset : 0;
+}
 
-		/* This line goes after the 'if' in original revorb, however putting it before incrementing total_block
-		 * gets rid of one error from ogginfo, the ".. headers incorrectly framed, terminal header page has non-zero granpos."
-		 * Honestly, it's probably just a fluke with this whole algorithm and that one test I did it on; */
-		packet.granulepos = total_block;
+static void
+i_rewrite_packet(const i_audio_t *const audio, brrsz index, oggpack_buffer *const packer)
+{
+	const wwriff_t *const wem = audio->wem;
+	const i_audio_packet_t *const entry = &audio->packets[index];
+	i_packeteer_t packeteer;
+	oggpack_buffer unpacker;
+	/* Already succeeded while indexing */
+	i_packeteer_init(&packeteer, wem->data + entry->offset, wem->data_size - entry->offset, wem->flags, entry->offset);
+	oggpack_readinit(&unpacker, packeteer.payload, packeteer.payload_size);
 
-		if (last_block)
-			total_block += (last_block + current_block) / 4;
-		last_block = current_block;
-		//NeExtraPrint(DEB, "Granulepos: %llu | Block: %llu | Total block: %llu", packet.granulepos, current_block, total_block);
+	if (wem->flags.mod_packets) {
+		const int mode_count_bits = audio->mode_count_bits;
+		int packet_type = packer_pack(packer, 0, 1); /* W Packet type */
+		int mode_number = packer_transfer(&unpacker, mode_count_bits, packer, mode_count_bits); /* R/W Mode number */
+		int remainder = packer_unpack(&unpacker, 8 - mode_count_bits); /* R Remainder bits */
+		if (i_mode_blockflag(wem, mode_number)) {
+			/* Long window */
+			int prev_blockflag = index > 0 ? i_mode_blockflag(wem, audio->packets[index - 1].mode) : 0;
+			int next_blockflag = index + 1 < audio->n_packets ? i_mode_blockflag(wem, audio->packets[index + 1].mode) : 0;
+			packer_pack(packer, prev_blockflag, 1); /* W Previous window type */
+			packer_pack(packer, next_blockflag, 1); /* W Next window type */
+		}
+		packer_pack(packer, remainder, 8 - mode_count_bits); /* W Remainder of read-in first byte */
+	}
 
-		if ((err = i_insert_packet(streamer, &packet))) {
-			oggpack_writeclear(&packer);
-			return err;
+	packer_transfer_remaining(&unpacker, packer);
+}
+
+/* pool_task_t; rewrites every packet of one range into the range's buffer */
+static int
+i_rewrite_range(void *const context, brrsz index)
+{
+	i_audio_t *const audio = context;
+	i_audio_range_t *const range = &audio->ranges[index];
+	const brrsz end = range->first + range->count;
+	brrsz capacity = 0;
+	{
+		/* Rewritten packets are at most one byte larger than their payloads, so this is almost always enough */
+		brrsz end_offset = end < audio->n_packets ? audio->packets[end].offset : audio->wem->data_size;
+		capacity = end_offset - audio->packets[range->first].offset + range->count;
+		USDT_PROBE3(batch__start, index, range->first, range->count);
+		if (brrlib_alloc((void **)&range->data, capacity, 0)) {
+			USDT_PROBE4(batch__end, index, range->count, 0, I_BUFFER_ERROR);
+			return I_BUFFER_ERROR;
 		}
+	}
 
-		oggpack_writeclear(&packer);
-		packets_start += packeteer.total_size;
-		packets_size  -= packeteer.total_size;
-		++packetno;
+	oggpack_buffer packer;
+	oggpack_writeinit(&packer);
+	for (brrsz i = range->first; i < end; ++i) {
+		oggpack_reset(&packer);
+		i_rewrite_packet(audio, i, &packer);
+		long bytes = oggpack_bytes(&packer);
+		if (range->size + bytes > capacity) {
+			while (range->size + bytes > capacity)
+				capacity *= 2;
+			if (brrlib_alloc((void **)&range->data, capacity, 0)) {
+				oggpack_writeclear(&packer);
+				USDT_PROBE4(batch__end, index, range->count, range->size, I_BUFFER_ERROR);
+				return I_BUFFER_ERROR;
+			}
+		}
+		memcpy(range->data + range->size, oggpack_get_buffer(&packer), bytes);
+		range->size += bytes;
+		audio->packets[i].out_size = bytes;
 	}
-	//NeExtraPrint(DEBUG, "Total packets: %lld", 3 + packetno);
+	oggpack_writeclear(&packer);
+	USDT_PROBE4(batch__end, index, range->count, range->size, I_SUCCESS);
 	return I_SUCCESS;
 }
 
-int
-wwise_convert_wwriff(
+/* Decodes rebuilt audio packets straight to interleaved 16-bit little-endian PCM, in place of them going into the
+ * Ogg stream. */
+typedef struct i_decoder {
+	vorbis_dsp_state dsp;
+	vorbis_block block;
+	FILE *output;
+	int channels;
+	brru8 frames;     /* Frames written so far */
+	brru8 max_frames; /* Granule position of the last packet; an Ogg decoder would stop there too */
+	unsigned char *samples;
+	brrsz samples_size;
+} i_decoder_t;
+
+static int
+i_decoder_init(i_decoder_t *const decoder, vorbis_info *const vi, FILE *const output)
+{
+	/* Initialized in place, since the block keeps a pointer to the dsp state */
+	*decoder = (i_decoder_t){.output = output, .channels = vi->channels};
+	if (vorbis_synthesis_init(&decoder->dsp, vi)) {
+		BRRLOG_ERR("Failed to initialize vorbis decoder");
+		return I_INIT_ERROR;
+	}
+	if (vorbis_block_init(&decoder->dsp, &decoder->block)) {
+		BRRLOG_ERR("Failed to initialize vorbis decoder block");
+		vorbis_dsp_clear(&decoder->dsp);
+		return I_INIT_ERROR;
+	}
+	return I_SUCCESS;
+}
+static void
+i_decoder_clear(i_decoder_t *const decoder)
+{
+	vorbis_block_clear(&decoder->block);
+	vorbis_dsp_clear(&decoder->dsp);
+	if (decoder->samples)
+		free(decoder->samples);
+	memset(decoder, 0, sizeof(*decoder));
+}
+static int
+i_decode_packet(i_decoder_t *const decoder, ogg_packet *const packet)
+{
+	float **pcm = NULL;
+	int n_frames = 0;
+	/* Packets that don't decode produce no audio, same as they would from the Ogg */
+	if (vorbis_synthesis(&decoder->block, packet) || vorbis_synthesis_blockin(&decoder->dsp, &decoder->block))
+		return I_SUCCESS;
+	while ((n_frames = vorbis_synthesis_pcmout(&decoder->dsp, &pcm)) > 0) {
+		brru8 keep = n_frames;
+		if (decoder->frames + keep > decoder->max_frames)
+			keep = decoder->max_frames > decoder->frames ? decoder->max_frames - decoder->frames : 0;
+		if (keep) {
+			brrsz size = keep * decoder->channels * 2;
+			if (size > decoder->samples_size) {
+				if (brrlib_alloc((void **)&decoder->samples, size, 0))
+					return I_BUFFER_ERROR;
+				decoder->samples_size = size;
+			}
+			unsigned char *sample = decoder->samples;
+			for (brru8 f = 0; f < keep; ++f) {
+				for (int c = 0; c < decoder->channels; ++c) {
+					long value = (long)(pcm[c][f] * 32767.f + (pcm[c][f] < 0 ? -.5f : .5f));
+					if (value > 32767)
+						value = 32767;
+					else if (value < -32768)
+						value = -32768;
+					*sample++ = value & 0xFF;
+					*sample++ = (value >> 8) & 0xFF;
+				}
+			}
+			if (size != fwrite(decoder->samples, 1, size, decoder->output)) {
+				BRRLOG_ERR("Failed to write decoded audio : %s", strerror(errno));
+				return I_IO_ERROR;
+			}
+			decoder->frames += keep;
+		}
+		vorbis_synthesis_read(&decoder->dsp, n_frames);
+	}
+	return I_SUCCESS;
+}
+
+static int
+i_splice_audio(ogg_stream_state *const streamer, i_decoder_t *const decoder, i_audio_t *const audio)
+{
+	int err = 0;
+	if (decoder && audio->end > audio->first)
+		decoder->max_frames = i_output_granule(audio, audio->end - 1);
+	for (brrsz r = 0; r < audio->n_ranges; ++r) {
+		i_audio_range_t *const range = &audio->ranges[r];
+		brrsz cursor = 0;
+		for (brrsz i = range->first; i < range->first + range->count; ++i) {
+			ogg_packet packet = {
+				.packet = range->data + cursor,
+				.bytes = audio->packets[i].out_size,
+				.b_o_s = 0,
+				.e_o_s = i + 1 == audio->end,
+				.packetno = i - audio->first + 3,
+				.granulepos = i_output_granule(audio, i),
+			};
+			if (decoder)
+				err = i_decode_packet(decoder, &packet);
+			else
+				err = i_insert_packet(streamer, &packet);
+			if (err)
+				return err;
+			cursor += packet.bytes;
+		}
+		/* The stream has its own copy now, or the packets have been decoded */
+		free(range->data);
+		range->data = NULL;
+	}
+	return I_SUCCESS;
+}
+
+static int
+i_process_audio(
+    ogg_stream_state *const streamer,
+    i_decoder_t *const decoder,
+    wwriff_t *const wem,
+    vorbis_info *const vi,
+    vorbis_comment *const vc
+)
+{
+	int err = 0;
+	i_audio_t audio = {.wem = wem, .mode_count_bits = lib_count_bits(wem->mode_count - 1)};
+
+	NeExtraPrint(DEB, "Stream mod packets");
+	if (s_current_input && s_current_input->flag.time_range && s_current_input->range_end > 0)
+		audio.index_until = s_current_input->range_end * wem->fmt.samples_per_sec;
+	if (!(err = i_index_audio(&audio, vi))) {
+		audio.end = audio.n_packets;
+		if (s_current_input && s_current_input->flag.time_range) {
+			if ((err = i_select_time_range(&audio, s_current_input->range_start, s_current_input->range_end)))
+				BRRLOG_ERR("Cannot convert range %.3fs to %.3fs : %s",
+				    s_current_input->range_start, s_current_input->range_end, lib_strerr(err));
+		}
+	}
+	if (!err && audio.end > audio.first) {
+		const brrsz n_packets = audio.end - audio.first;
+		brrsz n_ranges = n_packets / AUDIO_RANGE_MIN_PACKETS;
+		brrsz max_ranges = (brrsz)pool_get_threads() * AUDIO_RANGES_PER_THREAD;
+		if (n_ranges > max_ranges)
+			n_ranges = max_ranges;
+		if (!n_ranges)
+			n_ranges = 1;
+		if (!(audio.ranges = calloc(n_ranges, sizeof(*audio.ranges)))) {
+			BRRLOG_ERR("Failed to allocate audio ranges : %s", strerror(errno));
+			err = I_BUFFER_ERROR;
+		} else {
+			audio.n_ranges = n_ranges;
+			for (brrsz r = 0; r < n_ranges; ++r) {
+				audio.ranges[r].first = audio.first + n_packets * r / n_ranges;
+				audio.ranges[r].count = audio.first + n_packets * (r + 1) / n_ranges - audio.ranges[r].first;
+			}
+			if ((err = pool_run(n_ranges, i_rewrite_range, &audio)))
+				BRRLOG_ERR("Failed to rewrite audio packets : %s", lib_strerr(err));
+			else
+				err = i_splice_audio(streamer, decoder, &audio);
+			for (brrsz r = 0; r < n_ranges; ++r) {
+				if (audio.ranges[r].data)
+					free(audio.ranges[r].data);
+			}
+			free(audio.ranges);
+		}
+	}
+	if (audio.packets)
+		free(audio.packets);
+	//NeExtraPrint(DEBUG, "Total packets: %lld", 3 + audio.n_packets);
+	return err;
+}
+
+/* Converts 'in_wwriff' to 'out_stream' or, when 'output' is given, decodes it to 'output' instead; 'out_stream' then
+ * only ever holds the headers. */
+static int
+i_convert(
     wwriff_t *const in_wwriff,
     ogg_stream_state *const out_stream,
+    FILE *const output,
     const codebook_library_t *const library,
     const neinput_t *const input
 )
@@ -1140,10 +1741,36 @@ wwise_convert_wwriff(
 	s_current_input = input;
 	s_used_library = library;
 
-	if (!(err = i_process_headers(out_stream, in_wwriff, &vi, &vc)))
-		err = i_process_audio(out_stream, in_wwriff, &vi, &vc);
+	brru8 start = timing_start(timing_stage_headers);
+	USDT_PROBE1(headers__start, in_wwriff->data_size);
+	err = i_process_headers(out_stream, in_wwriff, &vi, &vc);
+	USDT_PROBE2(headers__end, out_stream->body_fill, err);
+	if (!err) {
+		/* Output is measured by what's buffered in the stream, or written to 'output' when decoding */
+		const long headers_size = out_stream->body_fill;
+		const long output_start = output ? ftell(output) : -1;
+		timing_add(timing_stage_headers, start, 0, headers_size);
+		start = timing_start(timing_stage_audio);
+		if (output) {
+			i_decoder_t decoder;
+			if (!(err = i_decoder_init(&decoder, &vi, output))) {
+				err = i_process_audio(out_stream, &decoder, in_wwriff, &vi, &vc);
+				i_decoder_clear(&decoder);
+			}
+		} else {
+			err = i_process_audio(out_stream, NULL, in_wwriff, &vi, &vc);
+		}
+		if (!err) {
+			long audio_size = 0;
+			if (!output)
+				audio_size = out_stream->body_fill - headers_size;
+			else if (output_start != -1)
+				audio_size = ftell(output) - output_start;
+			timing_add(timing_stage_audio, start, in_wwriff->data_size, audio_size > 0 ? audio_size : 0);
+		}
+	}
 
-	if (err)
+	if (err || output)
 		ogg_stream_clear(out_stream);
 
 	vorbis_info_clear(&vi);
@@ -1153,3 +1780,58 @@ wwise_convert_wwriff(
 	s_used_library = NULL;
 	return err;
 }
+
+int
+wwise_convert_wwriff(
+    wwriff_t *const in_wwriff,
+    ogg_stream_state *const out_stream,
+    const codebook_library_t *const library,
+    const neinput_t *const input
+)
+{
+	return i_convert(in_wwriff, out_stream, NULL, library, input);
+}
+
+int
+wwise_decode_wwriff(
+    wwriff_t *const in_wwriff,
+    FILE *const output,
+    int wav,
+    const codebook_library_t *const library,
+    const neinput_t *const input
+)
+{
+	int err = 0;
+	ogg_stream_state headers;
+	long start = 0;
+	unsigned char header[LIB_WAV_HEADER_MAX];
+	brrsz header_size = 0;
+	/* Decoded to 16-bit samples, in the channel layout of the source */
+	wwise_fmt_t fmt = in_wwriff->fmt;
+	fmt.bits_per_sample = 16;
+	fmt.block_align = fmt.n_channels * 2;
+	fmt.avg_byte_rate = fmt.samples_per_sec * fmt.block_align;
+	if (wav) {
+		/* Sizes are filled in once decoding is done */
+		start = ftell(output);
+		header_size = lib_make_wav_header(header, &fmt, 0);
+		if (header_size != fwrite(header, 1, header_size, output)) {
+			BRRLOG_ERR("Failed to write WAV header : %s", strerror(errno));
+			return I_IO_ERROR;
+		}
+	}
+	if ((err = i_convert(in_wwriff, &headers, output, library, input)))
+		return err;
+	if (wav) {
+		long end = ftell(output);
+		brru4 data_size = end - start - header_size;
+		lib_make_wav_header(header, &fmt, data_size);
+		if (start < 0 || end < 0 || fseek(output, start, SEEK_SET)
+		 || header_size != fwrite(header, 1, header_size, output)
+		 || fseek(output, end, SEEK_SET)) {
+			BRRLOG_ERR("Failed to finish WAV header : %s", strerror(errno));
+			return I_IO_ERROR;
+		}
+	}
+	return I_SUCCESS;
+}
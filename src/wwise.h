@@ -17,6 +17,8 @@ limitations under the License.
 #ifndef WWISE_H
 #define WWISE_H
 
+#include <stdio.h>
+
 #include <ogg/ogg.h>
 
 #include <brrtools/brrtypes.h>
@@ -26,6 +28,11 @@ limitations under the License.
 #include "riff.h"
 
 #define VORBIS_STR "vorbis"
+
+/* 'fmt' format tags */
+#define WWISE_FORMAT_PCM 0x0001
+#define WWISE_FORMAT_EXTENSIBLE 0xFFFE
+#define WWISE_FORMAT_VORBIS 0xFFFF
 #define CODEBOOK_SYNC "BCV"
 
 typedef enum vorbis_header_packet {
@@ -91,6 +98,38 @@ typedef struct wwriff {
 	brrstringr_t *comments;
 } wwriff_t;
 
+typedef enum wwise_vorb_type {
+	wwise_vorb_type_none = 0,
+	wwise_vorb_type_implicit, /* 42-byte vorb data stored at the end of a 66-byte 'fmt' */
+	wwise_vorb_type_basic,    /* Explicit 'vorb' chunk of at most 44 bytes; all vorbis headers present */
+	wwise_vorb_type_extra,    /* Explicit 'vorb' chunk with uid and blocksizes; headers must be rebuilt */
+} wwise_vorb_type_t;
+
+/* Header-only view of a WwRIFF; nothing is allocated and the data chunk is never copied or read. */
+typedef struct wwise_probe {
+	wwriff_flags_t flags;  /* Only the initialization and header-layout flags are meaningful */
+	brru1 vorb_type;       /* wwise_vorb_type_t */
+	riff_byteorder_t byteorder;
+	brru4 riff_size;       /* Size of the whole RIFF, including root fourcc and size */
+	brru4 data_size;       /* Declared size of the 'data' chunk */
+	brru4 data_offset;     /* Offset of the 'data' chunk's contents from the start of the RIFF */
+	wwise_vorb_t vorb;
+	wwise_fmt_t fmt;
+} wwise_probe_t;
+
+/* Reads the 'fmt' and 'vorb' headers of the WwRIFF in 'buffer' without parsing the rest of it.
+ * 'buffer' need only contain the RIFF up to the end of those chunks; the 'data' chunk may be truncated or absent
+ * from it.
+ * Returns 0 on success, I_NOT_RIFF if 'buffer' isn't a RIFF, or I_INSUFFICIENT_DATA if no 'fmt' chunk was found.
+ * */
+int wwise_probe(wwise_probe_t *const probe, const unsigned char *const buffer, brrsz buffer_size);
+/* Returns non-zero if 'probe' describes plain PCM audio rather than Wwise Vorbis; such WwRIFFs are already WAV data
+ * and have no 'vorb' header to convert with. */
+int wwise_probe_is_pcm(const wwise_probe_t *const probe);
+/* Fills 'meta' from 'probe' so it can be checked against filter expressions; 'index' is the entry's index in its
+ * archive, or 0. */
+void wwise_probe_meta(const wwise_probe_t *const probe, brru4 index, neinput_meta_t *const meta);
+
 /* Consumes the riff data 'rf', and parses it as WWRIFF data.
  * 'rf' is free to be cleared after initialization.
  * Returns:
@@ -107,6 +146,55 @@ void wwriff_clear(wwriff_t *const wwriff);
 
 int wwriff_add_comment(wwriff_t *const wwriff, const char *const format, ...);
 
+/* One way the codebooks of a rebuilt setup header may be stored. */
+typedef struct wwise_codebooks {
+	const codebook_library_t *library; /* External codebooks, or NULL if they're inline */
+	brrsz library_index;               /* Index of 'library' in the loaded libraries, or -1 */
+	int stripped;                      /* Whether inline codebooks and the rest of the setup header are stripped */
+} wwise_codebooks_t;
+
+typedef struct wwise_setup_match {
+	brru8 hash;      /* Hash of the setup packet */
+	brrsz candidate;
+} wwise_setup_match_t;
+
+/* Detects how the codebooks of WwRIFFs are stored, by trial-building only their setup headers with each candidate
+ * until one passes vorbis_synthesis_headerin.
+ * Every match is remembered by the hash of its setup packet, so identical setup headers skip detection entirely,
+ * and the last candidate to match is tried first, since entries of one archive nearly always share it. */
+typedef struct wwise_detector {
+	wwise_codebooks_t *candidates; /* Inline, stripped inline, then each loaded library both ways */
+	brrsz n_candidates;
+	brrsz last;
+	wwise_setup_match_t *matches;
+	brrsz n_matches;
+} wwise_detector_t;
+
+/* Initializes 'detector' with the inline candidates, and every library in 'libraries' that loads successfully.
+ * Returns 0 on success or I_BUFFER_ERROR. */
+int wwise_detector_init(wwise_detector_t *const detector, neinput_library_t *const libraries, brrsz n_libraries);
+void wwise_detector_clear(wwise_detector_t *const detector);
+/* Finds which candidate of 'detector' the setup header of 'wwriff' was built with, and stores it in 'detected'.
+ * Candidates that don't match aren't logged, without touching the log settings that other threads share.
+ * Returns 0 on success, or I_UNRECOGNIZED_DATA if no candidate matches. */
+int wwise_detect_codebooks(
+    wwise_detector_t *const detector,
+    wwriff_t *const wwriff,
+    const wwise_codebooks_t **const detected
+);
+
+/* Packs vorbis header 'header' of 'wwriff' into 'packer' as it would be written to the output, copying it if all
+ * headers are present and rebuilding it with 'library' and 'stripped' otherwise; the result is not checked with
+ * libvorbis. Meant for measuring the header routines in isolation.
+ * Returns 0 on success or an error code. */
+int wwise_pack_header(
+    wwriff_t *const wwriff,
+    vorbis_header_packet_t header,
+    const codebook_library_t *const library,
+    int stripped,
+    oggpack_buffer *const packer
+);
+
 /* Converts the wwriff data 'in_riff' to an ogg stream in 'out_stream', using codebooks from 'library'.
  * 'input' is for output stream metadata (like which file the output is converted from, etc.).
  * */
@@ -117,4 +205,17 @@ int wwise_convert_wwriff(
     const neinput_t *const input
 );
 
+/* Converts the wwriff data 'in_wwriff' like 'wwise_convert_wwriff', but decodes the rebuilt audio packets straight to
+ * 16-bit little-endian PCM in 'output' rather than building an Ogg.
+ * If 'wav' is non-zero, a WAV header is written first, and its sizes are filled in once decoding is done, so
+ * 'output' must be seekable.
+ * */
+int wwise_decode_wwriff(
+    wwriff_t *const in_wwriff,
+    FILE *const output,
+    int wav,
+    const codebook_library_t *const library,
+    const neinput_t *const input
+);
+
 #endif /* WWISE_H */